@@ -0,0 +1,162 @@
+#ifndef _AABB_H_
+#define _AABB_H_
+
+#include <cfloat>
+#include "Vector3d.h"
+
+using namespace std;
+
+
+// Relative widening of the entry and exit distances of the slab test, in
+// units of REAL_EPSILON. Covers the rounding of the inverse direction, of
+// the subtraction and product, and of the widening itself.
+#define AABB_ERROR_ULPS     4.0
+
+
+// Axis-aligned bounding box, used by the acceleration structures.
+
+class AABB
+{
+public:
+
+// Constructors
+
+    AABB() { setEmpty(); }
+
+    AABB( const Vector3d &minPt_, const Vector3d &maxPt_ )
+        { minPt = minPt_;  maxPt = maxPt_; }
+
+
+// Data setting and reading.
+
+    AABB &setEmpty()
+    {
+        minPt.setXYZ( REAL_MAX, REAL_MAX, REAL_MAX );
+        maxPt.setXYZ( -REAL_MAX, -REAL_MAX, -REAL_MAX );
+        return (*this);
+    }
+
+    bool isEmpty() const
+        { return ( minPt.x() > maxPt.x() || minPt.y() > maxPt.y() || minPt.z() > maxPt.z() ); }
+
+
+    // Grows the box to contain the point p.
+    AABB &expand( const Vector3d &p )
+    {
+        for ( int i = 0; i < 3; i++ )
+        {
+            if ( p[i] < minPt[i] ) minPt[i] = p[i];
+            if ( p[i] > maxPt[i] ) maxPt[i] = p[i];
+        }
+        return (*this);
+    }
+
+    // Grows the box to contain the box b.
+    AABB &expand( const AABB &b )
+    {
+        for ( int i = 0; i < 3; i++ )
+        {
+            if ( b.minPt[i] < minPt[i] ) minPt[i] = b.minPt[i];
+            if ( b.maxPt[i] > maxPt[i] ) maxPt[i] = b.maxPt[i];
+        }
+        return (*this);
+    }
+
+
+// Other functions.
+
+    Vector3d centroid() const { return 0.5 * ( minPt + maxPt ); }
+
+    Vector3d extent() const { return maxPt - minPt; }
+
+    double surfaceArea() const
+    {
+        if ( isEmpty() ) return 0.0;
+        Vector3d d = extent();
+        return 2.0 * ( d.x() * d.y() + d.y() * d.z() + d.z() * d.x() );
+    }
+
+    // Returns the axis (0, 1 or 2) along which the box is longest.
+    int longestAxis() const
+    {
+        Vector3d d = extent();
+        if ( d.x() >= d.y() && d.x() >= d.z() ) return 0;
+        return ( d.y() >= d.z() )? 1 : 2;
+    }
+
+    bool contains( const Vector3d &p ) const
+    {
+        return ( p.x() >= minPt.x() && p.x() <= maxPt.x() &&
+                 p.y() >= minPt.y() && p.y() <= maxPt.y() &&
+                 p.z() >= minPt.z() && p.z() <= maxPt.z() );
+    }
+
+    // Squared distance from p to the nearest point of the box, 0 inside.
+    double distance2( const Vector3d &p ) const
+    {
+        double d2 = 0.0;
+        for ( int i = 0; i < 3; i++ )
+        {
+            double d = 0.0;
+            if ( p[i] < minPt[i] ) d = (double) minPt[i] - p[i];
+            else if ( p[i] > maxPt[i] ) d = (double) p[i] - maxPt[i];
+            d2 += d * d;
+        }
+        return d2;
+    }
+
+    bool overlaps( const AABB &b ) const
+    {
+        return ( minPt.x() <= b.maxPt.x() && maxPt.x() >= b.minPt.x() &&
+                 minPt.y() <= b.maxPt.y() && maxPt.y() >= b.minPt.y() &&
+                 minPt.z() <= b.maxPt.z() && maxPt.z() >= b.minPt.z() );
+    }
+
+
+    //////////////////////////////////////////////////////////////////////////////
+    // Slab test of a ray against the box.
+    // invDir is the component-wise reciprocal of the ray direction.
+    // NaNs produced by rays lying in a slab plane are ignored by the
+    // comparisons, so such rays are not culled.
+    // The distance to each slab is widened by its rounding error, so a ray
+    // that touches the box is never culled, as in the wide BVH nodes.
+    //////////////////////////////////////////////////////////////////////////////
+
+    bool hit( const Vector3d &orig, const Vector3d &invDir, Real tmin, Real tmax ) const
+        { return clip( orig, invDir, tmin, tmax ); }
+
+    // As hit(), and also narrows [tmin, tmax] to the part of the ray
+    // inside the box, widened by its rounding error, but never past the
+    // [tmin, tmax] given.
+    bool clip( const Vector3d &orig, const Vector3d &invDir, Real &tmin, Real &tmax ) const
+    {
+        const Real shrink = (Real)( 1.0 - AABB_ERROR_ULPS * REAL_EPSILON );
+        const Real grow = (Real)( 1.0 + AABB_ERROR_ULPS * REAL_EPSILON );
+        for ( int i = 0; i < 3; i++ )
+        {
+            Real t0 = ( minPt[i] - orig[i] ) * invDir[i];
+            Real t1 = ( maxPt[i] - orig[i] ) * invDir[i];
+            if ( invDir[i] < 0.0 ) { Real tmp = t0;  t0 = t1;  t1 = tmp; }
+
+            // Scaled rather than offset, so infinities stay infinite.
+            t0 *= ( t0 > 0.0 )? shrink : grow;
+            t1 *= ( t1 > 0.0 )? grow : shrink;
+            if ( t0 > tmin ) tmin = t0;
+            if ( t1 < tmax ) tmax = t1;
+            if ( tmin > tmax ) return false;
+        }
+        return true;
+    }
+
+
+    Vector3d minPt, maxPt;
+
+}; // AABB
+
+
+
+inline ostream &operator<< ( ostream &os, const AABB &b )
+    { return ( os << "[(" << b.minPt << "), (" << b.maxPt << ")]" ); }
+
+
+#endif // _AABB_H_
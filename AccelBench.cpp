@@ -0,0 +1,822 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include "Util.h"
+#include "Vector3d.h"
+#include "Ray.h"
+#include "Camera.h"
+#include "Surface.h"
+#include "TriangleMesh.h"
+#include "Instance.h"
+#include "Obj.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "KdTree.h"
+#include "Grid.h"
+#include "Sphere.h"
+#include "PrimitiveArrays.h"
+#include "SphereKernel.h"
+#include "PhongKernel.h"
+#include "Scheduler.h"
+#include "Raytrace.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Benchmark of the acceleration structure builders.
+//
+// Fills a square grid of cells with copies of Cow.obj, Teapot.obj and
+// Teddy.obj, each scaled to fit its cell, until the scene has at least
+// the requested number of triangles (1M by default). For each builder,
+// reports the build and refit times, the size and SAH cost of the tree,
+// and the time to trace a camera ray through every pixel of an image and
+// a shadow ray from every hit.
+//
+// A kd-tree over the same grid is reported alongside the BVHs, and then
+// compared with the SAH BVH on each of the models on its own. On both,
+// the primary rays are also traced through a BVH8 one by one and in
+// packets of 8 x 8, and the hits of the two compared.
+//
+// Last, fields of spheres of similar size, spread evenly or half of them
+// crowded into a corner, compare the BVHs with one- and two-level grids,
+// and the SAH BVH over the spheres as allocated one by one with that over
+// them copied into one PrimitiveArrays.
+//
+// The SIMD sphere kernels of each instruction set are timed against a
+// loop over Sphere::hit on rays through a small field of spheres, and
+// their results checked to be those of the loop, up to ties.
+//
+// The SIMD Phong kernels of each instruction set are timed against the
+// loop over the lights with powf that they replace, on random hits lit
+// by batches of random lights, half of them near the highlight. The
+// 8-bit colors they shade are checked to be within one step of those of
+// the loop, and the relative error of their pow is reported.
+//
+// The same grid is then made of Instances of one mesh per model, each
+// with its own BVH, under a top-level BVH over the Instances, and its
+// memory and trace time are compared with those of the flat scene.
+//
+// Usage: AccelBench [minTriangles]
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+static const int benchImageWidth = 1024;
+static const int benchImageHeight = 768;
+static const int benchNumThreads = 0;  // 0 -- use all hardware threads.
+static const int benchTraceRuns = 3;   // The fastest run is reported.
+static const int benchNumSpheres = 100000;
+static const int benchKernelSpheres = 4096;
+static const int benchKernelRays = 4096;
+static const int benchPhongHits = 100000;
+static const double benchPhongMaxPowError = 1e-5;  // The bound of PhongKernel.h.
+static const int benchWatertightGrid = 16;    // Cells on a side of the bumpy mesh.
+static const int benchWatertightRays = 100000;
+static const int benchPacketSize = 8;  // Width and height of a packet of primary rays.
+
+
+
+static double traceBench( const Surface &accel, const Camera &camera, int &numHits )
+{
+    int width = camera.getImageWidth();
+    int height = camera.getImageHeight();
+    vector<int> rowHits( height, 0 );
+    Vector3d lightPos( -1000.0, 2000.0, 500.0 );
+
+    double startTime = Util::GetCurrRealTime();
+
+    Scheduler::Run( height, benchNumThreads, [&]( int y, int )
+    {
+        for ( int x = 0; x < width; x++ )
+        {
+            Ray ray = camera.getRay( x + 0.5, y + 0.5 );
+            SurfaceHitRecord rec;
+            if ( !accel.hit( ray, DEFAULT_TMIN, DEFAULT_TMAX, rec ) ) continue;
+
+            SurfaceHitPoint point;
+            makeHitPoint( ray, rec, point );
+            rowHits[y]++;
+            Vector3d origin = Raytrace::LeavingOrigin( point, lightPos - point.p );
+            accel.shadowHit( Ray( origin, lightPos - origin ), DEFAULT_TMIN, 1.0 );
+        }
+    } );
+
+    double stopTime = Util::GetCurrRealTime();
+
+    numHits = 0;
+    for ( int y = 0; y < height; y++ ) numHits += rowHits[y];
+    return stopTime - startTime;
+}
+
+
+
+static size_t meshMemory( const TriangleMesh *mesh )
+{
+    return ( mesh->vertices.capacity() + mesh->normals.capacity() ) * sizeof( Vector3d )
+         + mesh->indices.capacity() * sizeof( uint32_t );
+}
+
+
+
+static double bestTrace( const Surface &accel, const Camera &camera, int &numRays )
+{
+    int numHits;
+    double traceTime = traceBench( accel, camera, numHits );
+    for ( int k = 1; k < benchTraceRuns; k++ )
+        traceTime = Util::Min2( traceTime, traceBench( accel, camera, numHits ) );
+    numRays = camera.getImageWidth() * camera.getImageHeight() + numHits;
+    return traceTime;
+}
+
+
+
+static void runBuilder( const char *name, const BVHBuildOptions &options,
+                        const vector<SurfacePtr> &surfaces, size_t sceneMemory, const Camera &camera )
+{
+    double startTime = Util::GetCurrRealTime();
+    BVH bvh( &surfaces[0], (int) surfaces.size(), options );
+    double buildTime = Util::GetCurrRealTime() - startTime;
+
+    int numRays;
+    double traceTime = bestTrace( bvh, camera, numRays );
+    double memory = ( sceneMemory + bvh.memoryUsage() ) / 1048576.0;
+    double sahCost = bvh.sahCost();
+
+    // Last, as a refit loses the clipped boxes of an SBVH.
+    startTime = Util::GetCurrRealTime();
+    bvh.refit();
+    double refitTime = Util::GetCurrRealTime() - startTime;
+
+    printf( "%-14s build %7.3f sec   refit %6.3f sec   %8d nodes   SAH cost %7.2f   %8.1f MB   trace %6.3f sec (%5.2f Mrays/s)\n",
+            name, buildTime, refitTime, bvh.numNodes(), sahCost, memory, traceTime, numRays / traceTime * 1e-6 );
+}
+
+
+
+static void runKdTree( const char *name, const vector<SurfacePtr> &surfaces, size_t sceneMemory,
+                       const Camera &camera )
+{
+    double startTime = Util::GetCurrRealTime();
+    KdTree kdTree( &surfaces[0], (int) surfaces.size() );
+    double buildTime = Util::GetCurrRealTime() - startTime;
+
+    int numRays;
+    double traceTime = bestTrace( kdTree, camera, numRays );
+    double memory = ( sceneMemory + kdTree.memoryUsage() ) / 1048576.0;
+
+    printf( "%-14s build %7.3f sec   %16s   %8d nodes   %17s   %8.1f MB   trace %6.3f sec (%5.2f Mrays/s)\n",
+            name, buildTime, "", kdTree.numNodes(), "", memory, traceTime, numRays / traceTime * 1e-6 );
+}
+
+
+
+static void runGrid( const char *name, const GridBuildOptions &options, const vector<SurfacePtr> &surfaces,
+                     size_t sceneMemory, const Camera &camera )
+{
+    double startTime = Util::GetCurrRealTime();
+    Grid grid( &surfaces[0], (int) surfaces.size(), options );
+    double buildTime = Util::GetCurrRealTime() - startTime;
+
+    int numRays;
+    double traceTime = bestTrace( grid, camera, numRays );
+    double memory = ( sceneMemory + grid.memoryUsage() ) / 1048576.0;
+
+    printf( "%-14s build %7.3f sec   %16s   %8d cells   %17s   %8.1f MB   trace %6.3f sec (%5.2f Mrays/s)\n",
+            name, buildTime, "", grid.numCells(), "", memory, traceTime, numRays / traceTime * 1e-6 );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Traces the primary rays of the camera through a BVH8 over the surfaces,
+// one by one and in packets, and counts the rays whose hits differ.
+//////////////////////////////////////////////////////////////////////////////
+
+static void runPackets( const char *name, const vector<SurfacePtr> &surfaces, const Camera &camera )
+{
+    BVH8 bvh( &surfaces[0], (int) surfaces.size(), false );
+    int width = camera.getImageWidth();
+    int height = camera.getImageHeight();
+    int numBlocksX = ( width + benchPacketSize - 1 ) / benchPacketSize;
+    int numBlocksY = ( height + benchPacketSize - 1 ) / benchPacketSize;
+
+    vector<double> singleT( width * height ), packetT( width * height );
+    double singleTime = DBL_MAX, packetTime = DBL_MAX;
+
+    for ( int run = 0; run < benchTraceRuns; run++ )
+    {
+        double startTime = Util::GetCurrRealTime();
+        Scheduler::Run( height, benchNumThreads, [&]( int y, int )
+        {
+            for ( int x = 0; x < width; x++ )
+            {
+                SurfaceHitRecord rec;
+                bool hit = bvh.hit( camera.getRay( x + 0.5, y + 0.5 ), DEFAULT_TMIN, DEFAULT_TMAX, rec );
+                singleT[ y * width + x ] = hit? rec.t : -1.0;
+            }
+        } );
+        singleTime = Util::Min2( singleTime, Util::GetCurrRealTime() - startTime );
+
+        startTime = Util::GetCurrRealTime();
+        Scheduler::Run( numBlocksX * numBlocksY, benchNumThreads, [&]( int block, int )
+        {
+            Ray rays[ benchPacketSize * benchPacketSize ];
+            SurfaceHitRecord recs[ benchPacketSize * benchPacketSize ];
+            bool hits[ benchPacketSize * benchPacketSize ];
+
+            int x0 = ( block % numBlocksX ) * benchPacketSize;
+            int y0 = ( block / numBlocksX ) * benchPacketSize;
+            int w = Util::Min2( benchPacketSize, width - x0 );
+            int h = Util::Min2( benchPacketSize, height - y0 );
+            for ( int j = 0; j < h; j++ )
+                for ( int i = 0; i < w; i++ )
+                    rays[ j * w + i ] = camera.getRay( x0 + i + 0.5, y0 + j + 0.5 );
+
+            bvh.hitPacket( rays, w * h, DEFAULT_TMIN, DEFAULT_TMAX, recs, hits );
+
+            for ( int j = 0; j < h; j++ )
+                for ( int i = 0; i < w; i++ )
+                    packetT[ ( y0 + j ) * width + x0 + i ] = hits[ j * w + i ]? recs[ j * w + i ].t : -1.0;
+        } );
+        packetTime = Util::Min2( packetTime, Util::GetCurrRealTime() - startTime );
+    }
+
+    int mismatches = 0;
+    for ( int i = 0; i < width * height; i++ )
+        if ( singleT[i] != packetT[i] ) mismatches++;
+
+    double numRays = (double) width * height;
+    printf( "%-14s primary rays: single %6.3f sec (%5.2f Mrays/s)   packets %6.3f sec (%5.2f Mrays/s)   mismatches %d\n",
+            name, singleTime, numRays / singleTime * 1e-6, packetTime, numRays / packetTime * 1e-6, mismatches );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Makes numSpheres spheres in a cube, filling about 5% of it, with radii
+// within a factor of 3 of each other. With clustered, every other sphere
+// is put, 8 times smaller, in the corner 1/8 the size of the cube.
+//////////////////////////////////////////////////////////////////////////////
+
+static void makeSphereField( int numSpheres, bool clustered, double size, vector<SurfacePtr> &spheres )
+{
+    srand( 1 );
+    double radius = cbrt( 0.05 * size * size * size / numSpheres * 3.0 / ( 4.0 * M_PI ) );
+
+    for ( int i = 0; i < numSpheres; i++ )
+    {
+        double scale = ( clustered && i % 2 == 0 )? 0.125 : 1.0;
+        Vector3d center( Util::UniformRandom(), Util::UniformRandom(), Util::UniformRandom() );
+        spheres.push_back( new Sphere( scale * size * center, scale * radius * Util::UniformRandom( 0.5, 1.5 ), NULL ) );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Times each sphere kernel on benchKernelRays rays, each tested against
+// all of benchKernelSpheres spheres, and counts the rays on which it finds
+// another sphere, or another t, than Sphere::hit.
+//////////////////////////////////////////////////////////////////////////////
+
+// Whether the kernel found the nearest hit that the loop over Sphere::hit
+// did. The kernel keeps t in double, which Sphere::hit rounds to Real, so
+// two spheres hit at the same Real t are a tie either may win.
+static bool sameHit( int hit, double t, int refHit, Real refT )
+{
+    if ( hit < 0 || refHit < 0 ) return hit == refHit;
+    return (Real) t == refT;
+}
+
+
+static void runSphereKernels()
+{
+    const double size = 100.0;
+    vector<SurfacePtr> spheres;
+    makeSphereField( benchKernelSpheres, false, size, spheres );
+
+    int numSpheres = (int) spheres.size();
+    int numPackets = ( numSpheres + SPHERE_PACKET_WIDTH - 1 ) / SPHERE_PACKET_WIDTH;
+    vector<SpherePacket> packets( numPackets );
+    for ( int i = 0; i < numPackets * SPHERE_PACKET_WIDTH; i++ )
+    {
+        if ( i < numSpheres )
+        {
+            const Sphere *sphere = static_cast<const Sphere *>( spheres[i] );
+            double center[3] = { sphere->center.x(), sphere->center.y(), sphere->center.z() };
+            SphereKernel::SetLane( packets[ i / SPHERE_PACKET_WIDTH ], i % SPHERE_PACKET_WIDTH, center, sphere->radius );
+        }
+        else
+            SphereKernel::ClearLane( packets[ i / SPHERE_PACKET_WIDTH ], i % SPHERE_PACKET_WIDTH );
+    }
+
+    // Rays from around the field through random points in it. The shadow
+    // rays end halfway to the nearest hit, or to the point.
+    vector<Ray> rays;
+    vector<SphereRay> kernelRays;
+    for ( int i = 0; i < benchKernelRays; i++ )
+    {
+        Vector3d orig( Util::UniformRandom( -1.0, 2.0 ), Util::UniformRandom( -1.0, 2.0 ), 2.0 );
+        Vector3d target( Util::UniformRandom(), Util::UniformRandom(), Util::UniformRandom() );
+        Ray ray( orig * size, ( target - orig ) * size );
+        rays.push_back( ray );
+        SphereRay kray = { ray.origin().x(), ray.origin().y(), ray.origin().z(),
+                           ray.direction().x(), ray.direction().y(), ray.direction().z() };
+        kernelRays.push_back( kray );
+    }
+
+    const Real tmin = DEFAULT_TMIN;
+    vector<int> refHit( benchKernelRays, -1 );
+    vector<Real> refT( benchKernelRays, REAL_MAX );
+    vector<Real> shadowTmax( benchKernelRays );
+    vector<char> refShadow( benchKernelRays );
+
+    double startTime = Util::GetCurrRealTime();
+    for ( int r = 0; r < benchKernelRays; r++ )
+    {
+        SurfaceHitRecord rec;
+        for ( int i = 0; i < numSpheres; i++ )
+        {
+            if ( spheres[i]->hit( rays[r], tmin, refT[r], rec ) )
+            {
+                refHit[r] = i;
+                refT[r] = rec.t;
+            }
+        }
+    }
+    double hitTime = Util::GetCurrRealTime() - startTime;
+
+    for ( int r = 0; r < benchKernelRays; r++ )
+        shadowTmax[r] = 0.5 * Util::Min2( (double) refT[r], 1.0 );
+
+    startTime = Util::GetCurrRealTime();
+    for ( int r = 0; r < benchKernelRays; r++ )
+    {
+        refShadow[r] = 0;
+        for ( int i = 0; i < numSpheres && !refShadow[r]; i++ )
+            refShadow[r] = spheres[i]->shadowHit( rays[r], tmin, shadowTmax[r] );
+    }
+    double shadowTime = Util::GetCurrRealTime() - startTime;
+
+    double numTests = (double) benchKernelRays * numSpheres;
+    printf( "Sphere kernels, %d rays against %d spheres\n", benchKernelRays, numSpheres );
+    printf( "  %-12s nearest %6.3f sec (%6.1f Mtests/s)   any-hit %6.3f sec\n",
+            "Sphere::hit", hitTime, numTests / hitTime * 1e-6, shadowTime );
+
+    SimdLevel bestLevel = SphereKernel::Level();
+    for ( int level = SIMD_SCALAR; level <= bestLevel; level++ )
+    {
+        if ( SphereKernel::Use( (SimdLevel) level ) != level ) continue;
+        int mismatches = 0;
+
+        // One ray against all the spheres.
+        startTime = Util::GetCurrRealTime();
+        vector<int> hit( benchKernelRays );
+        vector<double> t( benchKernelRays, DBL_MAX );
+        for ( int r = 0; r < benchKernelRays; r++ )
+            hit[r] = SphereKernel::Nearest( kernelRays[r], &packets[0], numPackets, tmin, t[r] );
+        double kernelHitTime = Util::GetCurrRealTime() - startTime;
+
+        for ( int r = 0; r < benchKernelRays; r++ )
+            if ( !sameHit( hit[r], t[r], refHit[r], refT[r] ) ) mismatches++;
+
+        startTime = Util::GetCurrRealTime();
+        for ( int r = 0; r < benchKernelRays; r++ )
+        {
+            bool occluded = SphereKernel::AnyHit( kernelRays[r], &packets[0], numPackets, tmin, shadowTmax[r] ) >= 0;
+            if ( occluded != ( refShadow[r] != 0 ) ) mismatches++;
+        }
+        double kernelShadowTime = Util::GetCurrRealTime() - startTime;
+
+        // All the rays, in packets, against one sphere at a time.
+        int numRayPackets = ( benchKernelRays + SPHERE_PACKET_WIDTH - 1 ) / SPHERE_PACKET_WIDTH;
+        vector<SphereRayPacket> rayPackets( numRayPackets );
+        for ( int r = 0; r < numRayPackets * SPHERE_PACKET_WIDTH; r++ )
+        {
+            SphereRayPacket &p = rayPackets[ r / SPHERE_PACKET_WIDTH ];
+            if ( r >= benchKernelRays )
+            {
+                SphereKernel::ClearRay( p, r % SPHERE_PACKET_WIDTH );
+                continue;
+            }
+            const SphereRay &k = kernelRays[r];
+            double orig[3] = { k.ox, k.oy, k.oz }, dir[3] = { k.dx, k.dy, k.dz };
+            SphereKernel::SetRay( p, r % SPHERE_PACKET_WIDTH, orig, dir, tmin, DBL_MAX );
+        }
+
+        vector<unsigned> masks( numRayPackets );
+        fill( hit.begin(), hit.end(), -1 );
+        startTime = Util::GetCurrRealTime();
+        for ( int i = 0; i < numSpheres; i++ )
+        {
+            const Sphere *sphere = static_cast<const Sphere *>( spheres[i] );
+            double center[3] = { sphere->center.x(), sphere->center.y(), sphere->center.z() };
+            SphereKernel::NearestRays( &rayPackets[0], numRayPackets, center, (double) sphere->radius * sphere->radius, &masks[0] );
+
+            for ( int k = 0; k < numRayPackets; k++ )
+                for ( unsigned m = masks[k]; m != 0; m &= m - 1 )
+                {
+                    int j = 0;
+                    while ( !( m & ( 1u << j ) ) ) j++;
+                    hit[ k * SPHERE_PACKET_WIDTH + j ] = i;
+                }
+        }
+        double raysTime = Util::GetCurrRealTime() - startTime;
+
+        for ( int r = 0; r < benchKernelRays; r++ )
+        {
+            double rt = rayPackets[ r / SPHERE_PACKET_WIDTH ].tmax[ r % SPHERE_PACKET_WIDTH ];
+            if ( !sameHit( hit[r], rt, refHit[r], refT[r] ) ) mismatches++;
+        }
+
+        printf( "  %-12s nearest %6.3f sec (%6.1f Mtests/s)   any-hit %6.3f sec   ray packets %6.3f sec   mismatches %d\n",
+                Simd::LevelName( (SimdLevel) level ), kernelHitTime, numTests / kernelHitTime * 1e-6,
+                kernelShadowTime, raysTime, mismatches );
+    }
+    SphereKernel::Use( bestLevel );
+
+    for ( size_t i = 0; i < spheres.size(); i++ ) delete spheres[i];
+}
+
+
+
+// The 8-bit value that Image writes for a color component.
+static int quantize( float c )
+{
+    int q = (int)( 256.0 * c );
+    return ( q > 255 )? 255 : q;
+}
+
+
+// A random unit vector.
+static Vector3d randomDirection()
+{
+    Vector3d d;
+    do
+        d = Vector3d( Util::UniformRandom( -1.0, 1.0 ), Util::UniformRandom( -1.0, 1.0 ), Util::UniformRandom( -1.0, 1.0 ) );
+    while ( dot( d, d ) > 1.0 || dot( d, d ) < 1e-6 );
+    return d.makeUnitVector();
+}
+
+
+// False if a kernel shades a color more than 1 step off, or its pow is
+// further off than PhongKernel.h promises.
+static bool runPhongKernels()
+{
+    // Each hit has its unit N, V and R, a material, and up to a batch of
+    // lights, with intensities that keep its color mostly below 1.
+    struct BenchHit
+    {
+        Vector3d N, V;
+        PhongHit hit;
+        PhongLightBatch batch;
+        vector<Vector3d> L;
+        int numLights;
+    };
+
+    vector<BenchHit> hits( benchPhongHits );
+    for ( int h = 0; h < benchPhongHits; h++ )
+    {
+        BenchHit &b = hits[h];
+        b.N = randomDirection();
+        b.V = randomDirection();
+        if ( dot( b.N, b.V ) < 0.0 ) b.V = -b.V;
+        Vector3d R = ( 2.0 * dot( b.N, b.V ) ) * b.N - b.V;
+
+        float n = ( h % 4 == 0 )? (float)( rand() % 8 ) : (float) Util::UniformRandom( 0.0, 256.0 );
+        PhongHit hit = { (float) b.N.x(), (float) b.N.y(), (float) b.N.z(), (float) R.x(), (float) R.y(), (float) R.z(),
+                         { (float) Util::UniformRandom(), (float) Util::UniformRandom(), (float) Util::UniformRandom() },
+                         { (float) Util::UniformRandom(), (float) Util::UniformRandom(), (float) Util::UniformRandom() }, n };
+        b.hit = hit;
+
+        b.batch = PhongLightBatch();
+        b.numLights = 1 + rand() % PHONG_BATCH_WIDTH;
+        for ( int j = 0; j < b.numLights; j++ )
+        {
+            // Lights about the mirror direction of V light the highlight.
+            Vector3d L = randomDirection();
+            if ( j % 2 == 0 ) L = ( R + 0.1 * Util::UniformRandom() * L ).makeUnitVector();
+            b.L.push_back( L );
+
+            double l[3] = { L.x(), L.y(), L.z() };
+            float I[3];
+            for ( int c = 0; c < 3; c++ ) I[c] = (float)( Util::UniformRandom() / b.numLights );
+            PhongKernel::SetLane( b.batch, j, l, I );
+        }
+    }
+
+    // The loop of Raytrace before the kernels: the reflection of each L,
+    // and powf.
+    vector<float> refColor( 3 * benchPhongHits );
+    double startTime = Util::GetCurrRealTime();
+    for ( int h = 0; h < benchPhongHits; h++ )
+    {
+        const BenchHit &b = hits[h];
+        float color[3] = { 0.0f, 0.0f, 0.0f };
+        for ( int j = 0; j < b.numLights; j++ )
+        {
+            const Vector3d &L = b.L[j];
+            Vector3d R = ( 2.0 * dot( b.N, L ) ) * b.N - L;
+
+            float N_dot_L = (float) dot( b.N, L );
+            if ( N_dot_L < 0.0f ) N_dot_L = 0.0f;
+            float R_dot_V = (float) dot( R, b.V );
+            if ( R_dot_V < 0.0f ) R_dot_V = 0.0f;
+            float R_dot_V_pow_n = powf( R_dot_V, b.hit.n );
+
+            for ( int c = 0; c < 3; c++ )
+            {
+                float I = ( c == 0 )? b.batch.ir[j] : ( c == 1 )? b.batch.ig[j] : b.batch.ib[j];
+                color[c] += I * ( b.hit.k_d[c] * N_dot_L + b.hit.k_r[c] * R_dot_V_pow_n );
+            }
+        }
+        for ( int c = 0; c < 3; c++ ) refColor[ 3 * h + c ] = color[c];
+    }
+    double refTime = Util::GetCurrRealTime() - startTime;
+
+    // Values in [1/2, 1], half of them within 1% of 1, and their powf.
+    const int numPows = benchPhongHits;
+    vector<float> x( numPows ), refPow( numPows ), kernelPow( numPows );
+    const float n = 64.0f;
+    for ( int i = 0; i < numPows; i++ )
+    {
+        x[i] = (float) pow( 2.0, -Util::UniformRandom( 0.0, 1.0 ) * ( ( i % 2 == 0 )? 1.0 : 0.01 ) );
+        refPow[i] = powf( x[i], n );
+    }
+
+    printf( "Phong kernels, %d hits by 1 to %d lights\n", benchPhongHits, PHONG_BATCH_WIDTH );
+    printf( "  %-12s %6.3f sec\n", "powf", refTime );
+
+    bool passed = true;
+    SimdLevel bestLevel = PhongKernel::Level();
+    for ( int level = SIMD_SCALAR; level <= bestLevel; level++ )
+    {
+        if ( PhongKernel::Use( (SimdLevel) level ) != level ) continue;
+
+        vector<float> color( 3 * benchPhongHits, 0.0f );
+        startTime = Util::GetCurrRealTime();
+        for ( int h = 0; h < benchPhongHits; h++ )
+            PhongKernel::Shade( hits[h].hit, hits[h].batch, hits[h].numLights, &color[ 3 * h ] );
+        double kernelTime = Util::GetCurrRealTime() - startTime;
+
+        int numDiffs = 0, numOff = 0;
+        for ( int i = 0; i < 3 * benchPhongHits; i++ )
+        {
+            int d = abs( quantize( color[i] ) - quantize( refColor[i] ) );
+            if ( d > 0 ) numDiffs++;
+            if ( d > 1 ) numOff++;
+        }
+
+        PhongKernel::Pow( &x[0], numPows, n, &kernelPow[0] );
+        double maxError = 0.0;
+        for ( int i = 0; i < numPows; i++ )
+            if ( refPow[i] > ldexp( 1.0, -24 ) )
+                maxError = Util::Max2( maxError, fabs( (double) kernelPow[i] / refPow[i] - 1.0 ) );
+
+        printf( "  %-12s %6.3f sec   8-bit colors off by 1: %d, by more: %d   pow error %.2g\n",
+                Simd::LevelName( (SimdLevel) level ), kernelTime, numDiffs - numOff, numOff, maxError );
+        if ( numOff > 0 || maxError > benchPhongMaxPowError )
+        {
+            fprintf( stderr, "Phong kernel %s is off the powf loop.\n", Simd::LevelName( (SimdLevel) level ) );
+            passed = false;
+        }
+    }
+    PhongKernel::Use( bestLevel );
+    return passed;
+}
+
+
+
+// Rays aimed exactly at the shared vertices and edges of a bumpy grid mesh,
+// steeply from above, so the mesh has no silhouette they could graze and
+// each of them has to hit it. False if the watertight test misses any.
+static bool runWatertight()
+{
+    const int n = benchWatertightGrid;
+    vector<Vector3d> vertices;
+    for ( int j = 0; j <= n; j++ )
+        for ( int i = 0; i <= n; i++ )
+            vertices.push_back( Vector3d( i + 0.2 * Util::UniformRandom( -1.0, 1.0 ),
+                                          j + 0.2 * Util::UniformRandom( -1.0, 1.0 ),
+                                          0.1 * Util::UniformRandom( -1.0, 1.0 ) ) );
+
+    // Two triangles a cell, split along its diagonal from (i, j) to (i+1, j+1).
+    vector<uint32_t> indices;
+    for ( int j = 0; j < n; j++ )
+        for ( int i = 0; i < n; i++ )
+        {
+            uint32_t k = j * ( n + 1 ) + i;
+            uint32_t cell[6] = { k, k + 1, k + n + 2,  k, k + n + 2, k + n + 1 };
+            indices.insert( indices.end(), cell, cell + 6 );
+        }
+    TriangleMesh mesh( vertices, indices, NULL );
+
+    // Each target is an inner vertex, or a point on one of the edges from
+    // it to the right, up or along the diagonal, which two triangles share.
+    vector<Ray> rays;
+    for ( int k = 0; k < benchWatertightRays; k++ )
+    {
+        int i = 1 + rand() % ( n - 1 ), j = 1 + rand() % ( n - 1 );
+        Vector3d target = vertices[ j * ( n + 1 ) + i ];
+        if ( k % 2 == 1 )
+        {
+            int edge = rand() % 3;
+            const Vector3d &other = vertices[ ( j + ( edge > 0 ) ) * ( n + 1 ) + i + ( edge != 1 ) ];
+            target = target + Util::UniformRandom() * ( other - target );
+        }
+        Vector3d origin = target + Vector3d( Util::UniformRandom( -1.0, 1.0 ), Util::UniformRandom( -1.0, 1.0 ), 4.0 );
+        rays.push_back( Ray( origin, target - origin ) );
+    }
+
+    printf( "Rays at shared edges and vertices, %d triangles\n", mesh.numTriangles() );
+
+    bool wasWatertight = Triangle::watertight;
+    int numMisses[2];
+    for ( int w = 0; w < 2; w++ )
+    {
+        Triangle::watertight = ( w == 1 );
+        numMisses[w] = 0;
+        SurfaceHitRecord rec;
+        for ( int k = 0; k < benchWatertightRays; k++ )
+            if ( !mesh.hit( rays[k], DEFAULT_TMIN, DEFAULT_TMAX, rec ) ) numMisses[w]++;
+
+        printf( "  %-12s misses %d of %d\n", Triangle::watertight? "watertight" : "Moller", numMisses[w],
+                benchWatertightRays );
+    }
+    Triangle::watertight = wasWatertight;
+
+    if ( numMisses[1] > 0 )
+    {
+        fprintf( stderr, "The watertight triangle test leaks rays through shared edges.\n" );
+        return false;
+    }
+    return true;
+}
+
+
+
+int main( int argc, char **argv )
+{
+    int minTriangles = ( argc > 1 )? atoi( argv[1] ) : 1000000;
+
+    const char *files[3] = { "Cow.obj", "Teapot.obj", "Teddy.obj" };
+    Obj models[3];
+    AABB modelBox[3];
+    int modelTriangles = 0;
+
+    for ( int m = 0; m < 3; m++ )
+    {
+        models[m].readfile( files[m] );
+        if ( models[m].faces.empty() )
+        {
+            fprintf( stderr, "Cannot read %s.\n", files[m] );
+            return 1;
+        }
+        for ( size_t i = 0; i < models[m].vertexes.size(); i++ )
+        {
+            const vertex &v = models[m].vertexes[i];
+            modelBox[m].expand( Vector3d( v.x, v.y, v.z ) );
+        }
+        modelTriangles += (int) models[m].faces.size();
+    }
+
+    // Enough cells for minTriangles, with the models in turn.
+    int numCells = ( 3 * minTriangles + modelTriangles - 1 ) / modelTriangles;
+    int gridSize = (int) ceil( sqrt( (double) numCells ) );
+
+    vector<SurfacePtr> surfaces;
+    int numTriangles = 0;
+    size_t sceneMemory = 0;
+    for ( int c = 0; c < numCells; c++ )
+    {
+        int m = c % 3;
+        Vector3d extent = modelBox[m].extent();
+        double scale = 0.8 / Util::Max3( extent.x(), extent.y(), extent.z() );
+        Vector3d cell( c % gridSize + 0.5, 0.0, c / gridSize + 0.5 );
+        Vector3d offset = cell - scale * modelBox[m].centroid();
+
+        TriangleMesh *mesh = models[m].makeMesh( scale, offset, NULL );
+        numTriangles += mesh->numTriangles();
+        sceneMemory += meshMemory( mesh );
+        surfaces.push_back( mesh );
+    }
+
+    Camera camera( Vector3d( 0.5 * gridSize, 0.4 * gridSize, 1.2 * gridSize ),
+                   Vector3d( 0.5 * gridSize, 0.0, 0.5 * gridSize ), Vector3d( 0.0, 1.0, 0.0 ),
+                   -0.5, 0.5, -0.375, 0.375, 0.8, benchImageWidth, benchImageHeight );
+
+    printf( "%d triangles in %d meshes, %d threads\n", numTriangles, (int) surfaces.size(),
+            ( benchNumThreads > 0 )? benchNumThreads : Scheduler::HardwareThreads() );
+
+    BVHBuildOptions sah;
+    runBuilder( "SAH", sah, surfaces, sceneMemory, camera );
+
+    BVHBuildOptions sbvh;
+    sbvh.method = BVH_BUILD_SBVH;
+    runBuilder( "SBVH", sbvh, surfaces, sceneMemory, camera );
+
+    BVHBuildOptions lbvh;
+    lbvh.method = BVH_BUILD_LBVH;
+    lbvh.rotate = false;
+    runBuilder( "LBVH", lbvh, surfaces, sceneMemory, camera );
+
+    lbvh.rotate = true;
+    runBuilder( "LBVH+rotate", lbvh, surfaces, sceneMemory, camera );
+
+    runKdTree( "Kd-tree", surfaces, sceneMemory, camera );
+    runPackets( "BVH8", surfaces, camera );
+
+    for ( size_t i = 0; i < surfaces.size(); i++ ) delete surfaces[i];
+    surfaces.clear();
+
+    // The same cells, as Instances of one mesh and BVH per model.
+    double startTime = Util::GetCurrRealTime();
+
+    TriangleMesh *modelMesh[3];
+    BVH *modelBvh[3];
+    size_t instancedMemory = 0;
+    for ( int m = 0; m < 3; m++ )
+    {
+        SurfacePtr mesh = modelMesh[m] = models[m].makeMesh( 1.0, Vector3d( 0.0, 0.0, 0.0 ), NULL );
+        modelBvh[m] = new BVH( &mesh, 1, sah );
+        instancedMemory += meshMemory( modelMesh[m] ) + modelBvh[m]->memoryUsage();
+    }
+
+    for ( int c = 0; c < numCells; c++ )
+    {
+        int m = c % 3;
+        Vector3d extent = modelBox[m].extent();
+        double scale = 0.8 / Util::Max3( extent.x(), extent.y(), extent.z() );
+        Vector3d cell( c % gridSize + 0.5, 0.0, c / gridSize + 0.5 );
+        Vector3d offset = cell - scale * modelBox[m].centroid();
+
+        surfaces.push_back( new Instance( modelBvh[m], Transform::Translate( offset ) * Transform::Scale( scale ) ) );
+    }
+
+    BVH topLevel( &surfaces[0], (int) surfaces.size(), sah );
+    double buildTime = Util::GetCurrRealTime() - startTime;
+    instancedMemory += topLevel.memoryUsage() + surfaces.size() * sizeof( Instance );
+
+    int numRays;
+    double traceTime = bestTrace( topLevel, camera, numRays );
+    printf( "%-14s build %7.3f sec   %16s   %8d nodes   %17s   %8.1f MB   trace %6.3f sec (%5.2f Mrays/s)\n",
+            "Instanced SAH", buildTime, "", topLevel.numNodes(), "", instancedMemory / 1048576.0,
+            traceTime, numRays / traceTime * 1e-6 );
+
+    // Each model on its own, filling the image.
+    for ( int m = 0; m < 3; m++ )
+    {
+        SurfacePtr mesh = modelMesh[m];
+        Vector3d center = modelBox[m].centroid();
+        double size = modelBox[m].extent().length();
+        Camera modelCamera( center + Vector3d( 0.3, 0.4, 1.0 ) * size, center, Vector3d( 0.0, 1.0, 0.0 ),
+                            -0.5, 0.5, -0.375, 0.375, 0.8, benchImageWidth, benchImageHeight );
+
+        printf( "%s: %d triangles\n", files[m], modelMesh[m]->numTriangles() );
+        vector<SurfacePtr> modelSurfaces( 1, mesh );
+        runBuilder( "  SAH", sah, modelSurfaces, meshMemory( modelMesh[m] ), modelCamera );
+        runKdTree( "  Kd-tree", modelSurfaces, meshMemory( modelMesh[m] ), modelCamera );
+        runPackets( "  BVH8", modelSurfaces, modelCamera );
+    }
+
+    for ( int clustered = 0; clustered < 2; clustered++ )
+    {
+        const double size = 100.0;
+        vector<SurfacePtr> spheres;
+        makeSphereField( benchNumSpheres, clustered != 0, size, spheres );
+        size_t spheresMemory = spheres.size() * sizeof( Sphere );
+
+        Camera fieldCamera( Vector3d( 0.5, 0.6, 2.0 ) * size, Vector3d( 0.5, 0.5, 0.5 ) * size,
+                            Vector3d( 0.0, 1.0, 0.0 ), -0.5, 0.5, -0.375, 0.375, 0.8,
+                            benchImageWidth, benchImageHeight );
+
+        printf( "%d spheres, %s\n", benchNumSpheres, clustered? "half of them in a corner" : "spread evenly" );
+        runBuilder( "  SAH", sah, spheres, spheresMemory, fieldCamera );
+        runBuilder( "  LBVH", lbvh, spheres, spheresMemory, fieldCamera );
+
+        // The spheres copied into one array.
+        vector<SurfacePtr> others;
+        PrimitiveArrays arrays( &spheres[0], (int) spheres.size(), others );
+        vector<SurfacePtr> arraySurfaces( 1, &arrays );
+        runBuilder( "  SAH, array", sah, arraySurfaces, spheresMemory, fieldCamera );
+
+        GridBuildOptions grid;
+        grid.twoLevel = false;
+        runGrid( "  Grid", grid, spheres, spheresMemory, fieldCamera );
+        grid.twoLevel = true;
+        runGrid( "  Two-level", grid, spheres, spheresMemory, fieldCamera );
+
+        for ( size_t i = 0; i < spheres.size(); i++ ) delete spheres[i];
+    }
+
+    runSphereKernels();
+    if ( !runPhongKernels() ) return 1;
+    if ( !runWatertight() ) return 1;
+
+    return 0;
+}
@@ -0,0 +1,649 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include "Util.h"
+#include "Scheduler.h"
+#include "BVH.h"
+
+using namespace std;
+
+
+BVH::BVH( const SurfacePtr *surfaces, int numSurfaces, const BVHBuildOptions &options )
+    : mSurfaces( surfaces, surfaces + numSurfaces ), mOptions( options )
+{
+    matp = NULL;
+    mMaxLeafSize = ( options.maxLeafSize < BVH_MAX_LEAF_SIZE )? options.maxLeafSize : BVH_MAX_LEAF_SIZE;
+    build();
+}
+
+
+
+void BVH::build()
+{
+    mBuiltSahCost = 0.0;
+
+    vector<BuildPrim> buildPrims;
+    gatherPrimitives( mSurfaces.data(), (int) mSurfaces.size(), mOptions.numThreads, buildPrims );
+    if ( buildPrims.empty() ) return;
+
+    mPrims.reserve( buildPrims.size() );
+    mNodes.reserve( 2 * buildPrims.size() );
+
+    if ( mOptions.method == BVH_BUILD_LBVH )
+        buildLBVH( buildPrims, mOptions.rotate, mOptions.numThreads );
+    else if ( mOptions.method == BVH_BUILD_SBVH )
+        buildSBVH( buildPrims, mOptions.splitBudget );
+    else
+        buildRecursive( buildPrims, 0, (int) buildPrims.size(), 0 );
+
+    mBuiltSahCost = sahCost();
+}
+
+
+
+void BVH::rebuild()
+{
+    mNodes.clear();
+    mPrims.clear();
+    mUnbounded.clear();
+    mPackets.clear();
+    build();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Computes the box of every primitive of the surfaces, in parallel. The
+// bounded ones are put in buildPrims, in order, and the others in
+// mUnbounded.
+//////////////////////////////////////////////////////////////////////////////
+
+void BVH::gatherPrimitives( const SurfacePtr *surfaces, int numSurfaces, int numThreads,
+                            vector<BuildPrim> &buildPrims )
+{
+    // firstPrim[i] is the index of the first primitive of surfaces[i].
+    vector<int> firstPrim( numSurfaces + 1, 0 );
+    for ( int i = 0; i < numSurfaces; i++ )
+        firstPrim[i + 1] = firstPrim[i] + surfaces[i]->numPrimitives();
+
+    int numPrims = firstPrim[ numSurfaces ];
+    vector<BuildPrim> all( numPrims );
+    vector<char> bounded( numPrims );
+
+    const int blockSize = 4096;
+    int numBlocks = ( numPrims + blockSize - 1 ) / blockSize;
+
+    Scheduler::Run( numBlocks, numThreads, [&]( int block, int )
+    {
+        int begin = block * blockSize;
+        int end = Util::Min2( begin + blockSize, numPrims );
+        int s = (int)( std::upper_bound( firstPrim.begin(), firstPrim.end(), begin ) - firstPrim.begin() ) - 1;
+
+        for ( int i = begin; i < end; i++ )
+        {
+            while ( i >= firstPrim[s + 1] ) s++;
+
+            BuildPrim &bp = all[i];
+            bp.prim.surface = surfaces[s];
+            bp.prim.index = i - firstPrim[s];
+            bounded[i] = surfaces[s]->primitiveBoundingBox( bp.prim.index, bp.box );
+            if ( bounded[i] )
+            {
+                Vector3d v0, v1, v2;
+                bp.centroid = bp.box.centroid();
+                bp.isTriangle = surfaces[s]->primitiveTriangle( bp.prim.index, v0, v1, v2 );
+            }
+        }
+    } );
+
+    buildPrims.reserve( numPrims );
+    for ( int i = 0; i < numPrims; i++ )
+    {
+        if ( bounded[i] )
+            buildPrims.push_back( all[i] );
+        else
+            mUnbounded.push_back( all[i].prim );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Builds the subtree over buildPrims[begin, end) and returns the index of
+// its root node. Bins the primitive centroids along each axis, and picks
+// the bin boundary with the lowest SAH cost, or makes a leaf if that is
+// cheaper.
+//////////////////////////////////////////////////////////////////////////////
+
+int BVH::buildRecursive( vector<BuildPrim> &buildPrims, int begin, int end, int depth )
+{
+    int nodeIndex = (int) mNodes.size();
+    mNodes.push_back( Node() );
+
+    AABB box, centroidBox;
+    int numTriangles = 0;
+    for ( int i = begin; i < end; i++ )
+    {
+        box.expand( buildPrims[i].box );
+        centroidBox.expand( buildPrims[i].centroid );
+        if ( buildPrims[i].isTriangle ) numTriangles++;
+    }
+
+    int count = end - begin;
+    ObjectSplit split;
+    if ( count > 1 && depth < BVH_MAX_DEPTH )
+        findObjectSplit( &buildPrims[0] + begin, count, centroidBox, split );
+
+    double area = box.surfaceArea();
+    int numPackets = ( numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+    double leafCost = numPackets * SAH_PACKET_COST + ( count - numTriangles );
+    double splitCost = ( area > 0.0 )? SAH_TRAVERSAL_COST + split.cost / area : DBL_MAX;
+
+    // Make a leaf if no split was found, or if a small enough node is
+    // cheaper to intersect directly.
+    if ( split.axis < 0 || ( count <= mMaxLeafSize && leafCost <= splitCost ) )
+    {
+        // A node that could not be split may exceed the leaf size limit;
+        // chain it into leaves of at most mMaxLeafSize primitives.
+        if ( count > mMaxLeafSize && count > 1 )
+        {
+            int mid = begin + count / 2;
+            mNodes[nodeIndex].box = box;
+            mNodes[nodeIndex].count = 0;
+            mNodes[nodeIndex].axis = (short) box.longestAxis();
+            buildRecursive( buildPrims, begin, mid, depth );
+            int second = buildRecursive( buildPrims, mid, end, depth );
+            mNodes[nodeIndex].offset = second;
+            return nodeIndex;
+        }
+
+        mNodes[nodeIndex].box = box;
+        makeLeaf( buildPrims, begin, end, mNodes[nodeIndex] );
+        return nodeIndex;
+    }
+
+    // Partition the primitives about the chosen bin boundary.
+    BuildPrim *mid = std::partition( &buildPrims[0] + begin, &buildPrims[0] + end,
+        [&]( const BuildPrim &bp ) { return split.isLeft( bp ); } );
+    int midIndex = (int)( mid - &buildPrims[0] );
+
+    mNodes[nodeIndex].box = box;
+    mNodes[nodeIndex].count = 0;
+    mNodes[nodeIndex].axis = (short) split.axis;
+    buildRecursive( buildPrims, begin, midIndex, depth + 1 );
+    int second = buildRecursive( buildPrims, midIndex, end, depth + 1 );
+    mNodes[nodeIndex].offset = second;
+    return nodeIndex;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Bins the centroids of prims[0 .. count-1] along each axis, and finds the
+// bin boundary with the lowest SAH cost. split.axis is -1 if there is
+// none, as when all the centroids coincide.
+//////////////////////////////////////////////////////////////////////////////
+
+void BVH::findObjectSplit( const BuildPrim *prims, int count, const AABB &centroidBox, ObjectSplit &split )
+{
+    split = ObjectSplit();
+
+    for ( int axis = 0; axis < 3; axis++ )
+    {
+        double cmin = centroidBox.minPt[axis];
+        double cmax = centroidBox.maxPt[axis];
+        if ( cmax <= cmin ) continue;
+
+        AABB binBox[ SAH_NUM_BINS ];
+        int binCount[ SAH_NUM_BINS ] = { 0 };
+        double scale = SAH_NUM_BINS / ( cmax - cmin );
+
+        for ( int i = 0; i < count; i++ )
+        {
+            int b = (int)( ( prims[i].centroid[axis] - cmin ) * scale );
+            if ( b >= SAH_NUM_BINS ) b = SAH_NUM_BINS - 1;
+            binCount[b]++;
+            binBox[b].expand( prims[i].box );
+        }
+
+        // Sweep from the right to get the box and count of every right side.
+        AABB rightBox[ SAH_NUM_BINS ];
+        int rightCount[ SAH_NUM_BINS ];
+        AABB acc;
+        int n = 0;
+        for ( int b = SAH_NUM_BINS - 1; b > 0; b-- )
+        {
+            acc.expand( binBox[b] );
+            n += binCount[b];
+            rightBox[b] = acc;
+            rightCount[b] = n;
+        }
+
+        // Sweep from the left and evaluate the cost of splitting before bin b.
+        acc.setEmpty();
+        n = 0;
+        for ( int b = 1; b < SAH_NUM_BINS; b++ )
+        {
+            acc.expand( binBox[b - 1] );
+            n += binCount[b - 1];
+            if ( n == 0 || rightCount[b] == 0 ) continue;
+            double cost = acc.surfaceArea() * n + rightBox[b].surfaceArea() * rightCount[b];
+            if ( cost < split.cost )
+            {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = b;
+                split.cmin = cmin;
+                split.scale = scale;
+                split.leftBox = acc;
+                split.rightBox = rightBox[b];
+            }
+        }
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Makes node a leaf over buildPrims[begin, end), appended to mPrims and
+// mPackets.
+//////////////////////////////////////////////////////////////////////////////
+
+void BVH::makeLeaf( vector<BuildPrim> &buildPrims, int begin, int end, Node &node )
+{
+    int numTriangles = 0;
+    for ( int i = begin; i < end; i++ )
+        if ( buildPrims[i].isTriangle ) numTriangles++;
+
+    node.offset = (int) mPrims.size();
+    node.packetOffset = (int) mPackets.size();
+    mPrims.resize( mPrims.size() + ( end - begin ) );
+    mPackets.resize( mPackets.size() + ( numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH );
+
+    fillLeaf( &buildPrims[0] + begin, end - begin, node );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Makes node a leaf over prims[0 .. count-1], with the triangles first and
+// packed for the SIMD kernel. They are stored at node.offset in mPrims and
+// node.packetOffset in mPackets, which must have room for them. Leaves
+// stored in disjoint ranges may be filled in parallel.
+//////////////////////////////////////////////////////////////////////////////
+
+void BVH::fillLeaf( BuildPrim *prims, int count, Node &node )
+{
+    BuildPrim *mid = std::stable_partition( prims, prims + count,
+        []( const BuildPrim &bp ) { return bp.isTriangle; } );
+    int numTriangles = (int)( mid - prims );
+
+    node.count = (short) count;
+    node.axis = 0;
+    node.numTriangles = (short) numTriangles;
+
+    for ( int i = 0; i < count; i++ ) mPrims[ node.offset + i ] = prims[i].prim;
+
+    packLeaf( node );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Stores the current vertices of the triangles of a leaf in its packets.
+//////////////////////////////////////////////////////////////////////////////
+
+void BVH::packLeaf( const Node &node )
+{
+    int numTriangles = node.numTriangles;
+    for ( int k = 0; k < numTriangles; k += TRI_PACKET_WIDTH )
+    {
+        TrianglePacket &packet = mPackets[ node.packetOffset + k / TRI_PACKET_WIDTH ];
+        for ( int j = 0; j < TRI_PACKET_WIDTH; j++ )
+        {
+            if ( k + j >= numTriangles )
+            {
+                TriangleKernel::ClearLane( packet, j );
+                continue;
+            }
+
+            const PrimRef &prim = mPrims[ node.offset + k + j ];
+            Vector3d v0, v1, v2;
+            prim.surface->primitiveTriangle( prim.index, v0, v1, v2 );
+
+            double v[3], e1[3], e2[3], ng[3];
+            ( v1 - v0 ).getXYZ( e1 );
+            ( v2 - v0 ).getXYZ( e2 );
+            cross( v1 - v0, v2 - v0 ).getXYZ( ng );
+            v0.getXYZ( v );
+            TriangleKernel::SetLane( packet, j, v, e1, e2, ng );
+        }
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Updates the boxes and triangle packets of the tree for primitives that
+// have moved, keeping its topology.
+//
+// In the depth-first layout every subtree is a contiguous range of nodes
+// that follows its root, so walking a range backwards meets the children
+// of a node before the node itself. The subtrees of at most
+// BVH_REFIT_TASK_NODES nodes just below the top of the tree are refit in
+// parallel, then the nodes above them serially.
+//////////////////////////////////////////////////////////////////////////////
+
+void BVH::refit()
+{
+    if ( mNodes.empty() ) return;
+
+    vector<int> tasks, top;
+    vector<int> stack( 1, 0 );
+    while ( !stack.empty() )
+    {
+        int nodeIndex = stack.back();
+        stack.pop_back();
+        if ( subtreeEnd( nodeIndex ) - nodeIndex <= BVH_REFIT_TASK_NODES )
+        {
+            tasks.push_back( nodeIndex );
+            continue;
+        }
+        top.push_back( nodeIndex );
+        stack.push_back( mNodes[nodeIndex].offset );
+        stack.push_back( nodeIndex + 1 );
+    }
+
+    Scheduler::Run( (int) tasks.size(), mOptions.numThreads, [&]( int task, int )
+    {
+        int begin = tasks[task];
+        for ( int i = subtreeEnd( begin ) - 1; i >= begin; i-- ) refitNode( i );
+    } );
+
+    // Every node of top precedes its descendants in top.
+    for ( int k = (int) top.size() - 1; k >= 0; k-- ) refitNode( top[k] );
+}
+
+
+
+bool BVH::refitOrRebuild( double maxCostGrowth )
+{
+    refit();
+    if ( sahCost() <= maxCostGrowth * mBuiltSahCost ) return false;
+
+    rebuild();
+    return true;
+}
+
+
+
+// The index one past the last node of the subtree at nodeIndex, which
+// ends with the leaf reached by always taking the second child.
+int BVH::subtreeEnd( int nodeIndex ) const
+{
+    while ( mNodes[nodeIndex].count == 0 ) nodeIndex = mNodes[nodeIndex].offset;
+    return nodeIndex + 1;
+}
+
+
+
+void BVH::refitNode( int nodeIndex )
+{
+    Node &node = mNodes[nodeIndex];
+    if ( node.count == 0 )
+    {
+        node.box = mNodes[ nodeIndex + 1 ].box;
+        node.box.expand( mNodes[ node.offset ].box );
+        return;
+    }
+
+    node.box.setEmpty();
+    for ( int i = node.offset; i < node.offset + node.count; i++ )
+    {
+        AABB box;
+        if ( mPrims[i].surface->primitiveBoundingBox( mPrims[i].index, box ) ) node.box.expand( box );
+    }
+    packLeaf( node );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Prepares the ray for the SIMD triangle kernel.
+//////////////////////////////////////////////////////////////////////////////
+
+KernelRay BVH::makeKernelRay( const Ray &r )
+{
+    KernelRay kr;
+    Vector3d o = r.origin();
+    Vector3d d = r.direction();
+    kr.ox = (float) o.x();  kr.oy = (float) o.y();  kr.oz = (float) o.z();
+    kr.dx = (float) d.x();  kr.dy = (float) d.y();  kr.dz = (float) d.z();
+    kr.oMax = (float) Util::Max3( fabs( o.x() ), fabs( o.y() ), fabs( o.z() ) );
+    kr.dSum = (float)( fabs( d.x() ) + fabs( d.y() ) + fabs( d.z() ) );
+    return kr;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tests the ray against the primitives of a leaf, and shortens nearest_t
+// to any hit found.
+//////////////////////////////////////////////////////////////////////////////
+
+bool BVH::hitLeaf( const Node &node, const Ray &r, const KernelRay &kray, Real tmin,
+                   Real &nearest_t, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    SurfaceHitRecord tempHitRec;
+
+    // Confirm the triangles the kernel cannot rule out.
+    if ( node.numTriangles > 0 )
+    {
+        unsigned masks[ BVH_MAX_LEAF_SIZE / TRI_PACKET_WIDTH ];
+        int numPackets = ( node.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+        TriangleKernel::Candidates( kray, &mPackets[ node.packetOffset ], numPackets,
+                                    (float) tmin, (float) nearest_t, masks );
+
+        for ( int k = 0; k < numPackets; k++ )
+        {
+            const PrimRef *prims = &mPrims[ node.offset + k * TRI_PACKET_WIDTH ];
+            for ( unsigned m = masks[k], j = 0; m != 0; m >>= 1, j++ )
+            {
+                if ( ( m & 1 ) && prims[j].hit( r, tmin, nearest_t, tempHitRec ) )
+                {
+                    hasHit = true;
+                    nearest_t = tempHitRec.t;
+                    rec = tempHitRec;
+                }
+            }
+        }
+    }
+
+    for ( int i = node.offset + node.numTriangles; i < node.offset + node.count; i++ )
+    {
+        if ( mPrims[i].hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    return hasHit;
+}
+
+
+
+bool BVH::shadowHitLeaf( const Node &node, const Ray &r, const KernelRay &kray,
+                         Real tmin, Real tmax, Occluder *occluder ) const
+{
+    if ( node.numTriangles > 0 )
+    {
+        unsigned masks[ BVH_MAX_LEAF_SIZE / TRI_PACKET_WIDTH ];
+        int numPackets = ( node.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+        TriangleKernel::Candidates( kray, &mPackets[ node.packetOffset ], numPackets,
+                                    (float) tmin, (float) tmax, masks );
+
+        for ( int k = 0; k < numPackets; k++ )
+        {
+            const PrimRef *prims = &mPrims[ node.offset + k * TRI_PACKET_WIDTH ];
+            for ( unsigned m = masks[k], j = 0; m != 0; m >>= 1, j++ )
+                if ( ( m & 1 ) && prims[j].shadowHit( r, tmin, tmax, occluder ) ) return true;
+        }
+    }
+
+    for ( int i = node.offset + node.numTriangles; i < node.offset + node.count; i++ )
+        if ( mPrims[i].shadowHit( r, tmin, tmax, occluder ) ) return true;
+
+    return false;
+}
+
+
+
+bool BVH::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    Real nearest_t = tmax;
+    SurfaceHitRecord tempHitRec;
+
+    for ( size_t i = 0; i < mUnbounded.size(); i++ )
+    {
+        if ( mUnbounded[i].hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    if ( mNodes.empty() ) return hasHit;
+
+    Vector3d orig = r.origin();
+    Vector3d dir = r.direction();
+    Vector3d invDir( 1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z() );
+    int dirIsNeg[3] = { invDir.x() < 0.0, invDir.y() < 0.0, invDir.z() < 0.0 };
+
+    KernelRay kray = makeKernelRay( r );
+
+    int stack[ 2 * BVH_MAX_DEPTH ];
+    int stackSize = 0;
+    int nodeIndex = 0;
+
+    while ( true )
+    {
+        const Node &node = mNodes[nodeIndex];
+
+        if ( node.box.hit( orig, invDir, tmin, nearest_t ) )
+        {
+            if ( node.count > 0 )
+            {
+                if ( hitLeaf( node, r, kray, tmin, nearest_t, rec ) ) hasHit = true;
+
+                if ( stackSize == 0 ) break;
+                nodeIndex = stack[ --stackSize ];
+            }
+            else
+            {
+                // Visit the near child first, so nearest_t shrinks sooner.
+                if ( dirIsNeg[ node.axis ] )
+                {
+                    stack[ stackSize++ ] = nodeIndex + 1;
+                    nodeIndex = node.offset;
+                }
+                else
+                {
+                    stack[ stackSize++ ] = node.offset;
+                    nodeIndex = nodeIndex + 1;
+                }
+            }
+        }
+        else
+        {
+            if ( stackSize == 0 ) break;
+            nodeIndex = stack[ --stackSize ];
+        }
+    }
+
+    return hasHit;
+}
+
+
+
+// The any-hit query of shadowHit() and shadowHitOccluder(), which sets
+// occluder if it is not NULL.
+bool BVH::anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const
+{
+    for ( size_t i = 0; i < mUnbounded.size(); i++ )
+        if ( mUnbounded[i].shadowHit( r, tmin, tmax, occluder ) ) return true;
+
+    if ( mNodes.empty() ) return false;
+
+    Vector3d orig = r.origin();
+    Vector3d dir = r.direction();
+    Vector3d invDir( 1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z() );
+
+    KernelRay kray = makeKernelRay( r );
+
+    int stack[ 2 * BVH_MAX_DEPTH ];
+    int stackSize = 0;
+    int nodeIndex = 0;
+
+    while ( true )
+    {
+        const Node &node = mNodes[nodeIndex];
+
+        if ( node.box.hit( orig, invDir, tmin, tmax ) )
+        {
+            if ( node.count > 0 )
+            {
+                if ( shadowHitLeaf( node, r, kray, tmin, tmax, occluder ) ) return true;
+
+                if ( stackSize == 0 ) break;
+                nodeIndex = stack[ --stackSize ];
+            }
+            else
+            {
+                stack[ stackSize++ ] = node.offset;
+                nodeIndex = nodeIndex + 1;
+            }
+        }
+        else
+        {
+            if ( stackSize == 0 ) break;
+            nodeIndex = stack[ --stackSize ];
+        }
+    }
+
+    return false;
+}
+
+
+
+double BVH::sahCost() const
+{
+    if ( mNodes.empty() || mNodes[0].box.surfaceArea() <= 0.0 ) return 0.0;
+
+    double cost = 0.0;
+    for ( size_t i = 0; i < mNodes.size(); i++ )
+    {
+        const Node &node = mNodes[i];
+        double nodeCost = SAH_TRAVERSAL_COST;
+        if ( node.count > 0 )
+        {
+            int numPackets = ( node.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+            nodeCost = numPackets * SAH_PACKET_COST + ( node.count - node.numTriangles );
+        }
+        cost += node.box.surfaceArea() * nodeCost;
+    }
+    return cost / mNodes[0].box.surfaceArea();
+}
+
+
+
+bool BVH::boundingBox( AABB &box ) const
+{
+    if ( mNodes.empty() || !mUnbounded.empty() ) return false;
+    box = mNodes[0].box;
+    return true;
+}
@@ -0,0 +1,262 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <vector>
+#include "Surface.h"
+#include "AABB.h"
+#include "TriangleKernel.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Bounding volume hierarchy over the primitives of an array of Surfaces.
+// A Surface made of many primitives, such as a TriangleMesh, has each of
+// its primitives placed in the tree individually.
+//
+// The tree is a binary BVH built top-down with the surface area heuristic
+// (SAH), evaluated over a fixed number of centroid bins per axis. It is
+// stored flattened in depth-first order, so the first child of an interior
+// node immediately follows it and only the second child's index is kept.
+//
+// Unbounded primitives (those whose bounding box cannot be computed, such
+// as a Plane) cannot be placed in the tree, and are kept in a separate list
+// that is tested linearly.
+//
+// Within a leaf, triangles come first and are also stored in packets for
+// the SIMD triangle kernel (see TriangleKernel.h), which picks out the
+// few that need the exact test. Other primitives are tested one by one.
+//
+// A BVH is itself a Surface, so it answers both the nearest-hit query
+// (hit) and the any-hit query for shadow rays (shadowHit).
+//
+// For very large scenes, the tree may instead be built as a linear BVH
+// (LBVH, see LBVH.cpp): the primitives are sorted along a Morton curve
+// and the tree is read off the sorted codes, in parallel. Tree rotations
+// and SAH leaf selection then recover most of the quality of the SAH
+// build at a fraction of its cost.
+//
+// For meshes with long, thin triangles, the tree may instead be built
+// with spatial splits (SBVH, see SBVH.cpp), which may reference a
+// triangle from several leaves, each with the box of its part there.
+//
+// When the primitives move but the scene keeps its topology, as in an
+// animation, the tree may be refit: its boxes are recomputed bottom-up
+// for the new positions, in parallel, at a fraction of the cost of a
+// build. The tree degrades as the primitives move away from where it was
+// built, which shows as a growing SAH cost, so refitOrRebuild() rebuilds
+// it once that cost has grown too much. A refit SBVH bounds every
+// reference by its whole primitive, so it loses its tighter boxes.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Two full triangle packets.
+#define BVH_MAX_LEAF_SIZE   ( 2 * TRI_PACKET_WIDTH )
+
+// Beyond this depth the build stops searching for SAH splits and makes
+// leaves, so that traversal stacks cannot overflow.
+#define BVH_MAX_DEPTH       64
+
+// Subtrees of at most this many nodes are refit as one parallel task.
+#define BVH_REFIT_TASK_NODES    4096
+
+// Number of centroid bins per axis evaluated by the SAH build.
+#define SAH_NUM_BINS        16
+
+// Cost of traversing an interior node, relative to one primitive test.
+#define SAH_TRAVERSAL_COST  0.125
+
+// Cost of running the SIMD kernel on one triangle packet, relative to one
+// primitive test.
+#define SAH_PACKET_COST     2.0
+
+
+
+enum BVHBuildMethod
+{
+    BVH_BUILD_SAH,      // Top-down binned SAH. Best tree, serial build.
+    BVH_BUILD_LBVH,     // Linear BVH from sorted Morton codes, parallel build.
+    BVH_BUILD_SBVH      // SAH with spatial splits. Best for long, thin triangles.
+};
+
+
+struct BVHBuildOptions
+{
+    BVHBuildMethod method;
+    int maxLeafSize;    // At most BVH_MAX_LEAF_SIZE.
+    bool rotate;        // LBVH: apply SAH tree rotations.
+    double splitBudget; // SBVH: extra references allowed, as a fraction of the primitives.
+    int numThreads;     // Parallel build and refit: 0 -- use all hardware threads.
+
+    BVHBuildOptions()
+        : method( BVH_BUILD_SAH ), maxLeafSize( BVH_MAX_LEAF_SIZE ), rotate( true ), splitBudget( 0.3 ),
+          numThreads( 0 ) {}
+};
+
+
+
+class BVH : public Surface
+{
+public:
+
+    BVH( const SurfacePtr *surfaces, int numSurfaces, const BVHBuildOptions &options = BVHBuildOptions() );
+
+
+    // Updates the boxes for primitives that have moved. The surfaces and
+    // their numbers of primitives must be unchanged.
+    void refit();
+
+    // Builds the tree again over the same surfaces.
+    void rebuild();
+
+    // Refits the tree, and rebuilds it if refitting has raised its SAH
+    // cost above maxCostGrowth times its cost when built. Returns true if
+    // it was rebuilt.
+    bool refitOrRebuild( double maxCostGrowth );
+
+
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const
+        { return anyHit( r, tmin, tmax, NULL ); }
+
+
+    virtual bool shadowHitOccluder( const Ray &r, Real tmin, Real tmax, Occluder &occluder ) const
+        { return anyHit( r, tmin, tmax, &occluder ); }
+
+
+    // Returns false if the BVH holds any unbounded primitive.
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    int numNodes() const { return (int) mNodes.size(); }
+
+    int numPrimitives() const { return (int) mPrims.size(); }
+
+    int numUnbounded() const { return (int) mUnbounded.size(); }
+
+    // Bytes held by the tree, its primitive references and its packets.
+    size_t memoryUsage() const
+    {
+        return mNodes.capacity() * sizeof( Node ) + ( mPrims.capacity() + mUnbounded.capacity() ) * sizeof( PrimRef )
+             + mPackets.capacity() * sizeof( TrianglePacket );
+    }
+
+    // The SAH cost of the tree: the expected cost of tracing a ray that
+    // hits the root box, in units of one primitive test.
+    double sahCost() const;
+
+    // The SAH cost of the tree as last built.
+    double builtSahCost() const { return mBuiltSahCost; }
+
+
+private:
+
+    template <int N> friend class WideBVH;
+    friend class LBVHBuilder;
+    friend class SBVHBuilder;
+    friend class MeshCache;
+    friend class KdTree;
+
+    // An empty tree, for MeshCache to fill in.
+    BVH() {}
+
+    struct Node
+    {
+        AABB box;
+        int offset;  // Leaf: index of first primitive. Interior: index of second child.
+        short count; // Number of primitives in leaf, 0 for interior node.
+        short axis;  // Split axis of interior node.
+        int packetOffset;    // Leaf: index of first triangle packet.
+        short numTriangles;  // Leaf: the first numTriangles primitives are triangles.
+    };
+
+    // Primitive i of a Surface.
+    struct PrimRef
+    {
+        const Surface *surface;
+        int index;
+
+        bool hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+            { return surface->hitPrimitive( index, r, tmin, tmax, rec ); }
+
+        // Sets occluder if it is not NULL.
+        bool shadowHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder = NULL ) const
+        {
+            return ( occluder == NULL )? surface->shadowHitPrimitive( index, r, tmin, tmax )
+                                       : surface->shadowHitPrimitiveOccluder( index, r, tmin, tmax, *occluder );
+        }
+    };
+
+    struct BuildPrim
+    {
+        AABB box;
+        Vector3d centroid;
+        PrimRef prim;
+        bool isTriangle;
+    };
+
+    // The best split of a set of primitives by the bins of their centroids.
+    struct ObjectSplit
+    {
+        int axis;           // -1 if none.
+        int bin;            // Primitives in bins before this one go left.
+        double cost;        // Sum of area times count of the two sides.
+        double cmin, scale; // Bin of centroid c is ( c - cmin ) * scale.
+        AABB leftBox, rightBox;
+
+        ObjectSplit() : axis( -1 ), cost( DBL_MAX ) {}
+
+        bool isLeft( const BuildPrim &bp ) const
+        {
+            int b = (int)( ( bp.centroid[axis] - cmin ) * scale );
+            return ( ( b < SAH_NUM_BINS )? b : SAH_NUM_BINS - 1 ) < bin;
+        }
+    };
+
+    void build();
+    void gatherPrimitives( const SurfacePtr *surfaces, int numSurfaces, int numThreads,
+                           vector<BuildPrim> &buildPrims );
+    int buildRecursive( vector<BuildPrim> &buildPrims, int begin, int end, int depth );
+    static void findObjectSplit( const BuildPrim *prims, int count, const AABB &centroidBox, ObjectSplit &split );
+    void buildLBVH( vector<BuildPrim> &buildPrims, bool rotate, int numThreads );
+    void buildSBVH( vector<BuildPrim> &buildPrims, double splitBudget );
+    void makeLeaf( vector<BuildPrim> &buildPrims, int begin, int end, Node &node );
+    void fillLeaf( BuildPrim *prims, int count, Node &node );
+    void packLeaf( const Node &node );
+
+    int subtreeEnd( int nodeIndex ) const;
+    void refitNode( int nodeIndex );
+
+    static KernelRay makeKernelRay( const Ray &r );
+
+    bool hitLeaf( const Node &node, const Ray &r, const KernelRay &kray, Real tmin,
+                  Real &nearest_t, SurfaceHitRecord &rec ) const;
+    bool shadowHitLeaf( const Node &node, const Ray &r, const KernelRay &kray,
+                        Real tmin, Real tmax, Occluder *occluder ) const;
+    bool anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const;
+
+    vector<Node> mNodes;
+    vector<PrimRef> mPrims;      // Bounded primitives, in leaf order.
+    vector<PrimRef> mUnbounded;  // Primitives without a bounding box.
+    vector<TrianglePacket> mPackets;
+    vector<SurfacePtr> mSurfaces;
+    BVHBuildOptions mOptions;
+    int mMaxLeafSize;
+    double mBuiltSahCost;
+
+}; // BVH
+
+
+#endif // _BVH_H_
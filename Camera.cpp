@@ -8,7 +8,7 @@ using namespace std;
 
 Camera &Camera::setCamera( 
                 const Vector3d &eye, const Vector3d &lookAt, const Vector3d &upVector,
-                double left, double right, double bottom, double top, double near,
+                Real left, Real right, Real bottom, Real top, Real near,
                 int image_width, int image_height )
 {
     assert( image_width > 0 && image_height > 0 );
@@ -20,7 +20,7 @@ Camera &Camera::setCamera(
     Vector3d cop_u = cross( upVector.unitVector(), cop_n );
     Vector3d cop_v = cross( cop_n, cop_u );
 
-    mImageOrigin = mCOP + ( left * cop_u ) + ( bottom * cop_v ) + ( -near * cop_n );
+    mImageOrigin = ( left * cop_u ) + ( bottom * cop_v ) + ( -near * cop_n );
 
     mImageU = (right - left) * cop_u;
     mImageV = (top - bottom) * cop_v;
@@ -34,7 +34,7 @@ public:
     //////////////////////////////////////////////////////////////////////////////////////
 
     Camera( const Vector3d &eye, const Vector3d &lookAt, const Vector3d &upVector,
-            double left, double right, double bottom, double top, double near,
+            Real left, Real right, Real bottom, Real top, Real near,
             int image_width, int image_height )
     {
         setCamera( eye, lookAt, upVector, left, right, bottom, top, near, image_width, image_height );
@@ -42,7 +42,7 @@ public:
 
 
     Camera &setCamera( const Vector3d &eye, const Vector3d &lookAt, const Vector3d &upVector,
-                    double left, double right, double bottom, double top, double near,
+                    Real left, Real right, Real bottom, Real top, Real near,
                     int image_width, int image_height );
 
 
@@ -73,16 +73,18 @@ public:
     // Note that the ray returned may not have unit direction vector.
     //////////////////////////////////////////////////////////////////////////////////////
 
-    Ray getRay( double pixelPosX, double pixelPosY ) const
+    Ray getRay( Real pixelPosX, Real pixelPosY ) const
     {
-        Vector3d imgPos = mImageOrigin + (pixelPosX/mImageWidth) * mImageU + (pixelPosY/mImageHeight) * mImageV;
-        return Ray( mCOP, imgPos - mCOP );
+        Vector3d imgDir = mImageOrigin + (pixelPosX/mImageWidth) * mImageU + (pixelPosY/mImageHeight) * mImageV;
+        return Ray( mCOP, imgDir );
     }
 
 
 private:
 
     Vector3d mCOP; // The center of projection or the camera viewpoint.
+    // The bottom-left corner of the image, relative to mCOP. Subtracting
+    // mCOP from the corner itself would lose the direction to rounding.
     Vector3d mImageOrigin;
     Vector3d mImageU, mImageV;
     int mImageWidth, mImageHeight; // In number of pixels.
@@ -0,0 +1,525 @@
+#include <cmath>
+#include <cfloat>
+#include <atomic>
+#include <algorithm>
+#include "Util.h"
+#include "Scheduler.h"
+#include "Grid.h"
+
+using namespace std;
+
+
+// Primitives, or cells, handled by one parallel build task.
+#define GRID_BUILD_BLOCK        4096
+
+// A primitive is put in every cell its box comes within this fraction of
+// a cell of, so rounding cannot leave it out of a cell it touches.
+#define GRID_CELL_PAD           1e-6
+
+
+
+Grid::Grid( const SurfacePtr *surfaces, int numSurfaces, const GridBuildOptions &options )
+    : mSurfaces( surfaces, surfaces + numSurfaces ), mOptions( options )
+{
+    matp = NULL;
+    build();
+}
+
+
+
+void Grid::rebuild()
+{
+    mLevels.clear();
+    mCells.clear();
+    mRefs.clear();
+    mPrims.clear();
+    mUnbounded.clear();
+    build();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Sorts the primitives into the cells of the top grid by counting: the
+// references to each cell are counted, the counts summed into offsets, and
+// the references scattered to them, each step in parallel. The references
+// of each cell are then sorted, so the grid does not depend on the timing
+// of the threads.
+//////////////////////////////////////////////////////////////////////////////
+
+void Grid::build()
+{
+    gatherPrimitives();
+    int numPrims = (int) mPrims.size();
+    if ( numPrims == 0 ) return;
+
+    AABB bounds;
+    for ( int i = 0; i < numPrims; i++ ) bounds.expand( mBoxes[i] );
+
+    Level top;
+    makeLevel( bounds, numPrims, mOptions.density, top );
+    top.firstCell = 0;
+    mLevels.push_back( top );
+
+    int numCells = top.res[0] * top.res[1] * top.res[2];
+    int numBlocks = ( numPrims + GRID_BUILD_BLOCK - 1 ) / GRID_BUILD_BLOCK;
+
+    vector< atomic<int> > counts( numCells );
+    for ( int c = 0; c < numCells; c++ ) counts[c].store( 0, memory_order_relaxed );
+
+    Scheduler::Run( numBlocks, mOptions.numThreads, [&]( int block, int )
+    {
+        int end = Util::Min2( ( block + 1 ) * GRID_BUILD_BLOCK, numPrims );
+        for ( int i = block * GRID_BUILD_BLOCK; i < end; i++ )
+        {
+            int lo[3], hi[3];
+            cellRange( top, mBoxes[i], lo, hi );
+            for ( int z = lo[2]; z <= hi[2]; z++ )
+                for ( int y = lo[1]; y <= hi[1]; y++ )
+                    for ( int x = lo[0]; x <= hi[0]; x++ )
+                        counts[ ( z * top.res[1] + y ) * top.res[0] + x ].fetch_add( 1, memory_order_relaxed );
+        }
+    } );
+
+    // The counts become the positions the references are scattered to.
+    mCells.resize( numCells );
+    int numRefs = 0;
+    for ( int c = 0; c < numCells; c++ )
+    {
+        mCells[c].offset = numRefs;
+        mCells[c].count = counts[c].load( memory_order_relaxed );
+        mCells[c].subgrid = 0;
+        counts[c].store( numRefs, memory_order_relaxed );
+        numRefs += mCells[c].count;
+    }
+    mRefs.resize( numRefs );
+
+    Scheduler::Run( numBlocks, mOptions.numThreads, [&]( int block, int )
+    {
+        int end = Util::Min2( ( block + 1 ) * GRID_BUILD_BLOCK, numPrims );
+        for ( int i = block * GRID_BUILD_BLOCK; i < end; i++ )
+        {
+            int lo[3], hi[3];
+            cellRange( top, mBoxes[i], lo, hi );
+            for ( int z = lo[2]; z <= hi[2]; z++ )
+                for ( int y = lo[1]; y <= hi[1]; y++ )
+                    for ( int x = lo[0]; x <= hi[0]; x++ )
+                        mRefs[ counts[ ( z * top.res[1] + y ) * top.res[0] + x ].fetch_add( 1, memory_order_relaxed ) ] = i;
+        }
+    } );
+
+    int numCellBlocks = ( numCells + GRID_BUILD_BLOCK - 1 ) / GRID_BUILD_BLOCK;
+    Scheduler::Run( numCellBlocks, mOptions.numThreads, [&]( int block, int )
+    {
+        int end = Util::Min2( ( block + 1 ) * GRID_BUILD_BLOCK, numCells );
+        for ( int c = block * GRID_BUILD_BLOCK; c < end; c++ )
+            std::sort( mRefs.begin() + mCells[c].offset, mRefs.begin() + mCells[c].offset + mCells[c].count );
+    } );
+
+    if ( mOptions.twoLevel ) buildSubgrids();
+
+    vector<AABB>().swap( mBoxes );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Puts the primitives of the surfaces in mPrims, with their boxes in
+// mBoxes, and the unbounded ones in mUnbounded. The boxes are computed in
+// parallel.
+//////////////////////////////////////////////////////////////////////////////
+
+void Grid::gatherPrimitives()
+{
+    vector<PrimRef> all;
+    for ( size_t s = 0; s < mSurfaces.size(); s++ )
+    {
+        PrimRef prim;
+        prim.surface = mSurfaces[s];
+        int n = mSurfaces[s]->numPrimitives();
+        for ( prim.index = 0; prim.index < n; prim.index++ ) all.push_back( prim );
+    }
+
+    int numPrims = (int) all.size();
+    vector<AABB> boxes( numPrims );
+    vector<char> bounded( numPrims );
+    int numBlocks = ( numPrims + GRID_BUILD_BLOCK - 1 ) / GRID_BUILD_BLOCK;
+
+    Scheduler::Run( numBlocks, mOptions.numThreads, [&]( int block, int )
+    {
+        int end = Util::Min2( ( block + 1 ) * GRID_BUILD_BLOCK, numPrims );
+        for ( int i = block * GRID_BUILD_BLOCK; i < end; i++ )
+            bounded[i] = all[i].surface->primitiveBoundingBox( all[i].index, boxes[i] );
+    } );
+
+    mPrims.reserve( numPrims );
+    mBoxes.reserve( numPrims );
+    for ( int i = 0; i < numPrims; i++ )
+    {
+        if ( bounded[i] )
+        {
+            mPrims.push_back( all[i] );
+            mBoxes.push_back( boxes[i] );
+        }
+        else
+            mUnbounded.push_back( all[i] );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Sets up a grid over the box with about density cells per primitive,
+// as near cubes. An axis along which the box is flat gets one cell.
+//////////////////////////////////////////////////////////////////////////////
+
+void Grid::makeLevel( const AABB &box, int numPrims, double density, Level &level )
+{
+    Vector3d extent = box.extent();
+
+    // The cells per unit length that give the wanted number of cells.
+    int numAxes = 0;
+    double measure = 1.0;
+    for ( int a = 0; a < 3; a++ )
+    {
+        if ( extent[a] <= 0.0 ) continue;
+        numAxes++;
+        measure *= extent[a];
+    }
+    double cellsPerUnit = ( numAxes > 0 )? pow( density * numPrims / measure, 1.0 / numAxes ) : 0.0;
+
+    level.box = box;
+    for ( int a = 0; a < 3; a++ )
+    {
+        int res = (int)( extent[a] * cellsPerUnit + 0.5 );
+        level.res[a] = Util::Min2( Util::Max2( res, 1 ), GRID_MAX_RESOLUTION );
+        level.cellSize[a] = extent[a] / level.res[a];
+        level.invCellSize[a] = ( extent[a] > 0.0 )? level.res[a] / extent[a] : 0.0;
+    }
+}
+
+
+
+// The range of cells of the level that the box overlaps, clamped to the grid.
+void Grid::cellRange( const Level &level, const AABB &box, int lo[3], int hi[3] ) const
+{
+    for ( int a = 0; a < 3; a++ )
+    {
+        double x0 = ( box.minPt[a] - level.box.minPt[a] ) * level.invCellSize[a] - GRID_CELL_PAD;
+        double x1 = ( box.maxPt[a] - level.box.minPt[a] ) * level.invCellSize[a] + GRID_CELL_PAD;
+        lo[a] = Util::Min2( Util::Max2( (int) floor( x0 ), 0 ), level.res[a] - 1 );
+        hi[a] = Util::Min2( Util::Max2( (int) floor( x1 ), 0 ), level.res[a] - 1 );
+    }
+}
+
+
+
+// The box of cell ( x, y, z ) of a level.
+static AABB cellBox( const AABB &box, const int res[3], const Real cellSize[3], const int idx[3] )
+{
+    AABB cell;
+    for ( int a = 0; a < 3; a++ )
+    {
+        cell.minPt[a] = box.minPt[a] + idx[a] * cellSize[a];
+        cell.maxPt[a] = ( idx[a] == res[a] - 1 )? box.maxPt[a] : box.minPt[a] + ( idx[a] + 1 ) * cellSize[a];
+    }
+    return cell;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Gives each crowded cell of the top grid a grid of its own, over the
+// parts of its primitives' boxes inside it. The subgrids are built in
+// parallel, then appended to the levels, cells and references.
+//////////////////////////////////////////////////////////////////////////////
+
+void Grid::buildSubgrids()
+{
+    const Level &top = mLevels[0];
+
+    vector<int> crowded;
+    for ( int c = 0; c < (int) mCells.size(); c++ )
+        if ( mCells[c].count > GRID_SUBGRID_MIN_PRIMS ) crowded.push_back( c );
+
+    int numSubgrids = (int) crowded.size();
+    vector<Level> levels( numSubgrids );
+    vector< vector<Cell> > cells( numSubgrids );
+    vector< vector<int> > refs( numSubgrids );
+
+    Scheduler::Run( numSubgrids, mOptions.numThreads, [&]( int k, int )
+    {
+        const Cell &parent = mCells[ crowded[k] ];
+        int idx[3] = { crowded[k] % top.res[0], crowded[k] / top.res[0] % top.res[1],
+                       crowded[k] / ( top.res[0] * top.res[1] ) };
+        AABB box = cellBox( top.box, top.res, top.cellSize, idx );
+
+        Level &level = levels[k];
+        makeLevel( box, parent.count, mOptions.density, level );
+        int numCells = level.res[0] * level.res[1] * level.res[2];
+        if ( numCells == 1 ) return;
+
+        // The primitives, clipped to the cell, into the cells of the subgrid.
+        vector<Cell> &subCells = cells[k];
+        subCells.resize( numCells );
+        for ( int c = 0; c < numCells; c++ )
+        {
+            subCells[c].count = 0;
+            subCells[c].subgrid = 0;
+        }
+
+        for ( int pass = 0; pass < 2; pass++ )
+        {
+            for ( int i = parent.offset; i < parent.offset + parent.count; i++ )
+            {
+                int lo[3], hi[3];
+                cellRange( level, mBoxes[ mRefs[i] ], lo, hi );
+                for ( int z = lo[2]; z <= hi[2]; z++ )
+                    for ( int y = lo[1]; y <= hi[1]; y++ )
+                        for ( int x = lo[0]; x <= hi[0]; x++ )
+                        {
+                            Cell &cell = subCells[ ( z * level.res[1] + y ) * level.res[0] + x ];
+                            if ( pass == 1 ) refs[k][ cell.offset + cell.count ] = mRefs[i];
+                            cell.count++;
+                        }
+            }
+
+            if ( pass == 1 ) break;
+
+            int numRefs = 0;
+            for ( int c = 0; c < numCells; c++ )
+            {
+                subCells[c].offset = numRefs;
+                numRefs += subCells[c].count;
+                subCells[c].count = 0;
+            }
+            refs[k].resize( numRefs );
+        }
+    } );
+
+    for ( int k = 0; k < numSubgrids; k++ )
+    {
+        if ( cells[k].empty() ) continue;
+
+        levels[k].firstCell = (int) mCells.size();
+        int refOffset = (int) mRefs.size();
+        for ( size_t c = 0; c < cells[k].size(); c++ ) cells[k][c].offset += refOffset;
+
+        mCells[ crowded[k] ].subgrid = (int) mLevels.size();
+        mLevels.push_back( levels[k] );
+        mCells.insert( mCells.end(), cells[k].begin(), cells[k].end() );
+        mRefs.insert( mRefs.end(), refs[k].begin(), refs[k].end() );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Walks the cells of a level that the ray passes through over [t0, t1],
+// which lies inside the box of the level, in order (3D-DDA). The
+// primitives of each cell are tested, and the walk descends into the
+// subgrid of a cell that has one. Returns true once a hit within the cell
+// being walked is found, as it is then the nearest.
+//////////////////////////////////////////////////////////////////////////////
+
+bool Grid::hitLevel( const Level &level, const Ray &r, const GridRay &gr, Real t0, Real t1, Real tmin,
+                     Real &nearest_t, SurfaceHitRecord &rec, bool &hasHit, Mailbox &mailbox ) const
+{
+    Vector3d p = gr.orig + t0 * gr.dir;
+    int idx[3], step[3];
+    Real tNext[3], tDelta[3];
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        int i = (int) floor( ( p[a] - level.box.minPt[a] ) * level.invCellSize[a] );
+        idx[a] = Util::Min2( Util::Max2( i, 0 ), level.res[a] - 1 );
+
+        if ( gr.dir[a] > 0.0 )
+        {
+            step[a] = 1;
+            tNext[a] = ( level.box.minPt[a] + ( idx[a] + 1 ) * level.cellSize[a] - gr.orig[a] ) * gr.invDir[a];
+            tDelta[a] = level.cellSize[a] * gr.invDir[a];
+        }
+        else if ( gr.dir[a] < 0.0 )
+        {
+            step[a] = -1;
+            tNext[a] = ( level.box.minPt[a] + idx[a] * level.cellSize[a] - gr.orig[a] ) * gr.invDir[a];
+            tDelta[a] = -level.cellSize[a] * gr.invDir[a];
+        }
+        else
+        {
+            step[a] = 0;
+            tNext[a] = REAL_MAX;
+            tDelta[a] = 0.0;
+        }
+    }
+
+    SurfaceHitRecord tempHitRec;
+    Real tEnter = t0;
+
+    while ( true )
+    {
+        int a = ( tNext[0] < tNext[1] )? ( ( tNext[0] < tNext[2] )? 0 : 2 ) : ( ( tNext[1] < tNext[2] )? 1 : 2 );
+        Real tExit = Util::Min2( tNext[a], t1 );
+
+        const Cell &cell = mCells[ level.firstCell + ( idx[2] * level.res[1] + idx[1] ) * level.res[0] + idx[0] ];
+        if ( cell.subgrid != 0 )
+        {
+            if ( hitLevel( mLevels[ cell.subgrid ], r, gr, tEnter, tExit, tmin, nearest_t, rec, hasHit, mailbox ) )
+                return true;
+        }
+        else
+        {
+            for ( int i = cell.offset; i < cell.offset + cell.count; i++ )
+            {
+                int prim = mRefs[i];
+                if ( !mailbox.seen( prim ) && mPrims[prim].hit( r, tmin, nearest_t, tempHitRec ) )
+                {
+                    hasHit = true;
+                    nearest_t = tempHitRec.t;
+                    rec = tempHitRec;
+                }
+            }
+        }
+
+        if ( hasHit && nearest_t <= tExit ) return true;
+        if ( tExit >= t1 ) return false;
+
+        idx[a] += step[a];
+        if ( idx[a] < 0 || idx[a] >= level.res[a] ) return false;
+        tEnter = tNext[a];
+        tNext[a] += tDelta[a];
+    }
+}
+
+
+
+// As hitLevel(), but returns true at the first hit found, with occluder
+// set if it is not NULL.
+bool Grid::shadowHitLevel( const Level &level, const Ray &r, const GridRay &gr, Real t0, Real t1,
+                           Real tmin, Real tmax, Mailbox &mailbox, Occluder *occluder ) const
+{
+    Vector3d p = gr.orig + t0 * gr.dir;
+    int idx[3], step[3];
+    Real tNext[3], tDelta[3];
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        int i = (int) floor( ( p[a] - level.box.minPt[a] ) * level.invCellSize[a] );
+        idx[a] = Util::Min2( Util::Max2( i, 0 ), level.res[a] - 1 );
+
+        if ( gr.dir[a] > 0.0 )
+        {
+            step[a] = 1;
+            tNext[a] = ( level.box.minPt[a] + ( idx[a] + 1 ) * level.cellSize[a] - gr.orig[a] ) * gr.invDir[a];
+            tDelta[a] = level.cellSize[a] * gr.invDir[a];
+        }
+        else if ( gr.dir[a] < 0.0 )
+        {
+            step[a] = -1;
+            tNext[a] = ( level.box.minPt[a] + idx[a] * level.cellSize[a] - gr.orig[a] ) * gr.invDir[a];
+            tDelta[a] = -level.cellSize[a] * gr.invDir[a];
+        }
+        else
+        {
+            step[a] = 0;
+            tNext[a] = REAL_MAX;
+            tDelta[a] = 0.0;
+        }
+    }
+
+    Real tEnter = t0;
+
+    while ( true )
+    {
+        int a = ( tNext[0] < tNext[1] )? ( ( tNext[0] < tNext[2] )? 0 : 2 ) : ( ( tNext[1] < tNext[2] )? 1 : 2 );
+        Real tExit = Util::Min2( tNext[a], t1 );
+
+        const Cell &cell = mCells[ level.firstCell + ( idx[2] * level.res[1] + idx[1] ) * level.res[0] + idx[0] ];
+        if ( cell.subgrid != 0 )
+        {
+            if ( shadowHitLevel( mLevels[ cell.subgrid ], r, gr, tEnter, tExit, tmin, tmax, mailbox, occluder ) )
+                return true;
+        }
+        else
+        {
+            for ( int i = cell.offset; i < cell.offset + cell.count; i++ )
+            {
+                int prim = mRefs[i];
+                if ( !mailbox.seen( prim ) && mPrims[prim].shadowHit( r, tmin, tmax, occluder ) ) return true;
+            }
+        }
+
+        if ( tExit >= t1 ) return false;
+
+        idx[a] += step[a];
+        if ( idx[a] < 0 || idx[a] >= level.res[a] ) return false;
+        tEnter = tNext[a];
+        tNext[a] += tDelta[a];
+    }
+}
+
+
+
+bool Grid::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    Real nearest_t = tmax;
+    SurfaceHitRecord tempHitRec;
+
+    for ( size_t i = 0; i < mUnbounded.size(); i++ )
+    {
+        if ( mUnbounded[i].hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    if ( mLevels.empty() ) return hasHit;
+
+    GridRay gr;
+    gr.orig = r.origin();
+    gr.dir = r.direction();
+    gr.invDir = Vector3d( 1.0 / gr.dir.x(), 1.0 / gr.dir.y(), 1.0 / gr.dir.z() );
+
+    Real t0 = tmin, t1 = nearest_t;
+    if ( !mLevels[0].box.clip( gr.orig, gr.invDir, t0, t1 ) ) return hasHit;
+
+    Mailbox mailbox;
+    hitLevel( mLevels[0], r, gr, t0, t1, tmin, nearest_t, rec, hasHit, mailbox );
+    return hasHit;
+}
+
+
+
+// The any-hit query of shadowHit() and shadowHitOccluder(), which sets
+// occluder if it is not NULL.
+bool Grid::anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const
+{
+    for ( size_t i = 0; i < mUnbounded.size(); i++ )
+        if ( mUnbounded[i].shadowHit( r, tmin, tmax, occluder ) ) return true;
+
+    if ( mLevels.empty() ) return false;
+
+    GridRay gr;
+    gr.orig = r.origin();
+    gr.dir = r.direction();
+    gr.invDir = Vector3d( 1.0 / gr.dir.x(), 1.0 / gr.dir.y(), 1.0 / gr.dir.z() );
+
+    Real t0 = tmin, t1 = tmax;
+    if ( !mLevels[0].box.clip( gr.orig, gr.invDir, t0, t1 ) ) return false;
+
+    Mailbox mailbox;
+    return shadowHitLevel( mLevels[0], r, gr, t0, t1, tmin, tmax, mailbox, occluder );
+}
+
+
+
+bool Grid::boundingBox( AABB &box ) const
+{
+    if ( mLevels.empty() || !mUnbounded.empty() ) return false;
+    box = mLevels[0].box;
+    return true;
+}
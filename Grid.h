@@ -0,0 +1,199 @@
+#ifndef _GRID_H_
+#define _GRID_H_
+
+#include <vector>
+#include "Surface.h"
+#include "AABB.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Uniform grid over the primitives of an array of Surfaces, for scenes of
+// many primitives of similar size, such as fields of spheres.
+//
+// The box of the scene is cut into cells, about density cells per
+// primitive, shaped as near cubes, and each cell lists the primitives
+// whose boxes overlap it. A ray walks the cells it passes through in
+// order with the 3D-DDA of Amanatides and Woo, and the nearest-hit query
+// stops at the first cell that holds a hit within it. A primitive in
+// several cells is tested once per ray, as a small mailbox remembers the
+// primitives tested last.
+//
+// Where the density is uneven, a single grid either wastes cells on
+// empty space or crowds many primitives into a cell. With twoLevel, each
+// cell holding more than GRID_SUBGRID_MIN_PRIMS primitives gets a grid of
+// its own, sized by the same density, that the ray walks in turn.
+//
+// The build sorts the primitive references into cells by counting, in
+// parallel, in time linear in their number, so a grid is cheap to
+// rebuild every frame for a moving scene. Unbounded primitives are kept
+// in a list tested linearly.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Limit on the cells along each axis of a grid.
+#define GRID_MAX_RESOLUTION     256
+
+// Cells with more primitives than this get a grid of their own, with twoLevel.
+#define GRID_SUBGRID_MIN_PRIMS  16
+
+// Primitives a ray remembers having tested.
+#define GRID_MAILBOX_SIZE       8
+
+
+
+struct GridBuildOptions
+{
+    double density;     // Cells per primitive, in each grid.
+    bool twoLevel;      // Give crowded cells grids of their own.
+    int numThreads;     // Parallel build: 0 -- use all hardware threads.
+
+    GridBuildOptions() : density( 2.0 ), twoLevel( true ), numThreads( 0 ) {}
+};
+
+
+
+class Grid : public Surface
+{
+public:
+
+    Grid( const SurfacePtr *surfaces, int numSurfaces, const GridBuildOptions &options = GridBuildOptions() );
+
+
+    // Builds the grid again over the same surfaces, after they have moved.
+    void rebuild();
+
+
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const
+        { return anyHit( r, tmin, tmax, NULL ); }
+
+
+    virtual bool shadowHitOccluder( const Ray &r, Real tmin, Real tmax, Occluder &occluder ) const
+        { return anyHit( r, tmin, tmax, &occluder ); }
+
+
+    // Returns false if the grid holds any unbounded primitive.
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    // Cells of the top grid and of all subgrids.
+    int numCells() const { return (int) mCells.size(); }
+
+    int numSubgrids() const { return (int) mLevels.size() - 1; }
+
+    int numPrimitives() const { return (int) mPrims.size(); }
+
+    int numUnbounded() const { return (int) mUnbounded.size(); }
+
+    // Resolution of the top grid along an axis.
+    int resolution( int axis ) const { return mLevels.empty()? 0 : mLevels[0].res[axis]; }
+
+    // Bytes held by the cells and primitive references.
+    size_t memoryUsage() const
+    {
+        return mCells.capacity() * sizeof( Cell ) + mRefs.capacity() * sizeof( int )
+             + ( mPrims.capacity() + mUnbounded.capacity() ) * sizeof( PrimRef )
+             + mLevels.capacity() * sizeof( Level );
+    }
+
+
+private:
+
+    // A grid: the top one, or the subgrid of a cell.
+    struct Level
+    {
+        AABB box;
+        int res[3];
+        Real cellSize[3];
+        double invCellSize[3];   // 0 along an axis of zero extent.
+        int firstCell;           // Index of its first cell in mCells, in x, y, z order.
+    };
+
+    struct Cell
+    {
+        int offset;     // Index of first primitive reference in mRefs.
+        int count;      // Number of primitive references.
+        int subgrid;    // Index in mLevels of its own grid, or 0 if none.
+    };
+
+    // Primitive i of a Surface.
+    struct PrimRef
+    {
+        const Surface *surface;
+        int index;
+
+        bool hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+            { return surface->hitPrimitive( index, r, tmin, tmax, rec ); }
+
+        // Sets occluder if it is not NULL.
+        bool shadowHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder = NULL ) const
+        {
+            return ( occluder == NULL )? surface->shadowHitPrimitive( index, r, tmin, tmax )
+                                       : surface->shadowHitPrimitiveOccluder( index, r, tmin, tmax, *occluder );
+        }
+    };
+
+    // The primitives tested last by a ray.
+    struct Mailbox
+    {
+        int prims[ GRID_MAILBOX_SIZE ];
+        int next;
+
+        Mailbox() : next( 0 ) { for ( int i = 0; i < GRID_MAILBOX_SIZE; i++ ) prims[i] = -1; }
+
+        // Returns true if prim was tested already, else records it.
+        bool seen( int prim )
+        {
+            for ( int i = 0; i < GRID_MAILBOX_SIZE; i++ )
+                if ( prims[i] == prim ) return true;
+            prims[next] = prim;
+            next = ( next + 1 ) % GRID_MAILBOX_SIZE;
+            return false;
+        }
+    };
+
+    // The ray as seen by the traversal.
+    struct GridRay
+    {
+        Vector3d orig, dir, invDir;
+    };
+
+    void build();
+    void gatherPrimitives();
+    static void makeLevel( const AABB &box, int numPrims, double density, Level &level );
+    void cellRange( const Level &level, const AABB &box, int lo[3], int hi[3] ) const;
+    void buildSubgrids();
+
+    bool hitLevel( const Level &level, const Ray &r, const GridRay &gr, Real t0, Real t1, Real tmin,
+                   Real &nearest_t, SurfaceHitRecord &rec, bool &hasHit, Mailbox &mailbox ) const;
+    bool shadowHitLevel( const Level &level, const Ray &r, const GridRay &gr, Real t0, Real t1,
+                         Real tmin, Real tmax, Mailbox &mailbox, Occluder *occluder ) const;
+    bool anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const;
+
+    vector<Level> mLevels;       // The top grid, then the subgrids.
+    vector<Cell> mCells;
+    vector<int> mRefs;           // Indices in mPrims, in cell order.
+    vector<PrimRef> mPrims;      // Bounded primitives.
+    vector<AABB> mBoxes;         // Their boxes, during the build.
+    vector<PrimRef> mUnbounded;  // Primitives without a bounding box.
+    vector<SurfacePtr> mSurfaces;
+    GridBuildOptions mOptions;
+
+}; // Grid
+
+
+#endif // _GRID_H_
@@ -0,0 +1,75 @@
+#include "Instance.h"
+
+using namespace std;
+
+
+
+Instance::Instance( const Surface *object, const Transform &objectToWorld, const Material *mat_ptr )
+{
+    mObject = object;
+    matp = mat_ptr;
+    setTransform( objectToWorld );
+}
+
+
+
+void Instance::setTransform( const Transform &objectToWorld )
+{
+    mObjectToWorld = objectToWorld;
+    mWorldToObject = objectToWorld.inverse();
+}
+
+
+
+bool Instance::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    if ( !mObject->hit( toObject( r ), tmin, tmax, rec ) ) return false;
+    rec.instance = this;
+    return true;
+}
+
+
+
+void Instance::hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const
+{
+    rec.surface->hitPoint( toObject( r ), rec, point );
+
+    // The point on the object is taken to world space, where its error
+    // grows with the transform.
+    point.p = mObjectToWorld.point( point.p, point.pError, point.pError );
+    point.normal = mWorldToObject.transposeVector( point.normal );
+    point.ng = mWorldToObject.transposeVector( point.ng );
+    if ( matp != NULL ) point.mat_ptr = matp;
+}
+
+
+
+bool Instance::shadowHit( const Ray &r, Real tmin, Real tmax ) const
+{
+    return mObject->shadowHit( toObject( r ), tmin, tmax );
+}
+
+
+
+bool Instance::shadowHitOccluder( const Ray &r, Real tmin, Real tmax, Occluder &occluder ) const
+{
+    if ( !mObject->shadowHitOccluder( toObject( r ), tmin, tmax, occluder ) ) return false;
+
+    if ( occluder.surface != NULL )
+    {
+        if ( occluder.instance != NULL ) occluder.surface = NULL;
+        else occluder.instance = this;
+    }
+    return true;
+}
+
+
+
+// Computed from the current box of the object, which may have been refit.
+bool Instance::boundingBox( AABB &box ) const
+{
+    AABB objectBox;
+    if ( !mObject->boundingBox( objectBox ) ) return false;
+    box = mObjectToWorld.box( objectBox );
+    return true;
+}
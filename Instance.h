@@ -0,0 +1,89 @@
+#ifndef _INSTANCE_H_
+#define _INSTANCE_H_
+
+#include "Surface.h"
+#include "Transform.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// A placed copy of a Surface that is defined in its own object space.
+//
+// The object is usually a BVH built once over a mesh (the bottom level),
+// shared by any number of Instances, each with its own affine transform.
+// A BVH over the Instances of a scene (the top level) then culls whole
+// copies, and a ray that reaches an Instance is moved into object space
+// and traced through the shared tree. A scene with a thousand copies of
+// a mesh thus stores the mesh and its tree once.
+//
+// The object-space ray keeps the ray parameter t, as its direction is
+// transformed but not normalized, so tmin, tmax and the hit distance need
+// no conversion.
+//
+// If the Instance is given a material, it replaces that of the object.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class Instance : public Surface
+{
+public:
+
+    Instance( const Surface *object, const Transform &objectToWorld, const Material *mat_ptr = NULL );
+
+
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const;
+
+
+    // The hit is recorded as a hit of the object, with instance set to this
+    // Instance, which makes its point in world space. A hit records one
+    // Instance only, so the object must not hold Instances itself.
+    virtual void hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const;
+
+
+    // The occluder is a primitive of the object, with instance set to this
+    // Instance. A second level of instancing is not followed, and the
+    // occluder is then unknown.
+    virtual bool shadowHitOccluder( const Ray &r, Real tmin, Real tmax, Occluder &occluder ) const;
+
+    virtual bool shadowHitPrimitiveOccluder( int i, const Ray &r, Real tmin, Real tmax,
+                                             Occluder &occluder ) const
+        { return shadowHitOccluder( r, tmin, tmax, occluder ); }
+
+
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    const Surface *object() const { return mObject; }
+
+    // The ray in object space.
+    Ray toObject( const Ray &r ) const
+        { return Ray( mWorldToObject.point( r.origin() ), mWorldToObject.vector( r.direction() ) ); }
+
+    const Transform &objectToWorld() const { return mObjectToWorld; }
+
+    // Moves the Instance. A BVH over it must then be refit or rebuilt.
+    void setTransform( const Transform &objectToWorld );
+
+
+private:
+
+    const Surface *mObject;
+    Transform mObjectToWorld;
+    Transform mWorldToObject;
+
+}; // Instance
+
+
+#endif // _INSTANCE_H_
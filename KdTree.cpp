@@ -0,0 +1,702 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include "Util.h"
+#include "BVH.h"
+#include "KdTree.h"
+
+using namespace std;
+
+
+// Clipped boxes are widened by this many ulps of their coordinates, to
+// cover the rounding of the clipping.
+#define KD_CLIP_ERROR_ULPS      4.0
+
+// Packets of a leaf run through the triangle kernel at a time.
+#define KD_KERNEL_PACKETS       4
+
+// Sides of the plane of a node that a primitive is in.
+#define KD_SIDE_BELOW           1
+#define KD_SIDE_ABOVE           2
+#define KD_SIDE_BOTH            3
+
+
+
+KdTree::KdTree( const SurfacePtr *surfaces, int numSurfaces )
+    : mSurfaces( surfaces, surfaces + numSurfaces )
+{
+    matp = NULL;
+    build();
+}
+
+
+
+void KdTree::rebuild()
+{
+    mNodes.clear();
+    mLeaves.clear();
+    mPrims.clear();
+    mUnbounded.clear();
+    mPackets.clear();
+    mBounds.setEmpty();
+    build();
+}
+
+
+
+void KdTree::build()
+{
+    for ( size_t s = 0; s < mSurfaces.size(); s++ )
+    {
+        int n = mSurfaces[s]->numPrimitives();
+        for ( int i = 0; i < n; i++ )
+        {
+            BuildPrim bp;
+            bp.prim.surface = mSurfaces[s];
+            bp.prim.index = i;
+            if ( mSurfaces[s]->primitiveBoundingBox( i, bp.box ) )
+            {
+                Vector3d v0, v1, v2;
+                bp.isTriangle = mSurfaces[s]->primitiveTriangle( i, v0, v1, v2 );
+                mBuildPrims.push_back( bp );
+            }
+            else
+                mUnbounded.push_back( bp.prim );
+        }
+    }
+
+    int numPrims = (int) mBuildPrims.size();
+    if ( numPrims == 0 ) return;
+
+    vector<Event> events[3];
+    for ( int a = 0; a < 3; a++ ) events[a].reserve( 2 * numPrims );
+    for ( int i = 0; i < numPrims; i++ )
+    {
+        mBounds.expand( mBuildPrims[i].box );
+        addEvents( i, mBuildPrims[i].box, events );
+    }
+    for ( int a = 0; a < 3; a++ ) std::sort( events[a].begin(), events[a].end() );
+
+    mSide.assign( numPrims, 0 );
+    mMaxDepth = Util::Min2( KD_MAX_DEPTH, (int)( 8.0 + 1.3 * log2( (double) numPrims ) ) );
+
+    buildRecursive( events, numPrims, mBounds, 0 );
+
+    vector<BuildPrim>().swap( mBuildPrims );
+    vector<char>().swap( mSide );
+}
+
+
+
+// Appends the events of a primitive with the given box, unsorted.
+void KdTree::addEvents( int prim, const AABB &box, vector<Event> events[3] )
+{
+    for ( int a = 0; a < 3; a++ )
+    {
+        Event e;
+        e.prim = prim;
+        if ( box.minPt[a] == box.maxPt[a] )
+        {
+            e.pos = box.minPt[a];
+            e.type = EVENT_PLANAR;
+            events[a].push_back( e );
+        }
+        else
+        {
+            e.pos = box.minPt[a];
+            e.type = EVENT_START;
+            events[a].push_back( e );
+            e.pos = box.maxPt[a];
+            e.type = EVENT_END;
+            events[a].push_back( e );
+        }
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Builds the subtree over the primitives of the sorted events, within the
+// cell, and returns the index of its root node. The events are consumed.
+//////////////////////////////////////////////////////////////////////////////
+
+int KdTree::buildRecursive( vector<Event> events[3], int numPrims, const AABB &cell, int depth )
+{
+    int nodeIndex = (int) mNodes.size();
+    mNodes.push_back( Node() );
+
+    Split split;
+    if ( depth < mMaxDepth && numPrims > 0 ) findSplit( events, numPrims, cell, split );
+
+    if ( split.axis < 0 || split.cost >= KD_INTERSECT_COST * numPrims )
+    {
+        makeLeaf( events[0], nodeIndex );
+        return nodeIndex;
+    }
+
+    vector<Event> below[3], above[3];
+    int numBelow, numAbove;
+    splitEvents( events, split, cell, below, numBelow, above, numAbove );
+    for ( int a = 0; a < 3; a++ ) vector<Event>().swap( events[a] );
+
+    AABB belowCell = cell, aboveCell = cell;
+    belowCell.maxPt[ split.axis ] = split.pos;
+    aboveCell.minPt[ split.axis ] = split.pos;
+
+    buildRecursive( below, numBelow, belowCell, depth + 1 );
+    int aboveIndex = buildRecursive( above, numAbove, aboveCell, depth + 1 );
+
+    Node &node = mNodes[nodeIndex];
+    node.split = split.pos;
+    node.axis = split.axis;
+    node.offset = aboveIndex;
+    return nodeIndex;
+}
+
+
+
+static double splitCost( double probBelow, double probAbove, int numBelow, int numAbove )
+{
+    double cost = KD_TRAVERSAL_COST + KD_INTERSECT_COST * ( probBelow * numBelow + probAbove * numAbove );
+    return ( numBelow == 0 || numAbove == 0 )? KD_EMPTY_BONUS * cost : cost;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Finds the plane with the lowest SAH cost by sweeping the sorted events
+// of each axis, counting the primitives below, in and above every
+// candidate plane. Primitives lying in the plane go to the cheaper side.
+//////////////////////////////////////////////////////////////////////////////
+
+void KdTree::findSplit( const vector<Event> events[3], int numPrims, const AABB &cell, Split &split ) const
+{
+    double area = cell.surfaceArea();
+    if ( area <= 0.0 ) return;
+
+    for ( int axis = 0; axis < 3; axis++ )
+    {
+        const vector<Event> &e = events[axis];
+        int n = (int) e.size();
+        int numBelow = 0, numAbove = numPrims;
+
+        for ( int i = 0; i < n; )
+        {
+            double pos = e[i].pos;
+            int numEnd = 0, numPlanar = 0, numStart = 0;
+            for ( ; i < n && e[i].pos == pos && e[i].type == EVENT_END; i++ ) numEnd++;
+            for ( ; i < n && e[i].pos == pos && e[i].type == EVENT_PLANAR; i++ ) numPlanar++;
+            for ( ; i < n && e[i].pos == pos && e[i].type == EVENT_START; i++ ) numStart++;
+
+            numAbove -= numPlanar + numEnd;
+
+            if ( pos > cell.minPt[axis] && pos < cell.maxPt[axis] )
+            {
+                AABB belowCell = cell, aboveCell = cell;
+                belowCell.maxPt[axis] = pos;
+                aboveCell.minPt[axis] = pos;
+                double probBelow = belowCell.surfaceArea() / area;
+                double probAbove = aboveCell.surfaceArea() / area;
+
+                double costLeft = splitCost( probBelow, probAbove, numBelow + numPlanar, numAbove );
+                double costRight = splitCost( probBelow, probAbove, numBelow, numAbove + numPlanar );
+                double cost = Util::Min2( costLeft, costRight );
+                if ( cost < split.cost )
+                {
+                    split.axis = axis;
+                    split.pos = pos;
+                    split.planarLeft = ( costLeft <= costRight );
+                    split.cost = cost;
+                }
+            }
+
+            numBelow += numPlanar + numStart;
+        }
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Sends the events of each primitive to the side of the plane it is on,
+// keeping them sorted. A primitive on both sides is clipped to each child
+// cell, and the new events of the clipped boxes, which are few, are sorted
+// and merged in.
+//////////////////////////////////////////////////////////////////////////////
+
+void KdTree::splitEvents( vector<Event> events[3], const Split &split, const AABB &cell,
+                          vector<Event> below[3], int &numBelow, vector<Event> above[3], int &numAbove )
+{
+    const vector<Event> &e = events[ split.axis ];
+
+    for ( size_t i = 0; i < e.size(); i++ ) mSide[ e[i].prim ] = KD_SIDE_BOTH;
+    for ( size_t i = 0; i < e.size(); i++ )
+    {
+        if ( e[i].type == EVENT_END && e[i].pos <= split.pos )
+            mSide[ e[i].prim ] = KD_SIDE_BELOW;
+        else if ( e[i].type == EVENT_START && e[i].pos >= split.pos )
+            mSide[ e[i].prim ] = KD_SIDE_ABOVE;
+        else if ( e[i].type == EVENT_PLANAR )
+        {
+            bool isBelow = ( e[i].pos < split.pos ) || ( e[i].pos == split.pos && split.planarLeft );
+            mSide[ e[i].prim ] = isBelow? KD_SIDE_BELOW : KD_SIDE_ABOVE;
+        }
+    }
+
+    AABB belowCell = cell, aboveCell = cell;
+    belowCell.maxPt[ split.axis ] = split.pos;
+    aboveCell.minPt[ split.axis ] = split.pos;
+
+    // Count the primitives of each side, by their one start or planar
+    // event, and clip those on both.
+    vector<Event> newBelow[3], newAbove[3];
+    numBelow = numAbove = 0;
+    for ( size_t i = 0; i < e.size(); i++ )
+    {
+        if ( e[i].type == EVENT_END ) continue;
+        int prim = e[i].prim;
+        int side = mSide[prim];
+        if ( side == KD_SIDE_BELOW ) numBelow++;
+        else if ( side == KD_SIDE_ABOVE ) numAbove++;
+        else
+        {
+            AABB box;
+            if ( clipPrimitive( prim, belowCell, box ) )
+            {
+                addEvents( prim, box, newBelow );
+                numBelow++;
+            }
+            if ( clipPrimitive( prim, aboveCell, box ) )
+            {
+                addEvents( prim, box, newAbove );
+                numAbove++;
+            }
+        }
+    }
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        for ( size_t i = 0; i < events[a].size(); i++ )
+        {
+            int side = mSide[ events[a][i].prim ];
+            if ( side == KD_SIDE_BELOW ) below[a].push_back( events[a][i] );
+            else if ( side == KD_SIDE_ABOVE ) above[a].push_back( events[a][i] );
+        }
+
+        size_t n = below[a].size();
+        std::sort( newBelow[a].begin(), newBelow[a].end() );
+        below[a].insert( below[a].end(), newBelow[a].begin(), newBelow[a].end() );
+        std::inplace_merge( below[a].begin(), below[a].begin() + n, below[a].end() );
+
+        n = above[a].size();
+        std::sort( newAbove[a].begin(), newAbove[a].end() );
+        above[a].insert( above[a].end(), newAbove[a].begin(), newAbove[a].end() );
+        std::inplace_merge( above[a].begin(), above[a].begin() + n, above[a].end() );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Computes the box of the part of a primitive inside the cell. A triangle
+// is clipped to the cell (Sutherland-Hodgman), another primitive has its
+// box cut. Returns false if nothing is left.
+//////////////////////////////////////////////////////////////////////////////
+
+bool KdTree::clipPrimitive( int prim, const AABB &cell, AABB &box ) const
+{
+    const BuildPrim &bp = mBuildPrims[prim];
+    box = bp.box;
+
+    Vector3d v[3];
+    if ( bp.isTriangle && bp.prim.surface->primitiveTriangle( bp.prim.index, v[0], v[1], v[2] ) )
+    {
+        // A triangle clipped by six planes has at most nine vertices.
+        Vector3d poly[9], clipped[9];
+        int n = 3;
+        for ( int i = 0; i < 3; i++ ) poly[i] = v[i];
+
+        for ( int plane = 0; plane < 6 && n > 0; plane++ )
+        {
+            int axis = plane / 2;
+            bool isMax = ( plane % 2 == 1 );
+            double p = isMax? cell.maxPt[axis] : cell.minPt[axis];
+
+            int m = 0;
+            for ( int i = 0; i < n; i++ )
+            {
+                const Vector3d &a = poly[i];
+                const Vector3d &b = poly[ ( i + 1 ) % n ];
+                bool aIn = isMax? ( a[axis] <= p ) : ( a[axis] >= p );
+                bool bIn = isMax? ( b[axis] <= p ) : ( b[axis] >= p );
+                if ( aIn ) clipped[ m++ ] = a;
+                if ( aIn != bIn )
+                {
+                    Vector3d q = a + ( ( p - a[axis] ) / ( b[axis] - a[axis] ) ) * ( b - a );
+                    q[axis] = p;
+                    clipped[ m++ ] = q;
+                }
+            }
+            n = m;
+            for ( int i = 0; i < n; i++ ) poly[i] = clipped[i];
+        }
+
+        // Rounding may clip away a part that only touches the cell; the
+        // whole box, cut by the cell below, is then kept.
+        if ( n > 0 )
+        {
+            AABB polyBox;
+            for ( int i = 0; i < n; i++ ) polyBox.expand( poly[i] );
+
+            Real err = KD_CLIP_ERROR_ULPS * REAL_EPSILON;
+            for ( int a = 0; a < 3; a++ )
+            {
+                Real m = Util::Max3( fabs( v[0][a] ), fabs( v[1][a] ), fabs( v[2][a] ) );
+                box.minPt[a] = Util::Max2( box.minPt[a], polyBox.minPt[a] - err * m );
+                box.maxPt[a] = Util::Min2( box.maxPt[a], polyBox.maxPt[a] + err * m );
+            }
+        }
+    }
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        box.minPt[a] = Util::Max2( box.minPt[a], cell.minPt[a] );
+        box.maxPt[a] = Util::Min2( box.maxPt[a], cell.maxPt[a] );
+    }
+    return !box.isEmpty();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Makes a leaf over the primitives of the events, with the triangles first
+// and packed for the SIMD kernel.
+//////////////////////////////////////////////////////////////////////////////
+
+void KdTree::makeLeaf( const vector<Event> &events, int nodeIndex )
+{
+    Leaf leaf;
+    leaf.offset = (int) mPrims.size();
+    leaf.packetOffset = (int) mPackets.size();
+
+    vector<int> others;
+    for ( size_t i = 0; i < events.size(); i++ )
+    {
+        if ( events[i].type == EVENT_END ) continue;
+        const BuildPrim &bp = mBuildPrims[ events[i].prim ];
+        if ( bp.isTriangle )
+            mPrims.push_back( bp.prim );
+        else
+            others.push_back( events[i].prim );
+    }
+    leaf.numTriangles = (int) mPrims.size() - leaf.offset;
+    for ( size_t i = 0; i < others.size(); i++ ) mPrims.push_back( mBuildPrims[ others[i] ].prim );
+    leaf.count = (int) mPrims.size() - leaf.offset;
+
+    mPackets.resize( mPackets.size() + ( leaf.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH );
+    for ( int k = 0; k < leaf.numTriangles; k += TRI_PACKET_WIDTH )
+    {
+        TrianglePacket &packet = mPackets[ leaf.packetOffset + k / TRI_PACKET_WIDTH ];
+        for ( int j = 0; j < TRI_PACKET_WIDTH; j++ )
+        {
+            if ( k + j >= leaf.numTriangles )
+            {
+                TriangleKernel::ClearLane( packet, j );
+                continue;
+            }
+
+            const PrimRef &prim = mPrims[ leaf.offset + k + j ];
+            Vector3d v0, v1, v2;
+            prim.surface->primitiveTriangle( prim.index, v0, v1, v2 );
+
+            double v[3], e1[3], e2[3], ng[3];
+            ( v1 - v0 ).getXYZ( e1 );
+            ( v2 - v0 ).getXYZ( e2 );
+            cross( v1 - v0, v2 - v0 ).getXYZ( ng );
+            v0.getXYZ( v );
+            TriangleKernel::SetLane( packet, j, v, e1, e2, ng );
+        }
+    }
+
+    Node &node = mNodes[nodeIndex];
+    node.split = 0.0;
+    node.axis = 3;
+    node.offset = (int) mLeaves.size();
+    mLeaves.push_back( leaf );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tests the ray against the primitives of a leaf, and shortens nearest_t
+// to any hit found.
+//////////////////////////////////////////////////////////////////////////////
+
+bool KdTree::hitLeaf( const Leaf &leaf, const Ray &r, const KernelRay &kray, Real tmin,
+                      Real &nearest_t, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    SurfaceHitRecord tempHitRec;
+
+    // Confirm the triangles the kernel cannot rule out.
+    int numPackets = ( leaf.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+    for ( int first = 0; first < numPackets; first += KD_KERNEL_PACKETS )
+    {
+        unsigned masks[ KD_KERNEL_PACKETS ];
+        int n = Util::Min2( KD_KERNEL_PACKETS, numPackets - first );
+        TriangleKernel::Candidates( kray, &mPackets[ leaf.packetOffset + first ], n,
+                                    (float) tmin, (float) nearest_t, masks );
+
+        for ( int k = 0; k < n; k++ )
+        {
+            const PrimRef *prims = &mPrims[ leaf.offset + ( first + k ) * TRI_PACKET_WIDTH ];
+            for ( unsigned m = masks[k], j = 0; m != 0; m >>= 1, j++ )
+            {
+                if ( ( m & 1 ) && prims[j].hit( r, tmin, nearest_t, tempHitRec ) )
+                {
+                    hasHit = true;
+                    nearest_t = tempHitRec.t;
+                    rec = tempHitRec;
+                }
+            }
+        }
+    }
+
+    for ( int i = leaf.offset + leaf.numTriangles; i < leaf.offset + leaf.count; i++ )
+    {
+        if ( mPrims[i].hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    return hasHit;
+}
+
+
+
+bool KdTree::shadowHitLeaf( const Leaf &leaf, const Ray &r, const KernelRay &kray,
+                            Real tmin, Real tmax, Occluder *occluder ) const
+{
+    int numPackets = ( leaf.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+    for ( int first = 0; first < numPackets; first += KD_KERNEL_PACKETS )
+    {
+        unsigned masks[ KD_KERNEL_PACKETS ];
+        int n = Util::Min2( KD_KERNEL_PACKETS, numPackets - first );
+        TriangleKernel::Candidates( kray, &mPackets[ leaf.packetOffset + first ], n,
+                                    (float) tmin, (float) tmax, masks );
+
+        for ( int k = 0; k < n; k++ )
+        {
+            const PrimRef *prims = &mPrims[ leaf.offset + ( first + k ) * TRI_PACKET_WIDTH ];
+            for ( unsigned m = masks[k], j = 0; m != 0; m >>= 1, j++ )
+                if ( ( m & 1 ) && prims[j].shadowHit( r, tmin, tmax, occluder ) ) return true;
+        }
+    }
+
+    for ( int i = leaf.offset + leaf.numTriangles; i < leaf.offset + leaf.count; i++ )
+        if ( mPrims[i].shadowHit( r, tmin, tmax, occluder ) ) return true;
+
+    return false;
+}
+
+
+
+// A far child still to be visited, over [tmin, tmax] of the ray.
+struct KdStackEntry
+{
+    int node;
+    Real tmin, tmax;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Visits the leaves along the ray front to back, from the root over the
+// part of the ray inside the tree, and stops at the first leaf within
+// whose part of the ray a hit is found. Far children are pushed on a short
+// stack, which drops its oldest entry when full; once it is empty, the
+// traversal restarts from the root for the rest of the ray.
+//////////////////////////////////////////////////////////////////////////////
+
+bool KdTree::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    Real nearest_t = tmax;
+    SurfaceHitRecord tempHitRec;
+
+    for ( size_t i = 0; i < mUnbounded.size(); i++ )
+    {
+        if ( mUnbounded[i].hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    if ( mNodes.empty() ) return hasHit;
+
+    Vector3d orig = r.origin();
+    Vector3d dir = r.direction();
+    Vector3d invDir( 1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z() );
+
+    Real segMin = tmin, segMax = nearest_t;
+    if ( !mBounds.clip( orig, invDir, segMin, segMax ) ) return hasHit;
+    Real rayMax = segMax;
+
+    KernelRay kray = BVH::makeKernelRay( r );
+
+    KdStackEntry stack[ KD_SHORT_STACK_SIZE ];
+    int stackTop = 0, stackSize = 0;
+    int nodeIndex = 0;
+
+    while ( true )
+    {
+        while ( mNodes[nodeIndex].axis < 3 )
+        {
+            const Node &node = mNodes[nodeIndex];
+            int axis = node.axis;
+            Real tSplit = ( node.split - orig[axis] ) * invDir[axis];
+
+            bool belowFirst = ( orig[axis] < node.split ) || ( orig[axis] == node.split && dir[axis] <= 0.0 );
+            int first = belowFirst? nodeIndex + 1 : node.offset;
+            int second = belowFirst? node.offset : nodeIndex + 1;
+
+            if ( tSplit > segMax || tSplit <= 0.0 )
+                nodeIndex = first;
+            else if ( tSplit < segMin )
+                nodeIndex = second;
+            else
+            {
+                // A ray lying in the plane (tSplit is NaN) is in both children.
+                KdStackEntry &entry = stack[stackTop];
+                entry.node = second;
+                entry.tmin = ( tSplit == tSplit )? tSplit : segMin;
+                entry.tmax = segMax;
+                stackTop = ( stackTop + 1 ) % KD_SHORT_STACK_SIZE;
+                stackSize = Util::Min2( stackSize + 1, KD_SHORT_STACK_SIZE );
+
+                nodeIndex = first;
+                if ( tSplit == tSplit ) segMax = tSplit;
+            }
+        }
+
+        if ( hitLeaf( mLeaves[ mNodes[nodeIndex].offset ], r, kray, tmin, nearest_t, rec ) ) hasHit = true;
+
+        // The cells along the ray are visited in order, so a hit within
+        // this one is the nearest.
+        if ( hasHit && nearest_t <= segMax ) break;
+
+        if ( stackSize > 0 )
+        {
+            stackTop = ( stackTop + KD_SHORT_STACK_SIZE - 1 ) % KD_SHORT_STACK_SIZE;
+            stackSize--;
+            nodeIndex = stack[stackTop].node;
+            segMin = stack[stackTop].tmin;
+            segMax = stack[stackTop].tmax;
+        }
+        else if ( segMax < Util::Min2( rayMax, nearest_t ) )
+        {
+            nodeIndex = 0;
+            segMin = segMax;
+            segMax = rayMax;
+        }
+        else
+            break;
+
+        if ( segMin > nearest_t ) break;
+    }
+
+    return hasHit;
+}
+
+
+
+// The any-hit query of shadowHit() and shadowHitOccluder(), which sets
+// occluder if it is not NULL.
+bool KdTree::anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const
+{
+    for ( size_t i = 0; i < mUnbounded.size(); i++ )
+        if ( mUnbounded[i].shadowHit( r, tmin, tmax, occluder ) ) return true;
+
+    if ( mNodes.empty() ) return false;
+
+    Vector3d orig = r.origin();
+    Vector3d dir = r.direction();
+    Vector3d invDir( 1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z() );
+
+    Real segMin = tmin, segMax = tmax;
+    if ( !mBounds.clip( orig, invDir, segMin, segMax ) ) return false;
+    Real rayMax = segMax;
+
+    KernelRay kray = BVH::makeKernelRay( r );
+
+    KdStackEntry stack[ KD_SHORT_STACK_SIZE ];
+    int stackTop = 0, stackSize = 0;
+    int nodeIndex = 0;
+
+    while ( true )
+    {
+        while ( mNodes[nodeIndex].axis < 3 )
+        {
+            const Node &node = mNodes[nodeIndex];
+            int axis = node.axis;
+            Real tSplit = ( node.split - orig[axis] ) * invDir[axis];
+
+            bool belowFirst = ( orig[axis] < node.split ) || ( orig[axis] == node.split && dir[axis] <= 0.0 );
+            int first = belowFirst? nodeIndex + 1 : node.offset;
+            int second = belowFirst? node.offset : nodeIndex + 1;
+
+            if ( tSplit > segMax || tSplit <= 0.0 )
+                nodeIndex = first;
+            else if ( tSplit < segMin )
+                nodeIndex = second;
+            else
+            {
+                KdStackEntry &entry = stack[stackTop];
+                entry.node = second;
+                entry.tmin = ( tSplit == tSplit )? tSplit : segMin;
+                entry.tmax = segMax;
+                stackTop = ( stackTop + 1 ) % KD_SHORT_STACK_SIZE;
+                stackSize = Util::Min2( stackSize + 1, KD_SHORT_STACK_SIZE );
+
+                nodeIndex = first;
+                if ( tSplit == tSplit ) segMax = tSplit;
+            }
+        }
+
+        // Any hit will do, wherever it is along the ray.
+        if ( shadowHitLeaf( mLeaves[ mNodes[nodeIndex].offset ], r, kray, tmin, tmax, occluder ) ) return true;
+
+        if ( stackSize > 0 )
+        {
+            stackTop = ( stackTop + KD_SHORT_STACK_SIZE - 1 ) % KD_SHORT_STACK_SIZE;
+            stackSize--;
+            nodeIndex = stack[stackTop].node;
+            segMin = stack[stackTop].tmin;
+            segMax = stack[stackTop].tmax;
+        }
+        else if ( segMax < rayMax )
+        {
+            nodeIndex = 0;
+            segMin = segMax;
+            segMax = rayMax;
+        }
+        else
+            break;
+    }
+
+    return false;
+}
+
+
+
+bool KdTree::boundingBox( AABB &box ) const
+{
+    if ( mNodes.empty() || !mUnbounded.empty() ) return false;
+    box = mBounds;
+    return true;
+}
@@ -0,0 +1,213 @@
+#ifndef _KDTREE_H_
+#define _KDTREE_H_
+
+#include <vector>
+#include "Surface.h"
+#include "AABB.h"
+#include "TriangleKernel.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Kd-tree over the primitives of an array of Surfaces, as an alternative
+// to the BVH behind the same Surface interface.
+//
+// The tree splits space rather than the primitives: each interior node
+// cuts its cell in two with an axis-aligned plane, and a primitive that
+// straddles the plane is referenced from both sides. The cells do not
+// overlap, so a ray visits the leaves along it front to back, and the
+// nearest-hit query stops at the first leaf that holds a hit within it.
+//
+// The build is the O(N log N) SAH build of Wald and Havran: the start and
+// end of every primitive along each axis are sorted once as events, the
+// best plane of a node is found by sweeping them, and the sorted events
+// are split between the children without sorting again, except for the
+// few of primitives that straddle the plane. Those are clipped to each
+// child cell ("perfect splits"), so a reference is bounded by the part of
+// its triangle inside the cell. A side left empty by a split is favoured,
+// as empty space is traversed cheaply.
+//
+// The traversal keeps a short stack of far children. When it overflows
+// the oldest entry is lost, and once the stack runs dry the traversal
+// restarts from the root for the rest of the ray, so the stack needs no
+// bound on the depth of the tree.
+//
+// Leaves store their triangles in packets for the SIMD triangle kernel, as
+// the BVH does. Unbounded primitives are kept in a list tested linearly.
+//
+// The tree cannot be refit, as moved primitives may leave their cells;
+// it is rebuilt instead.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Entries of the short traversal stack.
+#define KD_SHORT_STACK_SIZE     8
+
+// Limit on the depth of the tree, besides that of 8 + 1.3 log2( N ).
+#define KD_MAX_DEPTH            64
+
+// Costs of traversing an interior node and of testing one primitive. The
+// SIMD kernel makes a triangle cheap to test, so leaves are kept large.
+#define KD_TRAVERSAL_COST       1.0
+#define KD_INTERSECT_COST       0.6
+
+// Factor of the cost of a split that leaves one side empty.
+#define KD_EMPTY_BONUS          0.8
+
+
+
+class KdTree : public Surface
+{
+public:
+
+    KdTree( const SurfacePtr *surfaces, int numSurfaces );
+
+
+    // Builds the tree again over the same surfaces, after they have moved.
+    void rebuild();
+
+
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const
+        { return anyHit( r, tmin, tmax, NULL ); }
+
+
+    virtual bool shadowHitOccluder( const Ray &r, Real tmin, Real tmax, Occluder &occluder ) const
+        { return anyHit( r, tmin, tmax, &occluder ); }
+
+
+    // Returns false if the tree holds any unbounded primitive.
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    int numNodes() const { return (int) mNodes.size(); }
+
+    int numLeaves() const { return (int) mLeaves.size(); }
+
+    // References to primitives from the leaves, counting each primitive
+    // once for every leaf it is in.
+    int numReferences() const { return (int) mPrims.size(); }
+
+    int numUnbounded() const { return (int) mUnbounded.size(); }
+
+    // Bytes held by the tree, its primitive references and its packets.
+    size_t memoryUsage() const
+    {
+        return mNodes.capacity() * sizeof( Node ) + mLeaves.capacity() * sizeof( Leaf )
+             + ( mPrims.capacity() + mUnbounded.capacity() ) * sizeof( PrimRef )
+             + mPackets.capacity() * sizeof( TrianglePacket );
+    }
+
+
+private:
+
+    // Interior nodes have the child below the plane right after them.
+    struct Node
+    {
+        Real split;   // Interior: position of the plane along the axis.
+        int offset;     // Interior: index of the child above the plane. Leaf: index in mLeaves.
+        int axis;       // Split axis, or 3 for a leaf.
+    };
+
+    struct Leaf
+    {
+        int offset;         // Index of first primitive in mPrims.
+        int count;          // Number of primitives.
+        int packetOffset;   // Index of first triangle packet.
+        int numTriangles;   // The first numTriangles primitives are triangles.
+    };
+
+    // Primitive i of a Surface.
+    struct PrimRef
+    {
+        const Surface *surface;
+        int index;
+
+        bool hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+            { return surface->hitPrimitive( index, r, tmin, tmax, rec ); }
+
+        // Sets occluder if it is not NULL.
+        bool shadowHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder = NULL ) const
+        {
+            return ( occluder == NULL )? surface->shadowHitPrimitive( index, r, tmin, tmax )
+                                       : surface->shadowHitPrimitiveOccluder( index, r, tmin, tmax, *occluder );
+        }
+    };
+
+    struct BuildPrim
+    {
+        AABB box;
+        PrimRef prim;
+        bool isTriangle;
+    };
+
+    // Where the box of primitive prim starts, ends, or lies flat, along
+    // an axis. Sorted by position, and at equal positions ends first.
+    enum EventType { EVENT_END, EVENT_PLANAR, EVENT_START };
+
+    struct Event
+    {
+        Real pos;
+        int prim;
+        int type;
+
+        bool operator< ( const Event &e ) const
+            { return ( pos < e.pos ) || ( pos == e.pos && type < e.type ); }
+    };
+
+    struct Split
+    {
+        int axis;           // -1 if none.
+        Real pos;
+        bool planarLeft;    // Primitives lying in the plane go below it.
+        double cost;
+
+        Split() : axis( -1 ), cost( DBL_MAX ) {}
+    };
+
+    void build();
+    static void addEvents( int prim, const AABB &box, vector<Event> events[3] );
+    int buildRecursive( vector<Event> events[3], int numPrims, const AABB &cell, int depth );
+    void findSplit( const vector<Event> events[3], int numPrims, const AABB &cell, Split &split ) const;
+    void splitEvents( vector<Event> events[3], const Split &split, const AABB &cell,
+                      vector<Event> left[3], int &numLeft, vector<Event> right[3], int &numRight );
+    bool clipPrimitive( int prim, const AABB &cell, AABB &box ) const;
+    void makeLeaf( const vector<Event> &events, int nodeIndex );
+
+    bool hitLeaf( const Leaf &leaf, const Ray &r, const KernelRay &kray, Real tmin,
+                  Real &nearest_t, SurfaceHitRecord &rec ) const;
+    bool shadowHitLeaf( const Leaf &leaf, const Ray &r, const KernelRay &kray,
+                        Real tmin, Real tmax, Occluder *occluder ) const;
+    bool anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const;
+
+    vector<Node> mNodes;
+    vector<Leaf> mLeaves;
+    vector<PrimRef> mPrims;      // Bounded primitives, in leaf order.
+    vector<PrimRef> mUnbounded;  // Primitives without a bounding box.
+    vector<TrianglePacket> mPackets;
+    AABB mBounds;
+    vector<SurfacePtr> mSurfaces;
+
+    // Build state: the primitives, and the side of the plane of each, for
+    // the node being split.
+    vector<BuildPrim> mBuildPrims;
+    vector<char> mSide;
+    int mMaxDepth;
+
+}; // KdTree
+
+
+#endif // _KDTREE_H_
@@ -0,0 +1,608 @@
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+#include "Util.h"
+#include "Scheduler.h"
+#include "BVH.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Linear BVH (LBVH) builder of class BVH.
+//
+// 1. The centroid of every primitive gets a 30-bit Morton code, which
+//    interleaves the bits of its quantized x, y and z, so primitives that
+//    are close along the Morton curve are close in space.
+// 2. The primitives are sorted by code with a parallel radix sort.
+// 3. The tree is read off the sorted codes: a node is split where the
+//    highest bit that differs among its codes turns from 0 to 1. The top
+//    levels are split serially, and the subtrees below them are built in
+//    parallel, one task each, down to a few primitives.
+// 4. Bottom-up, each node applies the tree rotation (the swap of a child
+//    with a grandchild) that lowers the SAH cost the most, and a subtree
+//    of at most maxLeafSize primitives becomes a leaf if the SAH build
+//    would have made it one.
+// 5. The tree is flattened into the depth-first layout of the BVH, again
+//    with the subtrees below the top levels in parallel.
+//
+// Every step is linear in the number of primitives. The tree is not as
+// good as the SAH build's, but builds several times faster.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+// Bits per axis of the Morton codes.
+#define LBVH_MORTON_BITS    10
+
+// Radix sort digit size.
+#define LBVH_RADIX_BITS     8
+
+// Subtrees built by one task have at least this many primitives, unless
+// the whole scene has fewer.
+#define LBVH_MIN_TASK_SIZE  1024
+
+// Ranges of at most this many primitives are not split by Morton code.
+#define LBVH_LEAF_SIZE      4
+
+
+
+class LBVHBuilder
+{
+public:
+
+    LBVHBuilder( BVH &bvh, vector<BVH::BuildPrim> &buildPrims, bool rotate, int numThreads );
+
+    void build();
+
+private:
+
+    struct Node
+    {
+        AABB box;
+        int child[2];       // -1, -1 for a leaf of the Morton tree.
+        int begin, end;     // Leaf of the Morton tree: its sorted primitives.
+        int count;          // Number of primitives in the subtree.
+        int numTriangles;
+        int numPackets;     // Triangle packets of the flattened subtree.
+        int numFlatNodes;   // Nodes of the flattened subtree.
+        int height;         // 1 for a leaf.
+        bool leaf;          // A leaf of the Morton tree, or a subtree made a leaf.
+        bool done;          // Optimized; box and counts are valid.
+    };
+
+    // A subtree built, or flattened, by one task.
+    struct Task
+    {
+        int begin, end;     // Build: range of sorted primitives.
+        int node;           // Build: the node it replaces in the top levels. Flatten: its root.
+        int nodeIndex, primOffset, packetOffset;    // Flatten: where it goes in the BVH.
+    };
+
+    void computeMortonCodes( vector<uint32_t> &codes, vector<int> &order );
+    void radixSort( vector<uint32_t> &codes, vector<int> &order );
+
+    int findSplit( int begin, int end ) const;
+    int emitTop( int begin, int end );
+    int emit( vector<Node> &nodes, int begin, int end );
+
+    double leafCost( const Node &n ) const;
+    void update( vector<Node> &nodes, int i );
+    void rotate( vector<Node> &nodes, int i );
+    void optimize( vector<Node> &nodes, int i );
+
+    void gatherLeaf( int i, BVH::BuildPrim *prims, int &count ) const;
+    void flatten( int i, int nodeIndex, int primOffset, int packetOffset, vector<Task> *tasks );
+
+    BVH &mBvh;
+    vector<BVH::BuildPrim> &mBuildPrims;
+    vector<BVH::BuildPrim> mSorted;     // mBuildPrims in Morton order.
+    vector<uint32_t> mCodes;            // Codes of mSorted.
+    vector<Node> mNodes;
+    vector<Task> mTasks;
+    bool mRotate;
+    int mNumThreads;
+    int mTaskSize;
+    int mMortonLeafSize;
+
+}; // LBVHBuilder
+
+
+
+void BVH::buildLBVH( vector<BuildPrim> &buildPrims, bool rotate, int numThreads )
+{
+    LBVHBuilder builder( *this, buildPrims, rotate, numThreads );
+    builder.build();
+}
+
+
+
+LBVHBuilder::LBVHBuilder( BVH &bvh, vector<BVH::BuildPrim> &buildPrims, bool rotate, int numThreads )
+    : mBvh( bvh ), mBuildPrims( buildPrims )
+{
+    mRotate = rotate;
+    mNumThreads = ( numThreads > 0 )? numThreads : Scheduler::HardwareThreads();
+
+    int n = (int) buildPrims.size();
+    mTaskSize = Util::Max2( LBVH_MIN_TASK_SIZE, n / ( 16 * mNumThreads ) );
+    mMortonLeafSize = Util::Min2( LBVH_LEAF_SIZE, bvh.mMaxLeafSize );
+}
+
+
+
+void LBVHBuilder::build()
+{
+    int n = (int) mBuildPrims.size();
+
+    vector<uint32_t> codes;
+    vector<int> order;
+    computeMortonCodes( codes, order );
+    radixSort( codes, order );
+
+    mSorted.resize( n );
+    mCodes.resize( n );
+    Scheduler::Run( mNumThreads, mNumThreads, [&]( int t, int )
+    {
+        int begin = (int)( (long long) n * t / mNumThreads );
+        int end = (int)( (long long) n * ( t + 1 ) / mNumThreads );
+        for ( int i = begin; i < end; i++ )
+        {
+            mSorted[i] = mBuildPrims[ order[i] ];
+            mCodes[i] = codes[i];
+        }
+    } );
+
+    // The top levels, then the subtrees below them in parallel. Each task
+    // builds and optimizes its subtree in a separate array.
+    emitTop( 0, n );
+
+    vector< vector<Node> > subtrees( mTasks.size() );
+    Scheduler::Run( (int) mTasks.size(), mNumThreads, [&]( int t, int )
+    {
+        emit( subtrees[t], mTasks[t].begin, mTasks[t].end );
+        optimize( subtrees[t], 0 );
+    } );
+
+    // Move the subtrees into mNodes. The root of each replaces the node of
+    // its task, and the other nodes are appended.
+    for ( size_t t = 0; t < mTasks.size(); t++ )
+    {
+        vector<Node> &sub = subtrees[t];
+        int base = (int) mNodes.size() - 1;
+        for ( size_t j = 0; j < sub.size(); j++ )
+        {
+            for ( int c = 0; c < 2; c++ )
+            {
+                int k = sub[j].child[c];
+                if ( k >= 0 ) sub[j].child[c] = ( k == 0 )? mTasks[t].node : base + k;
+            }
+        }
+        mNodes[ mTasks[t].node ] = sub[0];
+        mNodes.insert( mNodes.end(), sub.begin() + 1, sub.end() );
+        vector<Node>().swap( sub );
+    }
+
+    optimize( mNodes, 0 );
+
+    // Flatten the top levels, then the subtrees below them in parallel.
+    const Node &root = mNodes[0];
+    mBvh.mNodes.resize( root.numFlatNodes );
+    mBvh.mPrims.resize( root.count );
+    mBvh.mPackets.resize( root.numPackets );
+
+    vector<Task> flattenTasks;
+    flatten( 0, 0, 0, 0, &flattenTasks );
+    Scheduler::Run( (int) flattenTasks.size(), mNumThreads, [&]( int t, int )
+    {
+        const Task &task = flattenTasks[t];
+        flatten( task.node, task.nodeIndex, task.primOffset, task.packetOffset, NULL );
+    } );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Inserts two zero bits after each of the low 10 bits of v.
+//////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t expandBits( uint32_t v )
+{
+    v = ( v * 0x00010001u ) & 0xFF0000FFu;
+    v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+    v = ( v * 0x00000011u ) & 0xC30C30C3u;
+    v = ( v * 0x00000005u ) & 0x49249249u;
+    return v;
+}
+
+
+
+void LBVHBuilder::computeMortonCodes( vector<uint32_t> &codes, vector<int> &order )
+{
+    int n = (int) mBuildPrims.size();
+    int numThreads = mNumThreads;
+
+    // The box of the centroids, reduced over one partial box per thread.
+    vector<AABB> partial( numThreads );
+    Scheduler::Run( numThreads, numThreads, [&]( int t, int )
+    {
+        int begin = (int)( (long long) n * t / numThreads );
+        int end = (int)( (long long) n * ( t + 1 ) / numThreads );
+        for ( int i = begin; i < end; i++ ) partial[t].expand( mBuildPrims[i].centroid );
+    } );
+
+    AABB centroidBox;
+    for ( int t = 0; t < numThreads; t++ ) centroidBox.expand( partial[t] );
+
+    const double gridSize = 1 << LBVH_MORTON_BITS;
+    double scale[3];
+    for ( int a = 0; a < 3; a++ )
+    {
+        double extent = centroidBox.maxPt[a] - centroidBox.minPt[a];
+        scale[a] = ( extent > 0.0 )? gridSize / extent : 0.0;
+    }
+
+    codes.resize( n );
+    order.resize( n );
+    Scheduler::Run( numThreads, numThreads, [&]( int t, int )
+    {
+        int begin = (int)( (long long) n * t / numThreads );
+        int end = (int)( (long long) n * ( t + 1 ) / numThreads );
+        for ( int i = begin; i < end; i++ )
+        {
+            uint32_t q[3];
+            for ( int a = 0; a < 3; a++ )
+            {
+                double x = ( mBuildPrims[i].centroid[a] - centroidBox.minPt[a] ) * scale[a];
+                q[a] = (uint32_t) Util::Min2( Util::Max2( x, 0.0 ), gridSize - 1.0 );
+            }
+            codes[i] = ( expandBits( q[0] ) << 2 ) | ( expandBits( q[1] ) << 1 ) | expandBits( q[2] );
+            order[i] = i;
+        }
+    } );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Sorts the codes, and order along with them, with a least significant
+// digit radix sort. In each pass, every block of the array counts its
+// digits, the counts are turned into output offsets, and every block
+// scatters its elements. The sort is stable, so equal codes keep the
+// order of the primitives.
+//////////////////////////////////////////////////////////////////////////////
+
+void LBVHBuilder::radixSort( vector<uint32_t> &codes, vector<int> &order )
+{
+    const int numDigits = 1 << LBVH_RADIX_BITS;
+    const int codeBits = 3 * LBVH_MORTON_BITS;
+
+    int n = (int) codes.size();
+    int numBlocks = Util::Max2( 1, Util::Min2( 4 * mNumThreads, n / 16384 ) );
+
+    vector<uint32_t> codes2( n );
+    vector<int> order2( n );
+    vector<int> offsets( numBlocks * numDigits );
+
+    for ( int shift = 0; shift < codeBits; shift += LBVH_RADIX_BITS )
+    {
+        Scheduler::Run( numBlocks, mNumThreads, [&]( int b, int )
+        {
+            int begin = (int)( (long long) n * b / numBlocks );
+            int end = (int)( (long long) n * ( b + 1 ) / numBlocks );
+            int *count = &offsets[ b * numDigits ];
+            for ( int d = 0; d < numDigits; d++ ) count[d] = 0;
+            for ( int i = begin; i < end; i++ ) count[ ( codes[i] >> shift ) & ( numDigits - 1 ) ]++;
+        } );
+
+        // Elements with digit d from block b go after those with smaller
+        // digits, and after those with digit d from earlier blocks.
+        int sum = 0;
+        for ( int d = 0; d < numDigits; d++ )
+        {
+            for ( int b = 0; b < numBlocks; b++ )
+            {
+                int count = offsets[ b * numDigits + d ];
+                offsets[ b * numDigits + d ] = sum;
+                sum += count;
+            }
+        }
+
+        Scheduler::Run( numBlocks, mNumThreads, [&]( int b, int )
+        {
+            int begin = (int)( (long long) n * b / numBlocks );
+            int end = (int)( (long long) n * ( b + 1 ) / numBlocks );
+            int *offset = &offsets[ b * numDigits ];
+            for ( int i = begin; i < end; i++ )
+            {
+                int k = offset[ ( codes[i] >> shift ) & ( numDigits - 1 ) ]++;
+                codes2[k] = codes[i];
+                order2[k] = order[i];
+            }
+        } );
+
+        codes.swap( codes2 );
+        order.swap( order2 );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Returns where to split the sorted primitives [begin, end): the first
+// one with the highest differing bit set, or the middle if all the codes
+// are equal.
+//////////////////////////////////////////////////////////////////////////////
+
+int LBVHBuilder::findSplit( int begin, int end ) const
+{
+    uint32_t first = mCodes[ begin ];
+    uint32_t last = mCodes[ end - 1 ];
+    if ( first == last ) return ( begin + end ) / 2;
+
+    uint32_t diff = first ^ last;
+    int bit = 31;
+    while ( !( ( diff >> bit ) & 1 ) ) bit--;
+
+    // The codes share the bits above bit, so those with it clear come first.
+    int lo = begin, hi = end - 1;
+    while ( hi - lo > 1 )
+    {
+        int mid = ( lo + hi ) / 2;
+        if ( ( mCodes[mid] >> bit ) & 1 )
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return hi;
+}
+
+
+
+int LBVHBuilder::emitTop( int begin, int end )
+{
+    int index = (int) mNodes.size();
+    mNodes.push_back( Node() );
+    mNodes[index].child[0] = mNodes[index].child[1] = -1;
+    mNodes[index].done = false;
+
+    if ( end - begin <= mTaskSize )
+    {
+        Task task = { begin, end, index, 0, 0, 0 };
+        mTasks.push_back( task );
+        return index;
+    }
+
+    int split = findSplit( begin, end );
+    int left = emitTop( begin, split );
+    int right = emitTop( split, end );
+    mNodes[index].child[0] = left;
+    mNodes[index].child[1] = right;
+    return index;
+}
+
+
+
+int LBVHBuilder::emit( vector<Node> &nodes, int begin, int end )
+{
+    int index = (int) nodes.size();
+    nodes.push_back( Node() );
+    nodes[index].child[0] = nodes[index].child[1] = -1;
+    nodes[index].begin = begin;
+    nodes[index].end = end;
+    nodes[index].done = false;
+
+    if ( end - begin <= mMortonLeafSize ) return index;
+
+    int split = findSplit( begin, end );
+    int left = emit( nodes, begin, split );
+    int right = emit( nodes, split, end );
+    nodes[index].child[0] = left;
+    nodes[index].child[1] = right;
+    return index;
+}
+
+
+
+double LBVHBuilder::leafCost( const Node &n ) const
+{
+    int numPackets = ( n.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+    return n.box.surfaceArea() * ( numPackets * SAH_PACKET_COST + ( n.count - n.numTriangles ) );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Recomputes interior node i from its children. It is made a leaf if it is
+// small enough and, as in the SAH build, a leaf is cheaper than splitting
+// it with each side tested primitive by primitive.
+//////////////////////////////////////////////////////////////////////////////
+
+void LBVHBuilder::update( vector<Node> &nodes, int i )
+{
+    Node &n = nodes[i];
+    const Node &l = nodes[ n.child[0] ];
+    const Node &r = nodes[ n.child[1] ];
+
+    n.box = l.box;
+    n.box.expand( r.box );
+    n.count = l.count + r.count;
+    n.numTriangles = l.numTriangles + r.numTriangles;
+
+    double area = n.box.surfaceArea();
+    double splitCost = area * SAH_TRAVERSAL_COST
+                     + l.box.surfaceArea() * l.count + r.box.surfaceArea() * r.count;
+
+    if ( n.count <= mBvh.mMaxLeafSize && leafCost( n ) <= splitCost )
+    {
+        n.numPackets = ( n.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+        n.numFlatNodes = 1;
+        n.height = 1;
+        n.leaf = true;
+        return;
+    }
+
+    n.numPackets = l.numPackets + r.numPackets;
+    n.numFlatNodes = 1 + l.numFlatNodes + r.numFlatNodes;
+    n.height = 1 + Util::Max2( l.height, r.height );
+    n.leaf = false;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tries the four rotations at interior node i, each of which swaps one
+// child with a child of the other, and applies the one that lowers the SAH
+// cost the most. In the cost model of the SAH build, where the primitives
+// below a node are charged the area of its box, a rotation only changes
+// the box of the child that receives the swapped-in node, so it pays off
+// when that child's area times primitive count shrinks. Rotations that
+// would make the tree deeper than the traversal stacks allow are skipped.
+//////////////////////////////////////////////////////////////////////////////
+
+void LBVHBuilder::rotate( vector<Node> &nodes, int i )
+{
+    Node &n = nodes[i];
+    double bestGain = 0.0;
+    int bestC = -1, bestG = -1;
+
+    for ( int c = 0; c < 2; c++ )
+    {
+        const Node &other = nodes[ n.child[1 - c] ];
+        if ( other.leaf ) continue;
+
+        double oldCost = other.box.surfaceArea() * other.count;
+
+        for ( int g = 0; g < 2; g++ )
+        {
+            // n.child[c] would take the place of other.child[g].
+            const Node &moved = nodes[ n.child[c] ];
+            const Node &kept = nodes[ other.child[1 - g] ];
+            const Node &raised = nodes[ other.child[g] ];
+
+            AABB box = moved.box;
+            box.expand( kept.box );
+            double newCost = box.surfaceArea() * ( moved.count + kept.count );
+
+            int height = 2 + Util::Max2( moved.height, kept.height );
+            if ( height > BVH_MAX_DEPTH || raised.height >= BVH_MAX_DEPTH ) continue;
+
+            if ( oldCost - newCost > bestGain )
+            {
+                bestGain = oldCost - newCost;
+                bestC = c;
+                bestG = g;
+            }
+        }
+    }
+
+    if ( bestC < 0 ) return;
+
+    int o = n.child[1 - bestC];
+    int moved = n.child[ bestC ];
+    n.child[ bestC ] = nodes[o].child[ bestG ];
+    nodes[o].child[ bestG ] = moved;
+    update( nodes, o );
+}
+
+
+
+void LBVHBuilder::optimize( vector<Node> &nodes, int i )
+{
+    if ( nodes[i].done ) return;
+
+    if ( nodes[i].child[0] < 0 )
+    {
+        Node &n = nodes[i];
+        n.box.setEmpty();
+        n.numTriangles = 0;
+        for ( int k = n.begin; k < n.end; k++ )
+        {
+            n.box.expand( mSorted[k].box );
+            if ( mSorted[k].isTriangle ) n.numTriangles++;
+        }
+        n.count = n.end - n.begin;
+        n.numPackets = ( n.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+        n.numFlatNodes = 1;
+        n.height = 1;
+        n.leaf = true;
+        n.done = true;
+        return;
+    }
+
+    optimize( nodes, nodes[i].child[0] );
+    optimize( nodes, nodes[i].child[1] );
+    if ( mRotate ) rotate( nodes, i );
+    update( nodes, i );
+    nodes[i].done = true;
+}
+
+
+
+// Appends the primitives of the subtree at i to prims.
+void LBVHBuilder::gatherLeaf( int i, BVH::BuildPrim *prims, int &count ) const
+{
+    const Node &n = mNodes[i];
+    if ( n.child[0] < 0 )
+    {
+        for ( int k = n.begin; k < n.end; k++ ) prims[ count++ ] = mSorted[k];
+        return;
+    }
+    gatherLeaf( n.child[0], prims, count );
+    gatherLeaf( n.child[1], prims, count );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Writes the subtree at i into the BVH in depth-first order, with its root
+// at nodeIndex and its primitives and packets from primOffset and
+// packetOffset on. If tasks is not NULL, subtrees small enough are not
+// written but added to tasks, to be flattened in parallel.
+//////////////////////////////////////////////////////////////////////////////
+
+void LBVHBuilder::flatten( int i, int nodeIndex, int primOffset, int packetOffset, vector<Task> *tasks )
+{
+    const Node &n = mNodes[i];
+
+    if ( tasks != NULL && n.count <= mTaskSize )
+    {
+        Task task = { 0, 0, i, nodeIndex, primOffset, packetOffset };
+        tasks->push_back( task );
+        return;
+    }
+
+    BVH::Node &out = mBvh.mNodes[ nodeIndex ];
+    out.box = n.box;
+
+    if ( n.leaf )
+    {
+        BVH::BuildPrim prims[ BVH_MAX_LEAF_SIZE ];
+        int count = 0;
+        gatherLeaf( i, prims, count );
+        out.offset = primOffset;
+        out.packetOffset = packetOffset;
+        mBvh.fillLeaf( prims, count, out );
+        return;
+    }
+
+    // Put first the child with the lower centroid along the axis that
+    // separates them most, as the traversal expects.
+    Vector3d d = mNodes[ n.child[1] ].box.centroid() - mNodes[ n.child[0] ].box.centroid();
+    int axis = 0;
+    for ( int a = 1; a < 3; a++ )
+        if ( fabs( d[a] ) > fabs( d[axis] ) ) axis = a;
+
+    int first = n.child[0], second = n.child[1];
+    if ( d[axis] < 0.0 ) swap( first, second );
+
+    int secondIndex = nodeIndex + 1 + mNodes[ first ].numFlatNodes;
+    out.count = 0;
+    out.axis = (short) axis;
+    out.offset = secondIndex;
+
+    flatten( first, nodeIndex + 1, primOffset, packetOffset, tasks );
+    flatten( second, secondIndex, primOffset + mNodes[ first ].count,
+             packetOffset + mNodes[ first ].numPackets, tasks );
+}
@@ -12,7 +12,11 @@
 // Here it is computed as
 //
 //     I_local = I_a * k_a  +  
-//               SUM_OVER_ALL_LIGHTS ( I_source * [ k_d * (N.L) + k_r * (R.V)^n ] )
+//               SUM_OVER_ALL_LIGHTS ( I_source * f(d) * [ k_d * (N.L) + k_r * (R.V)^n ] )
+//
+// where f(d) is the falloff of a point light at distance d. A light with
+// an influence radius r dims as f(d) = (1 - d^2/r^2)^2 and does not reach
+// beyond r; one without (r = 0) has f(d) = 1 everywhere.
 //
 // and
 //
@@ -29,6 +33,17 @@ struct PointLightSource
 {
     Vector3d position;
     Color I_source;
+    double radius;      // Influence radius; 0 -- the light reaches everywhere undimmed.
+
+    PointLightSource() : radius( 0.0 ) {}
+
+    // Returns f(d) for a point at squared distance dist2 from the light.
+    float falloff( double dist2 ) const
+    {
+        if ( radius <= 0.0 ) return 1.0f;
+        double x = 1.0 - dist2 / ( radius * radius );
+        return ( x > 0.0 )? (float)( x * x ) : 0.0f;
+    }
 };
 
 
@@ -0,0 +1,270 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include "Util.h"
+#include "LightCuller.h"
+
+using namespace std;
+
+
+// Most lights in a leaf of the BVH.
+#define LIGHT_LEAF_SIZE     4
+
+// Deepest BVH walked; a median split of n lights is log2(n) deep.
+#define LIGHT_STACK_SIZE    64
+
+// Cells along the longest axis of the grid over which maxIntensity() is
+// bounded.
+#define LIGHT_BOUND_CELLS   32
+
+
+
+LightCuller::LightCuller( const Scene &scene, int maxSamples, float minContribution )
+{
+    mPtLight = scene.ptLight;
+    mMaxSamples = maxSamples;
+    mNumCulled = 0;
+
+    // The most of the intensity of a light that any material reflects.
+    float maxReflect = 0.0f;
+    for ( int m = 0; m < scene.numMaterials; m++ )
+    {
+        Color r = scene.material[m].k_d + scene.material[m].k_r;
+        maxReflect = Util::Max2( maxReflect, Util::Max3( r.r(), r.g(), r.b() ) );
+    }
+
+    for ( int i = 0; i < scene.numPtLights; i++ )
+    {
+        const PointLightSource &pt = scene.ptLight[i];
+        CulledLight light;
+        light.position = pt.position;
+        light.intensity = Util::Max3( pt.I_source.r(), pt.I_source.g(), pt.I_source.b() );
+        light.light = i;
+
+        float brightest = light.intensity * maxReflect;
+        if ( brightest < minContribution )
+        {
+            mNumCulled++;
+            continue;
+        }
+
+        if ( pt.radius <= 0.0 )
+        {
+            light.reach2 = DBL_MAX;
+            mGlobal.push_back( light );
+            continue;
+        }
+
+        // Where brightest * ( 1 - d^2/r^2 )^2 falls to minContribution.
+        light.reach2 = pt.radius * pt.radius * ( 1.0 - sqrt( minContribution / brightest ) );
+        mLights.push_back( light );
+    }
+
+    if ( !mLights.empty() )
+    {
+        mNodes.reserve( 2 * mLights.size() / LIGHT_LEAF_SIZE + 1 );
+        build( 0, (int) mLights.size() );
+    }
+    mMaxIntensity = boundIntensity();
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Builds the subtree over the lights [first, first + count), split at the
+// median of their positions along the longest axis of their box, and
+// returns the index of its root.
+//////////////////////////////////////////////////////////////////////////////
+
+int LightCuller::build( int first, int count )
+{
+    int index = (int) mNodes.size();
+    mNodes.push_back( Node() );
+
+    AABB box, centers;
+    for ( int i = first; i < first + count; i++ )
+    {
+        double reach = sqrt( mLights[i].reach2 );
+        Vector3d r( reach, reach, reach );
+        box.expand( AABB( mLights[i].position - r, mLights[i].position + r ) );
+        centers.expand( mLights[i].position );
+    }
+    mNodes[index].box = box;
+
+    if ( count <= LIGHT_LEAF_SIZE )
+    {
+        mNodes[index].first = first;
+        mNodes[index].count = count;
+        mNodes[index].second = -1;
+        return index;
+    }
+
+    int axis = centers.longestAxis();
+    int half = count / 2;
+    nth_element( mLights.begin() + first, mLights.begin() + first + half, mLights.begin() + first + count,
+                 [axis]( const CulledLight &a, const CulledLight &b ) { return a.position[axis] < b.position[axis]; } );
+
+    build( first, half );
+    int second = build( first + half, count - half );
+
+    mNodes[index].first = first;
+    mNodes[index].count = 0;
+    mNodes[index].second = second;
+    return index;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Bounds maxIntensity(). The lights with a radius reach only within the box
+// of the root of the BVH, which is cut into cells. A light reaches a point
+// of a cell with at most its intensity times its falloff at the nearest
+// point of the cell, so the lights that reach into the cell, found with
+// the BVH, add up to at most the sum of those there; the lights that reach
+// everywhere are added to the most over the cells. A light drawn by
+// select() is weighted by the brightness of all it stands for, over its
+// own, so the weighted sum is that of all the lights that reach the point.
+//////////////////////////////////////////////////////////////////////////////
+
+float LightCuller::boundIntensity() const
+{
+    double global = 0.0;
+    for ( size_t g = 0; g < mGlobal.size(); g++ ) global += mGlobal[g].intensity;
+    if ( mNodes.empty() ) return (float) global;
+
+    const AABB &bounds = mNodes[0].box;
+    Vector3d extent = bounds.extent();
+    double cellSize = Util::Max3( extent.x(), extent.y(), extent.z() ) / LIGHT_BOUND_CELLS;
+    if ( cellSize <= 0.0 ) cellSize = 1.0;
+
+    int numCells[3];
+    for ( int a = 0; a < 3; a++ )
+        numCells[a] = Util::Max2( 1, (int) ceil( extent[a] / cellSize ) );
+
+    double most = 0.0;
+    int stack[ LIGHT_STACK_SIZE ];
+
+    for ( int z = 0; z < numCells[2]; z++ )
+        for ( int y = 0; y < numCells[1]; y++ )
+            for ( int x = 0; x < numCells[0]; x++ )
+            {
+                Vector3d lo = bounds.minPt + cellSize * Vector3d( x, y, z );
+                AABB cell( lo, lo + Vector3d( cellSize, cellSize, cellSize ) );
+
+                double sum = 0.0;
+                int top = 0;
+                stack[ top++ ] = 0;
+
+                while ( top > 0 )
+                {
+                    int index = stack[ --top ];
+                    const Node &node = mNodes[index];
+                    if ( !node.box.overlaps( cell ) ) continue;
+
+                    if ( node.count == 0 )
+                    {
+                        stack[ top++ ] = node.second;
+                        stack[ top++ ] = index + 1;
+                        continue;
+                    }
+
+                    for ( int i = node.first; i < node.first + node.count; i++ )
+                    {
+                        const CulledLight &light = mLights[i];
+                        double dist2 = cell.distance2( light.position );
+                        if ( dist2 < light.reach2 )
+                            sum += light.intensity * mPtLight[ light.light ].falloff( dist2 );
+                    }
+                }
+                most = Util::Max2( most, sum );
+            }
+
+    return (float)( global + most );
+}
+
+
+
+int LightCuller::select( const Vector3d &p, vector<LightSample> &samples ) const
+{
+    size_t begin = samples.size();
+
+    // Gather the lights that reach p, weighted by how bright they are at p.
+    for ( size_t g = 0; g < mGlobal.size(); g++ )
+    {
+        LightSample s = { mGlobal[g].light, mGlobal[g].intensity };
+        samples.push_back( s );
+    }
+
+    int stack[ LIGHT_STACK_SIZE ];
+    int top = 0;
+    if ( !mNodes.empty() ) stack[ top++ ] = 0;
+
+    while ( top > 0 )
+    {
+        int index = stack[ --top ];
+        const Node &node = mNodes[index];
+        if ( !node.box.contains( p ) ) continue;
+
+        if ( node.count == 0 )
+        {
+            stack[ top++ ] = node.second;
+            stack[ top++ ] = index + 1;
+            continue;
+        }
+
+        for ( int i = node.first; i < node.first + node.count; i++ )
+        {
+            const CulledLight &light = mLights[i];
+            Vector3d d = p - light.position;
+            double dist2 = dot( d, d );
+            if ( dist2 >= light.reach2 ) continue;
+
+            LightSample s = { light.light, light.intensity * mPtLight[ light.light ].falloff( dist2 ) };
+            samples.push_back( s );
+        }
+    }
+
+    int numReached = (int)( samples.size() - begin );
+    if ( mMaxSamples <= 0 || numReached <= mMaxSamples )
+    {
+        for ( size_t j = begin; j < samples.size(); j++ ) samples[j].weight = 1.0f;
+        return numReached;
+    }
+
+    // Draw mMaxSamples of them, stratified over the sum of their
+    // brightness, in place. A light drawn n times is kept once, with
+    // n times the weight.
+    double total = 0.0;
+    for ( size_t j = begin; j < samples.size(); j++ ) total += samples[j].weight;
+
+    double pt[3] = { p.x(), p.y(), p.z() };
+    double step = total / mMaxSamples;
+    double target = Util::HashUniform( pt, 3 ) * step;
+    double sum = 0.0;
+    int numDrawn = 0;
+    size_t out = begin;
+
+    for ( size_t j = begin; j < samples.size() && numDrawn < mMaxSamples; j++ )
+    {
+        float brightness = samples[j].weight;
+        sum += brightness;
+
+        int n = 0;
+        while ( target < sum && numDrawn < mMaxSamples )
+        {
+            n++;
+            numDrawn++;
+            target += step;
+        }
+
+        if ( n > 0 )
+        {
+            samples[out].light = samples[j].light;
+            samples[out].weight = (float)( n * step / brightness );
+            out++;
+        }
+    }
+
+    samples.resize( out );
+    return (int)( out - begin );
+}
@@ -0,0 +1,107 @@
+#ifndef _LIGHTCULLER_H_
+#define _LIGHTCULLER_H_
+
+#include <vector>
+#include "Vector3d.h"
+#include "AABB.h"
+#include "Scene.h"
+
+using namespace std;
+
+
+// The lights that reach a point less than this, times the largest
+// reflectance of the materials, are skipped: half a step of the 8-bit
+// output.
+#define LIGHT_MIN_CONTRIBUTION  ( 0.5f / 255.0f )
+
+
+// A light picked to shade a point, whose lighting is scaled by weight.
+struct LightSample
+{
+    int light;      // Index into Scene::ptLight.
+    float weight;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Finds the point lights that shade a point, so that the cost of shading,
+// and the number of shadow rays, follow the lights near the point rather
+// than all the lights of the scene.
+//
+// Each light with an influence radius reaches a sphere about it: the
+// points where its falloff, times its intensity and the largest
+// reflectance of the materials, is at least minContribution. So a light
+// that is bright reaches further than a dim one of the same radius. The
+// spheres are kept in a binary BVH, which is walked down to the leaves
+// whose boxes hold the point. The lights without a radius reach
+// everywhere, and are kept aside.
+//
+// With maxSamples, a point reached by more lights than that is shaded by
+// at most maxSamples of them, drawn with probability in proportion to the
+// intensity with which they reach it, and weighted so that the expected
+// lighting is that of all of them. The draws are stratified, and seeded
+// by a hash of the point, so they do not depend on the order of shading.
+// This bounds the shadow rays per point, at the cost of some noise where
+// many lights overlap.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class LightCuller
+{
+public:
+
+    LightCuller( const Scene &scene, int maxSamples = 0,
+                 float minContribution = LIGHT_MIN_CONTRIBUTION );
+
+    // Appends to samples the lights that shade the point p, with their
+    // weights, and returns how many.
+    int select( const Vector3d &p, vector<LightSample> &samples ) const;
+
+    int numLights() const { return (int) mLights.size() + (int) mGlobal.size(); }
+    int numGlobal() const { return (int) mGlobal.size(); }
+    int numCulled() const { return mNumCulled; }    // Lights too dim to reach any point.
+    int numNodes() const { return (int) mNodes.size(); }
+    int maxSamples() const { return mMaxSamples; }
+
+    // Bound on what the lights that shade any one point add up to: the sum
+    // over the samples of select() of weight times intensity times falloff,
+    // with the intensity of a light the largest component of its I_source.
+    // Sampling keeps that sum, so the bound holds with maxSamples too.
+    float maxIntensity() const { return mMaxIntensity; }
+
+private:
+
+    // A light with an influence radius, and the sphere it reaches.
+    struct CulledLight
+    {
+        Vector3d position;
+        double reach2;      // Squared radius of the sphere it reaches.
+        float intensity;    // Largest component of its I_source.
+        int light;
+    };
+
+    // A node of the BVH holds the lights [first, first + count) if it is
+    // a leaf (count > 0), and else has its first child next to it and its
+    // second child at index second.
+    struct Node
+    {
+        AABB box;
+        int first, count, second;
+    };
+
+    int build( int first, int count );
+    float boundIntensity() const;
+
+    const PointLightSource *mPtLight;
+    vector<CulledLight> mLights;    // In the order of the leaves.
+    vector<Node> mNodes;
+    vector<CulledLight> mGlobal;    // Lights without a radius.
+    int mMaxSamples;
+    int mNumCulled;
+    float mMaxIntensity;
+
+}; // LightCuller
+
+
+#endif // _LIGHTCULLER_H_
@@ -14,12 +14,34 @@
 #include "Sphere.h"
 #include "Plane.h"
 #include "Triangle.h"
+#include "TriangleMesh.h"
+#include "Instance.h"
+#include "PrimitiveArrays.h"
+#include "Obj.h"
+#include "MeshCache.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "KdTree.h"
+#include "Grid.h"
+#include "TriangleKernel.h"
 #include "Scene.h"
 #include "Raytrace.h"
+#include "RaySort.h"
+#include "ShadowCache.h"
+#include "LightCuller.h"
+#include "Scheduler.h"
 #include <iostream>
 #include <fstream>
 #include <vector>
 
+#ifdef __linux__
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
 
 using namespace std;
 
@@ -37,66 +59,80 @@ static const int reflectLevels2 = 2;  // 0 -- object does not reflect scene.
 static const int hasShadow2 = true;
 static const char outImageFile2[] = "out2.png";
 
+// Constants for the animation of Scene 2.
+static const int numFrames2 = 0;  // 0 -- render the still image only.
+static const char animImageFile2[] = "anim2_%03d.png";
+
+// Constants for rendering.
+static const int numRenderThreads = 0;  // 0 -- use all hardware threads.
+static const int renderTileSize = 32;   // Width and height of an image tile in pixels.
+static const int packetSize = 8;        // Primary rays are traced in packets of packetSize x packetSize pixels; 1 -- one by one.
+static const bool wavefront = false;    // Trace each tile breadth first, one bounce of all its rays at a time.
+static const RaySortMode raySortMode = RAY_SORT_OCTANT;  // RAY_SORT_MORTON for scenes too big for the cache; see benchRaySort.
+static const bool watertightTriangles = true;  // Rays never leak through shared mesh edges.
+static const PathEnd pathEnd = PATH_END_CONTRIBUTION;  // PATH_END_DEPTH -- always reflectLevels deep; PATH_END_ROULETTE for deep mirrors.
+static const bool useShadowCache = true;  // Test the last occluder of each light first, per thread.
+static const bool useLightCulling = true;  // Shade each hit with only the lights that reach it, found in a BVH over the lights.
+static const int maxLightSamples = 0;      // Shade each hit with at most this many of them, picked at random by brightness; 0 -- all.
+
+// Constants for the acceleration structure.
+static const int bvhWidth = 8;             // Children per BVH node: 2, 4 or 8.
+static const bool bvhQuantized = false;    // 8-bit child boxes in BVH4 and BVH8 nodes.
+static const BVHBuildMethod bvhBuildMethod = BVH_BUILD_SAH;  // BVH_BUILD_LBVH for very large scenes, BVH_BUILD_SBVH for thin triangles.
+enum AccelType { ACCEL_BVH, ACCEL_KDTREE, ACCEL_GRID };
+static const AccelType accelType = ACCEL_BVH;  // ACCEL_GRID for fields of similar spheres.
+static const bool useMeshCache = true;     // Keep meshes and their BVHs in .bvhcache files.
+static const double accelMaxCostGrowth = 1.5;  // Rebuild instead of refitting once the SAH cost grows this much.
+
+// Constants for benchmarking.
+static const bool benchRaySort = false;  // Time the ray sort modes on Scene 2 instead of rendering.
+static const bool benchManyLights = false;  // Time Scene 2 lit by numBenchLights small lights instead of rendering.
+static const int numBenchLights = 5000;
 
-// vertex definition for 3D objects
-struct vertex{
-       double x;
-       double y;
-       double z;
-  };
-
-// face definition for 3D objectts
-struct face{
-      unsigned int v1,v2,v3;
-};
 
-//obj class
-class Obj
-{
-public:
-   std::vector<vertex> vertexes;
-   std::vector<face> faces;
-    
-  void readfile(const char* filename);
-  void draw(Scene &scene);
-};
+///////////////////////////////////////////////////////////////////////////
+// Raytrace the pixels [x0, x1) x [y0, y1) of the image breadth first, with
+// the rays in blocks of packetSize x packetSize pixels, so that the primary
+// rays are traced in coherent packets.
+///////////////////////////////////////////////////////////////////////////
 
-//method to read in Obj files
-void Obj::readfile(const char *filename)
+void TraceTileWavefront( Image &image, const Scene &scene, int x0, int y0, int x1, int y1,
+                         int reflectLevels, bool hasShadow, RaySortMode sortMode, ShadowCache *shadowCache )
 {
-   string s;
-   ifstream fin(filename);
-   if(!fin)
-         return;
-   while(fin>>s)
-   {
-         switch(*s.c_str())
-         {
-         case 'v':
-              {
-                    vertex v;
-                    fin>>v.x>>v.y>>v.z;
-                    this->vertexes.push_back(v);
-              }
-              break;
-         case 'f':
-              {
-                    face f;
-                    fin>>f.v1>>f.v2>>f.v3;
-               
-                    faces.push_back(f);
-              }
-              break;
-         }
-   }
+    int blockSize = Util::Max2( packetSize, 1 );
+    vector<Ray> rays;
+    vector<int> pixelX, pixelY;
+
+    for ( int py = y0; py < y1; py += blockSize )
+        for ( int px = x0; px < x1; px += blockSize )
+            for ( int y = py; y < Util::Min2( py + blockSize, y1 ); y++ )
+                for ( int x = px; x < Util::Min2( px + blockSize, x1 ); x++ )
+                {
+                    rays.push_back( scene.camera.getRay( x + 0.5, y + 0.5 ) );
+                    pixelX.push_back( x );
+                    pixelY.push_back( y );
+                }
+
+    vector<Color> colors( rays.size() );
+    Raytrace::TraceWavefront( &rays[0], (int) rays.size(), scene, reflectLevels, hasShadow, &colors[0],
+                              sortMode, shadowCache );
+
+    for ( size_t k = 0; k < rays.size(); k++ )
+    {
+        Color pixelColor = colors[k];
+        pixelColor.clamp();
+        image.setPixel( pixelX[k], pixelY[k], pixelColor );
+    }
 }
 
 
+
 ///////////////////////////////////////////////////////////////////////////
 // Raytrace the whole image of the scene and write it to a file.
 ///////////////////////////////////////////////////////////////////////////
 
-void RenderImage( const char *imageFilename, const Scene &scene, int reflectLevels, bool hasShadow )
+void RenderImage( const char *imageFilename, const Scene &scene, int reflectLevels, bool hasShadow,
+                  int numThreads = numRenderThreads )
 {
     int imgWidth = scene.camera.getImageWidth();
     int imgHeight = scene.camera.getImageHeight();
@@ -105,36 +141,496 @@ void RenderImage( const char *imageFilename, const Scene &scene, int reflectLeve
     double startTime = Util::GetCurrRealTime();
     double startCPUTime = Util::GetCurrCPUTime();
 
-    // Generate image.
-    for ( int y = 0; y < imgHeight; y++ )
+    // Generate image, one tile per task. Every pixel is traced exactly as in
+    // a serial walk over the image, so the result does not depend on the
+    // number of threads.
+    int numTilesX = ( imgWidth + renderTileSize - 1 ) / renderTileSize;
+    int numTilesY = ( imgHeight + renderTileSize - 1 ) / renderTileSize;
+
+    // One shadow cache per thread, as the tiles of a thread are neighbours.
+    int numCaches = ( numThreads > 0 )? numThreads : Scheduler::HardwareThreads();
+    vector<ShadowCache> shadowCaches( numCaches, ShadowCache( scene.numPtLights ) );
+
+    Scheduler::Run( numTilesX * numTilesY, numThreads, [&]( int tile, int thread )
     {
-        double pixelPosY = y + 0.5;
+        ShadowCache *shadowCache = useShadowCache? &shadowCaches[thread] : NULL;
+
+        int x0 = ( tile % numTilesX ) * renderTileSize;
+        int y0 = ( tile / numTilesX ) * renderTileSize;
+        int x1 = Util::Min2( x0 + renderTileSize, imgWidth );
+        int y1 = Util::Min2( y0 + renderTileSize, imgHeight );
 
-        for ( int x = 0; x < imgWidth; x++ )
+        if ( wavefront )
         {
-            double pixelPosX = x + 0.5;
-            Ray ray = scene.camera.getRay( pixelPosX, pixelPosY );
-            Color pixelColor = Raytrace::TraceRay( ray, scene, reflectLevels, hasShadow );
-            pixelColor.clamp();
-            image.setPixel( x, y, pixelColor );
+            TraceTileWavefront( image, scene, x0, y0, x1, y1, reflectLevels, hasShadow, raySortMode, shadowCache );
+            return;
         }
-        // printf( "%d ", y );
-    }
+
+        if ( packetSize > 1 )
+        {
+            vector<Ray> rays( packetSize * packetSize );
+            vector<Color> colors( packetSize * packetSize );
+
+            for ( int py = y0; py < y1; py += packetSize )
+                for ( int px = x0; px < x1; px += packetSize )
+                {
+                    int w = Util::Min2( packetSize, x1 - px );
+                    int h = Util::Min2( packetSize, y1 - py );
+
+                    for ( int j = 0; j < h; j++ )
+                        for ( int i = 0; i < w; i++ )
+                            rays[ j * w + i ] = scene.camera.getRay( px + i + 0.5, py + j + 0.5 );
+
+                    Raytrace::TracePacket( &rays[0], w * h, scene, reflectLevels, hasShadow, &colors[0], shadowCache );
+
+                    for ( int j = 0; j < h; j++ )
+                        for ( int i = 0; i < w; i++ )
+                        {
+                            Color pixelColor = colors[ j * w + i ];
+                            pixelColor.clamp();
+                            image.setPixel( px + i, py + j, pixelColor );
+                        }
+                }
+            return;
+        }
+
+        for ( int y = y0; y < y1; y++ )
+        {
+            double pixelPosY = y + 0.5;
+
+            for ( int x = x0; x < x1; x++ )
+            {
+                double pixelPosX = x + 0.5;
+                Ray ray = scene.camera.getRay( pixelPosX, pixelPosY );
+                Color pixelColor = Raytrace::TraceRay( ray, scene, reflectLevels, hasShadow, shadowCache );
+                pixelColor.clamp();
+                image.setPixel( x, y, pixelColor );
+            }
+        }
+    } );
 
     double stopCPUTime = Util::GetCurrCPUTime();
     double stopTime = Util::GetCurrRealTime();
-    printf( "CPU time taken = %.1f sec\n", stopTime - startTime ); 
+    printf( "CPU time taken = %.1f sec\n", stopCPUTime - startCPUTime ); 
     printf( "Real time taken = %.1f sec\n", stopTime - startTime ); 
 
+    if ( useShadowCache && hasShadow )
+    {
+        for ( int t = 1; t < numCaches; t++ ) shadowCaches[0].addStats( shadowCaches[t] );
+        const ShadowCache &stats = shadowCaches[0];
+        printf( "Shadow cache: %lld of %lld shadow rays blocked, %lld (%.1f%%) of them by the last occluder, "
+                "which blocked %.1f%% of the rays it was tested on\n",
+                stats.numOccluded(), stats.numRays(), stats.numHits(),
+                100.0 * stats.numHits() / Util::Max2( stats.numOccluded(), 1LL ),
+                100.0 * stats.numHits() / Util::Max2( stats.numTested(), 1LL ) );
+    }
+
     // Write image to file.
     image.writeToFile( imageFilename );
 }
 
 
 
+///////////////////////////////////////////////////////////////////////////
+// Make the acceleration structure of width bvhWidth from a binary BVH,
+// which it takes over, and report on it.
+///////////////////////////////////////////////////////////////////////////
+
+Surface *WidenAccel( BVH *bvh, double startTime )
+{
+    if ( bvhWidth == 4 || bvhWidth == 8 )
+    {
+        Surface *accel;
+        int numNodes, numPrimitives, numUnbounded, nodeSize;
+        if ( bvhWidth == 4 )
+        {
+            BVH4 *wide = new BVH4( *bvh, bvhQuantized );
+            accel = wide;
+            numNodes = wide->numNodes();  numPrimitives = wide->numPrimitives();
+            numUnbounded = wide->numUnbounded();  nodeSize = wide->nodeSize();
+        }
+        else
+        {
+            BVH8 *wide = new BVH8( *bvh, bvhQuantized );
+            accel = wide;
+            numNodes = wide->numNodes();  numPrimitives = wide->numPrimitives();
+            numUnbounded = wide->numUnbounded();  nodeSize = wide->nodeSize();
+        }
+        delete bvh;
+
+        double stopTime = Util::GetCurrRealTime();
+        printf( "BVH%d built: %d nodes of %d bytes over %d primitives (%d unbounded) in %.2f sec\n",
+                bvhWidth, numNodes, nodeSize, numPrimitives, numUnbounded, stopTime - startTime );
+        return accel;
+    }
+
+    double stopTime = Util::GetCurrRealTime();
+    printf( "BVH built: %d nodes over %d primitives (%d unbounded) in %.2f sec\n",
+            bvh->numNodes(), bvh->numPrimitives(), bvh->numUnbounded(), stopTime - startTime );
+    return bvh;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Build an acceleration structure over the primitives of the surfaces.
+///////////////////////////////////////////////////////////////////////////
+
+Surface *NewAccel( const SurfacePtr *surfaces, int numSurfaces )
+{
+    double startTime = Util::GetCurrRealTime();
+
+    if ( accelType == ACCEL_KDTREE )
+    {
+        KdTree *kdTree = new KdTree( surfaces, numSurfaces );
+        double stopTime = Util::GetCurrRealTime();
+        printf( "Kd-tree built: %d nodes, %d leaves with %d primitive references (%d unbounded) in %.2f sec\n",
+                kdTree->numNodes(), kdTree->numLeaves(), kdTree->numReferences(), kdTree->numUnbounded(),
+                stopTime - startTime );
+        return kdTree;
+    }
+
+    if ( accelType == ACCEL_GRID )
+    {
+        Grid *grid = new Grid( surfaces, numSurfaces );
+        double stopTime = Util::GetCurrRealTime();
+        printf( "Grid built: %d x %d x %d cells, %d subgrids, %d cells in all over %d primitives (%d unbounded) in %.2f sec\n",
+                grid->resolution( 0 ), grid->resolution( 1 ), grid->resolution( 2 ), grid->numSubgrids(),
+                grid->numCells(), grid->numPrimitives(), grid->numUnbounded(), stopTime - startTime );
+        return grid;
+    }
+
+    BVHBuildOptions options;
+    options.method = bvhBuildMethod;
+    return WidenAccel( new BVH( surfaces, numSurfaces, options ), startTime );
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Load the model of an .obj file, in its own object space, and build an
+// acceleration structure over it. With useMeshCache, both are read from,
+// or else written to, the binary cache file of the model, which holds a
+// BVH and so is used for BVHs only.
+///////////////////////////////////////////////////////////////////////////
+
+void LoadModel( const char *objFilename, const Material *mat_ptr, TriangleMesh *&mesh, Surface *&accel )
+{
+    double startTime = Util::GetCurrRealTime();
+
+    BVHBuildOptions options;
+    options.method = bvhBuildMethod;
+
+    if ( useMeshCache && accelType == ACCEL_BVH )
+    {
+        BVH *bvh;
+        bool cacheHit;
+        if ( MeshCache::LoadObj( objFilename, Transform(), options, mat_ptr, mesh, bvh, cacheHit ) )
+        {
+            printf( "%s: mesh and BVH %s the cache\n", objFilename, cacheHit? "read from" : "written to" );
+            accel = WidenAccel( bvh, startTime );
+            return;
+        }
+    }
+
+    Obj obj;
+    obj.readfile( objFilename );
+    mesh = obj.makeMesh( Transform(), mat_ptr );
+    SurfacePtr surface = mesh;
+    accel = NewAccel( &surface, 1 );
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Build the acceleration structure over the surface primitives of the scene.
+// Over Instances, this is the top level, and each shared object has its
+// own structure (the bottom level), made by NewAccel when it is defined.
+// The Spheres, Planes and Triangles of the scene are traced as copies in
+// contiguous arrays; the other surfaces, such as Instances, in place.
+///////////////////////////////////////////////////////////////////////////
+
+void BuildAccel( Scene &scene )
+{
+    vector<SurfacePtr> surfaces;
+    PrimitiveArrays *primitives = new PrimitiveArrays( scene.surfacep, scene.numSurfaces, surfaces );
+    if ( primitives->numPrimitives() > 0 )
+        surfaces.insert( surfaces.begin(), primitives );
+    else
+        delete primitives;
+
+    scene.accel = NewAccel( surfaces.data(), (int) surfaces.size() );
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Build the light culler of the scene with useLightCulling, which shades
+// each hit with at most maxSamples lights, or else shade with all lights.
+// Then bound the paths of the scene for the lights that shade them.
+///////////////////////////////////////////////////////////////////////////
+
+void BuildLightCuller( Scene &scene, int maxSamples = maxLightSamples )
+{
+    scene.lightCuller = NULL;
+
+    if ( useLightCulling )
+    {
+        double startTime = Util::GetCurrRealTime();
+        LightCuller *culler = new LightCuller( scene, maxSamples );
+        scene.lightCuller = culler;
+
+        double stopTime = Util::GetCurrRealTime();
+        printf( "Light BVH built: %d nodes over %d lights (%d reach everywhere, %d too dim to see) in %.3f sec\n",
+                culler->numNodes(), culler->numLights(), culler->numGlobal(), culler->numCulled(), stopTime - startTime );
+    }
+
+    Raytrace::BoundPaths( scene );
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Bring an acceleration structure made by NewAccel up to date after its
+// primitives have moved: refit it, or rebuild it if refitting has
+// degraded it too much.
+///////////////////////////////////////////////////////////////////////////
+
+template <class Accel>
+bool UpdateAccelOfType( Surface *accel, bool &rebuilt, double &costGrowth )
+{
+    Accel *a = dynamic_cast<Accel *>( accel );
+    if ( a == NULL ) return false;
+    rebuilt = a->refitOrRebuild( accelMaxCostGrowth );
+    costGrowth = ( a->builtSahCost() > 0.0 )? a->sahCost() / a->builtSahCost() : 1.0;
+    return true;
+}
+
+
+void UpdateAccel( Surface *accel )
+{
+    double startTime = Util::GetCurrRealTime();
+
+    // Kd-trees and grids cannot be refit, and grids are cheap to rebuild.
+    KdTree *kdTree = dynamic_cast<KdTree *>( accel );
+    Grid *grid = dynamic_cast<Grid *>( accel );
+    if ( kdTree != NULL || grid != NULL )
+    {
+        if ( kdTree != NULL ) kdTree->rebuild();
+        if ( grid != NULL ) grid->rebuild();
+        printf( "%s rebuilt in %.3f sec\n", ( kdTree != NULL )? "Kd-tree" : "Grid", Util::GetCurrRealTime() - startTime );
+        return;
+    }
+
+    bool rebuilt = false;
+    double costGrowth = 1.0;
+    if ( !UpdateAccelOfType<BVH>( accel, rebuilt, costGrowth ) &&
+         !UpdateAccelOfType<BVH4>( accel, rebuilt, costGrowth ) )
+        UpdateAccelOfType<BVH8>( accel, rebuilt, costGrowth );
+
+    double stopTime = Util::GetCurrRealTime();
+    printf( "BVH %s in %.3f sec, SAH cost %.2f times that when built\n",
+            rebuilt? "rebuilt" : "refit", stopTime - startTime, costGrowth );
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Render the frames of an animation of the scene, one image file per
+// frame. Before each frame, animate moves the surfaces of the scene and
+// updates the acceleration structures over those that moved, so the
+// scene and its structures are reused from frame to frame.
+///////////////////////////////////////////////////////////////////////////
+
+typedef void (*AnimateFunc)( Scene &scene, int frame, int numFrames );
+
+void RenderAnimation( const char *imageFilePattern, Scene &scene, int numFrames, AnimateFunc animate,
+                      int reflectLevels, bool hasShadow )
+{
+    for ( int frame = 0; frame < numFrames; frame++ )
+    {
+        animate( scene, frame, numFrames );
+
+        char imageFilename[256];
+        sprintf( imageFilename, imageFilePattern, frame );
+        printf( "Render frame %d...\n", frame );
+        RenderImage( imageFilename, scene, reflectLevels, hasShadow );
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Counts the cache misses of the process, and of the threads it starts,
+// with the hardware counter of the CPU where the OS gives access to it.
+///////////////////////////////////////////////////////////////////////////
+
+class CacheMissCounter
+{
+public:
+
+    CacheMissCounter() : mFd( -1 )
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset( &attr, 0, sizeof( attr ) );
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof( attr );
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        mFd = (int) syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+#endif
+    }
+
+    ~CacheMissCounter()
+    {
+#ifdef __linux__
+        if ( mFd >= 0 ) close( mFd );
+#endif
+    }
+
+    bool available() const { return mFd >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        if ( mFd < 0 ) return;
+        ioctl( mFd, PERF_EVENT_IOC_RESET, 0 );
+        ioctl( mFd, PERF_EVENT_IOC_ENABLE, 0 );
+#endif
+    }
+
+    // Returns the misses since start(), or -1 if not available.
+    long long stop()
+    {
+        long long count = -1;
+#ifdef __linux__
+        if ( mFd < 0 ) return -1;
+        ioctl( mFd, PERF_EVENT_IOC_DISABLE, 0 );
+        if ( read( mFd, &count, sizeof( count ) ) != sizeof( count ) ) count = -1;
+#endif
+        return count;
+    }
+
+private:
+
+    int mFd;
+
+}; // CacheMissCounter
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Time the wavefront renderer on the scene with each ray sort mode, for
+// reflectLevels from 2 to 8. Tiles of renderTileSize and of four times
+// that are tried, as larger batches of rays get finer Morton codes.
+///////////////////////////////////////////////////////////////////////////
+
+void BenchRaySort( const Scene &scene, bool hasShadow )
+{
+    static const RaySortMode modes[] = { RAY_SORT_NONE, RAY_SORT_OCTANT, RAY_SORT_MORTON };
+    static const char *modeNames[] = { "none", "octant", "morton" };
+    const int numModes = 3;
+
+    int imgWidth = scene.camera.getImageWidth();
+    int imgHeight = scene.camera.getImageHeight();
+    Image image( imgWidth, imgHeight );
+
+    CacheMissCounter counter;
+    if ( !counter.available() ) printf( "No access to the cache miss counter of the CPU.\n" );
+
+    printf( "%5s %8s %7s %9s %8s %14s %8s\n", "tile", "reflect", "sort", "time (s)", "speedup",
+            "cache misses", "ratio" );
+
+    for ( int tileSize = renderTileSize; tileSize <= 4 * renderTileSize; tileSize *= 4 )
+    {
+        int numTilesX = ( imgWidth + tileSize - 1 ) / tileSize;
+        int numTilesY = ( imgHeight + tileSize - 1 ) / tileSize;
+
+        for ( int reflectLevels = 2; reflectLevels <= 8; reflectLevels++ )
+        {
+            double baseTime = 0.0;
+            long long baseMisses = 0;
+
+            for ( int m = 0; m < numModes; m++ )
+            {
+                counter.start();
+                double startTime = Util::GetCurrRealTime();
+
+                Scheduler::Run( numTilesX * numTilesY, numRenderThreads, [&]( int tile, int )
+                {
+                    int x0 = ( tile % numTilesX ) * tileSize;
+                    int y0 = ( tile / numTilesX ) * tileSize;
+                    TraceTileWavefront( image, scene, x0, y0, Util::Min2( x0 + tileSize, imgWidth ),
+                                        Util::Min2( y0 + tileSize, imgHeight ), reflectLevels, hasShadow, modes[m], NULL );
+                } );
+
+                double time = Util::GetCurrRealTime() - startTime;
+                long long misses = counter.stop();
+                if ( m == 0 ) { baseTime = time;  baseMisses = misses; }
+
+                printf( "%5d %8d %7s %9.3f %8.2f", tileSize, reflectLevels, modeNames[m], time, baseTime / time );
+                if ( misses >= 0 && baseMisses > 0 )
+                    printf( " %14lld %8.2f\n", misses, (double) misses / baseMisses );
+                else
+                    printf( " %14s %8s\n", "-", "-" );
+            }
+        }
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Light Scene 2 with numLights small point lights scattered over the room,
+// and render it with every light, with the lights culled, and with at most
+// 16 of them picked per hit, into lights_all.png, lights_culled.png and
+// lights_sampled.png. The shadow cache counts the shadow rays.
+///////////////////////////////////////////////////////////////////////////
+
+void BenchManyLights( Scene &scene, bool hasShadow, int numLights )
+{
+    delete [] scene.ptLight;
+    scene.numPtLights = numLights;
+    scene.ptLight = new PointLightSource[ numLights ];
+
+    srand( 1 );
+    for ( int i = 0; i < numLights; i++ )
+    {
+        PointLightSource &light = scene.ptLight[i];
+        light.position = Vector3d( Util::UniformRandom( -5.0, 110.0 ), Util::UniformRandom( 5.0, 60.0 ),
+                                   Util::UniformRandom( 5.0, 110.0 ) );
+        light.I_source = Color( (float) Util::UniformRandom( 0.2, 1.0 ), (float) Util::UniformRandom( 0.2, 1.0 ),
+                                (float) Util::UniformRandom( 0.2, 1.0 ) ) * 0.15f;
+        light.radius = Util::UniformRandom( 10.0, 25.0 );
+    }
+
+    printf( "%d lights, every light:\n", numLights );
+    scene.lightCuller = NULL;
+    Raytrace::BoundPaths( scene );
+    RenderImage( "lights_all.png", scene, reflectLevels2, hasShadow );
+
+    printf( "%d lights, culled:\n", numLights );
+    BuildLightCuller( scene, 0 );
+    RenderImage( "lights_culled.png", scene, reflectLevels2, hasShadow );
+    delete scene.lightCuller;
+
+    printf( "%d lights, culled, at most 16 per hit:\n", numLights );
+    BuildLightCuller( scene, 16 );
+    RenderImage( "lights_sampled.png", scene, reflectLevels2, hasShadow );
+    delete scene.lightCuller;
+    scene.lightCuller = NULL;
+}
+
+
+
 // Forward declarations. These functions are defined later in the file.
 void DefineScene1( Scene &scene, int imageWidth, int imageHeight );
 void DefineScene2( Scene &scene, int imageWidth, int imageHeight );
+void AnimateScene2( Scene &scene, int frame, int numFrames );
 
 
 
@@ -150,11 +646,36 @@ int main()
 {
     atexit( WaitForEnterKeyBeforeExit );
 
+    Triangle::watertight = watertightTriangles;
+    Raytrace::pathEnd = pathEnd;
+    printf( "Triangle kernel: %s\n", Simd::LevelName( TriangleKernel::Level() ) );
+
+    if ( benchRaySort )
+    {
+        Scene scene2;
+        DefineScene2( scene2, imageWidth2, imageHeight2 );
+        BuildAccel( scene2 );
+        BuildLightCuller( scene2 );
+        BenchRaySort( scene2, hasShadow2 );
+        return 0;
+    }
+
+    if ( benchManyLights )
+    {
+        Scene scene2;
+        DefineScene2( scene2, imageWidth2 / 4, imageHeight2 / 4 );
+        BuildAccel( scene2 );
+        BenchManyLights( scene2, hasShadow2, numBenchLights );
+        return 0;
+    }
+
 
 // Define Scene 1.
 
     Scene scene1;
     DefineScene1( scene1, imageWidth1, imageHeight1 );
+    BuildAccel( scene1 );
+    BuildLightCuller( scene1 );
 
 // Render Scene 1.
 
@@ -168,6 +689,8 @@ int main()
 
     Scene scene2;
     DefineScene2( scene2, imageWidth2, imageHeight2 );
+    BuildAccel( scene2 );
+    BuildLightCuller( scene2 );
 
 // Render Scene 2.
  
@@ -175,6 +698,15 @@ int main()
     RenderImage( outImageFile2, scene2, reflectLevels2, hasShadow2 );
     printf( "Image completed.\n" );
 
+// Animate Scene 2.
+
+    if ( numFrames2 > 0 )
+    {
+        printf( "Render animation of Scene 2...\n" );
+        RenderAnimation( animImageFile2, scene2, numFrames2, AnimateScene2, reflectLevels2, hasShadow2 );
+        printf( "Animation completed.\n" );
+    }
+
 
     printf( "All done.\n" );
     return 0;
@@ -300,6 +832,18 @@ void DefineScene1( Scene &scene, int imageWidth, int imageHeight )
 
 
 
+// The parts of Scene 2 that move in its animation, set by DefineScene2.
+static struct
+{
+    TriangleMesh *teddyMesh;
+    vector<Vector3d> teddyRest;  // Vertices of the teddy bear at rest.
+    Surface *teddyAccel;
+    Instance *teaPot;
+    Transform teaPotPlacement;
+} scene2Moving;
+
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Modeling of Scene 2.
 ///////////////////////////////////////////////////////////////////////////
@@ -314,14 +858,6 @@ void DefineScene2( Scene &scene, int imageWidth, int imageHeight )
         scene.backgroundColor = Color( 0.5f, 0.5f, 0.9f );
         scene.amLight.I_a = Color( 0.5f, 0.5f, 1.0f ) * 0.25f;
     
-        //Intilize 3D Objects
-        Obj teddy;
-        //Obj Cow;
-        Obj teaPot;
-        teddy.readfile("Teddy.obj");
-       // Cow.readfile("Cow.obj");
-        teaPot.readfile("Teapot.obj");
-    
         // Define materials.
 
         scene.numMaterials = 9;
@@ -406,8 +942,8 @@ void DefineScene2( Scene &scene, int imageWidth, int imageHeight )
 
         // Define surface primitives.
 
-        scene.numSurfaces = 19 ;
-        scene.surfacep = new SurfacePtr[ teddy.faces.size() +teaPot.faces.size() + scene.numSurfaces ];
+        scene.numSurfaces = 21;
+        scene.surfacep = new SurfacePtr[ scene.numSurfaces ];
     
         //define the room
     
@@ -448,30 +984,25 @@ void DefineScene2( Scene &scene, int imageWidth, int imageHeight )
         scene.surfacep[18] = new Sphere( Vector3d( 40, 35, 90 ), 3.0, &(scene.material[3]) );
     
         
-        //Teddy bear using triangles
-       for(int i=0;i<teddy.faces.size();i++)
-       {
-          vertex v1 = teddy.vertexes[teddy.faces[i].v1 - 1];
-          vertex v2 =  teddy.vertexes[teddy.faces[i].v2 - 1];
-          vertex v3 =  teddy.vertexes[teddy.faces[i].v3 - 1];
-
-          scene.surfacep[ i + 19 ] = new Triangle( Vector3d( v1.x+ 30.0, v1.y + 20.0, v1.z + 6), Vector3d( v2.x+ 30.0, v2.y + 20.0, v2.z + 6 ), Vector3d( v3.x + 30.0, v3.y+  20.0, v3.z + 6), &(scene.material[8]) );
-           scene.numSurfaces++;
-           
-       }
+        //Teddy bear as an instance of a triangle mesh
+        TriangleMesh *teddyMesh;
+        Surface *teddyAccel;
+        LoadModel( "Teddy.obj", &(scene.material[8]), teddyMesh, teddyAccel );
+        scene.surfacep[19] = new Instance( teddyAccel, Transform::Translate( Vector3d( 30.0, 20.0, 6.0 ) ) );
     
-        
-        //teap pot with triangles
-       for(int i=0;i<teaPot.faces.size();i++)
-        {
-           vertex v1 = teaPot.vertexes[teaPot.faces[i].v1 - 1];
-           vertex v2 =  teaPot.vertexes[teaPot.faces[i].v2 - 1];
-           vertex v3 =  teaPot.vertexes[teaPot.faces[i].v3 - 1];
-
-           scene.surfacep[ i + 19 + teddy.faces.size()] = new Triangle( Vector3d( 4*v1.x + 40, 4*v1.y + 21 , 4*v1.z + 70), Vector3d( 4*v2.x + 40, 4*v2.y + 21, 4*v2.z + 70), Vector3d( 4*v3.x + 40, 4*v3.y + 21, 4*v3.z + 70), &(scene.material[5]) );
-            scene.numSurfaces++;
-            
-        }
+        //tea pot as an instance of a triangle mesh
+        TriangleMesh *teaPotMesh;
+        Surface *teaPotAccel;
+        LoadModel( "Teapot.obj", &(scene.material[5]), teaPotMesh, teaPotAccel );
+        Transform teaPotPlacement = Transform::Translate( Vector3d( 40.0, 21.0, 70.0 ) ) * Transform::Scale( 4.0 );
+        Instance *teaPotInstance = new Instance( teaPotAccel, teaPotPlacement );
+        scene.surfacep[20] = teaPotInstance;
+
+        scene2Moving.teddyMesh = teddyMesh;
+        scene2Moving.teddyRest = teddyMesh->vertices;
+        scene2Moving.teddyAccel = teddyAccel;
+        scene2Moving.teaPot = teaPotInstance;
+        scene2Moving.teaPotPlacement = teaPotPlacement;
          
 
      
@@ -483,3 +1014,33 @@ void DefineScene2( Scene &scene, int imageWidth, int imageHeight )
     
 }
 
+
+
+///////////////////////////////////////////////////////////////////////////
+// Animation of Scene 2: the teapot turns once about its vertical axis,
+// which moves its Instance, and the teddy bear breathes, which moves the
+// vertices of its mesh.
+///////////////////////////////////////////////////////////////////////////
+
+void AnimateScene2( Scene &scene, int frame, int numFrames )
+{
+    double phase = 2.0 * M_PI * frame / numFrames;
+
+    scene2Moving.teaPot->setTransform( scene2Moving.teaPotPlacement
+                                       * Transform::Rotate( Vector3d( 0.0, 1.0, 0.0 ), phase ) );
+
+    // The belly swells, most at its middle and not at all at the head.
+    const double bellyY = -8.0, bellyHalfHeight = 12.0;
+    double swell = 0.06 * sin( phase );
+    vector<Vector3d> &vertices = scene2Moving.teddyMesh->vertices;
+    for ( size_t i = 0; i < vertices.size(); i++ )
+    {
+        const Vector3d &v = scene2Moving.teddyRest[i];
+        double w = Util::Max2( 0.0, 1.0 - fabs( v.y() - bellyY ) / bellyHalfHeight );
+        double s = 1.0 + swell * w;
+        vertices[i].setXYZ( s * v.x(), v.y(), s * v.z() );
+    }
+
+    UpdateAccel( scene2Moving.teddyAccel );
+    UpdateAccel( scene.accel );
+}
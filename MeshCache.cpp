@@ -0,0 +1,342 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid  _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "Obj.h"
+#include "MeshCache.h"
+
+using namespace std;
+
+
+#define MESH_CACHE_SUFFIX   ".bvhcache"
+
+// Must change whenever the layout of the file or of anything stored in it
+// changes, or the build gives a different tree for the same options.
+#define MESH_CACHE_VERSION  1
+
+// Alignment of every array in the file.
+#define MESH_CACHE_ALIGN    64
+
+
+
+struct MeshCacheHeader
+{
+    char magic[8];          // "MESHBVH".
+    uint32_t version;
+    uint32_t vertexSize;    // Sizes of the stored types, which must match
+    uint32_t nodeSize;      // those of the program reading the file.
+    uint32_t packetSize;
+    uint64_t key;
+    uint64_t numVertices;
+    uint64_t numIndices;
+    uint64_t numNodes;
+    uint64_t numPrims;      // Stored as the int32 index of each triangle. An
+                            // SBVH may reference a triangle more than once.
+    uint64_t numPackets;
+    int32_t maxLeafSize;
+    int32_t reserved;
+};
+
+
+// Offsets of the arrays in the file.
+struct MeshCacheLayout
+{
+    size_t vertices, indices, nodes, prims, packets, end;
+
+    MeshCacheLayout( const MeshCacheHeader &h )
+    {
+        vertices = align( sizeof( MeshCacheHeader ) );
+        indices = align( vertices + h.numVertices * h.vertexSize );
+        nodes = align( indices + h.numIndices * sizeof( uint32_t ) );
+        prims = align( nodes + h.numNodes * h.nodeSize );
+        packets = align( prims + h.numPrims * sizeof( int32_t ) );
+        end = packets + h.numPackets * h.packetSize;
+    }
+
+    static size_t align( size_t offset )
+        { return ( offset + MESH_CACHE_ALIGN - 1 ) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN; }
+};
+
+
+
+// A read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+
+    MappedFile() : data( NULL ), size( 0 ) {}
+
+    ~MappedFile()
+    {
+        if ( data == NULL ) return;
+#ifdef _WIN32
+        UnmapViewOfFile( data );
+#else
+        munmap( (void *) data, size );
+#endif
+    }
+
+    bool open( const char *filename )
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL, NULL );
+        if ( file == INVALID_HANDLE_VALUE ) return false;
+
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = NULL;
+        if ( GetFileSizeEx( file, &fileSize ) && fileSize.QuadPart > 0 )
+            mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+        if ( mapping != NULL )
+        {
+            data = (const unsigned char *) MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+            size = ( data != NULL )? (size_t) fileSize.QuadPart : 0;
+            CloseHandle( mapping );
+        }
+        CloseHandle( file );
+#else
+        int fd = ::open( filename, O_RDONLY );
+        if ( fd < 0 ) return false;
+
+        struct stat st;
+        if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+        {
+            void *p = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( p != MAP_FAILED )
+            {
+                data = (const unsigned char *) p;
+                size = (size_t) st.st_size;
+            }
+        }
+        close( fd );
+#endif
+        return data != NULL;
+    }
+
+    const unsigned char *data;
+    size_t size;
+};
+
+
+
+// 64-bit hash of the bytes, eight at a time, continuing from h.
+static uint64_t hashBytes( uint64_t h, const void *bytes, size_t size )
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    const unsigned char *p = (const unsigned char *) bytes;
+
+    for ( ; size >= 8; p += 8, size -= 8 )
+    {
+        uint64_t w;
+        memcpy( &w, p, 8 );
+        h = ( h ^ w ) * prime;
+        h ^= h >> 29;
+    }
+    for ( ; size > 0; p++, size-- ) h = ( h ^ *p ) * prime;
+    return h;
+}
+
+
+
+// Copies n elements of type T from the file at offset.
+template <class T>
+static void copyArray( vector<T> &v, const unsigned char *data, size_t offset, size_t n )
+{
+    v.resize( n );
+    if ( n > 0 ) memcpy( (void *) &v[0], data + offset, n * sizeof( T ) );
+}
+
+
+// Writes n elements of type T at the next aligned offset after pos, the
+// current size of the file, and updates pos.
+template <class T>
+static void writeArray( FILE *fp, size_t &pos, const T *p, size_t n )
+{
+    static const char zeros[ MESH_CACHE_ALIGN ] = { 0 };
+    size_t start = MeshCacheLayout::align( pos );
+    fwrite( zeros, 1, start - pos, fp );
+    if ( n > 0 ) fwrite( p, sizeof( T ), n, fp );
+    pos = start + n * sizeof( T );
+}
+
+
+
+bool MeshCache::LoadObj( const char *objFilename, const Transform &transform,
+                         const BVHBuildOptions &options, const Material *mat_ptr,
+                         TriangleMesh *&mesh, BVH *&bvh, bool &cacheHit )
+{
+    // The number of threads does not change the tree.
+    uint64_t key = 0xcbf29ce484222325ULL;
+    {
+        MappedFile source;
+        if ( !source.open( objFilename ) ) return false;
+        key = hashBytes( key, source.data, source.size );
+    }
+    int32_t params[4] = { MESH_CACHE_VERSION, (int32_t) options.method, options.maxLeafSize, options.rotate };
+    key = hashBytes( key, transform.m, sizeof( transform.m ) );
+    key = hashBytes( key, params, sizeof( params ) );
+    key = hashBytes( key, &options.splitBudget, sizeof( options.splitBudget ) );
+
+    string cacheFilename = string( objFilename ) + MESH_CACHE_SUFFIX;
+    cacheHit = ReadCache( cacheFilename.c_str(), key, options, mat_ptr, mesh, bvh );
+    if ( cacheHit ) return true;
+
+    Obj obj;
+    obj.readfile( objFilename );
+    if ( obj.faces.empty() ) return false;
+
+    mesh = obj.makeMesh( transform, mat_ptr );
+    SurfacePtr surface = mesh;
+    bvh = new BVH( &surface, 1, options );
+
+    WriteCache( cacheFilename.c_str(), key, *mesh, *bvh );
+    return true;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Reads the mesh and BVH from the cache file, if it exists and matches the
+// key and this program. The file is checked to be whole and its indices in
+// range, so a damaged file is rebuilt rather than crashing the program.
+//////////////////////////////////////////////////////////////////////////////
+
+bool MeshCache::ReadCache( const char *filename, uint64_t key, const BVHBuildOptions &options,
+                           const Material *mat_ptr, TriangleMesh *&mesh, BVH *&bvh )
+{
+    MappedFile file;
+    if ( !file.open( filename ) || file.size < sizeof( MeshCacheHeader ) ) return false;
+
+    MeshCacheHeader h;
+    memcpy( &h, file.data, sizeof( h ) );
+    if ( memcmp( h.magic, "MESHBVH", 8 ) != 0 || h.version != MESH_CACHE_VERSION || h.key != key ||
+         h.vertexSize != sizeof( Vector3d ) || h.nodeSize != sizeof( BVH::Node ) ||
+         h.packetSize != sizeof( TrianglePacket ) || h.numIndices % 3 != 0 ||
+         h.numPrims < h.numIndices / 3 || h.numVertices > UINT32_MAX || h.numPrims > INT32_MAX ||
+         h.numNodes > file.size || h.numPackets > file.size || h.maxLeafSize > BVH_MAX_LEAF_SIZE )
+        return false;
+
+    MeshCacheLayout layout( h );
+    if ( layout.end > file.size ) return false;
+
+    TriangleMesh *m = new TriangleMesh( mat_ptr );
+    copyArray( m->vertices, file.data, layout.vertices, h.numVertices );
+    copyArray( m->indices, file.data, layout.indices, h.numIndices );
+
+    BVH *b = new BVH();
+    copyArray( b->mNodes, file.data, layout.nodes, h.numNodes );
+    copyArray( b->mPackets, file.data, layout.packets, h.numPackets );
+
+    bool valid = true;
+    for ( size_t i = 0; i < m->indices.size(); i++ )
+        if ( m->indices[i] >= h.numVertices ) valid = false;
+
+    // The primitives are made straight from the indices in the mapping.
+    b->mPrims.resize( h.numPrims );
+    for ( size_t i = 0; i < h.numPrims; i++ )
+    {
+        int32_t primIndex;
+        memcpy( &primIndex, file.data + layout.prims + i * sizeof( int32_t ), sizeof( int32_t ) );
+        if ( primIndex < 0 || (uint64_t) primIndex >= h.numIndices / 3 ) valid = false;
+        b->mPrims[i].surface = m;
+        b->mPrims[i].index = primIndex;
+    }
+
+    for ( size_t i = 0; i < b->mNodes.size(); i++ )
+    {
+        const BVH::Node &node = b->mNodes[i];
+        int numPackets = ( node.numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+        if ( node.count == 0 )
+            valid = valid && node.offset > (int) i && (uint64_t) node.offset < h.numNodes && i + 1 < h.numNodes;
+        else
+            valid = valid && node.count > 0 && node.count <= BVH_MAX_LEAF_SIZE && node.offset >= 0 &&
+                    (uint64_t)( node.offset + node.count ) <= h.numPrims && node.numTriangles <= node.count &&
+                    node.packetOffset >= 0 && (uint64_t)( node.packetOffset + numPackets ) <= h.numPackets;
+    }
+
+    if ( !valid )
+    {
+        delete b;
+        delete m;
+        return false;
+    }
+
+    b->matp = NULL;
+    b->mSurfaces.assign( 1, m );
+    b->mOptions = options;
+    b->mMaxLeafSize = h.maxLeafSize;
+    b->mBuiltSahCost = b->sahCost();
+
+    mesh = m;
+    bvh = b;
+    return true;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Writes the mesh and its BVH to the cache file. The file is written under
+// a temporary name of its own and then renamed over the old one, so a reader finds
+// either the old file or the new one, never a half-written one or none.
+// Only Windows needs the old file removed first, as its rename() does not
+// replace an existing file.
+//////////////////////////////////////////////////////////////////////////////
+
+bool MeshCache::WriteCache( const char *filename, uint64_t key, const TriangleMesh &mesh, const BVH &bvh )
+{
+    MeshCacheHeader h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, "MESHBVH", 8 );
+    h.version = MESH_CACHE_VERSION;
+    h.vertexSize = sizeof( Vector3d );
+    h.nodeSize = sizeof( BVH::Node );
+    h.packetSize = sizeof( TrianglePacket );
+    h.key = key;
+    h.numVertices = mesh.vertices.size();
+    h.numIndices = mesh.indices.size();
+    h.numNodes = bvh.mNodes.size();
+    h.numPrims = bvh.mPrims.size();
+    h.numPackets = bvh.mPackets.size();
+    h.maxLeafSize = bvh.mMaxLeafSize;
+
+    vector<int32_t> primIndices( bvh.mPrims.size() );
+    for ( size_t i = 0; i < primIndices.size(); i++ ) primIndices[i] = bvh.mPrims[i].index;
+
+    // Named after the process, so two runs writing the cache at once each
+    // write their own file, and the last rename wins whole.
+    char suffix[32];
+    sprintf( suffix, ".%d.tmp", (int) getpid() );
+    string tempFilename = string( filename ) + suffix;
+    FILE *fp = fopen( tempFilename.c_str(), "wb" );
+    if ( fp == NULL ) return false;
+
+    size_t pos = 0;
+    writeArray( fp, pos, &h, 1 );
+    writeArray( fp, pos, mesh.vertices.data(), mesh.vertices.size() );
+    writeArray( fp, pos, mesh.indices.data(), mesh.indices.size() );
+    writeArray( fp, pos, bvh.mNodes.data(), bvh.mNodes.size() );
+    writeArray( fp, pos, primIndices.data(), primIndices.size() );
+    writeArray( fp, pos, bvh.mPackets.data(), bvh.mPackets.size() );
+
+    bool ok = !ferror( fp );
+    ok = ( fclose( fp ) == 0 ) && ok;
+
+#ifdef _WIN32
+    if ( ok ) remove( filename );
+#endif
+    if ( !ok || rename( tempFilename.c_str(), filename ) != 0 )
+    {
+        remove( tempFilename.c_str() );
+        return false;
+    }
+    return true;
+}
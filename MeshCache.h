@@ -0,0 +1,57 @@
+#ifndef _MESHCACHE_H_
+#define _MESHCACHE_H_
+
+#include <cstdint>
+#include "Material.h"
+#include "Transform.h"
+#include "TriangleMesh.h"
+#include "BVH.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Binary cache of the triangle mesh of an .obj file and of the BVH built
+// over it, so that later runs skip both the text parsing and the build.
+//
+// The cache of "model.obj" is the file "model.obj.bvhcache". It holds the
+// vertices, the indices, the BVH nodes, the primitive order and the packed
+// triangles, each as a raw array aligned to a cache line, after a header
+// with a format version and a key. The key is a hash of the bytes of the
+// .obj file, the transform applied to its vertices, the build options and
+// the version. A cache whose key, version or layout does not match is
+// rebuilt and overwritten.
+//
+// The cache is memory-mapped, and the arrays are copied out of the mapping
+// in bulk into the mesh and the BVH, which own them and may refit them.
+// Loading thus skips the parsing and the build, but not a pass over the
+// whole file, and until the mapping is released at the end of the load,
+// the file is held twice: once in the copies and once in the page cache.
+// Tracing straight from the mapping would need the mesh and the BVH to
+// borrow their arrays rather than own them.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class MeshCache
+{
+public:
+
+    // Makes the mesh of the .obj file, with every vertex v placed at
+    // transform.point( v ), and a BVH over it. They are read from the
+    // cache if it matches, else made and written to the cache. cacheHit
+    // tells which. Returns false if the .obj file cannot be read.
+    static bool LoadObj( const char *objFilename, const Transform &transform,
+                         const BVHBuildOptions &options, const Material *mat_ptr,
+                         TriangleMesh *&mesh, BVH *&bvh, bool &cacheHit );
+
+
+private:
+
+    static bool ReadCache( const char *filename, uint64_t key, const BVHBuildOptions &options,
+                           const Material *mat_ptr, TriangleMesh *&mesh, BVH *&bvh );
+
+    static bool WriteCache( const char *filename, uint64_t key, const TriangleMesh &mesh, const BVH &bvh );
+
+}; // MeshCache
+
+
+#endif // _MESHCACHE_H_
@@ -0,0 +1,71 @@
+#include <fstream>
+#include <string>
+#include "Obj.h"
+
+using namespace std;
+
+
+//method to read in Obj files
+void Obj::readfile(const char *filename)
+{
+   string s;
+   ifstream fin(filename);
+   if(!fin)
+         return;
+   while(fin>>s)
+   {
+         switch(*s.c_str())
+         {
+         case 'v':
+              {
+                    vertex v;
+                    fin>>v.x>>v.y>>v.z;
+                    this->vertexes.push_back(v);
+              }
+              break;
+         case 'f':
+              {
+                    face f;
+                    fin>>f.v1>>f.v2>>f.v3;
+               
+                    faces.push_back(f);
+              }
+              break;
+         }
+   }
+}
+
+
+//method to make a triangle mesh of the Obj, with every vertex v
+//placed at scale * v + offset
+TriangleMesh *Obj::makeMesh(double scale, const Vector3d &offset, const Material *mat_ptr) const
+{
+   TriangleMesh *mesh = new TriangleMesh(mat_ptr);
+   mesh->vertices.reserve(vertexes.size());
+   mesh->indices.reserve(3 * faces.size());
+
+   for(size_t i = 0; i < vertexes.size(); i++)
+   {
+         const vertex &v = vertexes[i];
+         mesh->vertices.push_back(Vector3d(scale*v.x + offset.x(), scale*v.y + offset.y(), scale*v.z + offset.z()));
+   }
+   //obj indices start from 1
+   for(size_t i = 0; i < faces.size(); i++)
+   {
+         mesh->indices.push_back(faces[i].v1 - 1);
+         mesh->indices.push_back(faces[i].v2 - 1);
+         mesh->indices.push_back(faces[i].v3 - 1);
+   }
+   return mesh;
+}
+
+
+//method to make a triangle mesh of the Obj, with every vertex v
+//placed at transform.point(v)
+TriangleMesh *Obj::makeMesh(const Transform &transform, const Material *mat_ptr) const
+{
+   TriangleMesh *mesh = makeMesh(1.0, Vector3d(0.0, 0.0, 0.0), mat_ptr);
+   for(size_t i = 0; i < mesh->vertices.size(); i++)
+         mesh->vertices[i] = transform.point(mesh->vertices[i]);
+   return mesh;
+}
@@ -0,0 +1,39 @@
+#ifndef _OBJ_H_
+#define _OBJ_H_
+
+#include <vector>
+#include "Vector3d.h"
+#include "Material.h"
+#include "TriangleMesh.h"
+#include "Transform.h"
+
+struct Scene;
+
+
+// vertex definition for 3D objects
+struct vertex{
+       double x;
+       double y;
+       double z;
+  };
+
+// face definition for 3D objectts
+struct face{
+      unsigned int v1,v2,v3;
+};
+
+//obj class
+class Obj
+{
+public:
+   std::vector<vertex> vertexes;
+   std::vector<face> faces;
+    
+  void readfile(const char* filename);
+  void draw(Scene &scene);
+  TriangleMesh *makeMesh(double scale, const Vector3d &offset, const Material *mat_ptr) const;
+  TriangleMesh *makeMesh(const Transform &transform, const Material *mat_ptr) const;
+};
+
+
+#endif // _OBJ_H_
@@ -0,0 +1,109 @@
+#include <cstring>
+#include "PhongKernel.h"
+
+using namespace std;
+
+
+// The scalar kernels, one lane at a time.
+
+namespace
+{
+    typedef float vfloat;
+    typedef bool vmask;
+
+    const int VLANES = 1;
+
+    inline vfloat vset1( float x ) { return x; }
+    inline vfloat vload( const float *p ) { return *p; }
+    inline void vstore( float *p, vfloat a ) { *p = a; }
+    inline vfloat vmax( vfloat a, vfloat b ) { return ( a > b )? a : b; }
+    inline vfloat vround( vfloat a ) { return (float)(int)( a + ( ( a < 0.0f )? -0.5f : 0.5f ) ); }
+    inline vfloat vselect( vmask m, vfloat a, vfloat b ) { return m? a : b; }
+    inline vmask vgt( vfloat a, vfloat b ) { return a > b; }
+    inline bool vany( vmask m ) { return m; }
+
+    inline vfloat vmantissa( vfloat a )
+    {
+        unsigned bits;
+        memcpy( &bits, &a, sizeof( bits ) );
+        bits = ( bits & 0x007FFFFFu ) | 0x3F800000u;
+        memcpy( &a, &bits, sizeof( bits ) );
+        return a;
+    }
+
+    inline vfloat vexponent( vfloat a )
+    {
+        unsigned bits;
+        memcpy( &bits, &a, sizeof( bits ) );
+        return (float)( (int)( bits >> 23 ) - 127 );
+    }
+
+    inline vfloat vexp2i( vfloat a )
+    {
+        unsigned bits = (unsigned)( (int) a + 127 ) << 23;
+        float r;
+        memcpy( &r, &bits, sizeof( bits ) );
+        return r;
+    }
+
+    #include "PhongKernelImpl.h"
+}
+
+
+
+const PhongKernelSet PhongKernel::SetScalar = { shadeImpl, powImpl, VLANES };
+
+PhongShadeFn PhongKernel::Shade = shadeImpl;
+PhongPowFn PhongKernel::Pow = powImpl;
+SimdLevel PhongKernel::sLevel = SIMD_SCALAR;
+int PhongKernel::sWidth = VLANES;
+
+// Pick the best kernels before main() runs.
+static SimdLevel sInitialLevel = PhongKernel::Use( Simd::DetectLevel() );
+
+
+
+SimdLevel PhongKernel::Use( SimdLevel level )
+{
+    SimdLevel maxLevel = Simd::DetectLevel();
+    if ( level > maxLevel ) level = maxLevel;
+
+    const PhongKernelSet *set = NULL;
+    while ( set == NULL )
+    {
+        switch ( level )
+        {
+            case SIMD_AVX512: set = SetAVX512; break;
+            case SIMD_AVX2:   set = SetAVX2; break;
+            case SIMD_SSE4:   set = SetSSE4; break;
+            default:          set = &SetScalar; break;
+        }
+        if ( set == NULL ) level = (SimdLevel)( level - 1 );
+    }
+
+    Shade = set->shade;
+    Pow = set->pow;
+    sLevel = level;
+    sWidth = set->width;
+    return level;
+}
+
+
+
+void PhongKernel::SetLane( PhongLightBatch &batch, int j, const double L[3], const float I[3] )
+{
+    batch.lx[j] = (float) L[0];  batch.ly[j] = (float) L[1];  batch.lz[j] = (float) L[2];
+    batch.ir[j] = I[0];  batch.ig[j] = I[1];  batch.ib[j] = I[2];
+}
+
+
+
+void PhongKernel::ClearLanes( PhongLightBatch &batch, int j )
+{
+    int end = ( j + sWidth - 1 ) / sWidth * sWidth;
+    for ( ; j < end; j++ )
+    {
+        batch.lx[j] = batch.ly[j] = batch.lz[j] = 0.0f;
+        batch.ir[j] = batch.ig[j] = batch.ib[j] = 0.0f;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef _PHONGKERNEL_H_
+#define _PHONGKERNEL_H_
+
+#include "Simd.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// SIMD Phong shading of a hit by a batch of lights, in structure-of-arrays
+// float layout: the sum over the lights of
+//
+//     I * [ k_d * (N.L) + k_r * (R.V)^n ]
+//
+// as in Light.h. The mirror reflection R of each L is not made: as
+// (2 (N.L) N - L).V = L.(2 (N.V) N - V), the reflection of V, made once
+// for the hit, is dotted with each L instead.
+//
+// (R.V)^n is computed as 2^(n log2(R.V)), with log2 from its atanh series
+// on the mantissa and 2^x from its Taylor series on the fraction, both
+// truncated below float precision. Its relative error is a few float
+// roundings times 1 + n |log2(R.V)|, which is below 1e-5 wherever the
+// result is above 2^-24; the shaded colors stay within 1 step of the
+// 8-bit output of powf, as the Phong kernel benchmark of AccelBench checks.
+//
+// As with the other kernels, there is one implementation per instruction
+// set, the best one the CPU supports is picked at startup, and the
+// kernel translation units must not include Vector3d.h. Hence the plain
+// float interface.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+#define PHONG_BATCH_WIDTH   16
+
+
+// Up to PHONG_BATCH_WIDTH lights: the unit vector L towards each, and the
+// intensity with which it reaches the hit. Unused lanes have all fields
+// zero, and add nothing.
+struct PhongLightBatch
+{
+    float lx[ PHONG_BATCH_WIDTH ], ly[ PHONG_BATCH_WIDTH ], lz[ PHONG_BATCH_WIDTH ];
+    float ir[ PHONG_BATCH_WIDTH ], ig[ PHONG_BATCH_WIDTH ], ib[ PHONG_BATCH_WIDTH ];
+};
+
+
+// A hit as seen by the kernel: the unit normal N, the mirror reflection R
+// of the unit vector V towards the eye, and the material.
+struct PhongHit
+{
+    float nx, ny, nz;
+    float rx, ry, rz;
+    float k_d[3], k_r[3];
+    float n;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Shade: adds to color the lighting of the hit by the lights of batch
+// [0 .. numLights-1]. The lanes of batch from numLights up to the next
+// multiple of the width of the kernel are read, so must be unused lanes.
+//
+// Pow: sets out[i] to x[i]^n for count values x[i] in [0, 1], as Shade
+// computes (R.V)^n.
+//////////////////////////////////////////////////////////////////////////////
+
+typedef void (*PhongShadeFn)( const PhongHit &hit, const PhongLightBatch &batch, int numLights, float color[3] );
+
+typedef void (*PhongPowFn)( const float *x, int count, float n, float *out );
+
+
+// The kernels of one instruction set.
+struct PhongKernelSet
+{
+    PhongShadeFn shade;
+    PhongPowFn pow;
+    int width;      // Lanes per vector.
+};
+
+
+
+class PhongKernel
+{
+public:
+
+    // The kernels in use. Set at startup to the best ones the CPU supports.
+    static PhongShadeFn Shade;
+    static PhongPowFn Pow;
+
+    static SimdLevel Level( void ) { return sLevel; }
+
+    // Switches to the kernels for the given level, or the best ones below
+    // it that are available. Returns the level actually used.
+    static SimdLevel Use( SimdLevel level );
+
+
+    // Packs the light into lane j of batch.
+    static void SetLane( PhongLightBatch &batch, int j, const double L[3], const float I[3] );
+
+    // Clears the lanes of batch that Shade reads from j on.
+    static void ClearLanes( PhongLightBatch &batch, int j );
+
+
+    // The implementations. Those not built for this platform are NULL.
+    static const PhongKernelSet SetScalar;
+    static const PhongKernelSet *const SetSSE4;
+    static const PhongKernelSet *const SetAVX2;
+    static const PhongKernelSet *const SetAVX512;
+
+private:
+
+    static SimdLevel sLevel;
+    static int sWidth;
+
+}; // PhongKernel
+
+
+#endif // _PHONGKERNEL_H_
@@ -0,0 +1,64 @@
+#include <cstddef>
+#include "PhongKernel.h"
+
+// Compiled with AVX2 enabled; see CMakeLists.txt.
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+
+namespace
+{
+    struct vfloat { __m256 v; };
+    struct vmask { __m256 m; };
+
+    const int VLANES = 8;
+
+    inline vfloat operator+ ( vfloat a, vfloat b ) { vfloat r = { _mm256_add_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator- ( vfloat a, vfloat b ) { vfloat r = { _mm256_sub_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator* ( vfloat a, vfloat b ) { vfloat r = { _mm256_mul_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator/ ( vfloat a, vfloat b ) { vfloat r = { _mm256_div_ps( a.v, b.v ) }; return r; }
+
+    inline vfloat vset1( float x ) { vfloat r = { _mm256_set1_ps( x ) }; return r; }
+    inline vfloat vload( const float *p ) { vfloat r = { _mm256_loadu_ps( p ) }; return r; }
+    inline void vstore( float *p, vfloat a ) { _mm256_storeu_ps( p, a.v ); }
+    inline vfloat vmax( vfloat a, vfloat b ) { vfloat r = { _mm256_max_ps( a.v, b.v ) }; return r; }
+    inline vfloat vround( vfloat a ) { vfloat r = { _mm256_round_ps( a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) }; return r; }
+    inline vfloat vselect( vmask m, vfloat a, vfloat b ) { vfloat r = { _mm256_blendv_ps( b.v, a.v, m.m ) }; return r; }
+    inline vmask vgt( vfloat a, vfloat b ) { vmask r = { _mm256_cmp_ps( a.v, b.v, _CMP_GT_OQ ) }; return r; }
+    inline bool vany( vmask m ) { return _mm256_movemask_ps( m.m ) != 0; }
+
+    inline vfloat vmantissa( vfloat a )
+    {
+        __m256i bits = _mm256_or_si256( _mm256_and_si256( _mm256_castps_si256( a.v ), _mm256_set1_epi32( 0x007FFFFF ) ),
+                                        _mm256_set1_epi32( 0x3F800000 ) );
+        vfloat r = { _mm256_castsi256_ps( bits ) };
+        return r;
+    }
+
+    inline vfloat vexponent( vfloat a )
+    {
+        __m256i e = _mm256_sub_epi32( _mm256_srli_epi32( _mm256_castps_si256( a.v ), 23 ), _mm256_set1_epi32( 127 ) );
+        vfloat r = { _mm256_cvtepi32_ps( e ) };
+        return r;
+    }
+
+    inline vfloat vexp2i( vfloat a )
+    {
+        __m256i e = _mm256_add_epi32( _mm256_cvtps_epi32( a.v ), _mm256_set1_epi32( 127 ) );
+        vfloat r = { _mm256_castsi256_ps( _mm256_slli_epi32( e, 23 ) ) };
+        return r;
+    }
+
+    #include "PhongKernelImpl.h"
+
+    const PhongKernelSet kernelsAVX2 = { shadeImpl, powImpl, VLANES };
+}
+
+const PhongKernelSet *const PhongKernel::SetAVX2 = &kernelsAVX2;
+
+#else
+
+const PhongKernelSet *const PhongKernel::SetAVX2 = NULL;
+
+#endif
@@ -0,0 +1,64 @@
+#include <cstddef>
+#include "PhongKernel.h"
+
+// Compiled with AVX-512F enabled; see CMakeLists.txt.
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+
+namespace
+{
+    struct vfloat { __m512 v; };
+    struct vmask { __mmask16 m; };
+
+    const int VLANES = 16;
+
+    inline vfloat operator+ ( vfloat a, vfloat b ) { vfloat r = { _mm512_add_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator- ( vfloat a, vfloat b ) { vfloat r = { _mm512_sub_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator* ( vfloat a, vfloat b ) { vfloat r = { _mm512_mul_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator/ ( vfloat a, vfloat b ) { vfloat r = { _mm512_div_ps( a.v, b.v ) }; return r; }
+
+    inline vfloat vset1( float x ) { vfloat r = { _mm512_set1_ps( x ) }; return r; }
+    inline vfloat vload( const float *p ) { vfloat r = { _mm512_loadu_ps( p ) }; return r; }
+    inline void vstore( float *p, vfloat a ) { _mm512_storeu_ps( p, a.v ); }
+    inline vfloat vmax( vfloat a, vfloat b ) { vfloat r = { _mm512_max_ps( a.v, b.v ) }; return r; }
+    inline vfloat vround( vfloat a ) { vfloat r = { _mm512_roundscale_ps( a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) }; return r; }
+    inline vfloat vselect( vmask m, vfloat a, vfloat b ) { vfloat r = { _mm512_mask_blend_ps( m.m, b.v, a.v ) }; return r; }
+    inline vmask vgt( vfloat a, vfloat b ) { vmask r = { _mm512_cmp_ps_mask( a.v, b.v, _CMP_GT_OQ ) }; return r; }
+    inline bool vany( vmask m ) { return m.m != 0; }
+
+    inline vfloat vmantissa( vfloat a )
+    {
+        __m512i bits = _mm512_or_si512( _mm512_and_si512( _mm512_castps_si512( a.v ), _mm512_set1_epi32( 0x007FFFFF ) ),
+                                        _mm512_set1_epi32( 0x3F800000 ) );
+        vfloat r = { _mm512_castsi512_ps( bits ) };
+        return r;
+    }
+
+    inline vfloat vexponent( vfloat a )
+    {
+        __m512i e = _mm512_sub_epi32( _mm512_srli_epi32( _mm512_castps_si512( a.v ), 23 ), _mm512_set1_epi32( 127 ) );
+        vfloat r = { _mm512_cvtepi32_ps( e ) };
+        return r;
+    }
+
+    inline vfloat vexp2i( vfloat a )
+    {
+        __m512i e = _mm512_add_epi32( _mm512_cvtps_epi32( a.v ), _mm512_set1_epi32( 127 ) );
+        vfloat r = { _mm512_castsi512_ps( _mm512_slli_epi32( e, 23 ) ) };
+        return r;
+    }
+
+    #include "PhongKernelImpl.h"
+
+    const PhongKernelSet kernelsAVX512 = { shadeImpl, powImpl, VLANES };
+}
+
+const PhongKernelSet *const PhongKernel::SetAVX512 = &kernelsAVX512;
+
+#else
+
+const PhongKernelSet *const PhongKernel::SetAVX512 = NULL;
+
+#endif
@@ -0,0 +1,140 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Body of the SIMD Phong kernels, shared by every instruction set.
+//
+// Included by each kernel translation unit, inside an anonymous namespace,
+// after it defines:
+//
+//   vfloat                 A vector of VLANES float lanes, with +, -, *, /.
+//   vmask                  A vector of lane flags.
+//   VLANES                 The number of lanes, which divides PHONG_BATCH_WIDTH.
+//   vset1( x )             All lanes set to x.
+//   vload( p ), vstore( p, a )   Unaligned load and store of VLANES floats.
+//   vmax( a, b )
+//   vround( a )            a rounded to a nearest integer.
+//   vselect( m, a, b )     a in the lanes of m, else b.
+//   vgt( a, b )            Lane-wise comparison.
+//   vany( m )              Whether any lane is in m.
+//   vmantissa( a )         For normal a > 0, its mantissa, in [1, 2).
+//   vexponent( a )         For normal a > 0, its unbiased exponent.
+//   vexp2i( a )            2^a for whole a in [-126, 127].
+//
+// Not a standalone header.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+// Smallest normal float.
+#define PHONG_MIN_NORMAL    1.17549435e-38f
+
+
+// log2( x ) for normal x > 0. With x = m 2^e and m in [sqrt(1/2), sqrt(2)),
+// log2( m ) = 2/ln(2) * ( t + t^3/3 + t^5/5 + t^7/7 + ... ) where
+// t = ( m - 1 ) / ( m + 1 ), |t| < 0.172, so the terms left out are below
+// 1e-8.
+static inline vfloat log2Approx( vfloat x )
+{
+    vfloat m = vmantissa( x ), e = vexponent( x );
+    vmask high = vgt( m, vset1( 1.41421356f ) );
+    m = vselect( high, m * vset1( 0.5f ), m );
+    e = vselect( high, e + vset1( 1.0f ), e );
+
+    vfloat t = ( m - vset1( 1.0f ) ) / ( m + vset1( 1.0f ) );
+    vfloat t2 = t * t;
+    vfloat p = vset1( 0.41219858f );                // 2 / ( 7 ln 2 )
+    p = p * t2 + vset1( 0.57707802f );              // 2 / ( 5 ln 2 )
+    p = p * t2 + vset1( 0.96179669f );              // 2 / ( 3 ln 2 )
+    p = p * t2 + vset1( 2.88539008f );              // 2 / ln 2
+    return e + t * p;
+}
+
+
+// 2^y for y <= 0, and 2^-126 below that. With y = i + f, i whole and
+// |f| <= 1/2, 2^f = e^( f ln 2 ) is summed to the 6th power, which leaves
+// out less than 2e-7.
+static inline vfloat exp2Approx( vfloat y )
+{
+    y = vmax( y, vset1( -126.0f ) );
+    vfloat i = vround( y );
+    vfloat f = y - i;
+
+    vfloat p = vset1( 1.54035304e-4f );             // ln(2)^6 / 6!
+    p = p * f + vset1( 1.33335581e-3f );            // ln(2)^5 / 5!
+    p = p * f + vset1( 9.61812911e-3f );            // ln(2)^4 / 4!
+    p = p * f + vset1( 5.55041087e-2f );            // ln(2)^3 / 3!
+    p = p * f + vset1( 2.40226507e-1f );            // ln(2)^2 / 2!
+    p = p * f + vset1( 6.93147181e-1f );            // ln(2)
+    p = p * f + vset1( 1.0f );
+    return p * vexp2i( i );
+}
+
+
+// x^n for x in [0, 1]. x below the smallest normal float counts as 0,
+// and 0^n is zeroPow: 1 for n = 0, as with powf, else 0. Most lights
+// are outside the highlight, with x = 0 in every lane, and then the
+// series are skipped.
+static inline vfloat powApprox( vfloat x, vfloat n, vfloat zeroPow )
+{
+    vmask normal = vgt( x, vset1( PHONG_MIN_NORMAL ) );
+    if ( !vany( normal ) ) return zeroPow;
+    x = vselect( normal, x, vset1( 1.0f ) );
+    return vselect( normal, exp2Approx( n * log2Approx( x ) ), zeroPow );
+}
+
+
+
+static void shadeImpl( const PhongHit &hit, const PhongLightBatch &batch, int numLights, float color[3] )
+{
+    const vfloat zero = vset1( 0.0f );
+    vfloat nx = vset1( hit.nx ), ny = vset1( hit.ny ), nz = vset1( hit.nz );
+    vfloat rx = vset1( hit.rx ), ry = vset1( hit.ry ), rz = vset1( hit.rz );
+    vfloat n = vset1( hit.n );
+    vfloat zeroPow = vset1( ( hit.n == 0.0f )? 1.0f : 0.0f );
+
+    // The intensity times N.L, and times (R.V)^n, summed over the lights.
+    vfloat diffR = zero, diffG = zero, diffB = zero;
+    vfloat specR = zero, specG = zero, specB = zero;
+
+    for ( int h = 0; h < numLights; h += VLANES )
+    {
+        vfloat lx = vload( batch.lx + h ), ly = vload( batch.ly + h ), lz = vload( batch.lz + h );
+        vfloat N_dot_L = vmax( nx * lx + ny * ly + nz * lz, zero );
+        vfloat R_dot_V = vmax( rx * lx + ry * ly + rz * lz, zero );
+        vfloat R_dot_V_pow_n = powApprox( R_dot_V, n, zeroPow );
+
+        vfloat ir = vload( batch.ir + h ), ig = vload( batch.ig + h ), ib = vload( batch.ib + h );
+        diffR = diffR + ir * N_dot_L;  specR = specR + ir * R_dot_V_pow_n;
+        diffG = diffG + ig * N_dot_L;  specG = specG + ig * R_dot_V_pow_n;
+        diffB = diffB + ib * N_dot_L;  specB = specB + ib * R_dot_V_pow_n;
+    }
+
+    // The lanes past numLights hold nothing.
+    float lanes[3][ VLANES ];
+    vstore( lanes[0], vset1( hit.k_d[0] ) * diffR + vset1( hit.k_r[0] ) * specR );
+    vstore( lanes[1], vset1( hit.k_d[1] ) * diffG + vset1( hit.k_r[1] ) * specG );
+    vstore( lanes[2], vset1( hit.k_d[2] ) * diffB + vset1( hit.k_r[2] ) * specB );
+
+    int numUsed = ( numLights < VLANES )? numLights : VLANES;
+    for ( int c = 0; c < 3; c++ )
+        for ( int j = 0; j < numUsed; j++ ) color[c] += lanes[c][j];
+}
+
+
+
+static void powImpl( const float *x, int count, float n, float *out )
+{
+    vfloat vn = vset1( n );
+    vfloat zeroPow = vset1( ( n == 0.0f )? 1.0f : 0.0f );
+
+    int i = 0;
+    for ( ; i + VLANES <= count; i += VLANES )
+        vstore( out + i, powApprox( vload( x + i ), vn, zeroPow ) );
+
+    if ( i < count )
+    {
+        float in[ VLANES ], res[ VLANES ];
+        for ( int j = 0; j < VLANES; j++ ) in[j] = ( i + j < count )? x[ i + j ] : 0.0f;
+        vstore( res, powApprox( vload( in ), vn, zeroPow ) );
+        for ( int j = 0; i + j < count; j++ ) out[ i + j ] = res[j];
+    }
+}
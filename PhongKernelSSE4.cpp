@@ -0,0 +1,64 @@
+#include <cstddef>
+#include "PhongKernel.h"
+
+// Compiled with SSE4.1 enabled; see CMakeLists.txt.
+#if defined(__SSE4_1__) || ( defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) ) )
+
+#include <smmintrin.h>
+
+
+namespace
+{
+    struct vfloat { __m128 v; };
+    struct vmask { __m128 m; };
+
+    const int VLANES = 4;
+
+    inline vfloat operator+ ( vfloat a, vfloat b ) { vfloat r = { _mm_add_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator- ( vfloat a, vfloat b ) { vfloat r = { _mm_sub_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator* ( vfloat a, vfloat b ) { vfloat r = { _mm_mul_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator/ ( vfloat a, vfloat b ) { vfloat r = { _mm_div_ps( a.v, b.v ) }; return r; }
+
+    inline vfloat vset1( float x ) { vfloat r = { _mm_set1_ps( x ) }; return r; }
+    inline vfloat vload( const float *p ) { vfloat r = { _mm_loadu_ps( p ) }; return r; }
+    inline void vstore( float *p, vfloat a ) { _mm_storeu_ps( p, a.v ); }
+    inline vfloat vmax( vfloat a, vfloat b ) { vfloat r = { _mm_max_ps( a.v, b.v ) }; return r; }
+    inline vfloat vround( vfloat a ) { vfloat r = { _mm_round_ps( a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) }; return r; }
+    inline vfloat vselect( vmask m, vfloat a, vfloat b ) { vfloat r = { _mm_blendv_ps( b.v, a.v, m.m ) }; return r; }
+    inline vmask vgt( vfloat a, vfloat b ) { vmask r = { _mm_cmpgt_ps( a.v, b.v ) }; return r; }
+    inline bool vany( vmask m ) { return _mm_movemask_ps( m.m ) != 0; }
+
+    inline vfloat vmantissa( vfloat a )
+    {
+        __m128i bits = _mm_or_si128( _mm_and_si128( _mm_castps_si128( a.v ), _mm_set1_epi32( 0x007FFFFF ) ),
+                                     _mm_set1_epi32( 0x3F800000 ) );
+        vfloat r = { _mm_castsi128_ps( bits ) };
+        return r;
+    }
+
+    inline vfloat vexponent( vfloat a )
+    {
+        __m128i e = _mm_sub_epi32( _mm_srli_epi32( _mm_castps_si128( a.v ), 23 ), _mm_set1_epi32( 127 ) );
+        vfloat r = { _mm_cvtepi32_ps( e ) };
+        return r;
+    }
+
+    inline vfloat vexp2i( vfloat a )
+    {
+        __m128i e = _mm_add_epi32( _mm_cvtps_epi32( a.v ), _mm_set1_epi32( 127 ) );
+        vfloat r = { _mm_castsi128_ps( _mm_slli_epi32( e, 23 ) ) };
+        return r;
+    }
+
+    #include "PhongKernelImpl.h"
+
+    const PhongKernelSet kernelsSSE4 = { shadeImpl, powImpl, VLANES };
+}
+
+const PhongKernelSet *const PhongKernel::SetSSE4 = &kernelsSSE4;
+
+#else
+
+const PhongKernelSet *const PhongKernel::SetSSE4 = NULL;
+
+#endif
@@ -5,29 +5,47 @@ using namespace std;
 
 
 
-bool Plane::hit( const Ray &r, double tmin, double tmax, SurfaceHitRecord &rec ) const 
+bool Plane::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const 
 {
     Vector3d N( A, B, C );
-    double NRd = dot( N, r.direction() );
-    double NRo = dot( N, r.origin() );
-    double t = (-D - NRo) / NRd;
+    Real NRd = dot( N, r.direction() );
+    Real NRo = dot( N, r.origin() );
+    Real t = (-D - NRo) / NRd;
     if ( t < tmin || t > tmax ) return false;
 
-    // We have a hit -- populat hit record. 
+    // We have a hit -- populat hit record.
     rec.t = t;
-    rec.p = r.pointAtParam(t);
-    rec.normal = N;
-    rec.mat_ptr = matp;
+    rec.surface = this;
+    rec.primitive = 0;
+    rec.instance = NULL;
     return true;
 }
 
 
 
-bool Plane::shadowHit( const Ray &r, double tmin, double tmax ) const 
+// Rounding leaves the point of the ray off the plane by an error that
+// grows with t, so it is moved onto the plane, in WideReal, and is then
+// off it by about its rounding.
+void Plane::hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const
+{
+    WideReal p[3] = { r.origin().x() + (WideReal)rec.t * r.direction().x(),
+                      r.origin().y() + (WideReal)rec.t * r.direction().y(),
+                      r.origin().z() + (WideReal)rec.t * r.direction().z() };
+    WideReal s = ( A * p[0] + B * p[1] + C * p[2] + D ) / ( (WideReal)A * A + (WideReal)B * B + (WideReal)C * C );
+    point.p = Vector3d( p[0] - s * A, p[1] - s * B, p[2] - s * C );
+    point.pError = errorGamma( 4 ) * abs( point.p );
+    point.normal = Vector3d( A, B, C );
+    point.ng = point.normal;
+    point.mat_ptr = matp;
+}
+
+
+
+bool Plane::shadowHit( const Ray &r, Real tmin, Real tmax ) const 
 {
     Vector3d N( A, B, C );
-    double NRd = dot( N, r.direction() );
-    double NRo = dot( N, r.origin() );
-    double t = (-D - NRo) / NRd;
+    Real NRd = dot( N, r.direction() );
+    Real NRo = dot( N, r.origin() );
+    Real t = (-D - NRo) / NRd;
     return ( t >= tmin && t <= tmax );
 }
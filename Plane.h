@@ -9,10 +9,10 @@ class Plane : public Surface
 public:
 
     // The plane equation is Ax + By + Cz + D = 0.
-    double A, B, C, D;
+    Real A, B, C, D;
 
 
-    Plane( double A_, double B_, double C_, double D_, const Material *mat_ptr )
+    Plane( Real A_, Real B_, Real C_, Real D_, const Material *mat_ptr )
     { 
         A = A_;  B = B_;  C = C_;  D = D_;  
         matp = mat_ptr; 
@@ -31,18 +31,21 @@ public:
 
     virtual bool hit( 
                     const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax,  // Maximum hit parameter to be searched for.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
                     SurfaceHitRecord &rec 
                     ) const;
 
 
     virtual bool shadowHit(        
                     const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax   // Maximum hit parameter to be searched for.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
                     ) const; 
 
+
+    virtual void hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const;
+
 };
 
 #endif // _PLANE_H_
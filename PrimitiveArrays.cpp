@@ -0,0 +1,183 @@
+#include <typeinfo>
+#include "PrimitiveArrays.h"
+
+using namespace std;
+
+
+// The tests of the primitive types are called qualified, so without
+// virtual dispatch.
+
+PrimitiveArrays::PrimitiveArrays( const SurfacePtr *surfaces, int numSurfaces, vector<SurfacePtr> &others )
+{
+    matp = NULL;
+
+    // Only exactly these types are copied; a subclass may add state.
+    for ( int i = 0; i < numSurfaces; i++ )
+    {
+        const Surface &s = *surfaces[i];
+        if ( typeid( s ) == typeid( Sphere ) )
+            mSpheres.push_back( static_cast<const Sphere &>( s ) );
+        else if ( typeid( s ) == typeid( Triangle ) )
+            mTriangles.push_back( static_cast<const Triangle &>( s ) );
+        else if ( typeid( s ) == typeid( Plane ) )
+            mPlanes.push_back( static_cast<const Plane &>( s ) );
+        else
+            others.push_back( surfaces[i] );
+    }
+
+    int numSpheres = (int) mSpheres.size();
+    mSpherePackets.resize( ( numSpheres + SPHERE_PACKET_WIDTH - 1 ) / SPHERE_PACKET_WIDTH );
+    for ( int i = 0; i < (int) mSpherePackets.size() * SPHERE_PACKET_WIDTH; i++ )
+    {
+        SpherePacket &packet = mSpherePackets[ i / SPHERE_PACKET_WIDTH ];
+        if ( i < numSpheres )
+        {
+            const Vector3d &c = mSpheres[i].center;
+            double center[3] = { c.x(), c.y(), c.z() };
+            SphereKernel::SetLane( packet, i % SPHERE_PACKET_WIDTH, center, mSpheres[i].radius );
+        }
+        else
+            SphereKernel::ClearLane( packet, i % SPHERE_PACKET_WIDTH );
+    }
+}
+
+
+
+static SphereRay makeSphereRay( const Ray &r )
+{
+    Vector3d o = r.origin(), d = r.direction();
+    SphereRay ray = { o.x(), o.y(), o.z(), d.x(), d.y(), d.z() };
+    return ray;
+}
+
+
+
+bool PrimitiveArrays::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    Real nearest_t = tmax;
+    SurfaceHitRecord tempHitRec;
+
+    // The kernel finds the nearest sphere and its t exactly as Sphere::hit
+    // does, which then fills in the record.
+    if ( !mSpherePackets.empty() )
+    {
+        double t = tmax;
+        int i = SphereKernel::Nearest( makeSphereRay( r ), &mSpherePackets[0], (int) mSpherePackets.size(),
+                                       tmin, t );
+        if ( i >= 0 && mSpheres[i].Sphere::hit( r, tmin, tmax, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    for ( size_t i = 0; i < mTriangles.size(); i++ )
+    {
+        if ( mTriangles[i].Triangle::hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    for ( size_t i = 0; i < mPlanes.size(); i++ )
+    {
+        if ( mPlanes[i].Plane::hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    return hasHit;
+}
+
+
+
+bool PrimitiveArrays::shadowHit( const Ray &r, Real tmin, Real tmax ) const
+{
+    if ( !mSpherePackets.empty() &&
+         SphereKernel::AnyHit( makeSphereRay( r ), &mSpherePackets[0], (int) mSpherePackets.size(),
+                               tmin, tmax ) >= 0 )
+        return true;
+
+    for ( size_t i = 0; i < mTriangles.size(); i++ )
+        if ( mTriangles[i].Triangle::shadowHit( r, tmin, tmax ) ) return true;
+
+    for ( size_t i = 0; i < mPlanes.size(); i++ )
+        if ( mPlanes[i].Plane::shadowHit( r, tmin, tmax ) ) return true;
+
+    return false;
+}
+
+
+
+bool PrimitiveArrays::boundingBox( AABB &box ) const
+{
+    if ( !mPlanes.empty() ) return false;
+
+    box.setEmpty();
+    for ( int i = 0; i < numPrimitives(); i++ )
+    {
+        AABB primBox;
+        primitiveBoundingBox( i, primBox );
+        box.expand( primBox );
+    }
+    return true;
+}
+
+
+
+bool PrimitiveArrays::primitiveBoundingBox( int i, AABB &box ) const
+{
+    int numSpheres = (int) mSpheres.size();
+    int numTriangles = (int) mTriangles.size();
+
+    if ( i < numSpheres ) return mSpheres[i].Sphere::boundingBox( box );
+    i -= numSpheres;
+    if ( i < numTriangles ) return mTriangles[i].Triangle::boundingBox( box );
+    return false;
+}
+
+
+
+bool PrimitiveArrays::hitPrimitive( int i, const Ray &r, Real tmin, Real tmax,
+                                    SurfaceHitRecord &rec ) const
+{
+    int numSpheres = (int) mSpheres.size();
+    int numTriangles = (int) mTriangles.size();
+
+    if ( i < numSpheres ) return mSpheres[i].Sphere::hit( r, tmin, tmax, rec );
+    i -= numSpheres;
+    if ( i < numTriangles ) return mTriangles[i].Triangle::hit( r, tmin, tmax, rec );
+    return mPlanes[ i - numTriangles ].Plane::hit( r, tmin, tmax, rec );
+}
+
+
+
+bool PrimitiveArrays::shadowHitPrimitive( int i, const Ray &r, Real tmin, Real tmax ) const
+{
+    int numSpheres = (int) mSpheres.size();
+    int numTriangles = (int) mTriangles.size();
+
+    if ( i < numSpheres ) return mSpheres[i].Sphere::shadowHit( r, tmin, tmax );
+    i -= numSpheres;
+    if ( i < numTriangles ) return mTriangles[i].Triangle::shadowHit( r, tmin, tmax );
+    return mPlanes[ i - numTriangles ].Plane::shadowHit( r, tmin, tmax );
+}
+
+
+
+bool PrimitiveArrays::primitiveTriangle( int i, Vector3d &v0, Vector3d &v1, Vector3d &v2 ) const
+{
+    i -= (int) mSpheres.size();
+    if ( i < 0 || i >= (int) mTriangles.size() ) return false;
+
+    const Triangle &tri = mTriangles[i];
+    v0 = tri.v0;  v1 = tri.v1;  v2 = tri.v2;
+    return true;
+}
@@ -0,0 +1,93 @@
+#ifndef _PRIMITIVEARRAYS_H_
+#define _PRIMITIVEARRAYS_H_
+
+#include <vector>
+#include "Surface.h"
+#include "Sphere.h"
+#include "Plane.h"
+#include "Triangle.h"
+#include "SphereKernel.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// The simple primitives of a scene -- Spheres, Planes and Triangles --
+// stored by value in one contiguous array per type, as a single Surface.
+//
+// A scene defined as an array of individually allocated Surfaces is
+// traced through a virtual call and a pointer chase per primitive. Once
+// its simple primitives are copied into the arrays, an acceleration
+// structure over them makes one call into this object per primitive test,
+// which then branches on the index to the test of the type, called
+// directly, on data laid out side by side. hit() and shadowHit() loop over
+// each array in turn, and test the spheres with the SIMD sphere kernel on
+// a copy of them in packets.
+//
+// The primitives are numbered spheres first, then triangles, then planes,
+// so that the triangles are handed to the acceleration structures as such
+// for the SIMD triangle kernel, and the unbounded planes come last.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class PrimitiveArrays : public Surface
+{
+public:
+
+    // Copies the Spheres, Planes and Triangles among the surfaces into the
+    // arrays, and appends the other surfaces to others. Later changes to
+    // the original surfaces are not seen by the copies.
+    PrimitiveArrays( const SurfacePtr *surfaces, int numSurfaces, vector<SurfacePtr> &others );
+
+
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const;
+
+
+    // Returns false if there are any planes.
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    virtual int numPrimitives() const
+        { return (int)( mSpheres.size() + mTriangles.size() + mPlanes.size() ); }
+
+    virtual bool primitiveBoundingBox( int i, AABB &box ) const;
+
+    virtual bool hitPrimitive( int i, const Ray &r, Real tmin, Real tmax,
+                               SurfaceHitRecord &rec ) const;
+
+    virtual bool shadowHitPrimitive( int i, const Ray &r, Real tmin, Real tmax ) const;
+
+    virtual bool primitiveTriangle( int i, Vector3d &v0, Vector3d &v1, Vector3d &v2 ) const;
+
+
+    int numSpheres() const { return (int) mSpheres.size(); }
+
+    int numTriangles() const { return (int) mTriangles.size(); }
+
+    int numPlanes() const { return (int) mPlanes.size(); }
+
+
+private:
+
+    vector<Sphere> mSpheres;
+    vector<Triangle> mTriangles;
+    vector<Plane> mPlanes;
+    vector<SpherePacket> mSpherePackets;
+
+}; // PrimitiveArrays
+
+
+#endif // _PRIMITIVEARRAYS_H_
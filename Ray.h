@@ -7,41 +7,45 @@
 using namespace std;
 
 
-class Ray  
+// A ray, with components of type T. Ray is the one of the trace
+// pipeline, with Real components.
+
+template <typename T>
+class RayT  
 {
 public:
     
 // Constructors
 
-    Ray() {}
+    RayT() {}
 
-    Ray( const Vector3d &origin, const Vector3d &direction ) 
+    RayT( const Vector3T<T> &origin, const Vector3T<T> &direction ) 
         { data[0] = origin; data[1] = direction;  }
 
 
 // Data setting and reading.
 
-    Ray &setRay( const Vector3d &origin, const Vector3d &direction ) 
+    RayT &setRay( const Vector3T<T> &origin, const Vector3T<T> &direction ) 
         { data[0] = origin; data[1] = direction; return (*this); }
 
-    Ray &setOrigin( const Vector3d &origin ) { data[0] = origin; return (*this); }
-    Ray &setDirection( const Vector3d &direction ) { data[1] = direction; return (*this); }
+    RayT &setOrigin( const Vector3T<T> &origin ) { data[0] = origin; return (*this); }
+    RayT &setDirection( const Vector3T<T> &direction ) { data[1] = direction; return (*this); }
 
-    Vector3d origin() const { return data[0]; }
-    Vector3d direction() const { return data[1]; }
+    Vector3T<T> origin() const { return data[0]; }
+    Vector3T<T> direction() const { return data[1]; }
 
 
 // Other functions.
 
-    Vector3d pointAtParam( double t ) const { return data[0] + t * data[1]; }
+    Vector3T<T> pointAtParam( T t ) const { return data[0] + t * data[1]; }
 
-    Ray &makeUnitDirection()
+    RayT &makeUnitDirection()
     {
         data[1].makeUnitVector();
         return (*this);
     }
 
-    Ray &moveOriginForward( double delta_t )
+    RayT &moveOriginForward( T delta_t )
     {
         data[0] += delta_t * data[1];
         return (*this);
@@ -49,13 +53,17 @@ public:
 
 private:
 
-    Vector3d data[2];
+    Vector3T<T> data[2];
+
+}; // RayT
+
 
-}; // Ray
+typedef RayT<Real> Ray;
 
 
 
-inline ostream &operator<< ( ostream &os, const Ray &r ) 
+template <typename T>
+inline ostream &operator<< ( ostream &os, const RayT<T> &r ) 
     { return ( os << "(" << r.origin() << ") + t("  << r.direction() << ")" ); }
 
 
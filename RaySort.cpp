@@ -0,0 +1,130 @@
+#include <cstdint>
+#include <cfloat>
+#include "Util.h"
+#include "RaySort.h"
+
+using namespace std;
+
+
+// Queues of fewer rays are left in their order.
+#define RAY_SORT_MIN_RAYS       32
+
+// Rays per cell of the origin grid of each octant aimed for.
+#define RAY_SORT_RAYS_PER_CELL  8
+
+// Most bits per axis of the origin Morton code, so keys fit in 32 bits.
+#define RAY_SORT_MAX_BITS       9
+
+// Radix sort digit size.
+#define RAY_SORT_RADIX_BITS     8
+
+
+
+int RaySort::MortonBits( int numRays, RaySortMode mode )
+{
+    if ( mode == RAY_SORT_NONE || numRays < RAY_SORT_MIN_RAYS ) return -1;
+    if ( mode == RAY_SORT_OCTANT ) return 0;
+
+    // 8 octants of 2^(3 bits) cells each.
+    int bits = 0;
+    while ( bits < RAY_SORT_MAX_BITS &&
+            8LL * ( 1LL << ( 3 * ( bits + 1 ) ) ) * RAY_SORT_RAYS_PER_CELL <= numRays )
+        bits++;
+    return bits;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Inserts two zero bits after each of the low 10 bits of v.
+//////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t expandBits( uint32_t v )
+{
+    v = ( v * 0x00010001u ) & 0xFF0000FFu;
+    v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+    v = ( v * 0x00000011u ) & 0xC30C30C3u;
+    v = ( v * 0x00000005u ) & 0x49249249u;
+    return v;
+}
+
+
+
+void RaySort::sort( vector<int> &queue, const Ray *rays, RaySortMode mode )
+{
+    int n = (int) queue.size();
+    int bits = MortonBits( n, mode );
+    if ( bits < 0 ) return;
+
+    mKeys.resize( n );
+    mKeys2.resize( n );
+    mQueue2.resize( n );
+
+    // The box of the origins.
+    Real lo[3] = { REAL_MAX, REAL_MAX, REAL_MAX }, hi[3] = { -REAL_MAX, -REAL_MAX, -REAL_MAX };
+    if ( bits > 0 )
+    {
+        for ( int q = 0; q < n; q++ )
+        {
+            Vector3d o = rays[ queue[q] ].origin();
+            lo[0] = Util::Min2( lo[0], o.x() );  hi[0] = Util::Max2( hi[0], o.x() );
+            lo[1] = Util::Min2( lo[1], o.y() );  hi[1] = Util::Max2( hi[1], o.y() );
+            lo[2] = Util::Min2( lo[2], o.z() );  hi[2] = Util::Max2( hi[2], o.z() );
+        }
+    }
+
+    const double gridSize = 1 << bits;
+    double scale[3];
+    for ( int a = 0; a < 3; a++ )
+    {
+        double extent = hi[a] - lo[a];
+        scale[a] = ( bits > 0 && extent > 0.0 )? gridSize / extent : 0.0;
+    }
+
+    for ( int q = 0; q < n; q++ )
+    {
+        const Ray &r = rays[ queue[q] ];
+        Vector3d d = r.direction();
+        Vector3d o = r.origin();
+        uint32_t octant = ( d.x() < 0.0 ) | ( ( d.y() < 0.0 ) << 1 ) | ( ( d.z() < 0.0 ) << 2 );
+
+        // Scale 0 puts every origin in cell 0.
+        uint32_t cx = (uint32_t) Util::Min2( Util::Max2( ( o.x() - lo[0] ) * scale[0], 0.0 ), gridSize - 1.0 );
+        uint32_t cy = (uint32_t) Util::Min2( Util::Max2( ( o.y() - lo[1] ) * scale[1], 0.0 ), gridSize - 1.0 );
+        uint32_t cz = (uint32_t) Util::Min2( Util::Max2( ( o.z() - lo[2] ) * scale[2], 0.0 ), gridSize - 1.0 );
+        uint32_t code = ( expandBits( cx ) << 2 ) | ( expandBits( cy ) << 1 ) | expandBits( cz );
+
+        mKeys[q] = ( octant << ( 3 * bits ) ) | code;
+    }
+
+    // Least significant digit radix sort, stable so that rays with equal
+    // keys keep their order.
+    const int numDigits = 1 << RAY_SORT_RADIX_BITS;
+    const int keyBits = 3 + 3 * bits;
+    int offset[ numDigits ];
+
+    for ( int shift = 0; shift < keyBits; shift += RAY_SORT_RADIX_BITS )
+    {
+        int numUsed = Util::Min2( numDigits, 1 << ( keyBits - shift ) );
+        for ( int d = 0; d < numUsed; d++ ) offset[d] = 0;
+        for ( int q = 0; q < n; q++ ) offset[ ( mKeys[q] >> shift ) & ( numDigits - 1 ) ]++;
+
+        int sum = 0;
+        for ( int d = 0; d < numUsed; d++ )
+        {
+            int count = offset[d];
+            offset[d] = sum;
+            sum += count;
+        }
+
+        for ( int q = 0; q < n; q++ )
+        {
+            int k = offset[ ( mKeys[q] >> shift ) & ( numDigits - 1 ) ]++;
+            mKeys2[k] = mKeys[q];
+            mQueue2[k] = queue[q];
+        }
+
+        mKeys.swap( mKeys2 );
+        queue.swap( mQueue2 );
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef _RAYSORT_H_
+#define _RAYSORT_H_
+
+#include <cstdint>
+#include <vector>
+#include "Ray.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Reorders queues of rays, such as the reflection and shadow rays of a
+// bounce of the wavefront renderer, so that rays traced one after another
+// take similar paths through the acceleration structure and find its
+// nodes and primitives still in the cache.
+//
+// The key of a ray is its direction octant, then the Morton code of its
+// origin quantized in the box of the origins of the queue. The budget of
+// the sort follows the size of the queue: the Morton code has as many
+// bits per axis as give a few rays per cell of each octant, so small
+// queues are sorted by octant only and tiny ones not at all. The keys are
+// radix sorted, one pass per 8 bits, so the cost is linear in the number
+// of rays with a factor that grows with its logarithm.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+enum RaySortMode
+{
+    RAY_SORT_NONE,      // Keep the order.
+    RAY_SORT_OCTANT,    // By direction octant.
+    RAY_SORT_MORTON     // By direction octant, then origin Morton code.
+};
+
+
+class RaySort
+{
+public:
+
+    // Reorders queue, which holds indices into rays. The sort is stable.
+    // The scratch arrays are kept from call to call.
+    void sort( vector<int> &queue, const Ray *rays, RaySortMode mode );
+
+    // Bits per axis of the origin Morton code for a queue of numRays rays,
+    // 0 if it is sorted by octant only, and -1 if it is not sorted.
+    static int MortonBits( int numRays, RaySortMode mode );
+
+private:
+
+    vector<uint32_t> mKeys, mKeys2;
+    vector<int> mQueue2;
+
+}; // RaySort
+
+
+#endif // _RAYSORT_H_
@@ -1,6 +1,9 @@
 
 #include <cmath>
 #include <cfloat>
+#include <vector>
+#include <memory>
+#include "Util.h"
 #include "Vector3d.h"
 #include "Color.h"
 #include "Ray.h"
@@ -11,16 +14,30 @@
 #include "Triangle.h"
 #include "Light.h"
 #include "Scene.h"
+#include "LightCuller.h"
+#include "PhongKernel.h"
 #include "Raytrace.h"
 
 using namespace std;
 
 
-// This is for avoiding the "epsilon problem" or the shadow acne problem.
-#define DEFAULT_TMIN    10e-6       
+// Rays of a packet handed to Surface::hitPacket() at a time.
+#define PACKET_CHUNK_SIZE   256
 
-// Use this for tmax for non-shadow ray intersection test.
-#define DEFAULT_TMAX    DBL_MAX
+// Bounces of a path kept by TraceRay() without allocating.
+#define PATH_STACK_SIZE     16
+
+// A path ends when the rest of it can add less than this to any
+// component of its color: half a step of the 8-bit output.
+#define PATH_MIN_CONTRIBUTION   ( 0.5f / 255.0f )
+
+// With PATH_END_ROULETTE, a path whose weight falls below this goes on
+// with probability weight / PATH_ROULETTE_WEIGHT.
+#define PATH_ROULETTE_WEIGHT    0.02f
+
+
+
+PathEnd Raytrace::pathEnd = PATH_END_CONTRIBUTION;
 
 
 
@@ -40,24 +57,258 @@ static Vector3d mirrorReflect( const Vector3d &L, const Vector3d &N )
 
 
 //////////////////////////////////////////////////////////////////////////////
-// Compute I_source * [ k_d * (N.L) + k_r * (R.V)^n ].
-// Input vectors L, N and V are pointing AWAY from surface point.
-// Assume all vector L, N and V are unit vectors.
+// Makes the shadow ray from the hit point towards a point light source,
+// and sets Tmax to the parameter of the light along it.
+//////////////////////////////////////////////////////////////////////////////
+
+static Ray shadowRay( const SurfaceHitPoint &hitPoint, const PointLightSource &ptLight, Real &Tmax )
+{
+    Vector3d origin = Raytrace::LeavingOrigin(hitPoint, ptLight.position - hitPoint.p);
+    Vector3d L = ptLight.position - origin;
+    Tmax = L.length();
+    L.makeUnitVector();
+    return Ray(origin, L);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Computes the local lighting at a hit: the phong lighting contributed by
+// each of the numLights lights picked to shade it, or by every point light
+// source if lights is NULL, and the global ambient lighting. With
+// hasShadow, occluded[j] tells whether light j is blocked, or if occluded
+// is NULL, a shadow ray is traced, through shadowCache if it is not NULL.
+// The lights that are not blocked are shaded by PhongKernel, in batches,
+// each with its intensity times its falloff and weight.
+// V is left as the reflection uses it.
+//////////////////////////////////////////////////////////////////////////////
+
+static Color localLighting( const SurfaceHitPoint &hitPoint, const Vector3d &N, Vector3d &V,
+                            const Scene &scene, const LightSample *lights, int numLights,
+                            bool hasShadow, const bool *occluded, ShadowCache *shadowCache )
+{
+    Color result( 0.0f, 0.0f, 0.0f );   // The result will be accumulated here.
+
+
+    ////////////////////////////////////
+    ////////////////////////////////////
+
+
+// Add to result the phong lighting contributed by each point light source.
+// Compute for shadow if hasShadow is true.
+
+    //***********************************************
+    //*********** WRITE YOUR CODE HERE **************
+    //***********************************************
+    
+    if (lights == NULL) numLights = scene.numPtLights;
+    if (hasShadow) V.makeUnitVector();
+
+    const Material &mat = *hitPoint.mat_ptr;
+    Vector3d R = mirrorReflect(V, N);
+    PhongHit hit = { (float)N.x(), (float)N.y(), (float)N.z(), (float)R.x(), (float)R.y(), (float)R.z(),
+                     { mat.k_d.r(), mat.k_d.g(), mat.k_d.b() }, { mat.k_r.r(), mat.k_r.g(), mat.k_r.b() }, mat.n };
+    PhongLightBatch batch;
+    int numInBatch = 0;
+    float phong[3] = { 0.0f, 0.0f, 0.0f };
+
+    for(int j = 0; j < numLights; j++){
+        int i = lights? lights[j].light : j;
+        Real Tmax;
+        Ray sRay = shadowRay(hitPoint, scene.ptLight[i], Tmax);
+        if(hasShadow){
+            bool hitChecker = false;
+            if (occluded) hitChecker = occluded[j];
+            else if (shadowCache) hitChecker = shadowCache->occluded(*scene.accel, i, sRay, DEFAULT_TMIN, Tmax);
+            else hitChecker = scene.accel->shadowHit(sRay, DEFAULT_TMIN, Tmax);
+            if (hitChecker) continue;
+        }
+
+        Vector3d L = sRay.direction();
+        double l[3] = { L.x(), L.y(), L.z() };
+        Color I = scene.ptLight[i].I_source * (scene.ptLight[i].falloff(Tmax * Tmax) * (lights? lights[j].weight : 1.0f));
+        float intensity[3] = { I.r(), I.g(), I.b() };
+        PhongKernel::SetLane(batch, numInBatch++, l, intensity);
+
+        if (numInBatch == PHONG_BATCH_WIDTH){
+            PhongKernel::Shade(hit, batch, numInBatch, phong);
+            numInBatch = 0;
+        }
+    }
+    if (numInBatch > 0){
+        PhongKernel::ClearLanes(batch, numInBatch);
+        PhongKernel::Shade(hit, batch, numInBatch, phong);
+    }
+    result += Color(phong[0], phong[1], phong[2]);
+
+    // Add to result the global ambient lighting.
+
+    //***********************************************
+    //*********** WRITE YOUR CODE HERE **************
+    //***********************************************
+   result += hitPoint.mat_ptr->k_a * scene.amLight.I_a;
+
+    return result;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// The local color of a hit is at most its ambient color plus the lights
+// that shade it times k_d + k_r, with N.L and (R.V)^n at most 1. With a
+// light culler, the lights that shade any one point add up to at most
+// LightCuller::maxIntensity(), whatever the samples drawn; without one,
+// every light shades every point.
+//////////////////////////////////////////////////////////////////////////////
+
+void Raytrace::BoundPaths( Scene &scene )
+{
+    PathBound &bound = scene.pathBound;
+    bound.maxColor = Util::Max3( scene.backgroundColor.r(), scene.backgroundColor.g(), scene.backgroundColor.b() );
+    bound.maxK_rg = 0.0f;
+
+    for ( int m = 0; m < scene.numMaterials; m++ )
+    {
+        const Material &mat = scene.material[m];
+        Color c = mat.k_a * scene.amLight.I_a;
+        Color reflect = mat.k_d + mat.k_r;
+        float maxLocal;
+
+        if ( scene.lightCuller )
+            maxLocal = Util::Max3( c.r(), c.g(), c.b() ) +
+                       Util::Max3( reflect.r(), reflect.g(), reflect.b() ) * scene.lightCuller->maxIntensity();
+        else
+        {
+            for ( int i = 0; i < scene.numPtLights; i++ )
+                c += scene.ptLight[i].I_source * reflect;
+            maxLocal = Util::Max3( c.r(), c.g(), c.b() );
+        }
+
+        bound.maxColor = Util::Max2( bound.maxColor, maxLocal );
+        bound.maxK_rg = Util::Max2( bound.maxK_rg, Util::Max3( mat.k_rg.r(), mat.k_rg.g(), mat.k_rg.b() ) );
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Decides, as Raytrace::pathEnd says, whether a path of the given weight
+// goes on along the reflection ray next, which adds its color times
+// k_rg, with levelsLeft more reflections after it. Russian roulette
+// scales k_rg up for the paths that go on, so the expected color stays
+// the same. The random number is hashed from the ray, so it does not
+// depend on the order in which the rays are traced.
+//////////////////////////////////////////////////////////////////////////////
+
+static bool continuePath( Color &k_rg, const Color &weight, int levelsLeft, const PathBound &bound,
+                          const Ray &next )
+{
+    if ( Raytrace::pathEnd == PATH_END_DEPTH ) return true;
+
+    Color w = weight * k_rg;
+    float maxWeight = Util::Max3( w.r(), w.g(), w.b() );
+
+    if ( Raytrace::pathEnd == PATH_END_ROULETTE )
+    {
+        if ( maxWeight >= PATH_ROULETTE_WEIGHT ) return true;
+        float survive = maxWeight / PATH_ROULETTE_WEIGHT;
+
+        Vector3d o = next.origin(), d = next.direction();
+        double v[6] = { o.x(), o.y(), o.z(), d.x(), d.y(), d.z() };
+        float u = Util::HashUniform( v, 6 );
+
+        if ( u >= survive ) return false;
+        k_rg /= survive;
+        return true;
+    }
+
+    // The rest of the path adds at most w * maxColor * ( 1 + maxK_rg + ... + maxK_rg^levelsLeft ).
+    float sum = 0.0f, power = 1.0f;
+    for ( int j = 0; j <= levelsLeft; j++ )
+    {
+        sum += power;
+        power *= bound.maxK_rg;
+    }
+    return maxWeight * bound.maxColor * sum >= PATH_MIN_CONTRIBUTION;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Computes the color seen along the unit-direction ray uRay, which hits
+// the scene at hitRec, following its reflections in a loop. The point of
+// each hit is made from its record as it is shaded. The local
+// color and k_rg of every bounce are kept on a stack, and combined at the
+// end from the last bounce back to the first, as the recursion of
+// TraceRay() used to, so the colors are the same as long as no path is
+// ended early.
 //////////////////////////////////////////////////////////////////////////////
 
-static Color computePhongLighting( const Vector3d &L, const Vector3d &N, const Vector3d &V,
-                                   const Material &mat, const PointLightSource &ptLight )
+static Color tracePath( Ray uRay, SurfaceHitRecord &hitRec, const Scene &scene,
+                        int reflectLevels, bool hasShadow, ShadowCache *shadowCache )
 {
-    Vector3d R = mirrorReflect(L, N);
+    Color stackLocal[ PATH_STACK_SIZE ], stackK_rg[ PATH_STACK_SIZE ];
+    vector<Color> heap;
+    Color *local = stackLocal, *k_rg = stackK_rg;
+    if ( reflectLevels >= PATH_STACK_SIZE )
+    {
+        heap.resize( 2 * ( reflectLevels + 1 ) );
+        local = &heap[0];
+        k_rg = &heap[ reflectLevels + 1 ];
+    }
+
+    const PathBound &bound = scene.pathBound;
 
-    float N_dot_L = (float)dot(N, L);
-    if (N_dot_L < 0.0f) N_dot_L = 0.0f;
+    Color weight( 1.0f, 1.0f, 1.0f );
+    int last = 0;
+
+    // Kept by each thread from path to path, so it is not allocated anew.
+    static thread_local vector<LightSample> lights;
+    SurfaceHitPoint hitPoint;
+
+    for ( int bounce = 0; ; bounce++ )
+    {
+        makeHitPoint( uRay, hitRec, hitPoint );
+        hitPoint.normal.makeUnitVector();
+        Vector3d N = hitPoint.normal;       // Unit vector.
+        Vector3d V = -uRay.direction();     // Unit vector.
+
+        int numLights = 0;
+        if ( scene.lightCuller )
+        {
+            lights.clear();
+            numLights = scene.lightCuller->select( hitPoint.p, lights );
+        }
 
-    float R_dot_V = (float)dot(R, V);
-    if (R_dot_V < 0.0f) R_dot_V = 0.0f;
-    float R_dot_V_pow_n = powf(R_dot_V, (float)mat.n);
+        local[bounce] = localLighting( hitPoint, N, V, scene, scene.lightCuller? lights.data() : NULL, numLights,
+                                       hasShadow, NULL, shadowCache );
+        last = bounce;
+        if ( bounce == reflectLevels ) break;
+
+        // Reflect the ray.
+        k_rg[bounce] = hitPoint.mat_ptr->k_rg;
+        Vector3d reflectedRay = mirrorReflect( V, N ).makeUnitVector();
+        uRay = Ray( Raytrace::LeavingOrigin( hitPoint, reflectedRay ), reflectedRay );
+        uRay.makeUnitDirection();
+        if ( !continuePath( k_rg[bounce], weight, reflectLevels - bounce - 1, bound, uRay ) ) break;
+        weight *= k_rg[bounce];
+
+        last = bounce + 1;
+        if ( !scene.accel->hit( uRay, DEFAULT_TMIN, DEFAULT_TMAX, hitRec ) )
+        {
+            local[ bounce + 1 ] = scene.backgroundColor;
+            break;
+        }
+    }
 
-    return ptLight.I_source * (mat.k_d * N_dot_L + mat.k_r * R_dot_V_pow_n);
+    Color result = local[last];
+    for ( int bounce = last - 1; bounce >= 0; bounce-- )
+    {
+        Color c = local[bounce];
+        c += result * k_rg[bounce];
+        result = c;
+    }
+    return result;
 }
 
 
@@ -69,7 +320,7 @@ static Color computePhongLighting( const Vector3d &L, const Vector3d &N, const V
 //////////////////////////////////////////////////////////////////////////////
 
 Color Raytrace::TraceRay( const Ray &ray, const Scene &scene, 
-                          int reflectLevels, bool hasShadow )
+                          int reflectLevels, bool hasShadow, ShadowCache *shadowCache )
 {
     Ray uRay( ray );
     uRay.makeUnitDirection();  // Normalize ray direction.
@@ -78,88 +329,197 @@ Color Raytrace::TraceRay( const Ray &ray, const Scene &scene,
 // Find whether and where the ray hits some surface. 
 // Take the nearest hit point.
 
-    bool hasHitSomething = false;
-    double nearest_t = DEFAULT_TMAX;
     SurfaceHitRecord nearestHitRec;
-
-    for ( int i = 0; i < scene.numSurfaces; i++ )
-    {
-        SurfaceHitRecord tempHitRec;
-        bool hasHit = scene.surfacep[i]->hit( uRay, DEFAULT_TMIN, DEFAULT_TMAX, tempHitRec );
-
-        if ( hasHit && tempHitRec.t < nearest_t )
-        {
-            hasHitSomething = true;
-            nearest_t = tempHitRec.t;
-            nearestHitRec = tempHitRec;
-        }
-    }
+    bool hasHitSomething = scene.accel->hit( uRay, DEFAULT_TMIN, DEFAULT_TMAX, nearestHitRec );
 
     if ( !hasHitSomething ) return scene.backgroundColor;
 
-    nearestHitRec.normal.makeUnitVector();
-    Vector3d N = nearestHitRec.normal;  // Unit vector.
-    Vector3d V = -uRay.direction();     // Unit vector.
+    return tracePath( uRay, nearestHitRec, scene, reflectLevels, hasShadow, shadowCache );
+}
 
-    Color result( 0.0f, 0.0f, 0.0f );   // The result will be accumulated here.
 
 
-    ////////////////////////////////////
-    ////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+// Traces numRays rays, finding their nearest hits together with
+// Surface::hitPacket(), and shades each as TraceRay() would.
+//////////////////////////////////////////////////////////////////////////////
 
+void Raytrace::TracePacket( const Ray *rays, int numRays, const Scene &scene,
+                            int reflectLevels, bool hasShadow, Color *colors,
+                            ShadowCache *shadowCache )
+{
+    Ray uRays[ PACKET_CHUNK_SIZE ];
+    SurfaceHitRecord hitRecs[ PACKET_CHUNK_SIZE ];
+    bool hits[ PACKET_CHUNK_SIZE ];
 
-// Add to result the phong lighting contributed by each point light source.
-// Compute for shadow if hasShadow is true.
+    for ( int first = 0; first < numRays; first += PACKET_CHUNK_SIZE )
+    {
+        int n = ( numRays - first < PACKET_CHUNK_SIZE )? numRays - first : PACKET_CHUNK_SIZE;
 
-    //***********************************************
-    //*********** WRITE YOUR CODE HERE **************
-    //***********************************************
-    
-    if(hasShadow){
-        for(int i = 0;i < scene.numPtLights; i++){
-            bool hitChecker = false;
-            Vector3d L = scene.ptLight[i].position - nearestHitRec.p;
-            double Tmax  = L.length()/(L.makeUnitVector().length());
-            L = L.makeUnitVector();
-            for(int k = 0; k < scene.numSurfaces;k++){
-                hitChecker = scene.surfacep[k]->shadowHit(Ray(nearestHitRec.p, L), DEFAULT_TMIN, Tmax);
-                if(hitChecker){
-                break;
-                }
-            }
-            if(!hitChecker){
-                result += computePhongLighting(L, N, V.makeUnitVector(), *nearestHitRec.mat_ptr, scene.ptLight[i]);
-            }
-        }
-    }
-    else{
-        for(int i = 0; i < scene.numPtLights; i++){
-            Vector3d L = scene.ptLight[i].position - nearestHitRec.p;
-            L = L.makeUnitVector();
-            result += computePhongLighting(L, N, V, *nearestHitRec.mat_ptr, scene.ptLight[i]);
+        for ( int i = 0; i < n; i++ )
+        {
+            uRays[i] = rays[ first + i ];
+            uRays[i].makeUnitDirection();  // Normalize ray direction.
         }
+
+        scene.accel->hitPacket( uRays, n, DEFAULT_TMIN, DEFAULT_TMAX, hitRecs, hits );
+
+        for ( int i = 0; i < n; i++ )
+            colors[ first + i ] = hits[i]? tracePath( uRays[i], hitRecs[i], scene, reflectLevels, hasShadow, shadowCache )
+                                         : scene.backgroundColor;
     }
+}
 
-    // Add to result the global ambient lighting.
 
-    //***********************************************
-    //*********** WRITE YOUR CODE HERE **************
-    //***********************************************
-   result += nearestHitRec.mat_ptr->k_a * scene.amLight.I_a;
 
+//////////////////////////////////////////////////////////////////////////////
+// Traces numRays rays breadth first. Each bounce traces the queue of rays
+// still alive, then the queue of shadow rays of their hits, then shades
+// the hits and makes the queue of reflection rays for the next bounce.
+// The primary rays are sorted by direction octant only, as they come in
+// coherent blocks from one origin; the reflection and shadow rays are
+// sorted as sortMode says. The local color and k_rg of every bounce of a ray are
+// kept, and combined at the end from the last bounce back to the first,
+// in the order of TraceRay(), and paths end where TraceRay() would end
+// them, so the colors are exactly those of TraceRay().
+//////////////////////////////////////////////////////////////////////////////
 
+void Raytrace::TraceWavefront( const Ray *rays, int numRays, const Scene &scene,
+                               int reflectLevels, bool hasShadow, Color *colors,
+                               RaySortMode sortMode, ShadowCache *shadowCache )
+{
+    int numBounces = reflectLevels + 1;
 
-    // Add to result the reflection of the scene.
+    vector<Color> local( numRays * numBounces );   // Local color, then k_rg, of each bounce.
+    vector<Color> k_rg( numRays * numBounces );
+    vector<int> lastBounce( numRays );
+    vector<Color> weight( numRays, Color( 1.0f, 1.0f, 1.0f ) );
 
-    //***********************************************
-    //*********** WRITE YOUR CODE HERE **************
-    //***********************************************
-    if(reflectLevels != 0){
-    Vector3d reflectedRay = mirrorReflect(V, N);
-    result += TraceRay(Ray(nearestHitRec.p, reflectedRay.makeUnitVector()), scene, reflectLevels - 1, hasShadow) * nearestHitRec.mat_ptr->k_rg;
+    const PathBound &bound = scene.pathBound;
+
+    vector<Ray> pathRays( rays, rays + numRays );
+    vector<int> queue( numRays );
+    for ( int i = 0; i < numRays; i++ )
+    {
+        pathRays[i].makeUnitDirection();  // Normalize ray direction.
+        queue[i] = i;
     }
 
+    vector<Ray> batch;
+    vector<SurfaceHitRecord> hitRecs;
+    vector<SurfaceHitPoint> hitPoints;
+    unique_ptr<bool[]> hits;
+    vector<LightSample> lights;     // Those that shade each hit, from firstLight[q].
+    vector<int> firstLight;
+    vector<Ray> shadowRays;         // One per light of each hit.
+    vector<Real> shadowTmax;
+    vector<int> shadowQueue;
+    unique_ptr<bool[]> occluded;
+    vector<int> nextQueue;
+    RaySort sorter;
+
+    for ( int bounce = 0; !queue.empty(); bounce++ )
+    {
+        // Trace the rays of the bounce.
+        sorter.sort( queue, &pathRays[0], ( bounce == 0 )? RAY_SORT_OCTANT : sortMode );
+        int n = (int) queue.size();
+        batch.resize( n );
+        hitRecs.resize( n );
+        hitPoints.resize( n );
+        hits.reset( new bool[n] );
+        for ( int q = 0; q < n; q++ ) batch[q] = pathRays[ queue[q] ];
+
+        scene.accel->hitPacket( &batch[0], n, DEFAULT_TMIN, DEFAULT_TMAX, &hitRecs[0], hits.get() );
+
+        // Make the points of the hits, and pick their lights.
+        lights.clear();
+        firstLight.resize( n + 1 );
+        for ( int q = 0; q < n; q++ )
+        {
+            firstLight[q] = (int) lights.size();
+            if ( !hits[q] ) continue;
+            makeHitPoint( batch[q], hitRecs[q], hitPoints[q] );
+            hitPoints[q].normal.makeUnitVector();
+            if ( scene.lightCuller )
+                scene.lightCuller->select( hitPoints[q].p, lights );
+            else
+                for ( int i = 0; i < scene.numPtLights; i++ )
+                {
+                    LightSample s = { i, 1.0f };
+                    lights.push_back( s );
+                }
+        }
+        firstLight[n] = (int) lights.size();
+
+        // Trace the shadow rays of the hits, light by light.
+        int numShadowRays = hasShadow? (int) lights.size() : 0;
+        shadowRays.resize( numShadowRays );
+        shadowTmax.resize( numShadowRays );
+        shadowQueue.resize( numShadowRays );
+        for ( int q = 0; q < n && hasShadow; q++ )
+            for ( int k = firstLight[q]; k < firstLight[ q + 1 ]; k++ )
+            {
+                shadowRays[k] = shadowRay( hitPoints[q], scene.ptLight[ lights[k].light ], shadowTmax[k] );
+                shadowQueue[k] = k;
+            }
+
+        if ( !shadowQueue.empty() ) sorter.sort( shadowQueue, &shadowRays[0], sortMode );
+        occluded.reset( new bool[ numShadowRays + 1 ] );
+        for ( size_t s = 0; s < shadowQueue.size(); s++ )
+        {
+            int k = shadowQueue[s];
+            occluded[k] = shadowCache? shadowCache->occluded( *scene.accel, lights[k].light, shadowRays[k], DEFAULT_TMIN, shadowTmax[k] )
+                                     : scene.accel->shadowHit( shadowRays[k], DEFAULT_TMIN, shadowTmax[k] );
+        }
 
+        // Shade the hits, and reflect the rays for the next bounce.
+        nextQueue.clear();
+        for ( int q = 0; q < n; q++ )
+        {
+            int path = queue[q];
+            int slot = path * numBounces + bounce;
+            lastBounce[path] = bounce;
+
+            if ( !hits[q] )
+            {
+                local[slot] = scene.backgroundColor;
+                continue;
+            }
 
-    return result;
+            const SurfaceHitPoint &hitPoint = hitPoints[q];
+            Vector3d N = hitPoint.normal;           // Unit vector.
+            Vector3d V = -batch[q].direction();     // Unit vector.
+
+            local[slot] = localLighting( hitPoint, N, V, scene, lights.data() + firstLight[q], firstLight[ q + 1 ] - firstLight[q],
+                                         hasShadow, &occluded[0] + firstLight[q], NULL );
+            k_rg[slot] = hitPoint.mat_ptr->k_rg;
+
+            if ( bounce < reflectLevels )
+            {
+                Vector3d reflectedRay = mirrorReflect( V, N ).makeUnitVector();
+                pathRays[path] = Ray( Raytrace::LeavingOrigin( hitPoint, reflectedRay ), reflectedRay );
+                pathRays[path].makeUnitDirection();
+                if ( continuePath( k_rg[slot], weight[path], reflectLevels - bounce - 1, bound, pathRays[path] ) )
+                {
+                    weight[path] *= k_rg[slot];
+                    nextQueue.push_back( path );
+                }
+            }
+        }
+        queue.swap( nextQueue );
+    }
+
+    // Add up the bounces of each ray from the last.
+    for ( int path = 0; path < numRays; path++ )
+    {
+        int slot = path * numBounces;
+        Color result = local[ slot + lastBounce[path] ];
+        for ( int bounce = lastBounce[path] - 1; bounce >= 0; bounce-- )
+        {
+            Color c = local[ slot + bounce ];
+            c += result * k_rg[ slot + bounce ];
+            result = c;
+        }
+        colors[path] = result;
+    }
 }
@@ -4,20 +4,93 @@
 #include "Color.h"
 #include "Ray.h"
 #include "Scene.h"
+#include "RaySort.h"
+#include "ShadowCache.h"
+
+
+// Rays that leave a surface start off it (see Raytrace::LeavingOrigin()), so
+// that they cannot hit it again, and need no epsilon against the shadow
+// acne problem.
+#define DEFAULT_TMIN    0.0
+
+// Use this for tmax for non-shadow ray intersection test.
+#define DEFAULT_TMAX    REAL_MAX
+
+
+// How a path of reflections ends before reflectLevels.
+enum PathEnd
+{
+    PATH_END_DEPTH,         // Never.
+    PATH_END_CONTRIBUTION,  // Where the rest could not change the 8-bit color.
+    PATH_END_ROULETTE       // By Russian roulette once its weight is low.
+};
 
 
 class Raytrace
 {
 public:
 
+    // How paths end in all the Trace functions. PATH_END_CONTRIBUTION
+    // changes an 8-bit color by at most 1 from PATH_END_DEPTH. Russian
+    // roulette is unbiased but adds noise, and suits high reflectLevels.
+    static PathEnd pathEnd;
+
+
     //////////////////////////////////////////////////////////////////////////////
     // Traces a ray into the scene.
     // reflectLevel: specfies number of levels of reflections (0 for no reflection).
     // hasShadow: specifies whether to generate shadows.
+    // The reflections are followed in a loop, at most reflectLevels deep,
+    // and less as pathEnd says.
+    // shadowCache: if not NULL, the shadow rays are traced through it. It
+    // may be used by one thread at a time, here and in the functions below.
     //////////////////////////////////////////////////////////////////////////////
 
     static Color TraceRay( const Ray &ray, const Scene &scene, 
-                           int reflectLevels, bool hasShadow );
+                           int reflectLevels, bool hasShadow, ShadowCache *shadowCache = NULL );
+
+
+    //////////////////////////////////////////////////////////////////////////////
+    // Traces numRays coherent rays, such as the primary rays of a block of
+    // pixels, into colors. The nearest hits of the rays are found together,
+    // and the result for each ray is that of TraceRay().
+    //////////////////////////////////////////////////////////////////////////////
+
+    static void TracePacket( const Ray *rays, int numRays, const Scene &scene,
+                             int reflectLevels, bool hasShadow, Color *colors,
+                             ShadowCache *shadowCache = NULL );
+
+
+    //////////////////////////////////////////////////////////////////////////////
+    // Traces numRays rays into colors breadth first, one bounce of all of
+    // them at a time, in queues of rays sorted by direction, and by origin
+    // too with RAY_SORT_MORTON. The result for each ray is that of TraceRay().
+    //////////////////////////////////////////////////////////////////////////////
+
+    static void TraceWavefront( const Ray *rays, int numRays, const Scene &scene,
+                                int reflectLevels, bool hasShadow, Color *colors,
+                                RaySortMode sortMode = RAY_SORT_OCTANT, ShadowCache *shadowCache = NULL );
+
+
+
+    //////////////////////////////////////////////////////////////////////////////
+    // Sets scene.pathBound, with which the Trace functions end paths as
+    // pathEnd says, from the materials, the lights and the light culler of
+    // the scene. Must be called again whenever they change.
+    //////////////////////////////////////////////////////////////////////////////
+
+    static void BoundPaths( Scene &scene );
+
+
+    //////////////////////////////////////////////////////////////////////////////
+    // Returns the origin of a ray that leaves the hit towards the side of the
+    // surface that dir points to, and is traced from DEFAULT_TMIN. It is one
+    // of the two that makeHitPoint() made for the hit, which cannot hit the
+    // surface again, whatever the scale of the scene.
+    //////////////////////////////////////////////////////////////////////////////
+
+    static const Vector3d &LeavingOrigin( const SurfaceHitPoint &hitPoint, const Vector3d &dir )
+        { return ( dot( dir, hitPoint.ng ) < 0.0 )? hitPoint.originBelow : hitPoint.originAbove; }
 
 };
 
@@ -0,0 +1,418 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include "Util.h"
+#include "BVH.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Spatial split BVH (SBVH) builder of class BVH.
+//
+// Long, thin triangles have large boxes that overlap those of their
+// neighbours, so no split of the primitives (an object split) separates
+// them well. Besides the binned object split of the SAH build, each node
+// also considers splitting space: a plane cuts the node box, and a
+// primitive that straddles it is referenced on both sides, each reference
+// bounded by the part of the triangle on its side (the triangle is
+// clipped to the bins of the plane sweep). The cheaper split is taken.
+//
+// Spatial splits are only tried where the two sides of the best object
+// split overlap by a noticeable fraction of the scene, and the number of
+// references may grow by at most the split budget, a fraction of the
+// number of primitives; once it is spent, the build goes on with object
+// splits only. A straddling reference that is cheaper whole on one side
+// is not split ("unsplitting").
+//
+// The leaves hold references to whole primitives, which are intersected
+// in full, so a hit is found wherever it lies in the triangle; the same
+// primitive may just be tested in several leaves.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+// Number of bins per axis of the spatial split sweep.
+#define SBVH_SPATIAL_BINS       32
+
+// Spatial splits are tried where the sides of the best object split
+// overlap by more than this fraction of the area of the scene.
+#define SBVH_MIN_OVERLAP        1e-5
+
+// Clipped boxes are widened by this many ulps of their coordinates, to
+// cover the rounding of the clipping.
+#define SBVH_CLIP_ERROR_ULPS    4.0
+
+
+
+class SBVHBuilder
+{
+public:
+
+    SBVHBuilder( BVH &bvh, int numPrims, double splitBudget, const AABB &sceneBox );
+
+    int build( vector<BVH::BuildPrim> &refs, int depth );
+
+private:
+
+    struct SpatialSplit
+    {
+        int axis;           // -1 if none.
+        int bin;            // The plane is at the start of this bin.
+        double cost;        // Sum of area times count of the two sides.
+        double lo, binWidth;
+        AABB leftBox, rightBox;
+        int leftCount, rightCount;
+
+        SpatialSplit() : axis( -1 ), cost( DBL_MAX ) {}
+        double plane() const { return lo + bin * binWidth; }
+        int binOf( double x ) const
+        {
+            int b = (int)( ( x - lo ) / binWidth );
+            return ( b < 0 )? 0 : ( b >= SBVH_SPATIAL_BINS )? SBVH_SPATIAL_BINS - 1 : b;
+        }
+    };
+
+    void findSpatialSplit( const vector<BVH::BuildPrim> &refs, const AABB &box, SpatialSplit &split ) const;
+    void partitionSpatial( vector<BVH::BuildPrim> &refs, const SpatialSplit &split,
+                           vector<BVH::BuildPrim> &left, vector<BVH::BuildPrim> &right );
+    bool clip( const BVH::BuildPrim &ref, int axis, Real lo, Real hi, AABB &box ) const;
+
+    BVH &mBvh;
+    double mMinOverlapArea;
+    long long mNumRefs;     // References made so far, of at most mMaxRefs.
+    long long mMaxRefs;
+
+}; // SBVHBuilder
+
+
+
+void BVH::buildSBVH( vector<BuildPrim> &buildPrims, double splitBudget )
+{
+    AABB sceneBox;
+    for ( size_t i = 0; i < buildPrims.size(); i++ ) sceneBox.expand( buildPrims[i].box );
+
+    SBVHBuilder builder( *this, (int) buildPrims.size(), splitBudget, sceneBox );
+    builder.build( buildPrims, 0 );
+}
+
+
+
+SBVHBuilder::SBVHBuilder( BVH &bvh, int numPrims, double splitBudget, const AABB &sceneBox )
+    : mBvh( bvh )
+{
+    mMinOverlapArea = SBVH_MIN_OVERLAP * sceneBox.surfaceArea();
+    mNumRefs = numPrims;
+    mMaxRefs = numPrims + (long long)( Util::Max2( splitBudget, 0.0 ) * numPrims );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Builds the subtree over the references, as BVH::buildRecursive does, and
+// returns the index of its root node. The references are consumed.
+//////////////////////////////////////////////////////////////////////////////
+
+int SBVHBuilder::build( vector<BVH::BuildPrim> &refs, int depth )
+{
+    vector<BVH::Node> &nodes = mBvh.mNodes;
+    int nodeIndex = (int) nodes.size();
+    nodes.push_back( BVH::Node() );
+
+    AABB box, centroidBox;
+    int numTriangles = 0;
+    for ( size_t i = 0; i < refs.size(); i++ )
+    {
+        box.expand( refs[i].box );
+        centroidBox.expand( refs[i].centroid );
+        if ( refs[i].isTriangle ) numTriangles++;
+    }
+
+    int count = (int) refs.size();
+    BVH::ObjectSplit objectSplit;
+    SpatialSplit spatialSplit;
+
+    if ( count > 1 && depth < BVH_MAX_DEPTH )
+    {
+        BVH::findObjectSplit( &refs[0], count, centroidBox, objectSplit );
+
+        // Spatial splits pay where the sides of the object split overlap.
+        AABB overlap;
+        for ( int a = 0; a < 3 && objectSplit.axis >= 0; a++ )
+        {
+            overlap.minPt[a] = Util::Max2( objectSplit.leftBox.minPt[a], objectSplit.rightBox.minPt[a] );
+            overlap.maxPt[a] = Util::Min2( objectSplit.leftBox.maxPt[a], objectSplit.rightBox.maxPt[a] );
+        }
+        if ( mNumRefs < mMaxRefs && ( objectSplit.axis < 0 || overlap.surfaceArea() > mMinOverlapArea ) )
+            findSpatialSplit( refs, box, spatialSplit );
+    }
+
+    double area = box.surfaceArea();
+    int numPackets = ( numTriangles + TRI_PACKET_WIDTH - 1 ) / TRI_PACKET_WIDTH;
+    double leafCost = numPackets * SAH_PACKET_COST + ( count - numTriangles );
+    double bestCost = Util::Min2( objectSplit.cost, spatialSplit.cost );
+    double splitCost = ( area > 0.0 && bestCost < DBL_MAX )? SAH_TRAVERSAL_COST + bestCost / area : DBL_MAX;
+
+    bool leaf = ( count <= mBvh.mMaxLeafSize && leafCost <= splitCost );
+    vector<BVH::BuildPrim> left, right;
+    int axis = -1;
+    int childDepth = depth + 1;
+
+    // A spatial split that ends up with every reference whole on one
+    // side falls back to the object split.
+    if ( !leaf && spatialSplit.cost < objectSplit.cost )
+    {
+        partitionSpatial( refs, spatialSplit, left, right );
+        axis = spatialSplit.axis;
+        if ( left.empty() || right.empty() )
+        {
+            left.clear();
+            right.clear();
+            axis = -1;
+        }
+    }
+    if ( !leaf && axis < 0 && objectSplit.axis >= 0 )
+    {
+        for ( size_t i = 0; i < refs.size(); i++ )
+            ( objectSplit.isLeft( refs[i] )? left : right ).push_back( refs[i] );
+        axis = objectSplit.axis;
+    }
+
+    if ( axis < 0 )
+    {
+        // A node that could not be split may exceed the leaf size limit;
+        // chain it into leaves of at most mMaxLeafSize primitives.
+        if ( count <= mBvh.mMaxLeafSize || count <= 1 )
+        {
+            nodes[nodeIndex].box = box;
+            mBvh.makeLeaf( refs, 0, count, nodes[nodeIndex] );
+            return nodeIndex;
+        }
+        left.assign( refs.begin(), refs.begin() + count / 2 );
+        right.assign( refs.begin() + count / 2, refs.end() );
+        axis = box.longestAxis();
+        childDepth = depth;
+    }
+
+    // Free the references of this node before building below it.
+    vector<BVH::BuildPrim>().swap( refs );
+
+    nodes[nodeIndex].box = box;
+    nodes[nodeIndex].count = 0;
+    nodes[nodeIndex].axis = (short) axis;
+    build( left, childDepth );
+    int second = build( right, childDepth );
+    nodes[nodeIndex].offset = second;
+    return nodeIndex;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Finds the plane at a bin boundary of the node box, along any axis, with
+// the lowest SAH cost. Each reference is clipped to every bin it spans,
+// and counted as entering its first bin and leaving its last.
+//////////////////////////////////////////////////////////////////////////////
+
+void SBVHBuilder::findSpatialSplit( const vector<BVH::BuildPrim> &refs, const AABB &box,
+                                    SpatialSplit &split ) const
+{
+    for ( int axis = 0; axis < 3; axis++ )
+    {
+        double lo = box.minPt[axis];
+        double binWidth = ( box.maxPt[axis] - lo ) / SBVH_SPATIAL_BINS;
+        if ( binWidth <= 0.0 ) continue;
+
+        SpatialSplit s;
+        s.axis = axis;
+        s.lo = lo;
+        s.binWidth = binWidth;
+
+        AABB binBox[ SBVH_SPATIAL_BINS ];
+        int entries[ SBVH_SPATIAL_BINS ] = { 0 };
+        int exits[ SBVH_SPATIAL_BINS ] = { 0 };
+
+        for ( size_t i = 0; i < refs.size(); i++ )
+        {
+            const BVH::BuildPrim &ref = refs[i];
+            int first = s.binOf( ref.box.minPt[axis] );
+            int last = s.binOf( ref.box.maxPt[axis] );
+            entries[first]++;
+            exits[last]++;
+
+            if ( first == last )
+            {
+                binBox[first].expand( ref.box );
+                continue;
+            }
+            for ( int b = first; b <= last; b++ )
+            {
+                double binLo = ( b == 0 )? lo : lo + b * binWidth;
+                double binHi = ( b == SBVH_SPATIAL_BINS - 1 )? box.maxPt[axis] : lo + ( b + 1 ) * binWidth;
+                AABB piece;
+                if ( clip( ref, axis, binLo, binHi, piece ) ) binBox[b].expand( piece );
+            }
+        }
+
+        // Sweep from the right to get the box and count of every right side.
+        AABB rightBox[ SBVH_SPATIAL_BINS ];
+        int rightCount[ SBVH_SPATIAL_BINS ];
+        AABB acc;
+        int n = 0;
+        for ( int b = SBVH_SPATIAL_BINS - 1; b > 0; b-- )
+        {
+            acc.expand( binBox[b] );
+            n += exits[b];
+            rightBox[b] = acc;
+            rightCount[b] = n;
+        }
+
+        acc.setEmpty();
+        n = 0;
+        for ( int b = 1; b < SBVH_SPATIAL_BINS; b++ )
+        {
+            acc.expand( binBox[b - 1] );
+            n += entries[b - 1];
+            if ( n == 0 || rightCount[b] == 0 ) continue;
+            double cost = acc.surfaceArea() * n + rightBox[b].surfaceArea() * rightCount[b];
+            if ( cost < split.cost )
+            {
+                split = s;
+                split.bin = b;
+                split.cost = cost;
+                split.leftBox = acc;
+                split.rightBox = rightBox[b];
+                split.leftCount = n;
+                split.rightCount = rightCount[b];
+            }
+        }
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Sends each reference to the side of the plane it lies on, by the same
+// bins as the sweep. A straddling reference is split in two clipped
+// references, unless it is cheaper whole on one side, or the split budget
+// is spent.
+//////////////////////////////////////////////////////////////////////////////
+
+void SBVHBuilder::partitionSpatial( vector<BVH::BuildPrim> &refs, const SpatialSplit &split,
+                                    vector<BVH::BuildPrim> &left, vector<BVH::BuildPrim> &right )
+{
+    int axis = split.axis;
+    Real plane = split.plane();
+    double leftArea = split.leftBox.surfaceArea();
+    double rightArea = split.rightBox.surfaceArea();
+    int nl = split.leftCount, nr = split.rightCount;
+
+    for ( size_t i = 0; i < refs.size(); i++ )
+    {
+        const BVH::BuildPrim &ref = refs[i];
+        if ( split.binOf( ref.box.maxPt[axis] ) < split.bin )
+        {
+            left.push_back( ref );
+            continue;
+        }
+        if ( split.binOf( ref.box.minPt[axis] ) >= split.bin )
+        {
+            right.push_back( ref );
+            continue;
+        }
+
+        // Costs of splitting the reference, or of keeping it whole on the left or right.
+        AABB leftWith = split.leftBox, rightWith = split.rightBox;
+        leftWith.expand( ref.box );
+        rightWith.expand( ref.box );
+        double splitCost = leftArea * nl + rightArea * nr;
+        double leftCost = leftWith.surfaceArea() * nl + rightArea * ( nr - 1 );
+        double rightCost = leftArea * ( nl - 1 ) + rightWith.surfaceArea() * nr;
+
+        AABB leftPiece, rightPiece;
+        bool canSplit = mNumRefs < mMaxRefs && splitCost < Util::Min2( leftCost, rightCost ) &&
+                        clip( ref, axis, -REAL_MAX, plane, leftPiece ) &&
+                        clip( ref, axis, plane, REAL_MAX, rightPiece );
+        if ( canSplit )
+        {
+            BVH::BuildPrim piece = ref;
+            piece.box = leftPiece;
+            piece.centroid = leftPiece.centroid();
+            left.push_back( piece );
+            piece.box = rightPiece;
+            piece.centroid = rightPiece.centroid();
+            right.push_back( piece );
+            mNumRefs++;
+        }
+        else if ( leftCost <= rightCost )
+        {
+            left.push_back( ref );
+            nr--;
+        }
+        else
+        {
+            right.push_back( ref );
+            nl--;
+        }
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Computes the box of the part of the reference between the planes lo and
+// hi along the axis. A triangle is clipped to the slab; another primitive
+// has its box cut. Returns false if nothing is left.
+//////////////////////////////////////////////////////////////////////////////
+
+bool SBVHBuilder::clip( const BVH::BuildPrim &ref, int axis, Real lo, Real hi, AABB &box ) const
+{
+    Vector3d v[3];
+    if ( ref.isTriangle && ref.prim.surface->primitiveTriangle( ref.prim.index, v[0], v[1], v[2] ) )
+    {
+        box.setEmpty();
+        for ( int i = 0; i < 3; i++ )
+        {
+            const Vector3d &a = v[i];
+            const Vector3d &b = v[ ( i + 1 ) % 3 ];
+            Real pa = a[axis], pb = b[axis];
+            if ( pa >= lo && pa <= hi ) box.expand( a );
+
+            // Where the edge crosses the planes.
+            Real planes[2] = { lo, hi };
+            for ( int k = 0; k < 2; k++ )
+            {
+                Real p = planes[k];
+                if ( ( pa < p && pb > p ) || ( pa > p && pb < p ) )
+                {
+                    Vector3d q = a + ( ( p - pa ) / ( pb - pa ) ) * ( b - a );
+                    q[axis] = p;
+                    box.expand( q );
+                }
+            }
+        }
+        if ( box.isEmpty() ) return false;
+
+        Real err = SBVH_CLIP_ERROR_ULPS * REAL_EPSILON;
+        for ( int a = 0; a < 3; a++ )
+        {
+            Real m = Util::Max3( fabs( v[0][a] ), fabs( v[1][a] ), fabs( v[2][a] ) );
+            box.minPt[a] -= err * m;
+            box.maxPt[a] += err * m;
+        }
+    }
+    else
+        box = ref.box;
+
+    // Within the slab and the box of the reference, which may already
+    // have been clipped.
+    for ( int a = 0; a < 3; a++ )
+    {
+        box.minPt[a] = Util::Max2( box.minPt[a], ref.box.minPt[a] );
+        box.maxPt[a] = Util::Min2( box.maxPt[a], ref.box.maxPt[a] );
+    }
+    box.minPt[axis] = Util::Max2( box.minPt[axis], lo );
+    box.maxPt[axis] = Util::Min2( box.maxPt[axis], hi );
+    return !box.isEmpty();
+}
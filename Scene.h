@@ -8,17 +8,35 @@
 #include "Surface.h"
 
 
+class LightCuller;
+
+
+// Bounds on the color that the rest of a path can add, whatever it hits,
+// with which Raytrace ends paths early. Set by Raytrace::BoundPaths().
+struct PathBound
+{
+    float maxColor;     // Largest component of a local or background color.
+    float maxK_rg;      // Largest component of k_rg.
+};
+
+
 struct Scene
 {
     SurfacePtr *surfacep;   // Array of pointers to surface primitives.
     int numSurfaces;        // Number of surface primitives in array.
 
+    Surface *accel;         // Acceleration structure built over surfacep.
+
     Material *material;     // Array of materials.
     int numMaterials;       // Number of materials in array.
 
     PointLightSource *ptLight;  // Array of point light sources.
     int numPtLights;            // Number of point light sources in array.
 
+    const LightCuller *lightCuller; // Picks the lights that shade a point, or NULL for all of them.
+
+    PathBound pathBound;    // Set by Raytrace::BoundPaths() once the lights and culler are set.
+
     AmbientLightSource amLight; // The global ambient light source.
 
     Color backgroundColor;      // Use this color if ray hits nothing.
@@ -0,0 +1,92 @@
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include "Scheduler.h"
+
+using namespace std;
+
+
+// A worker's queue of task indices. The owner pops from the front, and
+// thieves steal from the back, so they rarely contend for the same tasks.
+struct TaskQueue
+{
+    mutex lock;
+    deque<int> tasks;
+
+    bool popFront( int &task )
+    {
+        lock_guard<mutex> guard( lock );
+        if ( tasks.empty() ) return false;
+        task = tasks.front();
+        tasks.pop_front();
+        return true;
+    }
+
+    bool popBack( int &task )
+    {
+        lock_guard<mutex> guard( lock );
+        if ( tasks.empty() ) return false;
+        task = tasks.back();
+        tasks.pop_back();
+        return true;
+    }
+};
+
+
+
+int Scheduler::HardwareThreads( void )
+{
+    int n = (int) thread::hardware_concurrency();
+    return ( n > 0 )? n : 1;
+}
+
+
+
+void Scheduler::Run( int numTasks, int numThreads, const function<void( int, int )> &task )
+{
+    if ( numThreads <= 0 ) numThreads = HardwareThreads();
+    if ( numThreads > numTasks ) numThreads = numTasks;
+
+    if ( numThreads <= 1 )
+    {
+        for ( int i = 0; i < numTasks; i++ ) task( i, 0 );
+        return;
+    }
+
+    // Deal out the tasks in contiguous blocks.
+    vector<TaskQueue> queues( numThreads );
+    for ( int t = 0; t < numThreads; t++ )
+    {
+        int begin = (int)( (long long) numTasks * t / numThreads );
+        int end = (int)( (long long) numTasks * ( t + 1 ) / numThreads );
+        for ( int i = begin; i < end; i++ ) queues[t].tasks.push_back( i );
+    }
+
+    // Tasks never create new tasks, so a worker that finds every queue
+    // empty can exit.
+    auto worker = [&]( int self )
+    {
+        int i;
+        while ( true )
+        {
+            if ( queues[self].popFront( i ) )
+            {
+                task( i, self );
+                continue;
+            }
+
+            bool stolen = false;
+            for ( int k = 1; k < numThreads && !stolen; k++ )
+                stolen = queues[ ( self + k ) % numThreads ].popBack( i );
+
+            if ( !stolen ) break;
+            task( i, self );
+        }
+    };
+
+    vector<thread> threads;
+    for ( int t = 1; t < numThreads; t++ ) threads.push_back( thread( worker, t ) );
+    worker( 0 );
+    for ( size_t t = 0; t < threads.size(); t++ ) threads[t].join();
+}
@@ -0,0 +1,37 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <functional>
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Runs a set of independent tasks on a group of worker threads.
+//
+// Tasks are dealt out in contiguous blocks, one block per thread, so that
+// neighbouring tasks (e.g. adjacent image tiles) run on the same thread.
+// Each thread takes tasks from the front of its own queue, and when that
+// is empty, steals from the back of another thread's queue. This keeps
+// all threads busy when task costs are very uneven.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class Scheduler
+{
+public:
+
+    // Returns the number of hardware threads, or 1 if unknown.
+    static int HardwareThreads( void );
+
+    // Runs task( taskIndex, threadIndex ) for every taskIndex in [0, numTasks)
+    // and returns when all have finished. numThreads <= 0 uses all hardware
+    // threads. threadIndex is in [0, numThreads) and identifies the worker,
+    // so the task can use per-thread storage.
+    static void Run( int numTasks, int numThreads, const function<void( int, int )> &task );
+
+}; // Scheduler
+
+
+#endif // _SCHEDULER_H_
@@ -0,0 +1,51 @@
+#include "Instance.h"
+#include "ShadowCache.h"
+
+using namespace std;
+
+
+
+ShadowCache::ShadowCache( int numLights )
+{
+    Occluder none = { NULL, 0, NULL };
+    mLast.assign( numLights, none );
+    mNumRays = mNumOccluded = mNumTested = mNumHits = 0;
+}
+
+
+
+bool ShadowCache::occluded( const Surface &accel, int light, const Ray &r, Real tmin, Real tmax )
+{
+    mNumRays++;
+
+    Occluder &last = mLast[light];
+    if ( last.surface != NULL )
+    {
+        mNumTested++;
+        Ray objectRay = ( last.instance != NULL )? last.instance->toObject( r ) : r;
+        if ( last.surface->shadowHitPrimitive( last.primitive, objectRay, tmin, tmax ) )
+        {
+            mNumHits++;
+            mNumOccluded++;
+            return true;
+        }
+    }
+
+    // The last occluder is kept if the ray is not blocked, as the next
+    // ray may again be in its shadow.
+    Occluder found;
+    if ( !accel.shadowHitOccluder( r, tmin, tmax, found ) ) return false;
+    if ( found.surface != NULL ) last = found;
+    mNumOccluded++;
+    return true;
+}
+
+
+
+void ShadowCache::addStats( const ShadowCache &other )
+{
+    mNumRays += other.mNumRays;
+    mNumOccluded += other.mNumOccluded;
+    mNumTested += other.mNumTested;
+    mNumHits += other.mNumHits;
+}
@@ -0,0 +1,55 @@
+#ifndef _SHADOWCACHE_H_
+#define _SHADOWCACHE_H_
+
+#include <vector>
+#include "Ray.h"
+#include "Surface.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Remembers, for each light, the primitive that last blocked a shadow ray
+// towards it, and tests that primitive first for the next shadow ray
+// before the any-hit query of the acceleration structure. Neighbouring
+// pixels are often in the shadow of the same primitive, and then one
+// primitive test replaces a whole traversal.
+//
+// The answer is always that of the full query, as a primitive test finds
+// a block only where the traversal would. A cache is meant for one
+// thread, which traces coherent rays, such as the pixels of its tiles.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class ShadowCache
+{
+public:
+
+    explicit ShadowCache( int numLights = 0 );
+
+    // Does any primitive of accel block the shadow ray towards the light
+    // in [tmin, tmax]?
+    bool occluded( const Surface &accel, int light, const Ray &r, Real tmin, Real tmax );
+
+    // Adds the counts of another cache, such as that of another thread.
+    void addStats( const ShadowCache &other );
+
+    long long numRays() const { return mNumRays; }
+
+    // Rays that are blocked.
+    long long numOccluded() const { return mNumOccluded; }
+
+    // Rays with an occluder to test first, and those it blocked.
+    long long numTested() const { return mNumTested; }
+    long long numHits() const { return mNumHits; }
+
+private:
+
+    vector<Occluder> mLast;  // Per light.
+    long long mNumRays, mNumOccluded, mNumTested, mNumHits;
+
+}; // ShadowCache
+
+
+#endif // _SHADOWCACHE_H_
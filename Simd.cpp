@@ -0,0 +1,66 @@
+#include "Simd.h"
+
+#if defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) )
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+
+// The kernels are only built for x86; see CMakeLists.txt.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#endif
+
+
+
+SimdLevel Simd::DetectLevel( void )
+{
+#if defined(SIMD_X86) && defined(__GNUC__)
+
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx512f" ) ) return SIMD_AVX512;
+    if ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ) return SIMD_AVX2;
+    if ( __builtin_cpu_supports( "sse4.1" ) ) return SIMD_SSE4;
+    return SIMD_SCALAR;
+
+#elif defined(SIMD_X86) && defined(_MSC_VER)
+
+    int info[4];
+    __cpuid( info, 1 );
+    bool sse41 = ( info[2] & ( 1 << 19 ) ) != 0;
+    bool fma = ( info[2] & ( 1 << 12 ) ) != 0;
+    bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+
+    // The OS must save the AVX (and AVX-512) registers on context switches.
+    unsigned long long xcr0 = osxsave? _xgetbv( 0 ) : 0;
+    bool osAvx = ( xcr0 & 0x6 ) == 0x6;
+    bool osAvx512 = ( xcr0 & 0xe6 ) == 0xe6;
+
+    __cpuidex( info, 7, 0 );
+    bool avx2 = ( info[1] & ( 1 << 5 ) ) != 0;
+    bool avx512f = ( info[1] & ( 1 << 16 ) ) != 0;
+
+    if ( avx512f && osAvx512 ) return SIMD_AVX512;
+    if ( avx2 && fma && osAvx ) return SIMD_AVX2;
+    if ( sse41 ) return SIMD_SSE4;
+    return SIMD_SCALAR;
+
+#else
+
+    return SIMD_SCALAR;
+
+#endif
+}
+
+
+
+const char *Simd::LevelName( SimdLevel level )
+{
+    switch ( level )
+    {
+        case SIMD_SSE4:   return "SSE4.1";
+        case SIMD_AVX2:   return "AVX2";
+        case SIMD_AVX512: return "AVX-512";
+        default:          return "scalar";
+    }
+}
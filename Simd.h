@@ -0,0 +1,29 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+
+// Instruction sets the SIMD kernels are compiled for, in increasing order.
+
+enum SimdLevel
+{
+    SIMD_SCALAR = 0,    // Portable C++.
+    SIMD_SSE4,          // SSE4.1, 4-wide float.
+    SIMD_AVX2,          // AVX2 and FMA, 8-wide float.
+    SIMD_AVX512         // AVX-512F, 16-wide float.
+};
+
+
+
+class Simd
+{
+public:
+
+    // Returns the highest level supported by both the CPU and the build.
+    static SimdLevel DetectLevel( void );
+
+    static const char *LevelName( SimdLevel level );
+
+}; // Simd
+
+
+#endif // _SIMD_H_
@@ -6,35 +6,36 @@ using namespace std;
 
 
 
-bool Sphere::hit( const Ray &r, double tmin, double tmax, SurfaceHitRecord &rec ) const 
+// Finds the nearer positive root of the quadratic of the ray and the
+// sphere, computing the square root once. A double root is taken whatever
+// its sign. The SIMD kernels of SphereKernel.h repeat these operations in
+// the same order, and must be kept in step with them.
+//
+// The quadratic loses much of its precision to cancellation, so it is
+// solved in double whatever the precision of the ray.
+
+bool Sphere::findRoot( const Ray &r, double &t ) const
 {
-    //***********************************************
-    //*********** WRITE YOUR CODE HERE **************
-    //***********************************************
     //Tranform ray to coordinates of Sphere
+    Vector3T<double> dir( r.direction() );
+    Vector3T<double> newVOrigin;
+    newVOrigin.x() =  (double)r.origin().x() - center.x();
+    newVOrigin.y() =  (double)r.origin().y() - center.y();
+    newVOrigin.z() =  (double)r.origin().z() - center.z();
 
-    
-    Vector3d newVOrigin;
-    newVOrigin.x() =  r.origin().x() - center.x();
-    newVOrigin.y() =  r.origin().y() - center.y();
-    newVOrigin.z() =  r.origin().z() - center.z();
-   
-    double a = dot(r.direction(), r.direction());
-    double b = 2 * dot(r.direction(), newVOrigin);
-    double c = dot(newVOrigin, newVOrigin) - (radius * radius);
+    double rad = radius;
+    double a = dot(dir, dir);
+    double b = 2 * dot(dir, newVOrigin);
+    double c = dot(newVOrigin, newVOrigin) - (rad * rad);
     double d = b * b - 4 * a * c;
-    double t;
-    //update SurfaceHItRecord if discrimant is more than or equals to 0
+
     if(d == 0){
         t = (-b + sqrt(d))/(2 * a);
-        if ( t < tmin || t > tmax ) return false;
-        rec.t = t;
-        rec.p = r.pointAtParam(t);
-        rec.normal = (rec.p - center).makeUnitVector();
-        rec.mat_ptr = matp;
+        return true;
     } else if(d > 0) {
-        double t1 = (-b + sqrt(d))/(2 * a);
-        double t2 = (-b - sqrt(d))/(2 * a);
+        double s = sqrt(d);
+        double t1 = (-b + s)/(2 * a);
+        double t2 = (-b - s)/(2 * a);
         if(t2 > 0 && (t1 < 0 || t1 > t2)){
             t = t2;
         } else if(t1 > 0 && (t2 < 0 || t2 > t1)){
@@ -42,54 +43,64 @@ bool Sphere::hit( const Ray &r, double tmin, double tmax, SurfaceHitRecord &rec
         } else {
             return false;
         }
-        if ( t < tmin || t > tmax ) return false;
-        rec.t = t;
-        rec.p = r.pointAtParam(t);
-        rec.normal = (rec.p - center).makeUnitVector();
-        rec.mat_ptr = matp;
-        
-    } else{
-        return false;
+        return true;
     }
+    return false;
+}
+
+
+
+// The point of the ray at t, moved onto the sphere along the radius. As
+// with findRoot, it is computed in double, and is then off the sphere by
+// little more than its rounding to Real.
+
+Vector3d Sphere::pointAt( const Ray &r, double t ) const
+{
+    Vector3T<double> c( center );
+    Vector3T<double> p = Vector3T<double>( r.origin() ) + t * Vector3T<double>( r.direction() );
+    Vector3T<double> d = p - c;
+    return Vector3d( c + d * ( radius / d.length() ) );
+}
+
+
+
+bool Sphere::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const 
+{
+    double t;
+    if ( !findRoot( r, t ) || t < tmin || t > tmax ) return false;
+
+    //update SurfaceHItRecord
+    rec.t = t;
+    rec.surface = this;
+    rec.primitive = 0;
+    rec.instance = NULL;
     return true;
 }
 
 
 
-bool Sphere::shadowHit( const Ray &r, double tmin, double tmax ) const 
+void Sphere::hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const
 {
-    //***********************************************
-    //*********** WRITE YOUR CODE HERE **************
-    //***********************************************
-    //Tranform ray to coordinates of Sphere
+    point.p = pointAt( r, rec.t );
+    point.pError = errorGamma( 5 ) * ( abs( point.p ) + abs( center ) );
+    point.normal = (point.p - center).makeUnitVector();
+    point.ng = point.normal;
+    point.mat_ptr = matp;
+}
 
-    Vector3d newVOrigin;
-    newVOrigin.x() =  r.origin().x() - center.x();
-    newVOrigin.y() =  r.origin().y() - center.y();
-    newVOrigin.z() =  r.origin().z() - center.z();
-   
-    double a = dot(r.direction(), r.direction());
-    double b = 2 * dot(r.direction(), newVOrigin);
-    double c = dot(newVOrigin, newVOrigin) - (radius * radius);
-    double d = b * b - 4 * a * c;
+
+
+bool Sphere::shadowHit( const Ray &r, Real tmin, Real tmax ) const 
+{
     double t;
-      //update SurfaceHItRecord if discrimant is more than or equals to 0
-    if(d == 0){
-        t = (-b + sqrt(d))/(2 * a);
-        if ( t < tmin || t > tmax ) return false;
-    } else if(d > 0) {
-        double t1 = (-b + sqrt(d))/(2 * a);
-        double t2 = (-b - sqrt(d))/(2 * a);
-        if(t2 > 0 && (t1 < 0 || t1 > t2)){
-            t = t2;
-        } else if(t1 > 0 && (t2 < 0 || t2 > t1)){
-            t = t1;
-        } else {
-            return false;
-        }
-        if ( t < tmin || t > tmax ) return false;
-    } else{
-        return false;
-    }
+    return findRoot( r, t ) && !( t < tmin || t > tmax );
+}
+
+
+
+bool Sphere::boundingBox( AABB &box ) const
+{
+    Vector3d r( radius, radius, radius );
+    box = AABB( center - r, center + r );
     return true;
 }
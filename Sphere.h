@@ -1,35 +1,51 @@
-#ifndef _SPHERE_H_  
-#define _SPHERE_H_
-
-#include "Surface.h"
-
-
-class Sphere : public Surface 
-{
-public:
-
-    Vector3d center;
-    double radius;
-
-
-    Sphere( const Vector3d &theCenter, double theRadius, const Material *mat_ptr )
-        { center = theCenter;  radius = theRadius;  matp = mat_ptr; }
-
-
-    virtual bool hit( 
-                    const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax,  // Maximum hit parameter to be searched for.
-                    SurfaceHitRecord &rec 
-                    ) const;
-
-
-    virtual bool shadowHit(        
-                    const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax   // Maximum hit parameter to be searched for.
-                    ) const; 
-
-};
-
-#endif // _SPHERE_H_
+#ifndef _SPHERE_H_  
+#define _SPHERE_H_
+
+#include "Surface.h"
+
+
+class Sphere : public Surface 
+{
+public:
+
+    Vector3d center;
+    Real radius;
+
+
+    Sphere( const Vector3d &theCenter, Real theRadius, const Material *mat_ptr )
+        { center = theCenter;  radius = theRadius;  matp = mat_ptr; }
+
+
+    virtual bool hit( 
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec 
+                    ) const;
+
+
+    virtual bool shadowHit(        
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const; 
+
+
+    virtual void hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const;
+
+
+    virtual bool boundingBox( AABB &box ) const;
+
+
+private:
+
+    // The parameter at which the ray enters the sphere, or leaves it from
+    // inside. Returns false if there is none.
+    bool findRoot( const Ray &r, double &t ) const;
+
+    // The point at which the ray hits the sphere at t.
+    Vector3d pointAt( const Ray &r, double t ) const;
+
+};
+
+#endif // _SPHERE_H_
@@ -0,0 +1,106 @@
+#include <cmath>
+#include <limits>
+#include "SphereKernel.h"
+
+using namespace std;
+
+
+// The scalar kernels, one lane at a time.
+
+namespace
+{
+    typedef double vdouble;
+    typedef bool vmask;
+
+    const int VLANES = 1;
+
+    inline vdouble vset1( double x ) { return x; }
+    inline vdouble vload( const double *p ) { return *p; }
+    inline void vstore( double *p, vdouble a ) { *p = a; }
+    inline vdouble vneg( vdouble a ) { return -a; }
+    inline vdouble vsqrt( vdouble a ) { return sqrt( a ); }
+    inline vdouble vselect( vmask m, vdouble a, vdouble b ) { return m? a : b; }
+    inline vmask vandnot( vmask m, vmask n ) { return !m && n; }
+    inline vmask veq( vdouble a, vdouble b ) { return a == b; }
+    inline vmask vlt( vdouble a, vdouble b ) { return a < b; }
+    inline vmask vgt( vdouble a, vdouble b ) { return a > b; }
+    inline unsigned vbits( vmask m ) { return m? 1u : 0u; }
+
+    #include "SphereKernelImpl.h"
+}
+
+
+
+const SphereKernelSet SphereKernel::SetScalar = { nearestImpl, anyHitImpl, nearestRaysImpl, anyHitRaysImpl };
+
+SphereNearestFn SphereKernel::Nearest = nearestImpl;
+SphereAnyHitFn SphereKernel::AnyHit = anyHitImpl;
+SphereNearestRaysFn SphereKernel::NearestRays = nearestRaysImpl;
+SphereAnyHitRaysFn SphereKernel::AnyHitRays = anyHitRaysImpl;
+SimdLevel SphereKernel::sLevel = SIMD_SCALAR;
+
+// Pick the best kernels before main() runs.
+static SimdLevel sInitialLevel = SphereKernel::Use( Simd::DetectLevel() );
+
+
+
+SimdLevel SphereKernel::Use( SimdLevel level )
+{
+    SimdLevel maxLevel = Simd::DetectLevel();
+    if ( level > maxLevel ) level = maxLevel;
+
+    const SphereKernelSet *set = NULL;
+    while ( set == NULL )
+    {
+        switch ( level )
+        {
+            case SIMD_AVX512: set = SetAVX512; break;
+            case SIMD_AVX2:   set = SetAVX2; break;
+            case SIMD_SSE4:   set = SetSSE4; break;
+            default:          set = &SetScalar; break;
+        }
+        if ( set == NULL ) level = (SimdLevel)( level - 1 );
+    }
+
+    Nearest = set->nearest;
+    AnyHit = set->anyHit;
+    NearestRays = set->nearestRays;
+    AnyHitRays = set->anyHitRays;
+    sLevel = level;
+    return level;
+}
+
+
+
+void SphereKernel::SetLane( SpherePacket &p, int j, const double center[3], double radius )
+{
+    p.cx[j] = center[0];  p.cy[j] = center[1];  p.cz[j] = center[2];
+    p.r2[j] = radius * radius;
+}
+
+
+
+void SphereKernel::ClearLane( SpherePacket &p, int j )
+{
+    p.cx[j] = p.cy[j] = p.cz[j] = numeric_limits<double>::quiet_NaN();
+    p.r2[j] = 0.0;
+}
+
+
+
+void SphereKernel::SetRay( SphereRayPacket &p, int j, const double orig[3], const double dir[3],
+                           double tmin, double tmax )
+{
+    p.ox[j] = orig[0];  p.oy[j] = orig[1];  p.oz[j] = orig[2];
+    p.dx[j] = dir[0];   p.dy[j] = dir[1];   p.dz[j] = dir[2];
+    p.tmin[j] = tmin;   p.tmax[j] = tmax;
+}
+
+
+
+void SphereKernel::ClearRay( SphereRayPacket &p, int j )
+{
+    p.ox[j] = p.oy[j] = p.oz[j] = numeric_limits<double>::quiet_NaN();
+    p.dx[j] = p.dy[j] = p.dz[j] = 0.0;
+    p.tmin[j] = p.tmax[j] = 0.0;
+}
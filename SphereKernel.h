@@ -0,0 +1,141 @@
+#ifndef _SPHEREKERNEL_H_
+#define _SPHEREKERNEL_H_
+
+#include "Simd.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// SIMD ray/sphere tests, in structure-of-arrays double layout: one ray
+// against packets of spheres, and packets of rays against one sphere.
+//
+// The kernels solve the quadratic of Sphere::hit with the same operations
+// in the same order, one square root per sphere, so each lane computes
+// bit for bit the t that Sphere::hit would, and picks the same root. No
+// exact test is needed to confirm a hit, unlike in the triangle kernel.
+// The kernel translation units are compiled without contraction into
+// fused multiply-adds, which would change the rounding.
+//
+// As with the triangle kernel, there is one implementation per
+// instruction set, the best one the CPU supports is picked at startup,
+// and the kernel translation units must not include Vector3d.h. Hence
+// the plain double interface.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+#define SPHERE_PACKET_WIDTH     8
+
+
+// Up to SPHERE_PACKET_WIDTH spheres. Unused lanes have a NaN center, and
+// are never reported.
+struct SpherePacket
+{
+    double cx[ SPHERE_PACKET_WIDTH ], cy[ SPHERE_PACKET_WIDTH ], cz[ SPHERE_PACKET_WIDTH ];
+    double r2[ SPHERE_PACKET_WIDTH ];   // Radius squared.
+};
+
+
+// A ray as seen by the kernel.
+struct SphereRay
+{
+    double ox, oy, oz;  // Origin.
+    double dx, dy, dz;  // Direction.
+};
+
+
+// Up to SPHERE_PACKET_WIDTH rays, each with its own interval. Unused
+// lanes have a NaN origin, and are never reported.
+struct SphereRayPacket
+{
+    double ox[ SPHERE_PACKET_WIDTH ], oy[ SPHERE_PACKET_WIDTH ], oz[ SPHERE_PACKET_WIDTH ];
+    double dx[ SPHERE_PACKET_WIDTH ], dy[ SPHERE_PACKET_WIDTH ], dz[ SPHERE_PACKET_WIDTH ];
+    double tmin[ SPHERE_PACKET_WIDTH ], tmax[ SPHERE_PACKET_WIDTH ];
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Spheres are numbered k * SPHERE_PACKET_WIDTH + j for lane j of
+// packets[k], and so are rays.
+//
+// Nearest: tests the ray against the spheres of packets[0 .. numPackets-1]
+// and returns the one hit nearest at t in [tmin, tmax], with tmax set to
+// its t, or -1 if none is. Of spheres hit at the same t, the last is
+// returned, as by a loop over Sphere::hit that narrows tmax.
+//
+// AnyHit: returns a sphere hit at t in [tmin, tmax], or -1 if none is.
+//
+// NearestRays: tests the rays of packets[0 .. numPackets-1] against the
+// sphere, and sets bit j of masks[k] if ray j of packets[k] hits it at t
+// in its [tmin, tmax], with its tmax then set to t.
+//
+// AnyHitRays: the same, but leaves the rays unchanged.
+//////////////////////////////////////////////////////////////////////////////
+
+typedef int (*SphereNearestFn)( const SphereRay &ray, const SpherePacket *packets, int numPackets,
+                                double tmin, double &tmax );
+
+typedef int (*SphereAnyHitFn)( const SphereRay &ray, const SpherePacket *packets, int numPackets,
+                               double tmin, double tmax );
+
+typedef void (*SphereNearestRaysFn)( SphereRayPacket *packets, int numPackets,
+                                     const double center[3], double r2, unsigned *masks );
+
+typedef void (*SphereAnyHitRaysFn)( const SphereRayPacket *packets, int numPackets,
+                                    const double center[3], double r2, unsigned *masks );
+
+
+// The kernels of one instruction set.
+struct SphereKernelSet
+{
+    SphereNearestFn nearest;
+    SphereAnyHitFn anyHit;
+    SphereNearestRaysFn nearestRays;
+    SphereAnyHitRaysFn anyHitRays;
+};
+
+
+
+class SphereKernel
+{
+public:
+
+    // The kernels in use. Set at startup to the best ones the CPU supports.
+    static SphereNearestFn Nearest;
+    static SphereAnyHitFn AnyHit;
+    static SphereNearestRaysFn NearestRays;
+    static SphereAnyHitRaysFn AnyHitRays;
+
+    static SimdLevel Level( void ) { return sLevel; }
+
+    // Switches to the kernels for the given level, or the best ones below
+    // it that are available. Returns the level actually used.
+    static SimdLevel Use( SimdLevel level );
+
+
+    // Packs the sphere into lane j of packet p.
+    static void SetLane( SpherePacket &p, int j, const double center[3], double radius );
+
+    static void ClearLane( SpherePacket &p, int j );
+
+    // Packs the ray into lane j of packet p.
+    static void SetRay( SphereRayPacket &p, int j, const double orig[3], const double dir[3],
+                        double tmin, double tmax );
+
+    static void ClearRay( SphereRayPacket &p, int j );
+
+
+    // The implementations. Those not built for this platform are NULL.
+    static const SphereKernelSet SetScalar;
+    static const SphereKernelSet *const SetSSE4;
+    static const SphereKernelSet *const SetAVX2;
+    static const SphereKernelSet *const SetAVX512;
+
+private:
+
+    static SimdLevel sLevel;
+
+}; // SphereKernel
+
+
+#endif // _SPHEREKERNEL_H_
@@ -0,0 +1,47 @@
+#include <cstddef>
+#include "SphereKernel.h"
+
+// Compiled with AVX2 enabled; see CMakeLists.txt.
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+
+namespace
+{
+    struct vdouble { __m256d v; };
+    struct vmask { __m256d m; };
+
+    const int VLANES = 4;
+
+    inline vdouble operator+ ( vdouble a, vdouble b ) { vdouble r = { _mm256_add_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator- ( vdouble a, vdouble b ) { vdouble r = { _mm256_sub_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator* ( vdouble a, vdouble b ) { vdouble r = { _mm256_mul_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator/ ( vdouble a, vdouble b ) { vdouble r = { _mm256_div_pd( a.v, b.v ) }; return r; }
+    inline vmask operator& ( vmask a, vmask b ) { vmask r = { _mm256_and_pd( a.m, b.m ) }; return r; }
+    inline vmask operator| ( vmask a, vmask b ) { vmask r = { _mm256_or_pd( a.m, b.m ) }; return r; }
+
+    inline vdouble vset1( double x ) { vdouble r = { _mm256_set1_pd( x ) }; return r; }
+    inline vdouble vload( const double *p ) { vdouble r = { _mm256_loadu_pd( p ) }; return r; }
+    inline void vstore( double *p, vdouble a ) { _mm256_storeu_pd( p, a.v ); }
+    inline vdouble vneg( vdouble a ) { vdouble r = { _mm256_xor_pd( a.v, _mm256_set1_pd( -0.0 ) ) }; return r; }
+    inline vdouble vsqrt( vdouble a ) { vdouble r = { _mm256_sqrt_pd( a.v ) }; return r; }
+    inline vdouble vselect( vmask m, vdouble a, vdouble b ) { vdouble r = { _mm256_blendv_pd( b.v, a.v, m.m ) }; return r; }
+    inline vmask vandnot( vmask m, vmask n ) { vmask r = { _mm256_andnot_pd( m.m, n.m ) }; return r; }
+    inline vmask veq( vdouble a, vdouble b ) { vmask r = { _mm256_cmp_pd( a.v, b.v, _CMP_EQ_OQ ) }; return r; }
+    inline vmask vlt( vdouble a, vdouble b ) { vmask r = { _mm256_cmp_pd( a.v, b.v, _CMP_LT_OQ ) }; return r; }
+    inline vmask vgt( vdouble a, vdouble b ) { vmask r = { _mm256_cmp_pd( a.v, b.v, _CMP_GT_OQ ) }; return r; }
+    inline unsigned vbits( vmask m ) { return (unsigned) _mm256_movemask_pd( m.m ); }
+
+    #include "SphereKernelImpl.h"
+
+    const SphereKernelSet kernelsAVX2 = { nearestImpl, anyHitImpl, nearestRaysImpl, anyHitRaysImpl };
+}
+
+const SphereKernelSet *const SphereKernel::SetAVX2 = &kernelsAVX2;
+
+#else
+
+const SphereKernelSet *const SphereKernel::SetAVX2 = NULL;
+
+#endif
@@ -0,0 +1,54 @@
+#include <cstddef>
+#include "SphereKernel.h"
+
+// Compiled with AVX-512F enabled; see CMakeLists.txt.
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+
+namespace
+{
+    struct vdouble { __m512d v; };
+    struct vmask { __mmask8 m; };
+
+    const int VLANES = 8;
+
+    inline vdouble operator+ ( vdouble a, vdouble b ) { vdouble r = { _mm512_add_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator- ( vdouble a, vdouble b ) { vdouble r = { _mm512_sub_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator* ( vdouble a, vdouble b ) { vdouble r = { _mm512_mul_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator/ ( vdouble a, vdouble b ) { vdouble r = { _mm512_div_pd( a.v, b.v ) }; return r; }
+    inline vmask operator& ( vmask a, vmask b ) { vmask r = { (__mmask8)( a.m & b.m ) }; return r; }
+    inline vmask operator| ( vmask a, vmask b ) { vmask r = { (__mmask8)( a.m | b.m ) }; return r; }
+
+    inline vdouble vset1( double x ) { vdouble r = { _mm512_set1_pd( x ) }; return r; }
+    inline vdouble vload( const double *p ) { vdouble r = { _mm512_loadu_pd( p ) }; return r; }
+    inline void vstore( double *p, vdouble a ) { _mm512_storeu_pd( p, a.v ); }
+    inline vdouble vsqrt( vdouble a ) { vdouble r = { _mm512_sqrt_pd( a.v ) }; return r; }
+    inline vdouble vselect( vmask m, vdouble a, vdouble b ) { vdouble r = { _mm512_mask_blend_pd( m.m, b.v, a.v ) }; return r; }
+    inline vmask vandnot( vmask m, vmask n ) { vmask r = { (__mmask8)( ~m.m & n.m ) }; return r; }
+    inline vmask veq( vdouble a, vdouble b ) { vmask r = { _mm512_cmp_pd_mask( a.v, b.v, _CMP_EQ_OQ ) }; return r; }
+    inline vmask vlt( vdouble a, vdouble b ) { vmask r = { _mm512_cmp_pd_mask( a.v, b.v, _CMP_LT_OQ ) }; return r; }
+    inline vmask vgt( vdouble a, vdouble b ) { vmask r = { _mm512_cmp_pd_mask( a.v, b.v, _CMP_GT_OQ ) }; return r; }
+    inline unsigned vbits( vmask m ) { return m.m; }
+
+    // Flips the sign bit. AVX-512F has no floating-point xor.
+    inline vdouble vneg( vdouble a )
+    {
+        vdouble r = { _mm512_castsi512_pd( _mm512_xor_si512( _mm512_castpd_si512( a.v ),
+                                                             _mm512_set1_epi64( (long long) 0x8000000000000000ULL ) ) ) };
+        return r;
+    }
+
+    #include "SphereKernelImpl.h"
+
+    const SphereKernelSet kernelsAVX512 = { nearestImpl, anyHitImpl, nearestRaysImpl, anyHitRaysImpl };
+}
+
+const SphereKernelSet *const SphereKernel::SetAVX512 = &kernelsAVX512;
+
+#else
+
+const SphereKernelSet *const SphereKernel::SetAVX512 = NULL;
+
+#endif
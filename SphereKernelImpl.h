@@ -0,0 +1,164 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Body of the SIMD ray/sphere kernels, shared by every instruction set.
+//
+// Included by each kernel translation unit, inside an anonymous namespace,
+// after it defines:
+//
+//   vdouble                A vector of VLANES double lanes, with +, -, *, /.
+//   vmask                  A vector of lane flags, with & and |.
+//   VLANES                 The number of lanes, which divides SPHERE_PACKET_WIDTH.
+//   vset1( x )             All lanes set to x.
+//   vload( p ), vstore( p, a )   Unaligned load and store of VLANES doubles.
+//   vneg( a ), vsqrt( a )
+//   vselect( m, a, b )     a in the lanes of m, else b.
+//   vandnot( m, n )        The lanes of n not in m.
+//   veq( a, b ), vlt( a, b ), vgt( a, b )   Lane-wise comparisons.
+//   vbits( m )             The lanes of m as bits of an unsigned.
+//
+// Not a standalone header.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+// Returns the lanes in which the ray hits the sphere at t in [tmin, tmax],
+// with t, computed exactly as in Sphere::hit.
+static inline vmask sphereLanes( vdouble ox, vdouble oy, vdouble oz, vdouble dx, vdouble dy, vdouble dz,
+                                 vdouble cx, vdouble cy, vdouble cz, vdouble r2,
+                                 vdouble tmin, vdouble tmax, vdouble &t )
+{
+    const vdouble zero = vset1( 0.0 );
+
+    vdouble ocx = ox - cx;
+    vdouble ocy = oy - cy;
+    vdouble ocz = oz - cz;
+
+    vdouble a = dx * dx + dy * dy + dz * dz;
+    vdouble b = vset1( 2.0 ) * ( dx * ocx + dy * ocy + dz * ocz );
+    vdouble c = ( ocx * ocx + ocy * ocy + ocz * ocz ) - r2;
+    vdouble d = b * b - vset1( 4.0 ) * a * c;
+
+    // NaN where d < 0, in lanes that are dropped.
+    vdouble s = vsqrt( d );
+    vdouble twoA = vset1( 2.0 ) * a;
+    vdouble t1 = ( vneg( b ) + s ) / twoA;
+    vdouble t2 = ( vneg( b ) - s ) / twoA;
+
+    // The nearer positive root. Where d == 0 the roots are equal, and
+    // t1 is taken whatever its sign.
+    vmask pick2 = vgt( t2, zero ) & ( vlt( t1, zero ) | vgt( t1, t2 ) );
+    vmask pick1 = vgt( t1, zero ) & ( vlt( t2, zero ) | vgt( t2, t1 ) );
+    vmask found = veq( d, zero ) | ( vgt( d, zero ) & ( pick1 | pick2 ) );
+
+    t = vselect( pick2, t2, t1 );
+    return vandnot( vlt( t, tmin ) | vgt( t, tmax ), found );
+}
+
+
+
+static int nearestImpl( const SphereRay &ray, const SpherePacket *packets, int numPackets,
+                        double tmin, double &tmax )
+{
+    vdouble ox = vset1( ray.ox ), oy = vset1( ray.oy ), oz = vset1( ray.oz );
+    vdouble dx = vset1( ray.dx ), dy = vset1( ray.dy ), dz = vset1( ray.dz );
+    vdouble vtmin = vset1( tmin );
+    int nearest = -1;
+
+    for ( int k = 0; k < numPackets; k++ )
+    {
+        const SpherePacket &p = packets[k];
+
+        for ( int h = 0; h < SPHERE_PACKET_WIDTH; h += VLANES )
+        {
+            vdouble t;
+            vmask m = sphereLanes( ox, oy, oz, dx, dy, dz, vload( p.cx + h ), vload( p.cy + h ),
+                                   vload( p.cz + h ), vload( p.r2 + h ), vtmin, vset1( tmax ), t );
+            unsigned bits = vbits( m );
+            if ( bits == 0 ) continue;
+
+            double ts[ VLANES ];
+            vstore( ts, t );
+            for ( int j = 0; j < VLANES; j++ )
+            {
+                if ( ( bits & ( 1u << j ) ) && ts[j] <= tmax )
+                {
+                    tmax = ts[j];
+                    nearest = k * SPHERE_PACKET_WIDTH + h + j;
+                }
+            }
+        }
+    }
+    return nearest;
+}
+
+
+
+static int anyHitImpl( const SphereRay &ray, const SpherePacket *packets, int numPackets,
+                       double tmin, double tmax )
+{
+    vdouble ox = vset1( ray.ox ), oy = vset1( ray.oy ), oz = vset1( ray.oz );
+    vdouble dx = vset1( ray.dx ), dy = vset1( ray.dy ), dz = vset1( ray.dz );
+    vdouble vtmin = vset1( tmin ), vtmax = vset1( tmax );
+
+    for ( int k = 0; k < numPackets; k++ )
+    {
+        const SpherePacket &p = packets[k];
+
+        for ( int h = 0; h < SPHERE_PACKET_WIDTH; h += VLANES )
+        {
+            vdouble t;
+            vmask m = sphereLanes( ox, oy, oz, dx, dy, dz, vload( p.cx + h ), vload( p.cy + h ),
+                                   vload( p.cz + h ), vload( p.r2 + h ), vtmin, vtmax, t );
+            unsigned bits = vbits( m );
+            if ( bits == 0 ) continue;
+
+            int j = 0;
+            while ( !( bits & ( 1u << j ) ) ) j++;
+            return k * SPHERE_PACKET_WIDTH + h + j;
+        }
+    }
+    return -1;
+}
+
+
+
+// Tests the rays, and lowers the tmax of those that hit if update is set.
+static inline void raysImpl( SphereRayPacket *packets, int numPackets, const double center[3],
+                             double r2, unsigned *masks, bool update )
+{
+    vdouble cx = vset1( center[0] ), cy = vset1( center[1] ), cz = vset1( center[2] );
+    vdouble vr2 = vset1( r2 );
+
+    for ( int k = 0; k < numPackets; k++ )
+    {
+        SphereRayPacket &p = packets[k];
+        unsigned mask = 0;
+
+        for ( int h = 0; h < SPHERE_PACKET_WIDTH; h += VLANES )
+        {
+            vdouble t;
+            vdouble tmax = vload( p.tmax + h );
+            vmask m = sphereLanes( vload( p.ox + h ), vload( p.oy + h ), vload( p.oz + h ),
+                                   vload( p.dx + h ), vload( p.dy + h ), vload( p.dz + h ),
+                                   cx, cy, cz, vr2, vload( p.tmin + h ), tmax, t );
+            unsigned bits = vbits( m );
+            if ( update && bits != 0 ) vstore( p.tmax + h, vselect( m, t, tmax ) );
+            mask |= bits << h;
+        }
+        masks[k] = mask;
+    }
+}
+
+
+static void nearestRaysImpl( SphereRayPacket *packets, int numPackets, const double center[3],
+                             double r2, unsigned *masks )
+{
+    raysImpl( packets, numPackets, center, r2, masks, true );
+}
+
+
+static void anyHitRaysImpl( const SphereRayPacket *packets, int numPackets, const double center[3],
+                            double r2, unsigned *masks )
+{
+    raysImpl( const_cast<SphereRayPacket *>( packets ), numPackets, center, r2, masks, false );
+}
@@ -0,0 +1,47 @@
+#include <cstddef>
+#include "SphereKernel.h"
+
+// Compiled with SSE4.1 enabled; see CMakeLists.txt.
+#if defined(__SSE4_1__) || ( defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) ) )
+
+#include <smmintrin.h>
+
+
+namespace
+{
+    struct vdouble { __m128d v; };
+    struct vmask { __m128d m; };
+
+    const int VLANES = 2;
+
+    inline vdouble operator+ ( vdouble a, vdouble b ) { vdouble r = { _mm_add_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator- ( vdouble a, vdouble b ) { vdouble r = { _mm_sub_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator* ( vdouble a, vdouble b ) { vdouble r = { _mm_mul_pd( a.v, b.v ) }; return r; }
+    inline vdouble operator/ ( vdouble a, vdouble b ) { vdouble r = { _mm_div_pd( a.v, b.v ) }; return r; }
+    inline vmask operator& ( vmask a, vmask b ) { vmask r = { _mm_and_pd( a.m, b.m ) }; return r; }
+    inline vmask operator| ( vmask a, vmask b ) { vmask r = { _mm_or_pd( a.m, b.m ) }; return r; }
+
+    inline vdouble vset1( double x ) { vdouble r = { _mm_set1_pd( x ) }; return r; }
+    inline vdouble vload( const double *p ) { vdouble r = { _mm_loadu_pd( p ) }; return r; }
+    inline void vstore( double *p, vdouble a ) { _mm_storeu_pd( p, a.v ); }
+    inline vdouble vneg( vdouble a ) { vdouble r = { _mm_xor_pd( a.v, _mm_set1_pd( -0.0 ) ) }; return r; }
+    inline vdouble vsqrt( vdouble a ) { vdouble r = { _mm_sqrt_pd( a.v ) }; return r; }
+    inline vdouble vselect( vmask m, vdouble a, vdouble b ) { vdouble r = { _mm_blendv_pd( b.v, a.v, m.m ) }; return r; }
+    inline vmask vandnot( vmask m, vmask n ) { vmask r = { _mm_andnot_pd( m.m, n.m ) }; return r; }
+    inline vmask veq( vdouble a, vdouble b ) { vmask r = { _mm_cmpeq_pd( a.v, b.v ) }; return r; }
+    inline vmask vlt( vdouble a, vdouble b ) { vmask r = { _mm_cmplt_pd( a.v, b.v ) }; return r; }
+    inline vmask vgt( vdouble a, vdouble b ) { vmask r = { _mm_cmpgt_pd( a.v, b.v ) }; return r; }
+    inline unsigned vbits( vmask m ) { return (unsigned) _mm_movemask_pd( m.m ); }
+
+    #include "SphereKernelImpl.h"
+
+    const SphereKernelSet kernelsSSE4 = { nearestImpl, anyHitImpl, nearestRaysImpl, anyHitRaysImpl };
+}
+
+const SphereKernelSet *const SphereKernel::SetSSE4 = &kernelsSSE4;
+
+#else
+
+const SphereKernelSet *const SphereKernel::SetSSE4 = NULL;
+
+#endif
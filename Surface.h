@@ -4,18 +4,57 @@
 //  Abstract class Surface may be subclassed to a particular type of 
 //  Surface such as a Plane, Sphere, Triangle, and triangle mesh.
 
+#include "Util.h"
 #include "Vector3d.h"
 #include "Ray.h"
 #include "Color.h"
 #include "Material.h"
+#include "AABB.h"
 
 
+class Surface;
+
+// A hit as traversal records it: where along the ray, and which primitive
+// was hit where. It is kept small, as it is written for every closer hit
+// found on the way. The point, normals and material are made from it once,
+// for the nearest hit, by makeHitPoint().
 struct SurfaceHitRecord 
 {
-    double t;          // Ray hits at p = Ray.origin() + t * Ray.direction().
+    Real t;                     // Ray hits at p = Ray.origin() + t * Ray.direction().
+    const Surface *surface;     // The Surface hit, which is not one that holds others.
+    int primitive;              // The primitive of surface hit.
+    Real u, v;                  // Where on the primitive: for a triangle, the
+                                // barycentric coordinates of v1 and v2.
+    const Surface *instance;    // The Instance through which surface was hit, or NULL.
+};
+
+
+struct SurfaceHitPoint
+{
     Vector3d p;        // The point of intersection.
+    Vector3d pError;   // Bound on how far p is off the surface along each axis.
     Vector3d normal;   // Surface normal at p. May not be unit vector.
+    Vector3d ng;       // Geometric normal of the surface at p. Unit vector once
+                       // makeHitPoint() has made the point.
     const Material *mat_ptr; // Pointer to the surface material.
+
+    // Origins of the rays that leave p on the side ng points to, and on the
+    // other side. Set by makeHitPoint(); see Raytrace::LeavingOrigin().
+    Vector3d originAbove, originBelow;
+};
+
+
+
+class Instance;
+
+// A primitive that blocked a shadow ray, which may be tested on its own
+// against the next one: primitive i of surface, in the object space of
+// instance if that is not NULL.
+struct Occluder
+{
+    const Surface *surface;     // NULL if none is known.
+    int primitive;
+    const Instance *instance;
 };
 
 
@@ -27,11 +66,14 @@ public:
     const Material *matp;   // Material of the surface.
 
 
+    virtual ~Surface() {}
+
+
     // Does a Ray hit the Surface?
     virtual bool hit( 
                     const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax,  // Maximum hit parameter to be searched for.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
                     SurfaceHitRecord &rec 
                     ) const = 0;
 
@@ -39,8 +81,8 @@ public:
     // Does a Ray hit any Surface?  Allows early termination.
     virtual bool shadowHit(        
                     const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax   // Maximum hit parameter to be searched for.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
                     ) const 
     { 
        SurfaceHitRecord rec;
@@ -48,10 +90,116 @@ public:
     }
 
 
+    // Like shadowHit(), and if the ray is blocked, sets occluder to a
+    // primitive that blocks it, or its surface to NULL if none is known.
+    virtual bool shadowHitOccluder(
+                    const Ray &r,
+                    Real tmin,
+                    Real tmax,
+                    Occluder &occluder
+                    ) const
+    {
+        occluder.surface = NULL;
+        return shadowHit( r, tmin, tmax );
+    }
+
+
+    // Nearest hits of numRays rays at once: sets hits[i] to whether ray i
+    // hits the Surface in [tmin, tmax], and recs[i] as hit() would if so.
+    // An acceleration structure may trace coherent rays together.
+    virtual void hitPacket(
+                    const Ray *rays,
+                    int numRays,
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord *recs,
+                    bool *hits
+                    ) const
+    {
+        for ( int i = 0; i < numRays; i++ )
+            hits[i] = hit( rays[i], tmin, tmax, recs[i] );
+    }
+
+
+    // Makes the point, normals and material of the hit of r that hit() or
+    // hitPrimitive() of this Surface recorded in rec. Every Surface that
+    // records itself as hit must override it. One that holds others is
+    // never the one recorded, and its hit point is an error.
+    virtual void hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const
+        { Util::ErrorExitLoc( __FILE__, __LINE__, (char *) "Surface recorded as hit has no hitPoint()." ); }
+
+
+    // Computes the axis-aligned bounding box of the Surface.
+    // Returns false if the Surface is unbounded (e.g. a Plane).
+    virtual bool boundingBox( AABB &box ) const { return false; }
+
+
+    // A Surface such as a triangle mesh is made of many primitives, which an
+    // acceleration structure may bound and intersect one at a time.
+    // A simple Surface is its own single primitive.
+
+    virtual int numPrimitives() const { return 1; }
+
+    virtual bool primitiveBoundingBox( int i, AABB &box ) const
+        { return boundingBox( box ); }
+
+    virtual bool hitPrimitive( int i, const Ray &r, Real tmin, Real tmax,
+                               SurfaceHitRecord &rec ) const
+        { return hit( r, tmin, tmax, rec ); }
+
+    virtual bool shadowHitPrimitive( int i, const Ray &r, Real tmin, Real tmax ) const
+        { return shadowHit( r, tmin, tmax ); }
+
+    // Like shadowHitPrimitive(), and sets occluder as shadowHitOccluder()
+    // does, to the primitive itself unless it holds others.
+    virtual bool shadowHitPrimitiveOccluder( int i, const Ray &r, Real tmin, Real tmax,
+                                             Occluder &occluder ) const
+    {
+        if ( !shadowHitPrimitive( i, r, tmin, tmax ) ) return false;
+        occluder.surface = this;  occluder.primitive = i;  occluder.instance = NULL;
+        return true;
+    }
+
+    // If primitive i is a triangle, returns true with its vertices, so that
+    // acceleration structures may intersect it with the SIMD triangle kernel.
+    virtual bool primitiveTriangle( int i, Vector3d &v0, Vector3d &v1, Vector3d &v2 ) const
+        { return false; }
+
+
 }; // Surface
 
 
 typedef Surface *SurfacePtr;
 
 
+// Makes the point, normals and material of the hit of r recorded in rec,
+// and the origins of the rays that leave it. The point is off the surface
+// by up to pError along each axis, so they are moved along ng by the most
+// that error can be across the surface, and then rounded away from it, so
+// that they move at least one step off even where the error is 0.
+inline void makeHitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point )
+{
+    const Surface *surface = ( rec.instance != NULL )? rec.instance : rec.surface;
+    surface->hitPoint( r, rec, point );
+
+    const Vector3d &n = point.ng.makeUnitVector();
+    Vector3d offset = dot( abs( n ), point.pError ) * n;
+    point.originAbove = point.p + offset;
+    point.originBelow = point.p - offset;
+    for ( int a = 0; a < 3; a++ )
+    {
+        if ( n[a] > 0.0 )
+        {
+            point.originAbove[a] = nextafter( point.originAbove[a], REAL_MAX );
+            point.originBelow[a] = nextafter( point.originBelow[a], -REAL_MAX );
+        }
+        else if ( n[a] < 0.0 )
+        {
+            point.originAbove[a] = nextafter( point.originAbove[a], -REAL_MAX );
+            point.originBelow[a] = nextafter( point.originBelow[a], REAL_MAX );
+        }
+    }
+}
+
+
 #endif // _SURFACE_H_
@@ -0,0 +1,178 @@
+#ifndef _TRANSFORM_H_
+#define _TRANSFORM_H_
+
+#include <cmath>
+#include "Vector3d.h"
+#include "AABB.h"
+
+using namespace std;
+
+
+// Affine transform p' = M p + T, stored as the 3x4 matrix [ M | T ].
+
+class Transform
+{
+public:
+
+// Constructors
+
+    Transform() { setIdentity(); }
+
+    static Transform Translate( const Vector3d &t )
+    {
+        Transform x;
+        x.m[0][3] = t.x();  x.m[1][3] = t.y();  x.m[2][3] = t.z();
+        return x;
+    }
+
+    static Transform Scale( Real sx, Real sy, Real sz )
+    {
+        Transform x;
+        x.m[0][0] = sx;  x.m[1][1] = sy;  x.m[2][2] = sz;
+        return x;
+    }
+
+    static Transform Scale( Real s ) { return Scale( s, s, s ); }
+
+    // Rotation by angle radians about the axis through the origin,
+    // counterclockwise when looking down the axis.
+    static Transform Rotate( const Vector3d &axis, Real angle )
+    {
+        Vector3d a = axis;
+        a.makeUnitVector();
+        Real c = cos( angle ), s = sin( angle ), k = 1.0 - c;
+
+        Transform x;
+        x.m[0][0] = k * a.x() * a.x() + c;
+        x.m[0][1] = k * a.x() * a.y() - s * a.z();
+        x.m[0][2] = k * a.x() * a.z() + s * a.y();
+        x.m[1][0] = k * a.y() * a.x() + s * a.z();
+        x.m[1][1] = k * a.y() * a.y() + c;
+        x.m[1][2] = k * a.y() * a.z() - s * a.x();
+        x.m[2][0] = k * a.z() * a.x() - s * a.y();
+        x.m[2][1] = k * a.z() * a.y() + s * a.x();
+        x.m[2][2] = k * a.z() * a.z() + c;
+        return x;
+    }
+
+
+// Data setting and reading.
+
+    Transform &setIdentity()
+    {
+        for ( int i = 0; i < 3; i++ )
+            for ( int j = 0; j < 4; j++ ) m[i][j] = ( i == j )? 1.0 : 0.0;
+        return (*this);
+    }
+
+
+// Other functions.
+
+    // Transforms the point p.
+    Vector3d point( const Vector3d &p ) const
+    {
+        return Vector3d( m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                         m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                         m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3] );
+    }
+
+    // Transforms the point p, which is off by up to pError along each axis,
+    // and sets error to a bound on how far off the result is.
+    Vector3d point( const Vector3d &p, const Vector3d &pError, Vector3d &error ) const
+    {
+        Vector3d e;
+        for ( int i = 0; i < 3; i++ )
+        {
+            Real mp = fabs( m[i][0] * p.x() ) + fabs( m[i][1] * p.y() ) + fabs( m[i][2] * p.z() ) + fabs( m[i][3] );
+            Real me = fabs( m[i][0] ) * pError.x() + fabs( m[i][1] ) * pError.y() + fabs( m[i][2] ) * pError.z();
+            e[i] = errorGamma( 3 ) * mp + ( 1 + errorGamma( 3 ) ) * me;
+        }
+        error = e;
+        return point( p );
+    }
+
+    // Transforms the direction v, which ignores the translation.
+    Vector3d vector( const Vector3d &v ) const
+    {
+        return Vector3d( m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                         m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                         m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z() );
+    }
+
+    // Multiplies v by the transpose of M. Normals are transformed to world
+    // space by the transpose of the world-to-object transform.
+    Vector3d transposeVector( const Vector3d &v ) const
+    {
+        return Vector3d( m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                         m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                         m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z() );
+    }
+
+    // Returns the box containing the transformed box b (Arvo's method).
+    AABB box( const AABB &b ) const
+    {
+        if ( b.isEmpty() ) return b;
+        AABB r;
+        for ( int i = 0; i < 3; i++ )
+        {
+            r.minPt[i] = r.maxPt[i] = m[i][3];
+            for ( int j = 0; j < 3; j++ )
+            {
+                Real e = m[i][j] * b.minPt[j];
+                Real f = m[i][j] * b.maxPt[j];
+                if ( e < f ) { r.minPt[i] += e;  r.maxPt[i] += f; }
+                else { r.minPt[i] += f;  r.maxPt[i] += e; }
+            }
+        }
+        return r;
+    }
+
+    // Returns the inverse transform. M must not be singular.
+    Transform inverse() const
+    {
+        Transform x;
+        Real det = m[0][0] * ( m[1][1] * m[2][2] - m[1][2] * m[2][1] )
+                   - m[0][1] * ( m[1][0] * m[2][2] - m[1][2] * m[2][0] )
+                   + m[0][2] * ( m[1][0] * m[2][1] - m[1][1] * m[2][0] );
+        Real invDet = 1.0 / det;
+
+        x.m[0][0] = ( m[1][1] * m[2][2] - m[1][2] * m[2][1] ) * invDet;
+        x.m[0][1] = ( m[0][2] * m[2][1] - m[0][1] * m[2][2] ) * invDet;
+        x.m[0][2] = ( m[0][1] * m[1][2] - m[0][2] * m[1][1] ) * invDet;
+        x.m[1][0] = ( m[1][2] * m[2][0] - m[1][0] * m[2][2] ) * invDet;
+        x.m[1][1] = ( m[0][0] * m[2][2] - m[0][2] * m[2][0] ) * invDet;
+        x.m[1][2] = ( m[0][2] * m[1][0] - m[0][0] * m[1][2] ) * invDet;
+        x.m[2][0] = ( m[1][0] * m[2][1] - m[1][1] * m[2][0] ) * invDet;
+        x.m[2][1] = ( m[0][1] * m[2][0] - m[0][0] * m[2][1] ) * invDet;
+        x.m[2][2] = ( m[0][0] * m[1][1] - m[0][1] * m[1][0] ) * invDet;
+
+        // T' = -M' T.
+        for ( int i = 0; i < 3; i++ )
+            x.m[i][3] = -( x.m[i][0] * m[0][3] + x.m[i][1] * m[1][3] + x.m[i][2] * m[2][3] );
+        return x;
+    }
+
+
+    Real m[3][4];
+
+}; // Transform
+
+
+
+// The transform that applies b, then a.
+inline Transform operator* ( const Transform &a, const Transform &b )
+{
+    Transform x;
+    for ( int i = 0; i < 3; i++ )
+    {
+        for ( int j = 0; j < 4; j++ )
+        {
+            x.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+            if ( j == 3 ) x.m[i][j] += a.m[i][3];
+        }
+    }
+    return x;
+}
+
+
+#endif // _TRANSFORM_H_
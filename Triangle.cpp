@@ -5,57 +5,116 @@ using namespace std;
 
 
 
-bool Triangle::hit( const Ray &r, double tmin, double tmax, SurfaceHitRecord &rec ) const 
+bool Triangle::watertight = false;
+
+
+
+bool Triangle::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const 
 {   
-    Vector3d e1 = v1 - v0;
-    Vector3d e2 = v2 - v0;
-    Vector3d p = cross( r.direction(), e2 );    
-    double a = dot( e1, p );
-    //if ( a == 0.0 ) return false;
-    double f = 1.0 / a;
-    Vector3d s = r.origin() - v0;
-    double beta = f * dot( s, p );
-    if ( beta < 0.0 || beta > 1.0 ) return false;
+    Real t, beta, gamma;
+    bool hasHit = watertight? intersectWatertight( r, v0, v1, v2, tmin, tmax, t, beta, gamma )
+                            : intersect( r, v0, e1, e2, ng, tmin, tmax, t, beta, gamma );
+    if ( !hasHit ) return false;
+
+    // We have a hit -- populat hit record. 
+    rec.t = t;
+    rec.surface = this;
+    rec.primitive = 0;
+    rec.u = beta;
+    rec.v = gamma;
+    rec.instance = NULL;
+    return true;
+}
 
-    Vector3d q = cross( s, e1 );
-    double gamma = f * dot( r.direction(), q );
-    if ( gamma < 0.0 || beta + gamma > 1.0 ) return false;
 
-    double t = f * dot( e2, q );
 
-    if ( t >= tmin && t <= tmax )
-    {
-        // We have a hit -- populat hit record. 
-        rec.t = t;
-        rec.p = r.pointAtParam(t);
-        double alpha = 1.0 - beta - gamma;
-        rec.normal = alpha * n0 + beta * n1 + gamma * n2;
-        rec.mat_ptr = matp;
-        return true;
-    }
-    return false;
+void Triangle::hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const
+{
+    Real beta = rec.u, gamma = rec.v;
+    point.p = barycentricPoint( v0, v1, v2, beta, gamma, point.pError );
+    Real alpha = 1.0 - beta - gamma;
+    point.normal = alpha * n0 + beta * n1 + gamma * n2;
+    point.ng = ng;
+    point.mat_ptr = matp;
 }
 
 
 
-bool Triangle::shadowHit( const Ray &r, double tmin, double tmax ) const 
+bool Triangle::shadowHit( const Ray &r, Real tmin, Real tmax ) const 
 {
-    Vector3d e1 = v1 - v0;
-    Vector3d e2 = v2 - v0;
-    Vector3d p = cross( r.direction(), e2 );    
-    double a = dot( e1, p );
-    //if ( a == 0.0 ) return false;
-    double f = 1.0 / a;
-    Vector3d s = r.origin() - v0;
-    double beta = f * dot( s, p );
-    if ( beta < 0.0 || beta > 1.0 ) return false;
+    Real t, beta, gamma;
+    return watertight? intersectWatertight( r, v0, v1, v2, tmin, tmax, t, beta, gamma )
+                     : intersect( r, v0, e1, e2, ng, tmin, tmax, t, beta, gamma );
+}
 
-    Vector3d q = cross( s, e1 );
-    double gamma = f * dot( r.direction(), q );
-    if ( gamma < 0.0 || beta + gamma > 1.0 ) return false;
 
-    double t = f * dot( e2, q );
-    return ( t >= tmin && t <= tmax );
+
+bool Triangle::intersectWatertight( const Ray &r, const Vector3d &v0, const Vector3d &v1,
+                                    const Vector3d &v2, Real tmin, Real tmax,
+                                    Real &t, Real &beta, Real &gamma )
+{
+    Vector3d o = r.origin();
+    Vector3d d = r.direction();
+
+    // Make kz the dimension where the ray direction is largest, and keep
+    // the winding of the sheared triangle by swapping kx and ky.
+    int kz = ( fabs( d.x() ) > fabs( d.y() ) )? ( ( fabs( d.x() ) > fabs( d.z() ) )? 0 : 2 )
+                                              : ( ( fabs( d.y() ) > fabs( d.z() ) )? 1 : 2 );
+    int kx = ( kz + 1 ) % 3;
+    int ky = ( kx + 1 ) % 3;
+    if ( d[kz] < 0.0 ) { int tmp = kx;  kx = ky;  ky = tmp; }
+
+    Real Sx = d[kx] / d[kz];
+    Real Sy = d[ky] / d[kz];
+    Real Sz = 1.0 / d[kz];
+
+    // Vertices relative to the ray origin, sheared so the ray is along +z.
+    Vector3d A = v0 - o;
+    Vector3d B = v1 - o;
+    Vector3d C = v2 - o;
+    Real Ax = A[kx] - Sx * A[kz],  Ay = A[ky] - Sy * A[kz];
+    Real Bx = B[kx] - Sx * B[kz],  By = B[ky] - Sy * B[kz];
+    Real Cx = C[kx] - Sx * C[kz],  Cy = C[ky] - Sy * C[kz];
+
+    // Scaled barycentric coordinates from the 2D edge functions.
+    Real U = Cx * By - Cy * Bx;
+    Real V = Ax * Cy - Ay * Cx;
+    Real W = Bx * Ay - By * Ax;
+
+    // On an edge, redo the edge functions in higher precision to decide
+    // which side the ray is on.
+    if ( U == 0.0 || V == 0.0 || W == 0.0 )
+    {
+        U = (Real)( (WideReal)Cx * By - (WideReal)Cy * Bx );
+        V = (Real)( (WideReal)Ax * Cy - (WideReal)Ay * Cx );
+        W = (Real)( (WideReal)Bx * Ay - (WideReal)By * Ax );
+    }
+
+    if ( ( U < 0.0 || V < 0.0 || W < 0.0 ) && ( U > 0.0 || V > 0.0 || W > 0.0 ) ) return false;
+
+    Real det = U + V + W;
+    if ( det == 0.0 ) return false;
+
+    Real T = U * ( Sz * A[kz] ) + V * ( Sz * B[kz] ) + W * ( Sz * C[kz] );
+    Real invDet = 1.0 / det;
+    t = T * invDet;
+    if ( t < tmin || t > tmax ) return false;
+
+    // Degenerate triangles are never hit. Checked last, as hits are rare.
+    if ( cross( v1 - v0, v2 - v0 ) == Vector3d( 0.0, 0.0, 0.0 ) ) return false;
+
+    beta = V * invDet;
+    gamma = W * invDet;
+    return true;
+}
+
+
+
+bool Triangle::boundingBox( AABB &box ) const
+{
+    box.setEmpty();
+    box.expand( v0 ).expand( v1 ).expand( v2 );
+    return true;
 }
 
 
@@ -11,12 +11,23 @@ public:
     Vector3d v0, v1, v2; // Vertices.
     Vector3d n0, n1, n2; // Vertex normals.
 
+    // Precomputed for the intersection test. Call update() after changing
+    // the vertices.
+    Vector3d e1, e2;     // Edges v1 - v0 and v2 - v0.
+    Vector3d ng;         // Geometric normal cross( e1, e2 ). Zero if degenerate.
+
+
+    // If true, all triangles use the watertight intersection test, which
+    // never lets a ray pass between two triangles sharing an edge.
+    static bool watertight;
+
 
     Triangle( const Vector3d &v0_, const Vector3d &v1_, const Vector3d &v2_, const Material *mat_ptr )
     {
         v0 = v0_;  v1 = v1_;  v2 = v2_;
         n0 = n1 = n2 = triNormal( v0, v1, v2 );
         matp = mat_ptr;
+        update();
     }
 
 
@@ -26,22 +37,94 @@ public:
         v0 = v0_;  v1 = v1_;  v2 = v2_; 
         n0 = n0_;  n1 = n1_;  n2 = n2_;  
         matp = mat_ptr;
+        update();
+    }
+
+
+    void update()
+    {
+        e1 = v1 - v0;
+        e2 = v2 - v0;
+        ng = cross( e1, e2 );
     }
 
 
     virtual bool hit( 
                     const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax,  // Maximum hit parameter to be searched for.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
                     SurfaceHitRecord &rec 
                     ) const;
 
 
     virtual bool shadowHit(        
                     const Ray &r, // Ray being sent.
-                    double tmin,  // Minimum hit parameter to be searched for.
-                    double tmax   // Maximum hit parameter to be searched for.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
                     ) const;
+
+
+    virtual void hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const;
+
+
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    virtual bool primitiveTriangle( int i, Vector3d &v0_, Vector3d &v1_, Vector3d &v2_ ) const
+        { v0_ = v0;  v1_ = v1;  v2_ = v2;  return true; }
+
+
+    //////////////////////////////////////////////////////////////////////////////
+    // Ray/triangle intersection tests, shared with TriangleMesh.
+    // If the ray hits the triangle at t in [tmin, tmax], they return true
+    // with t and the barycentric coordinates beta and gamma of v1 and v2.
+    // Degenerate triangles are never hit.
+    //////////////////////////////////////////////////////////////////////////////
+
+    // Moller-Trumbore test on the precomputed triangle record: vertex v0,
+    // edges e1 and e2, and geometric normal ng = cross( e1, e2 ).
+    // Reusing ng saves one of the two cross products of the usual test.
+    static bool intersect( const Ray &r, const Vector3d &v0, const Vector3d &e1, const Vector3d &e2,
+                           const Vector3d &ng, Real tmin, Real tmax,
+                           Real &t, Real &beta, Real &gamma )
+    {
+        Vector3d d = r.direction();
+        Real a = -dot( d, ng );
+        if ( a == 0.0 ) return false;
+        Real f = 1.0 / a;
+        Vector3d s = r.origin() - v0;
+        Vector3d R = cross( d, s );
+        beta = -f * dot( e2, R );
+        if ( beta < 0.0 || beta > 1.0 ) return false;
+
+        gamma = f * dot( e1, R );
+        if ( gamma < 0.0 || beta + gamma > 1.0 ) return false;
+
+        t = f * dot( s, ng );
+        return ( t >= tmin && t <= tmax );
+    }
+
+
+    // Watertight test of Woop, Benthin and Wald (JCGT 2013) on the vertices.
+    // The vertices are sheared into a space where the ray is the +z axis,
+    // and the 2D edge functions there are computed from the vertex pair
+    // alone, so two triangles sharing an edge evaluate it identically and
+    // a ray cannot slip between them.
+    static bool intersectWatertight( const Ray &r, const Vector3d &v0, const Vector3d &v1,
+                                     const Vector3d &v2, Real tmin, Real tmax,
+                                     Real &t, Real &beta, Real &gamma );
+
+
+    // The point with barycentric coordinates beta and gamma of v1 and v2.
+    // Unlike the point of the ray at t, it is off the plane of the triangle
+    // by little more than its rounding. Sets error to a bound on that.
+    static Vector3d barycentricPoint( const Vector3d &v0, const Vector3d &v1, const Vector3d &v2,
+                                      Real beta, Real gamma, Vector3d &error )
+    {
+        Vector3d a = ( 1 - beta - gamma ) * v0, b = beta * v1, c = gamma * v2;
+        error = errorGamma( 7 ) * ( abs( a ) + abs( b ) + abs( c ) );
+        return a + b + c;
+    }
 };
 
 
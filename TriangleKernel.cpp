@@ -0,0 +1,103 @@
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include "TriangleKernel.h"
+
+using namespace std;
+
+
+// The scalar kernel, one lane at a time.
+
+namespace
+{
+    typedef float vfloat;
+    typedef bool vmask;
+
+    inline vfloat vset1( float x ) { return x; }
+    inline vfloat vabs( vfloat a ) { return fabsf( a ); }
+    inline vfloat vmax( vfloat a, vfloat b ) { return ( a > b )? a : b; }
+    inline vmask vge( vfloat a, vfloat b ) { return a >= b; }
+    inline vmask vle( vfloat a, vfloat b ) { return a <= b; }
+    inline vmask vgt( vfloat a, vfloat b ) { return a > b; }
+
+    struct PacketLanes
+    {
+        vfloat v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z, ngx, ngy, ngz;
+    };
+
+    #include "TriangleKernelImpl.h"
+}
+
+
+
+void TriangleKernel::CandidatesScalar( const KernelRay &ray, const TrianglePacket *packets,
+                                       int numPackets, float tmin, float tmax, unsigned *masks )
+{
+    for ( int k = 0; k < numPackets; k++ )
+    {
+        const TrianglePacket &p = packets[k];
+        unsigned mask = 0;
+
+        for ( int j = 0; j < TRI_PACKET_WIDTH; j++ )
+        {
+            PacketLanes lanes = { p.v0x[j], p.v0y[j], p.v0z[j], p.e1x[j], p.e1y[j], p.e1z[j],
+                                  p.e2x[j], p.e2y[j], p.e2z[j], p.ngx[j], p.ngy[j], p.ngz[j] };
+            if ( candidateLanes( ray, lanes, tmin, tmax ) ) mask |= ( 1u << j );
+        }
+        masks[k] = mask;
+    }
+}
+
+
+
+TriangleCandidatesFn TriangleKernel::Candidates = TriangleKernel::CandidatesScalar;
+SimdLevel TriangleKernel::sLevel = SIMD_SCALAR;
+
+// Pick the best kernel before main() runs.
+static SimdLevel sInitialLevel = TriangleKernel::Use( Simd::DetectLevel() );
+
+
+
+SimdLevel TriangleKernel::Use( SimdLevel level )
+{
+    SimdLevel maxLevel = Simd::DetectLevel();
+    if ( level > maxLevel ) level = maxLevel;
+
+    TriangleCandidatesFn fn = NULL;
+    while ( fn == NULL )
+    {
+        switch ( level )
+        {
+            case SIMD_AVX512: fn = CandidatesAVX512; break;
+            case SIMD_AVX2:   fn = CandidatesAVX2; break;
+            case SIMD_SSE4:   fn = CandidatesSSE4; break;
+            default:          fn = CandidatesScalar; break;
+        }
+        if ( fn == NULL ) level = (SimdLevel)( level - 1 );
+    }
+
+    Candidates = fn;
+    sLevel = level;
+    return level;
+}
+
+
+
+void TriangleKernel::SetLane( TrianglePacket &p, int j, const double v0[3], const double e1[3],
+                              const double e2[3], const double ng[3] )
+{
+    p.v0x[j] = (float) v0[0];  p.v0y[j] = (float) v0[1];  p.v0z[j] = (float) v0[2];
+    p.e1x[j] = (float) e1[0];  p.e1y[j] = (float) e1[1];  p.e1z[j] = (float) e1[2];
+    p.e2x[j] = (float) e2[0];  p.e2y[j] = (float) e2[1];  p.e2z[j] = (float) e2[2];
+    p.ngx[j] = (float) ng[0];  p.ngy[j] = (float) ng[1];  p.ngz[j] = (float) ng[2];
+}
+
+
+
+void TriangleKernel::ClearLane( TrianglePacket &p, int j )
+{
+    p.v0x[j] = p.v0y[j] = p.v0z[j] = 0.0f;
+    p.e1x[j] = p.e1y[j] = p.e1z[j] = 0.0f;
+    p.e2x[j] = p.e2y[j] = p.e2z[j] = 0.0f;
+    p.ngx[j] = p.ngy[j] = p.ngz[j] = 0.0f;
+}
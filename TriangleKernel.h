@@ -0,0 +1,104 @@
+#ifndef _TRIANGLEKERNEL_H_
+#define _TRIANGLEKERNEL_H_
+
+#include "Simd.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// SIMD ray/triangle test on packets of triangles in structure-of-arrays
+// float layout, used in the leaves of the BVH.
+//
+// The kernel is a conservative filter: it runs the Moller-Trumbore test of
+// Triangle::intersect in float, and widens the barycentric and t bounds by
+// an estimate of the float rounding error (including, when Real is
+// double, the rounding of the inputs to float). A lane it does not report
+// is certain to be missed by the test of Triangle in Real; a lane it
+// reports must be confirmed with that test. Nearly all rays miss nearly
+// all triangles, so the confirmation is rarely needed and results are
+// exactly those of the Real test, including its watertightness.
+//
+// There is one implementation per instruction set, each in its own
+// translation unit compiled for that instruction set, and the best one
+// the CPU supports is picked at startup. The kernel translation units
+// must not include headers with inline functions that are also used
+// elsewhere (such as Vector3d.h), or the linker may keep a copy compiled
+// for an instruction set the CPU lacks. Hence the plain float interface.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+#define TRI_PACKET_WIDTH    8
+
+
+// Up to TRI_PACKET_WIDTH triangles. Unused lanes have all fields zero,
+// and are never reported.
+struct TrianglePacket
+{
+    float v0x[ TRI_PACKET_WIDTH ], v0y[ TRI_PACKET_WIDTH ], v0z[ TRI_PACKET_WIDTH ];
+    float e1x[ TRI_PACKET_WIDTH ], e1y[ TRI_PACKET_WIDTH ], e1z[ TRI_PACKET_WIDTH ];
+    float e2x[ TRI_PACKET_WIDTH ], e2y[ TRI_PACKET_WIDTH ], e2z[ TRI_PACKET_WIDTH ];
+    float ngx[ TRI_PACKET_WIDTH ], ngy[ TRI_PACKET_WIDTH ], ngz[ TRI_PACKET_WIDTH ];
+};
+
+
+// A ray as seen by the kernel.
+struct KernelRay
+{
+    float ox, oy, oz;   // Origin.
+    float dx, dy, dz;   // Direction.
+    float oMax;         // max( |ox|, |oy|, |oz| ).
+    float dSum;         // |dx| + |dy| + |dz|.
+};
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tests the ray against packets[0 .. numPackets-1], and sets bit j of
+// masks[k] if lane j of packets[k] may be hit at t in [tmin, tmax].
+//////////////////////////////////////////////////////////////////////////////
+
+typedef void (*TriangleCandidatesFn)( const KernelRay &ray, const TrianglePacket *packets,
+                                      int numPackets, float tmin, float tmax, unsigned *masks );
+
+
+// Relative error bound applied by the kernels, in units of FLT_EPSILON.
+#define TRI_KERNEL_ERROR_ULPS   32.0f
+
+
+
+class TriangleKernel
+{
+public:
+
+    // The kernel in use. Set at startup to the best one the CPU supports.
+    static TriangleCandidatesFn Candidates;
+
+    static SimdLevel Level( void ) { return sLevel; }
+
+    // Switches to the kernel for the given level, or the best one below it
+    // that is available. Returns the level actually used.
+    static SimdLevel Use( SimdLevel level );
+
+
+    // Packs triangle (v0, e1, e2, ng) into lane j of packet p.
+    static void SetLane( TrianglePacket &p, int j, const double v0[3], const double e1[3],
+                         const double e2[3], const double ng[3] );
+
+    static void ClearLane( TrianglePacket &p, int j );
+
+
+    // The implementations. Those not built for this platform are NULL.
+    static void CandidatesScalar( const KernelRay &ray, const TrianglePacket *packets,
+                                  int numPackets, float tmin, float tmax, unsigned *masks );
+    static const TriangleCandidatesFn CandidatesSSE4;
+    static const TriangleCandidatesFn CandidatesAVX2;
+    static const TriangleCandidatesFn CandidatesAVX512;
+
+private:
+
+    static SimdLevel sLevel;
+
+}; // TriangleKernel
+
+
+#endif // _TRIANGLEKERNEL_H_
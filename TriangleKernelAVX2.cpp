@@ -0,0 +1,61 @@
+#include <cfloat>
+#include <cstddef>
+#include "TriangleKernel.h"
+
+// Compiled with AVX2 and FMA enabled; see CMakeLists.txt.
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+
+namespace
+{
+    struct vfloat { __m256 v; };
+    struct vmask { __m256 m; };
+
+    inline vfloat operator+ ( vfloat a, vfloat b ) { vfloat r = { _mm256_add_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator- ( vfloat a, vfloat b ) { vfloat r = { _mm256_sub_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator* ( vfloat a, vfloat b ) { vfloat r = { _mm256_mul_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator/ ( vfloat a, vfloat b ) { vfloat r = { _mm256_div_ps( a.v, b.v ) }; return r; }
+    inline vmask operator& ( vmask a, vmask b ) { vmask r = { _mm256_and_ps( a.m, b.m ) }; return r; }
+    inline vmask operator| ( vmask a, vmask b ) { vmask r = { _mm256_or_ps( a.m, b.m ) }; return r; }
+
+    inline vfloat vset1( float x ) { vfloat r = { _mm256_set1_ps( x ) }; return r; }
+    inline vfloat vabs( vfloat a ) { vfloat r = { _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), a.v ) }; return r; }
+    inline vfloat vmax( vfloat a, vfloat b ) { vfloat r = { _mm256_max_ps( a.v, b.v ) }; return r; }
+    inline vmask vge( vfloat a, vfloat b ) { vmask r = { _mm256_cmp_ps( a.v, b.v, _CMP_GE_OQ ) }; return r; }
+    inline vmask vle( vfloat a, vfloat b ) { vmask r = { _mm256_cmp_ps( a.v, b.v, _CMP_LE_OQ ) }; return r; }
+    inline vmask vgt( vfloat a, vfloat b ) { vmask r = { _mm256_cmp_ps( a.v, b.v, _CMP_GT_OQ ) }; return r; }
+
+    struct PacketLanes
+    {
+        vfloat v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z, ngx, ngy, ngz;
+    };
+
+    #include "TriangleKernelImpl.h"
+
+
+    // One packet of 8 lanes at a time.
+    void candidatesAVX2( const KernelRay &ray, const TrianglePacket *packets,
+                         int numPackets, float tmin, float tmax, unsigned *masks )
+    {
+        for ( int k = 0; k < numPackets; k++ )
+        {
+            const TrianglePacket &p = packets[k];
+
+            #define LOAD( field ) { _mm256_loadu_ps( p.field ) }
+            PacketLanes lanes = { LOAD( v0x ), LOAD( v0y ), LOAD( v0z ), LOAD( e1x ), LOAD( e1y ), LOAD( e1z ),
+                                  LOAD( e2x ), LOAD( e2y ), LOAD( e2z ), LOAD( ngx ), LOAD( ngy ), LOAD( ngz ) };
+            #undef LOAD
+            masks[k] = (unsigned) _mm256_movemask_ps( candidateLanes( ray, lanes, tmin, tmax ).m );
+        }
+    }
+}
+
+const TriangleCandidatesFn TriangleKernel::CandidatesAVX2 = candidatesAVX2;
+
+#else
+
+const TriangleCandidatesFn TriangleKernel::CandidatesAVX2 = NULL;
+
+#endif
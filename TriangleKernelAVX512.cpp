@@ -0,0 +1,68 @@
+#include <cfloat>
+#include <cstddef>
+#include "TriangleKernel.h"
+
+// Compiled with AVX-512F enabled; see CMakeLists.txt.
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+
+namespace
+{
+    struct vfloat { __m512 v; };
+    struct vmask { __mmask16 m; };
+
+    inline vfloat operator+ ( vfloat a, vfloat b ) { vfloat r = { _mm512_add_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator- ( vfloat a, vfloat b ) { vfloat r = { _mm512_sub_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator* ( vfloat a, vfloat b ) { vfloat r = { _mm512_mul_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator/ ( vfloat a, vfloat b ) { vfloat r = { _mm512_div_ps( a.v, b.v ) }; return r; }
+    inline vmask operator& ( vmask a, vmask b ) { vmask r = { (__mmask16)( a.m & b.m ) }; return r; }
+    inline vmask operator| ( vmask a, vmask b ) { vmask r = { (__mmask16)( a.m | b.m ) }; return r; }
+
+    inline vfloat vset1( float x ) { vfloat r = { _mm512_set1_ps( x ) }; return r; }
+    inline vfloat vabs( vfloat a ) { vfloat r = { _mm512_abs_ps( a.v ) }; return r; }
+    inline vfloat vmax( vfloat a, vfloat b ) { vfloat r = { _mm512_max_ps( a.v, b.v ) }; return r; }
+    inline vmask vge( vfloat a, vfloat b ) { vmask r = { _mm512_cmp_ps_mask( a.v, b.v, _CMP_GE_OQ ) }; return r; }
+    inline vmask vle( vfloat a, vfloat b ) { vmask r = { _mm512_cmp_ps_mask( a.v, b.v, _CMP_LE_OQ ) }; return r; }
+    inline vmask vgt( vfloat a, vfloat b ) { vmask r = { _mm512_cmp_ps_mask( a.v, b.v, _CMP_GT_OQ ) }; return r; }
+
+    struct PacketLanes
+    {
+        vfloat v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z, ngx, ngy, ngz;
+    };
+
+    #include "TriangleKernelImpl.h"
+
+
+    // Two packets, 16 lanes, at a time. A lone last packet is padded with
+    // itself, and the upper half of its result dropped.
+    void candidatesAVX512( const KernelRay &ray, const TrianglePacket *packets,
+                           int numPackets, float tmin, float tmax, unsigned *masks )
+    {
+        for ( int k = 0; k < numPackets; k += 2 )
+        {
+            const TrianglePacket &p = packets[k];
+            const TrianglePacket &q = packets[ ( k + 1 < numPackets )? k + 1 : k ];
+
+            #define LOAD( field ) { _mm512_castpd_ps( _mm512_insertf64x4( \
+                                    _mm512_castps_pd( _mm512_castps256_ps512( _mm256_loadu_ps( p.field ) ) ), \
+                                    _mm256_castps_pd( _mm256_loadu_ps( q.field ) ), 1 ) ) }
+            PacketLanes lanes = { LOAD( v0x ), LOAD( v0y ), LOAD( v0z ), LOAD( e1x ), LOAD( e1y ), LOAD( e1z ),
+                                  LOAD( e2x ), LOAD( e2y ), LOAD( e2z ), LOAD( ngx ), LOAD( ngy ), LOAD( ngz ) };
+            #undef LOAD
+            unsigned mask = candidateLanes( ray, lanes, tmin, tmax ).m;
+
+            masks[k] = mask & 0xff;
+            if ( k + 1 < numPackets ) masks[k + 1] = mask >> 8;
+        }
+    }
+}
+
+const TriangleCandidatesFn TriangleKernel::CandidatesAVX512 = candidatesAVX512;
+
+#else
+
+const TriangleCandidatesFn TriangleKernel::CandidatesAVX512 = NULL;
+
+#endif
@@ -0,0 +1,73 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Body of the SIMD ray/triangle kernel, shared by every instruction set.
+//
+// Included by each kernel translation unit, inside an anonymous namespace,
+// after it defines:
+//
+//   vfloat                 A vector of float lanes, with +, -, *, /.
+//   vmask                  A vector of lane flags, with & and |.
+//   vset1( x )             All lanes set to x.
+//   vabs( a ), vmax( a, b )
+//   vge( a, b ), vle( a, b ), vgt( a, b )   Lane-wise comparisons.
+//   PacketLanes            The fields of TrianglePacket, loaded as vfloat.
+//
+// Not a standalone header.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+
+// Returns the lanes that may be hit at t in [tmin, tmax]. See TriangleKernel.h.
+static inline vmask candidateLanes( const KernelRay &ray, const PacketLanes &p, float tmin, float tmax )
+{
+    const vfloat zero = vset1( 0.0f );
+    const vfloat one = vset1( 1.0f );
+    const vfloat c = vset1( TRI_KERNEL_ERROR_ULPS * FLT_EPSILON );
+
+    vfloat dx = vset1( ray.dx ), dy = vset1( ray.dy ), dz = vset1( ray.dz );
+
+    // The Moller-Trumbore test of Triangle::intersect.
+    vfloat sx = vset1( ray.ox ) - p.v0x;
+    vfloat sy = vset1( ray.oy ) - p.v0y;
+    vfloat sz = vset1( ray.oz ) - p.v0z;
+
+    vfloat a = zero - ( dx * p.ngx + dy * p.ngy + dz * p.ngz );
+
+    vfloat Rx = dy * sz - dz * sy;
+    vfloat Ry = dz * sx - dx * sz;
+    vfloat Rz = dx * sy - dy * sx;
+
+    vfloat f = one / a;
+    vfloat u = ( zero - ( p.e2x * Rx + p.e2y * Ry + p.e2z * Rz ) ) * f;
+    vfloat v = ( p.e1x * Rx + p.e1y * Ry + p.e1z * Rz ) * f;
+    vfloat t = ( sx * p.ngx + sy * p.ngy + sz * p.ngz ) * f;
+
+    // Error bounds. delta bounds the absolute error of s, which is dominated
+    // by rounding the origin and v0 to float. g is the relative error of a,
+    // which scales u, v and t alike.
+    vfloat ngL1 = vabs( p.ngx ) + vabs( p.ngy ) + vabs( p.ngz );
+    vfloat e1L1 = vabs( p.e1x ) + vabs( p.e1y ) + vabs( p.e1z );
+    vfloat e2L1 = vabs( p.e2x ) + vabs( p.e2y ) + vabs( p.e2z );
+    vfloat delta = vset1( ray.oMax ) + vmax( vmax( vabs( p.v0x ), vabs( p.v0y ) ), vabs( p.v0z ) )
+                 + vabs( sx ) + vabs( sy ) + vabs( sz );
+
+    vfloat invAbsA = one / vabs( a );
+    vfloat dSum = vset1( ray.dSum );
+    vfloat g = c * dSum * ngL1 * invAbsA;
+    vfloat k = c * dSum * delta * invAbsA;
+
+    vfloat errU = k * e2L1 + vabs( u ) * g;
+    vfloat errV = k * e1L1 + vabs( v ) * g;
+    vfloat errT = c * delta * ngL1 * invAbsA + vabs( t ) * ( g + c );
+
+    vmask inside = vge( u, zero - errU ) & vge( v, zero - errV ) & vle( u + v, one + errU + errV )
+                 & vge( t, vset1( tmin ) - errT ) & vle( t, vset1( tmax ) + errT );
+
+    // Nearly parallel rays, including a == 0, are left to the exact test,
+    // as are slivers, on which the exact tests may disagree with the math.
+    vmask grazing = vge( g, vset1( 0.5f ) );
+    vmask sliver = vle( ngL1, vset1( 1e-5f ) * e1L1 * e2L1 );
+
+    // Unused lanes and degenerate triangles have ng == 0.
+    return ( inside | grazing | sliver ) & vgt( ngL1, zero );
+}
@@ -0,0 +1,66 @@
+#include <cfloat>
+#include <cstddef>
+#include "TriangleKernel.h"
+
+// Compiled with SSE4.1 enabled; see CMakeLists.txt.
+#if defined(__SSE4_1__) || ( defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) ) )
+
+#include <smmintrin.h>
+
+
+namespace
+{
+    struct vfloat { __m128 v; };
+    struct vmask { __m128 m; };
+
+    inline vfloat operator+ ( vfloat a, vfloat b ) { vfloat r = { _mm_add_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator- ( vfloat a, vfloat b ) { vfloat r = { _mm_sub_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator* ( vfloat a, vfloat b ) { vfloat r = { _mm_mul_ps( a.v, b.v ) }; return r; }
+    inline vfloat operator/ ( vfloat a, vfloat b ) { vfloat r = { _mm_div_ps( a.v, b.v ) }; return r; }
+    inline vmask operator& ( vmask a, vmask b ) { vmask r = { _mm_and_ps( a.m, b.m ) }; return r; }
+    inline vmask operator| ( vmask a, vmask b ) { vmask r = { _mm_or_ps( a.m, b.m ) }; return r; }
+
+    inline vfloat vset1( float x ) { vfloat r = { _mm_set1_ps( x ) }; return r; }
+    inline vfloat vabs( vfloat a ) { vfloat r = { _mm_andnot_ps( _mm_set1_ps( -0.0f ), a.v ) }; return r; }
+    inline vfloat vmax( vfloat a, vfloat b ) { vfloat r = { _mm_max_ps( a.v, b.v ) }; return r; }
+    inline vmask vge( vfloat a, vfloat b ) { vmask r = { _mm_cmpge_ps( a.v, b.v ) }; return r; }
+    inline vmask vle( vfloat a, vfloat b ) { vmask r = { _mm_cmple_ps( a.v, b.v ) }; return r; }
+    inline vmask vgt( vfloat a, vfloat b ) { vmask r = { _mm_cmpgt_ps( a.v, b.v ) }; return r; }
+
+    struct PacketLanes
+    {
+        vfloat v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z, ngx, ngy, ngz;
+    };
+
+    #include "TriangleKernelImpl.h"
+
+
+    // Each packet is done as two halves of 4 lanes.
+    void candidatesSSE4( const KernelRay &ray, const TrianglePacket *packets,
+                         int numPackets, float tmin, float tmax, unsigned *masks )
+    {
+        for ( int k = 0; k < numPackets; k++ )
+        {
+            const TrianglePacket &p = packets[k];
+            unsigned mask = 0;
+
+            for ( int h = 0; h < TRI_PACKET_WIDTH; h += 4 )
+            {
+                #define LOAD( field ) { _mm_loadu_ps( p.field + h ) }
+                PacketLanes lanes = { LOAD( v0x ), LOAD( v0y ), LOAD( v0z ), LOAD( e1x ), LOAD( e1y ), LOAD( e1z ),
+                                      LOAD( e2x ), LOAD( e2y ), LOAD( e2z ), LOAD( ngx ), LOAD( ngy ), LOAD( ngz ) };
+                #undef LOAD
+                mask |= (unsigned) _mm_movemask_ps( candidateLanes( ray, lanes, tmin, tmax ).m ) << h;
+            }
+            masks[k] = mask;
+        }
+    }
+}
+
+const TriangleCandidatesFn TriangleKernel::CandidatesSSE4 = candidatesSSE4;
+
+#else
+
+const TriangleCandidatesFn TriangleKernel::CandidatesSSE4 = NULL;
+
+#endif
@@ -0,0 +1,123 @@
+#include <cmath>
+#include "Triangle.h"
+#include "TriangleMesh.h"
+
+using namespace std;
+
+
+
+// The mesh does not store per-triangle edges, so they are computed here,
+// unless the watertight test, which works on the vertices, is in use.
+static inline bool intersectTriangle( const Ray &r, const Vector3d &v0, const Vector3d &v1,
+                                      const Vector3d &v2, Real tmin, Real tmax,
+                                      Real &t, Real &beta, Real &gamma )
+{
+    if ( Triangle::watertight )
+        return Triangle::intersectWatertight( r, v0, v1, v2, tmin, tmax, t, beta, gamma );
+
+    Vector3d e1 = v1 - v0;
+    Vector3d e2 = v2 - v0;
+    return Triangle::intersect( r, v0, e1, e2, cross( e1, e2 ), tmin, tmax, t, beta, gamma );
+}
+
+
+
+bool TriangleMesh::hitPrimitive( int i, const Ray &r, Real tmin, Real tmax,
+                                 SurfaceHitRecord &rec ) const
+{
+    Real t, beta, gamma;
+    if ( !intersectTriangle( r, vertices[ indices[3*i] ], vertices[ indices[3*i + 1] ],
+                             vertices[ indices[3*i + 2] ], tmin, tmax, t, beta, gamma ) ) return false;
+
+    rec.t = t;
+    rec.surface = this;
+    rec.primitive = i;
+    rec.u = beta;
+    rec.v = gamma;
+    rec.instance = NULL;
+    return true;
+}
+
+
+
+void TriangleMesh::hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const
+{
+    int i = rec.primitive;
+    uint32_t i0 = indices[3*i], i1 = indices[3*i + 1], i2 = indices[3*i + 2];
+    const Vector3d &v0 = vertices[i0];
+    const Vector3d &v1 = vertices[i1];
+    const Vector3d &v2 = vertices[i2];
+
+    Real beta = rec.u, gamma = rec.v;
+    point.p = Triangle::barycentricPoint( v0, v1, v2, beta, gamma, point.pError );
+    point.ng = triNormal( v0, v1, v2 );
+    if ( normals.empty() )
+        point.normal = point.ng;
+    else
+    {
+        Real alpha = 1.0 - beta - gamma;
+        point.normal = alpha * normals[i0] + beta * normals[i1] + gamma * normals[i2];
+    }
+    point.mat_ptr = matp;
+}
+
+
+
+bool TriangleMesh::shadowHitPrimitive( int i, const Ray &r, Real tmin, Real tmax ) const
+{
+    Real t, beta, gamma;
+    return intersectTriangle( r, vertices[ indices[3*i] ], vertices[ indices[3*i + 1] ],
+                              vertices[ indices[3*i + 2] ], tmin, tmax, t, beta, gamma );
+}
+
+
+
+bool TriangleMesh::primitiveBoundingBox( int i, AABB &box ) const
+{
+    box.setEmpty();
+    box.expand( vertices[ indices[3*i] ] );
+    box.expand( vertices[ indices[3*i + 1] ] );
+    box.expand( vertices[ indices[3*i + 2] ] );
+    return true;
+}
+
+
+
+bool TriangleMesh::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    int n = numTriangles();
+
+    for ( int i = 0; i < n; i++ )
+    {
+        if ( hitPrimitive( i, r, tmin, tmax, rec ) )
+        {
+            hasHit = true;
+            tmax = rec.t;
+        }
+    }
+    return hasHit;
+}
+
+
+
+bool TriangleMesh::shadowHit( const Ray &r, Real tmin, Real tmax ) const
+{
+    int n = numTriangles();
+
+    for ( int i = 0; i < n; i++ )
+        if ( shadowHitPrimitive( i, r, tmin, tmax ) ) return true;
+
+    return false;
+}
+
+
+
+bool TriangleMesh::boundingBox( AABB &box ) const
+{
+    if ( vertices.empty() ) return false;
+
+    box.setEmpty();
+    for ( size_t k = 0; k < vertices.size(); k++ ) box.expand( vertices[k] );
+    return true;
+}
@@ -0,0 +1,89 @@
+#ifndef _TRIANGLEMESH_H_
+#define _TRIANGLEMESH_H_
+
+#include <vector>
+#include <cstdint>
+#include "Surface.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// A triangle mesh with shared vertex buffers. Triangle i is made of the
+// vertices indices[3*i], indices[3*i+1] and indices[3*i+2]. Vertices
+// shared by several triangles are stored once.
+//
+// If the normals array is empty, each triangle is shaded with its
+// geometric normal, as a Triangle made without vertex normals is.
+// Otherwise normals[k] is the normal of vertices[k], and is interpolated
+// across each triangle.
+//
+// Each triangle is a primitive that acceleration structures bound and
+// intersect individually.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+class TriangleMesh : public Surface
+{
+public:
+
+    vector<Vector3d> vertices;
+    vector<Vector3d> normals;   // Empty, or one per vertex.
+    vector<uint32_t> indices;   // Three per triangle.
+
+
+    TriangleMesh( const Material *mat_ptr ) { matp = mat_ptr; }
+
+    TriangleMesh( const vector<Vector3d> &vertices_, const vector<uint32_t> &indices_,
+                  const Material *mat_ptr )
+    {
+        vertices = vertices_;  indices = indices_;
+        matp = mat_ptr;
+    }
+
+
+    int numTriangles() const { return (int)( indices.size() / 3 ); }
+
+
+    // Tests the ray against every triangle of the mesh.
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const;
+
+
+    virtual bool boundingBox( AABB &box ) const;
+
+
+    virtual int numPrimitives() const { return numTriangles(); }
+
+    virtual bool primitiveBoundingBox( int i, AABB &box ) const;
+
+    virtual bool hitPrimitive( int i, const Ray &r, Real tmin, Real tmax,
+                               SurfaceHitRecord &rec ) const;
+
+    virtual bool shadowHitPrimitive( int i, const Ray &r, Real tmin, Real tmax ) const;
+
+
+    virtual void hitPoint( const Ray &r, const SurfaceHitRecord &rec, SurfaceHitPoint &point ) const;
+
+    virtual bool primitiveTriangle( int i, Vector3d &v0, Vector3d &v1, Vector3d &v2 ) const
+    {
+        v0 = vertices[ indices[3*i] ];  v1 = vertices[ indices[3*i + 1] ];  v2 = vertices[ indices[3*i + 2] ];
+        return true;
+    }
+
+}; // TriangleMesh
+
+
+#endif // _TRIANGLEMESH_H_
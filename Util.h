@@ -3,6 +3,8 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include <cstdint>
 
 using namespace std;
 
@@ -236,7 +238,60 @@ public:
     }
 
 
+    static float HashUniform( const double v[], int n )
+        // Returns a value in the range [0, 1) hashed from the n values v, the
+        // same for the same values, so that a renderer may draw its random
+        // numbers whatever the order in which it traces its rays.
+    {
+        unsigned long long h = 0;
+        for ( int i = 0; i < n; i++ )
+        {
+            unsigned long long bits;
+            memcpy( &bits, &v[i], sizeof( bits ) );
+            h = ( h ^ bits ) * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 31;
+        }
+        return (float)( h >> 40 ) / (float)( 1 << 24 );
+    }
+
+
 }; // Util
 
 
+
+//============================================================================
+
+
+// An allocator for vectors whose elements must start on an Alignment-byte
+// boundary, such as a cache line, which std::allocator does not promise for
+// over-aligned types before C++17. Alignment is a power of 2.
+template <class T, size_t Alignment>
+struct AlignedAllocator
+{
+    typedef T value_type;
+    template <class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+    template <class U> AlignedAllocator( const AlignedAllocator<U, Alignment> & ) {}
+
+    // The block is allocated with room to move up to the boundary, and the
+    // pointer to it is kept just below the elements.
+    T *allocate( size_t n )
+    {
+        void *block = CMalloc( n * sizeof( T ) + Alignment + sizeof( void * ) );
+        uintptr_t start = ( (uintptr_t) block + sizeof( void * ) + Alignment - 1 ) & ~( (uintptr_t) Alignment - 1 );
+        ( (void **) start )[-1] = block;
+        return (T *) start;
+    }
+
+    void deallocate( T *p, size_t ) { free( ( (void **) p )[-1] ); }
+};
+
+template <class T, class U, size_t Alignment>
+bool operator==( const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> & ) { return true; }
+
+template <class T, class U, size_t Alignment>
+bool operator!=( const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> & ) { return false; }
+
+
 #endif // _UTIL_H_
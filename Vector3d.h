@@ -2,44 +2,78 @@
 #define _VECTOR3D_H_
 
 #include <cmath>
+#include <cfloat>
 #include <cassert>
 #include <iostream>
 
 using namespace std;
 
 
-// For 3D vectors and 3D points.
+// The precision of the trace pipeline: of points, directions, ray
+// parameters and the intersection tests. float, unless RAYTRACE_DOUBLE
+// is defined (CMake option RAYTRACE_DOUBLE). WideReal is a wider type,
+// for the few operations that must be redone with more precision.
 
-class Vector3d
+#ifdef RAYTRACE_DOUBLE
+typedef double Real;
+typedef long double WideReal;
+#define REAL_MAX        DBL_MAX
+#define REAL_EPSILON    DBL_EPSILON
+#else
+typedef float Real;
+typedef double WideReal;
+#define REAL_MAX        FLT_MAX
+#define REAL_EPSILON    FLT_EPSILON
+#endif
+
+
+// Bound on the relative error of a result of n operations in Real, each
+// rounded to nearest: n u / ( 1 - n u ), with u = REAL_EPSILON / 2.
+inline Real errorGamma( int n )
+{
+    Real nu = n * ( REAL_EPSILON / 2 );
+    return nu / ( 1 - nu );
+}
+
+
+// For 3D vectors and 3D points, with components of type T.
+// Vector3d is the one of the trace pipeline, with Real components.
+
+template <typename T>
+class Vector3T
 {
 public:
 
 // Constructors
 
-    Vector3d() {}
-    Vector3d( const double v[3] ) { data[0] = v[0]; data[1] = v[1]; data[2] = v[2]; }
-    Vector3d( const float  v[3] ) { data[0] = v[0]; data[1] = v[1]; data[2] = v[2]; }
-    Vector3d( double x, double y, double z ) { data[0] = x; data[1] = y; data[2] = z; }
+    Vector3T() {}
+    Vector3T( const double v[3] ) { data[0] = (T)v[0]; data[1] = (T)v[1]; data[2] = (T)v[2]; }
+    Vector3T( const float  v[3] ) { data[0] = v[0]; data[1] = v[1]; data[2] = v[2]; }
+    Vector3T( T x, T y, T z ) { data[0] = x; data[1] = y; data[2] = z; }
+
+    // From a vector of another precision.
+    template <typename U>
+    explicit Vector3T( const Vector3T<U> &v ) { data[0] = (T)v.x(); data[1] = (T)v.y(); data[2] = (T)v.z(); }
 
 
 // Data setting and reading.
 
-    Vector3d &setX( double a ) { data[0] = a; return (*this); }
-    Vector3d &setY( double a ) { data[1] = a; return (*this); }
-    Vector3d &setZ( double a ) { data[2] = a; return (*this); }
+    Vector3T &setX( T a ) { data[0] = a; return (*this); }
+    Vector3T &setY( T a ) { data[1] = a; return (*this); }
+    Vector3T &setZ( T a ) { data[2] = a; return (*this); }
 
-    Vector3d &setXYZ( const double v[3] ) { data[0] = v[0]; data[1] = v[1]; data[2] = v[2]; return (*this); }
-    Vector3d &setXYZ( const float  v[3] ) { data[0] = v[0]; data[1] = v[1]; data[2] = v[2]; return (*this); }
-    Vector3d &setXYZ( double x, double y, double z ) { data[0] = x; data[1] = y; data[2] = z; return (*this); }
-    Vector3d &setToZeros() { data[0] = data[1] = data[2] = 0.0; return (*this); }
+    Vector3T &setXYZ( const double v[3] ) { data[0] = (T)v[0]; data[1] = (T)v[1]; data[2] = (T)v[2]; return (*this); }
+    Vector3T &setXYZ( const float  v[3] ) { data[0] = v[0]; data[1] = v[1]; data[2] = v[2]; return (*this); }
+    Vector3T &setXYZ( T x, T y, T z ) { data[0] = x; data[1] = y; data[2] = z; return (*this); }
+    Vector3T &setToZeros() { data[0] = data[1] = data[2] = 0; return (*this); }
 
-    double &x() { return data[0]; }
-    double &y() { return data[1]; }
-    double &z() { return data[2]; }
+    T &x() { return data[0]; }
+    T &y() { return data[1]; }
+    T &z() { return data[2]; }
 
-    double x() const { return data[0]; }
-    double y() const { return data[1]; }
-    double z() const { return data[2]; }
+    T x() const { return data[0]; }
+    T y() const { return data[1]; }
+    T z() const { return data[2]; }
 
     void getXYZ( double v[3] ) const { v[0] = data[0]; v[1] = data[1]; v[2] = data[2]; }
     void getXYZ( float  v[3] ) const { v[0] = (float)data[0]; v[1] = (float)data[1]; v[2] = (float)data[2]; }
@@ -47,136 +81,132 @@ public:
 
 // Operators.
 
-    double &operator[]( int i ) { assert(i >= 0 && i < 3); return data[i]; }
+    T &operator[]( int i ) { assert(i >= 0 && i < 3); return data[i]; }
 
-    double operator[]( int i ) const { assert(i >= 0 && i < 3); return data[i]; }
+    T operator[]( int i ) const { assert(i >= 0 && i < 3); return data[i]; }
 
 
-    Vector3d operator+ () const 
+    Vector3T operator+ () const 
         { return (*this); }
 
-    Vector3d operator- () const 
-        { return Vector3d( -data[0], -data[1], -data[2] ); }
+    Vector3T operator- () const 
+        { return Vector3T( -data[0], -data[1], -data[2] ); }
 
 
-    Vector3d &operator+= ( const Vector3d &v ) 
+    Vector3T &operator+= ( const Vector3T &v ) 
         { data[0] += v.data[0]; data[1] += v.data[1]; data[2] += v.data[2]; return (*this); }
 
-    Vector3d &operator-= ( const Vector3d &v ) 
+    Vector3T &operator-= ( const Vector3T &v ) 
         { data[0] -= v.data[0]; data[1] -= v.data[1]; data[2] -= v.data[2]; return (*this); }
 
-    Vector3d &operator*= ( const Vector3d &v ) 
+    Vector3T &operator*= ( const Vector3T &v ) 
         { data[0] *= v.data[0]; data[1] *= v.data[1]; data[2] *= v.data[2]; return (*this); }
 
-    Vector3d &operator/= ( const Vector3d &v ) 
+    Vector3T &operator/= ( const Vector3T &v ) 
         { data[0] /= v.data[0]; data[1] /= v.data[1]; data[2] /= v.data[2]; return (*this); }
 
-    Vector3d &operator*= ( double a ) 
+    Vector3T &operator*= ( T a ) 
         { data[0] *= a; data[1] *= a; data[2] *= a; return (*this); }
 
-    Vector3d &operator/= ( double a ) 
+    Vector3T &operator/= ( T a ) 
         { data[0] /= a; data[1] /= a; data[2] /= a; return (*this); }
 
 
-    friend Vector3d operator+ ( const Vector3d &v1, const Vector3d &v2 );
-    friend Vector3d operator- ( const Vector3d &v1, const Vector3d &v2 );
-    friend Vector3d operator* ( const Vector3d &v1, const Vector3d &v2 );
-    friend Vector3d operator/ ( const Vector3d &v1, const Vector3d &v2 );
-    friend Vector3d operator* ( double a, const Vector3d &v );
-    friend Vector3d operator* ( const Vector3d &v, double a );
-    friend Vector3d operator/ ( const Vector3d &v, double a );
-    friend bool operator== ( const Vector3d &v1, const Vector3d &v2 );
-    friend bool operator!= ( const Vector3d &v1, const Vector3d &v2 );
-    friend double dot( const Vector3d &v1, const Vector3d &v2 );
-    friend Vector3d cross( const Vector3d &v1, const Vector3d &v2 );
-    friend Vector3d triNormal( const Vector3d &v1, const Vector3d &v2, const Vector3d &v3 );
+// More unary and binary vector operators. Defined here, they are not
+// templates, so a double scalar converts to T as it is passed.
 
+    friend Vector3T operator+ ( const Vector3T &v1, const Vector3T &v2 ) 
+        { return Vector3T( v1.data[0] + v2.data[0], v1.data[1] + v2.data[1], v1.data[2] + v2.data[2] ); }
 
-// Other functions.
+    friend Vector3T operator- ( const Vector3T &v1, const Vector3T &v2 ) 
+        { return Vector3T( v1.data[0] - v2.data[0], v1.data[1] - v2.data[1], v1.data[2] - v2.data[2] ); }
 
-    double length() const 
-        { return sqrt( data[0]*data[0] + data[1]*data[1] + data[2]*data[2] ); }
+    friend Vector3T operator* ( const Vector3T &v1, const Vector3T &v2 ) 
+        { return Vector3T( v1.data[0] * v2.data[0], v1.data[1] * v2.data[1], v1.data[2] * v2.data[2] ); }
 
-    double sqrLength() const 
-        { return ( data[0]*data[0] + data[1]*data[1] + data[2]*data[2] ); }
+    friend Vector3T operator/ ( const Vector3T &v1, const Vector3T &v2 ) 
+        { return Vector3T( v1.data[0] / v2.data[0], v1.data[1] / v2.data[1], v1.data[2] / v2.data[2] ); }
 
+    friend Vector3T operator* ( T a, const Vector3T &v ) 
+        { return Vector3T( a * v.data[0], a * v.data[1], a * v.data[2] ); }
 
-    Vector3d unitVector() const
-    {
-        double invLen = 1.0 / length();
-        return Vector3d( data[0]*invLen, data[1]*invLen, data[2]*invLen ); 
-    }
+    friend Vector3T operator* ( const Vector3T &v, T a ) 
+        { return Vector3T( a * v.data[0], a * v.data[1], a * v.data[2] ); }
 
+    friend Vector3T operator/ ( const Vector3T &v, T a ) 
+        { return Vector3T( v.data[0] / a, v.data[1] / a, v.data[2] / a ); }
 
-    Vector3d &makeUnitVector()
-    { 
-        double invLen = 1.0 / length();
-        data[0] *= invLen; 
-        data[1] *= invLen; 
-        data[2] *= invLen;
-        return (*this);
-    }
+    friend bool operator== ( const Vector3T &v1, const Vector3T &v2 ) 
+        { return ( ( v1.data[0] == v2.data[0] ) && ( v1.data[1] == v2.data[1] ) && ( v1.data[2] == v2.data[2] ) ); }
 
+    friend bool operator!= ( const Vector3T &v1, const Vector3T &v2 ) 
+        { return ( ( v1.data[0] != v2.data[0] ) || ( v1.data[1] != v2.data[1] ) || ( v1.data[2] != v2.data[2] ) ); }
 
-private:
 
-    // The 3D vector data.
-    double data[3];
+    friend T dot( const Vector3T &v1, const Vector3T &v2 ) 
+        { return (v1.data[0] * v2.data[0]) + (v1.data[1] * v2.data[1]) + (v1.data[2] * v2.data[2]); }
 
-}; // Vector3d
 
+    friend Vector3T cross( const Vector3T &v1, const Vector3T &v2 )
+        { return Vector3T( v1.data[1] * v2.data[2] - v1.data[2] * v2.data[1],
+                           v1.data[2] * v2.data[0] - v1.data[0] * v2.data[2],
+                           v1.data[0] * v2.data[1] - v1.data[1] * v2.data[0] ); } 
 
 
-// More unary and binary vector operators.
+    // Returns the normal vector of the triangle.
+    friend Vector3T triNormal( const Vector3T &v1, const Vector3T &v2, const Vector3T &v3 )
+        { return cross( v2 - v1, v3 - v1 ); }
 
-inline Vector3d operator+ ( const Vector3d &v1, const Vector3d &v2 ) 
-    { return Vector3d( v1.data[0] + v2.data[0], v1.data[1] + v2.data[1], v1.data[2] + v2.data[2] ); }
 
-inline Vector3d operator- ( const Vector3d &v1, const Vector3d &v2 ) 
-    { return Vector3d( v1.data[0] - v2.data[0], v1.data[1] - v2.data[1], v1.data[2] - v2.data[2] ); }
+    // The absolute values of the components.
+    friend Vector3T abs( const Vector3T &v )
+        { return Vector3T( fabs( v.data[0] ), fabs( v.data[1] ), fabs( v.data[2] ) ); }
 
-inline Vector3d operator* ( const Vector3d &v1, const Vector3d &v2 ) 
-    { return Vector3d( v1.data[0] * v2.data[0], v1.data[1] * v2.data[1], v1.data[2] * v2.data[2] ); }
 
-inline Vector3d operator/ ( const Vector3d &v1, const Vector3d &v2 ) 
-    { return Vector3d( v1.data[0] / v2.data[0], v1.data[1] / v2.data[1], v1.data[2] / v2.data[2] ); }
+// Other functions.
 
-inline Vector3d operator* ( double a, const Vector3d &v ) 
-    { return Vector3d( a * v.data[0], a * v.data[1], a * v.data[2] ); }
+    T length() const 
+        { return sqrt( data[0]*data[0] + data[1]*data[1] + data[2]*data[2] ); }
 
-inline Vector3d operator* ( const Vector3d &v, double a ) 
-    { return Vector3d( a * v.data[0], a * v.data[1], a * v.data[2] ); }
+    T sqrLength() const 
+        { return ( data[0]*data[0] + data[1]*data[1] + data[2]*data[2] ); }
 
-inline Vector3d operator/ ( const Vector3d &v, double a ) 
-    { return Vector3d( v.data[0] / a, v.data[1] / a, v.data[2] / a ); }
 
-inline bool operator== ( const Vector3d &v1, const Vector3d &v2 ) 
-    { return ( ( v1.data[0] == v2.data[0] ) && ( v1.data[1] == v2.data[1] ) && ( v1.data[2] == v2.data[2] ) ); }
+    Vector3T unitVector() const
+    {
+        T invLen = 1 / length();
+        return Vector3T( data[0]*invLen, data[1]*invLen, data[2]*invLen ); 
+    }
 
-inline bool operator!= ( const Vector3d &v1, const Vector3d &v2 ) 
-    { return ( ( v1.data[0] != v2.data[0] ) || ( v1.data[1] != v2.data[1] ) || ( v1.data[2] != v2.data[2] ) ); }
+
+    Vector3T &makeUnitVector()
+    { 
+        T invLen = 1 / length();
+        data[0] *= invLen; 
+        data[1] *= invLen; 
+        data[2] *= invLen;
+        return (*this);
+    }
 
 
-inline double dot( const Vector3d &v1, const Vector3d &v2 ) 
-    { return (v1.data[0] * v2.data[0]) + (v1.data[1] * v2.data[1]) + (v1.data[2] * v2.data[2]); }
+private:
 
+    // The 3D vector data.
+    T data[3];
 
-inline Vector3d cross( const Vector3d &v1, const Vector3d &v2 )
-    { return Vector3d( v1.data[1] * v2.data[2] - v1.data[2] * v2.data[1],
-                       v1.data[2] * v2.data[0] - v1.data[0] * v2.data[2],
-                       v1.data[0] * v2.data[1] - v1.data[1] * v2.data[0] ); } 
+}; // Vector3T
 
 
-// Returns the normal vector of the triangle.
-inline Vector3d triNormal( const Vector3d &v1, const Vector3d &v2, const Vector3d &v3 )
-    { return cross( v2 - v1, v3 - v1 ); }
+typedef Vector3T<Real> Vector3d;
 
 
 
-inline istream &operator>> ( istream &is, Vector3d &v ) 
+template <typename T>
+inline istream &operator>> ( istream &is, Vector3T<T> &v ) 
     { return ( is >> v.x() >> v.y() >> v.z() ); }
 
-inline ostream &operator<< ( ostream &os, Vector3d v ) 
+template <typename T>
+inline ostream &operator<< ( ostream &os, Vector3T<T> v ) 
     { return ( os << v.x() << " " << v.y() << " " << v.z() ); }
 
 
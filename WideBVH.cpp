@@ -0,0 +1,975 @@
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include "Util.h"
+#include "Scheduler.h"
+#include "WideBVH.h"
+
+using namespace std;
+
+
+// SSE2 is part of every x86-64 CPU, so the 4-wide node tests need no
+// runtime dispatch. A BVH8 node is tested as two groups of four.
+#if defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+
+// Relative widening of the entry and exit distances of the float slab
+// test, in units of FLT_EPSILON. Covers the rounding of the inverse
+// direction, of the subtraction and product, and of tmin and tmax.
+#define WIDE_BVH_ERROR_ULPS     8.0f
+
+
+
+static float roundDown( double x )
+{
+    float f = (float) x;
+    return ( (double) f > x )? nextafterf( f, -INFINITY ) : f;
+}
+
+
+static float roundUp( double x )
+{
+    float f = (float) x;
+    return ( (double) f < x )? nextafterf( f, INFINITY ) : f;
+}
+
+
+// The decoded bound of a quantized box, and a bound on how far a
+// compiler contracting it into a fused multiply-add may move it.
+static inline float dequantize( float origin, float scale, int q ) { return origin + (float) q * scale; }
+
+static inline float dequantizeError( float origin, float scale, int q )
+    { return 2.0f * FLT_EPSILON * ( fabsf( origin ) + (float) q * scale ); }
+
+
+
+template <int N>
+WideBVH<N>::WideBVH( const SurfacePtr *surfaces, int numSurfaces, bool quantized,
+                     const BVHBuildOptions &options )
+    : mBinary( surfaces, numSurfaces, options )
+{
+    matp = NULL;
+    mQuantized = quantized;
+    if ( !mBinary.mNodes.empty() ) collapse( 0 );
+}
+
+
+template <int N>
+WideBVH<N>::WideBVH( const BVH &binary, bool quantized )
+    : mBinary( binary )
+{
+    matp = NULL;
+    mQuantized = quantized;
+    if ( !mBinary.mNodes.empty() ) collapse( 0 );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Makes the wide node for the binary subtree at binaryIndex, then those of
+// its interior children, and returns its index.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+int WideBVH<N>::collapse( int binaryIndex )
+{
+    const vector<BVH::Node> &binaryNodes = mBinary.mNodes;
+    const BVH::Node &root = binaryNodes[ binaryIndex ];
+
+    int binaryChildren[N];
+    int numChildren = 0;
+
+    // A binary BVH that is a single leaf becomes a node with one child.
+    if ( root.count > 0 )
+        binaryChildren[ numChildren++ ] = binaryIndex;
+    else
+    {
+        binaryChildren[ numChildren++ ] = binaryIndex + 1;
+        binaryChildren[ numChildren++ ] = root.offset;
+    }
+
+    // Open the largest interior child until the node is full.
+    while ( numChildren < N )
+    {
+        int best = -1;
+        double bestArea = -1.0;
+        for ( int i = 0; i < numChildren; i++ )
+        {
+            const BVH::Node &c = binaryNodes[ binaryChildren[i] ];
+            if ( c.count == 0 && c.box.surfaceArea() > bestArea )
+            {
+                best = i;
+                bestArea = c.box.surfaceArea();
+            }
+        }
+        if ( best < 0 ) break;
+
+        int c = binaryChildren[ best ];
+        binaryChildren[ best ] = c + 1;
+        binaryChildren[ numChildren++ ] = binaryNodes[c].offset;
+    }
+
+    int nodeIndex = numNodes();
+    if ( mQuantized )
+        mQNodes.push_back( QuantizedNode() );
+    else
+        mNodes.push_back( Node() );
+
+    mBinaryChildren.resize( mBinaryChildren.size() + N, -1 );
+    for ( int i = 0; i < numChildren; i++ ) mBinaryChildren[ nodeIndex * N + i ] = binaryChildren[i];
+
+    int children[N];
+    for ( int i = 0; i < numChildren; i++ )
+    {
+        int c = binaryChildren[i];
+        children[i] = ( binaryNodes[c].count > 0 )? ~c : collapse( c );
+    }
+
+    setNode( nodeIndex, binaryChildren, children, numChildren );
+    return nodeIndex;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Refits the binary BVH, and copies its new boxes into the wide nodes, in
+// parallel. If the binary BVH is rebuilt instead, so is the wide one.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+bool WideBVH<N>::refitOrRebuild( double maxCostGrowth )
+{
+    if ( mBinary.refitOrRebuild( maxCostGrowth ) )
+    {
+        mNodes.clear();
+        mQNodes.clear();
+        mBinaryChildren.clear();
+        if ( !mBinary.mNodes.empty() ) collapse( 0 );
+        return true;
+    }
+
+    const int blockSize = 1024;
+    int numBlocks = ( numNodes() + blockSize - 1 ) / blockSize;
+
+    Scheduler::Run( numBlocks, mBinary.mOptions.numThreads, [&]( int block, int )
+    {
+        int end = Util::Min2( ( block + 1 ) * blockSize, numNodes() );
+        for ( int nodeIndex = block * blockSize; nodeIndex < end; nodeIndex++ )
+        {
+            const int *binaryChildren = &mBinaryChildren[ nodeIndex * N ];
+            const int *child = mQuantized? mQNodes[nodeIndex].child : mNodes[nodeIndex].child;
+
+            int children[N];
+            int numChildren = 0;
+            while ( numChildren < N && child[ numChildren ] != EMPTY_CHILD )
+            {
+                children[ numChildren ] = child[ numChildren ];
+                numChildren++;
+            }
+            setNode( nodeIndex, binaryChildren, children, numChildren );
+        }
+    } );
+    return false;
+}
+
+
+
+template <int N>
+void WideBVH<N>::setNode( int nodeIndex, const int *binaryChildren, const int *children, int numChildren )
+{
+    float lo[3][N], hi[3][N];
+    float parentLo[3] = { INFINITY, INFINITY, INFINITY };
+    float parentHi[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    for ( int i = 0; i < N; i++ )
+    {
+        for ( int a = 0; a < 3; a++ )
+        {
+            if ( i >= numChildren )
+            {
+                lo[a][i] = INFINITY;
+                hi[a][i] = -INFINITY;
+                continue;
+            }
+            const AABB &box = mBinary.mNodes[ binaryChildren[i] ].box;
+            lo[a][i] = roundDown( box.minPt[a] );
+            hi[a][i] = roundUp( box.maxPt[a] );
+            if ( lo[a][i] < parentLo[a] ) parentLo[a] = lo[a][i];
+            if ( hi[a][i] > parentHi[a] ) parentHi[a] = hi[a][i];
+        }
+    }
+
+    if ( !mQuantized )
+    {
+        Node &node = mNodes[ nodeIndex ];
+        for ( int i = 0; i < N; i++ )
+        {
+            node.minX[i] = lo[0][i];  node.minY[i] = lo[1][i];  node.minZ[i] = lo[2][i];
+            node.maxX[i] = hi[0][i];  node.maxY[i] = hi[1][i];  node.maxZ[i] = hi[2][i];
+            node.child[i] = ( i < numChildren )? children[i] : (int) EMPTY_CHILD;
+        }
+        return;
+    }
+
+    QuantizedNode &node = mQNodes[ nodeIndex ];
+    for ( int a = 0; a < 3; a++ )
+    {
+        // The grid spans the node box, with its last line at or beyond the
+        // top of the box.
+        float origin = parentLo[a];
+        double extent = (double) parentHi[a] - origin;
+        float scale = roundUp( ( extent + 4.0 * FLT_EPSILON * ( fabs( origin ) + fabs( parentHi[a] ) ) ) / 255.0 );
+        while ( dequantize( origin, scale, 255 ) - dequantizeError( origin, scale, 255 ) < parentHi[a] )
+            scale = nextafterf( scale, INFINITY );
+        node.origin[a] = origin;
+        node.scale[a] = scale;
+
+        // Round each child box outwards to the grid.
+        for ( int i = 0; i < N; i++ )
+        {
+            if ( i >= numChildren )
+            {
+                node.qmin[a][i] = 255;
+                node.qmax[a][i] = 0;
+                continue;
+            }
+
+            int qlo = ( scale > 0.0f )? (int) floorf( ( lo[a][i] - origin ) / scale ) : 0;
+            int qhi = ( scale > 0.0f )? (int) ceilf( ( hi[a][i] - origin ) / scale ) : 0;
+            qlo = ( qlo < 0 )? 0 : ( qlo > 255 )? 255 : qlo;
+            qhi = ( qhi < 0 )? 0 : ( qhi > 255 )? 255 : qhi;
+            while ( qlo > 0 && dequantize( origin, scale, qlo ) + dequantizeError( origin, scale, qlo ) > lo[a][i] )
+                qlo--;
+            while ( qhi < 255 && dequantize( origin, scale, qhi ) - dequantizeError( origin, scale, qhi ) < hi[a][i] )
+                qhi++;
+            node.qmin[a][i] = (unsigned char) qlo;
+            node.qmax[a][i] = (unsigned char) qhi;
+        }
+    }
+
+    for ( int i = 0; i < N; i++ )
+        node.child[i] = ( i < numChildren )? children[i] : (int) EMPTY_CHILD;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Prepares the ray for the float slab tests. The origin is rounded to
+// float, then moved by more than its rounding error, towards the far side
+// of the boxes when computing entry distances and towards the near side
+// when computing exit distances, so neither is overestimated or
+// underestimated because of the rounding.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+typename WideBVH<N>::NodeRay WideBVH<N>::makeNodeRay( const Ray &r )
+{
+    NodeRay ray;
+    Vector3d orig = r.origin();
+    Vector3d dir = r.direction();
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        float o = (float) orig[a];
+        double err = fabs( orig[a] - o ) + FLT_EPSILON * fabs( o ) + FLT_MIN;
+        float e = (float)( err * 1.0001 );
+
+        ray.invDir[a] = 1.0f / (float) dir[a];
+        ray.dirIsNeg[a] = ( ray.invDir[a] < 0.0f );
+        ray.oNear[a] = ray.dirIsNeg[a]? o - e : o + e;
+        ray.oFar[a] = ray.dirIsNeg[a]? o + e : o - e;
+    }
+    return ray;
+}
+
+
+
+#ifdef WIDE_BVH_SSE
+
+// Slab test of a ray against four boxes, given their near and far bounds
+// along each axis. Returns the mask of the boxes hit, and their widened
+// entry distances.
+static inline unsigned slabTest4( __m128 nearX, __m128 nearY, __m128 nearZ,
+                                  __m128 farX, __m128 farY, __m128 farZ,
+                                  const float *oNear, const float *oFar, const float *invDir,
+                                  float tmin, float tmax, float *tNear )
+{
+    __m128 invX = _mm_set1_ps( invDir[0] );
+    __m128 invY = _mm_set1_ps( invDir[1] );
+    __m128 invZ = _mm_set1_ps( invDir[2] );
+
+    __m128 t0x = _mm_mul_ps( _mm_sub_ps( nearX, _mm_set1_ps( oNear[0] ) ), invX );
+    __m128 t0y = _mm_mul_ps( _mm_sub_ps( nearY, _mm_set1_ps( oNear[1] ) ), invY );
+    __m128 t0z = _mm_mul_ps( _mm_sub_ps( nearZ, _mm_set1_ps( oNear[2] ) ), invZ );
+    __m128 t1x = _mm_mul_ps( _mm_sub_ps( farX, _mm_set1_ps( oFar[0] ) ), invX );
+    __m128 t1y = _mm_mul_ps( _mm_sub_ps( farY, _mm_set1_ps( oFar[1] ) ), invY );
+    __m128 t1z = _mm_mul_ps( _mm_sub_ps( farZ, _mm_set1_ps( oFar[2] ) ), invZ );
+
+    // _mm_max_ps and _mm_min_ps return their second operand if either is
+    // NaN, so the NaNs of rays lying in a slab plane are ignored.
+    __m128 tn = _mm_max_ps( t0x, _mm_max_ps( t0y, _mm_max_ps( t0z, _mm_set1_ps( tmin ) ) ) );
+    __m128 tf = _mm_min_ps( t1x, _mm_min_ps( t1y, _mm_min_ps( t1z, _mm_set1_ps( tmax ) ) ) );
+
+    const __m128 absMask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+    const __m128 k = _mm_set1_ps( WIDE_BVH_ERROR_ULPS * FLT_EPSILON );
+    tn = _mm_sub_ps( tn, _mm_mul_ps( _mm_and_ps( tn, absMask ), k ) );
+    tf = _mm_add_ps( tf, _mm_mul_ps( _mm_and_ps( tf, absMask ), k ) );
+
+    _mm_storeu_ps( tNear, tn );
+    return (unsigned) _mm_movemask_ps( _mm_cmple_ps( tn, tf ) );
+}
+
+
+// Loads four 8-bit grid coordinates as floats.
+static inline __m128 loadQuantized4( const unsigned char *q )
+{
+    int bytes;
+    memcpy( &bytes, q, 4 );
+    __m128i zero = _mm_setzero_si128();
+    __m128i b = _mm_cvtsi32_si128( bytes );
+    return _mm_cvtepi32_ps( _mm_unpacklo_epi16( _mm_unpacklo_epi8( b, zero ), zero ) );
+}
+
+#else
+
+// One box at a time. The comparisons ignore NaNs as the SSE version does.
+static inline unsigned slabTest1( float nearX, float nearY, float nearZ,
+                                  float farX, float farY, float farZ,
+                                  const float *oNear, const float *oFar, const float *invDir,
+                                  float tmin, float tmax, float *tNear )
+{
+    float t0[3] = { ( nearX - oNear[0] ) * invDir[0], ( nearY - oNear[1] ) * invDir[1],
+                    ( nearZ - oNear[2] ) * invDir[2] };
+    float t1[3] = { ( farX - oFar[0] ) * invDir[0], ( farY - oFar[1] ) * invDir[1],
+                    ( farZ - oFar[2] ) * invDir[2] };
+
+    float tn = tmin, tf = tmax;
+    for ( int a = 0; a < 3; a++ )
+    {
+        if ( t0[a] > tn ) tn = t0[a];
+        if ( t1[a] < tf ) tf = t1[a];
+    }
+
+    tn -= fabsf( tn ) * ( WIDE_BVH_ERROR_ULPS * FLT_EPSILON );
+    tf += fabsf( tf ) * ( WIDE_BVH_ERROR_ULPS * FLT_EPSILON );
+    *tNear = tn;
+    return ( tn <= tf )? 1u : 0u;
+}
+
+#endif
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tests the ray against the boxes of all the children of a node. Returns
+// the mask of those hit at t in [tmin, tmax], and sets their entry
+// distances in tNear.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+unsigned WideBVH<N>::intersectNode( const Node &node, const NodeRay &ray,
+                                    float tmin, float tmax, float *tNear ) const
+{
+    const float *nearX = ray.dirIsNeg[0]? node.maxX : node.minX;
+    const float *nearY = ray.dirIsNeg[1]? node.maxY : node.minY;
+    const float *nearZ = ray.dirIsNeg[2]? node.maxZ : node.minZ;
+    const float *farX = ray.dirIsNeg[0]? node.minX : node.maxX;
+    const float *farY = ray.dirIsNeg[1]? node.minY : node.maxY;
+    const float *farZ = ray.dirIsNeg[2]? node.minZ : node.maxZ;
+
+    unsigned mask = 0;
+
+#ifdef WIDE_BVH_SSE
+    for ( int g = 0; g < N; g += 4 )
+        mask |= slabTest4( _mm_loadu_ps( nearX + g ), _mm_loadu_ps( nearY + g ), _mm_loadu_ps( nearZ + g ),
+                           _mm_loadu_ps( farX + g ), _mm_loadu_ps( farY + g ), _mm_loadu_ps( farZ + g ),
+                           ray.oNear, ray.oFar, ray.invDir, tmin, tmax, tNear + g ) << g;
+#else
+    for ( int i = 0; i < N; i++ )
+        mask |= slabTest1( nearX[i], nearY[i], nearZ[i], farX[i], farY[i], farZ[i],
+                           ray.oNear, ray.oFar, ray.invDir, tmin, tmax, tNear + i ) << i;
+#endif
+
+    return mask;
+}
+
+
+
+template <int N>
+unsigned WideBVH<N>::intersectNode( const QuantizedNode &node, const NodeRay &ray,
+                                    float tmin, float tmax, float *tNear ) const
+{
+    const unsigned char *qNear[3], *qFar[3];
+    for ( int a = 0; a < 3; a++ )
+    {
+        qNear[a] = ray.dirIsNeg[a]? node.qmax[a] : node.qmin[a];
+        qFar[a] = ray.dirIsNeg[a]? node.qmin[a] : node.qmax[a];
+    }
+
+    unsigned mask = 0;
+
+#ifdef WIDE_BVH_SSE
+    __m128 origin[3], scale[3];
+    for ( int a = 0; a < 3; a++ )
+    {
+        origin[a] = _mm_set1_ps( node.origin[a] );
+        scale[a] = _mm_set1_ps( node.scale[a] );
+    }
+
+    for ( int g = 0; g < N; g += 4 )
+    {
+        __m128 nearB[3], farB[3];
+        for ( int a = 0; a < 3; a++ )
+        {
+            nearB[a] = _mm_add_ps( origin[a], _mm_mul_ps( loadQuantized4( qNear[a] + g ), scale[a] ) );
+            farB[a] = _mm_add_ps( origin[a], _mm_mul_ps( loadQuantized4( qFar[a] + g ), scale[a] ) );
+        }
+        mask |= slabTest4( nearB[0], nearB[1], nearB[2], farB[0], farB[1], farB[2],
+                           ray.oNear, ray.oFar, ray.invDir, tmin, tmax, tNear + g ) << g;
+    }
+#else
+    for ( int i = 0; i < N; i++ )
+    {
+        float nearB[3], farB[3];
+        for ( int a = 0; a < 3; a++ )
+        {
+            nearB[a] = dequantize( node.origin[a], node.scale[a], qNear[a][i] );
+            farB[a] = dequantize( node.origin[a], node.scale[a], qFar[a][i] );
+        }
+        mask |= slabTest1( nearB[0], nearB[1], nearB[2], farB[0], farB[1], farB[2],
+                           ray.oNear, ray.oFar, ray.invDir, tmin, tmax, tNear + i ) << i;
+    }
+#endif
+
+    return mask;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Nearest-hit traversal. The children hit are pushed farthest first, so the
+// nearest is visited next, and a child is skipped when popped if a hit
+// nearer than its entry distance has been found since it was pushed.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+template <class NodeType>
+bool WideBVH<N>::traverseHit( const NodeVector<NodeType> &nodes, const Ray &r, Real tmin,
+                              Real &nearest_t, SurfaceHitRecord &rec, int root ) const
+{
+    struct Entry
+    {
+        float t;
+        int child;
+    };
+
+    bool hasHit = false;
+    NodeRay ray = makeNodeRay( r );
+    KernelRay kray = BVH::makeKernelRay( r );
+    float tminF = (float) tmin;
+
+    Entry stack[ N * 2 * BVH_MAX_DEPTH ];
+    int stackSize = 0;
+    stack[ stackSize ].t = tminF;
+    stack[ stackSize++ ].child = root;
+
+    while ( stackSize > 0 )
+    {
+        Entry e = stack[ --stackSize ];
+        if ( e.t > nearest_t ) continue;
+
+        if ( e.child < 0 )
+        {
+            if ( mBinary.hitLeaf( mBinary.mNodes[ ~e.child ], r, kray, tmin, nearest_t, rec ) )
+                hasHit = true;
+            continue;
+        }
+
+        const NodeType &node = nodes[ e.child ];
+        float tNear[N];
+        unsigned mask = intersectNode( node, ray, tminF, (float) nearest_t, tNear );
+
+        int first = stackSize;
+        for ( int i = 0; i < N; i++ )
+        {
+            if ( !( mask & ( 1u << i ) ) || node.child[i] == EMPTY_CHILD ) continue;
+
+            // Insertion sort by decreasing entry distance.
+            int j = stackSize++;
+            while ( j > first && stack[j - 1].t < tNear[i] )
+            {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j].t = tNear[i];
+            stack[j].child = node.child[i];
+        }
+    }
+
+    return hasHit;
+}
+
+
+
+template <int N>
+template <class NodeType>
+bool WideBVH<N>::traverseShadowHit( const NodeVector<NodeType> &nodes, const Ray &r,
+                                    Real tmin, Real tmax, Occluder *occluder ) const
+{
+    NodeRay ray = makeNodeRay( r );
+    KernelRay kray = BVH::makeKernelRay( r );
+    float tminF = (float) tmin;
+    float tmaxF = (float) tmax;
+
+    int stack[ N * 2 * BVH_MAX_DEPTH ];
+    int stackSize = 0;
+    stack[ stackSize++ ] = 0;
+
+    while ( stackSize > 0 )
+    {
+        int child = stack[ --stackSize ];
+
+        if ( child < 0 )
+        {
+            if ( mBinary.shadowHitLeaf( mBinary.mNodes[ ~child ], r, kray, tmin, tmax, occluder ) ) return true;
+            continue;
+        }
+
+        const NodeType &node = nodes[ child ];
+        float tNear[N];
+        unsigned mask = intersectNode( node, ray, tminF, tmaxF, tNear );
+
+        for ( int i = 0; i < N; i++ )
+            if ( ( mask & ( 1u << i ) ) && node.child[i] != EMPTY_CHILD )
+                stack[ stackSize++ ] = node.child[i];
+    }
+
+    return false;
+}
+
+
+
+template <int N>
+bool WideBVH<N>::hit( const Ray &r, Real tmin, Real tmax, SurfaceHitRecord &rec ) const
+{
+    bool hasHit = false;
+    Real nearest_t = tmax;
+    SurfaceHitRecord tempHitRec;
+
+    for ( size_t i = 0; i < mBinary.mUnbounded.size(); i++ )
+    {
+        if ( mBinary.mUnbounded[i].hit( r, tmin, nearest_t, tempHitRec ) )
+        {
+            hasHit = true;
+            nearest_t = tempHitRec.t;
+            rec = tempHitRec;
+        }
+    }
+
+    if ( numNodes() == 0 ) return hasHit;
+
+    if ( mQuantized )
+    {
+        if ( traverseHit( mQNodes, r, tmin, nearest_t, rec ) ) hasHit = true;
+    }
+    else
+    {
+        if ( traverseHit( mNodes, r, tmin, nearest_t, rec ) ) hasHit = true;
+    }
+
+    return hasHit;
+}
+
+
+
+// The any-hit query of shadowHit() and shadowHitOccluder(), which sets
+// occluder if it is not NULL.
+template <int N>
+bool WideBVH<N>::anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const
+{
+    for ( size_t i = 0; i < mBinary.mUnbounded.size(); i++ )
+        if ( mBinary.mUnbounded[i].shadowHit( r, tmin, tmax, occluder ) ) return true;
+
+    if ( numNodes() == 0 ) return false;
+
+    if ( mQuantized )
+        return traverseShadowHit( mQNodes, r, tmin, tmax, occluder );
+    else
+        return traverseShadowHit( mNodes, r, tmin, tmax, occluder );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Prepares the rays of a packet for the node tests, with nearest_t as
+// their tmax. Returns false if the rays cannot be traced together: their
+// directions differ in sign along some axis, or one is parallel to an
+// axis, and so the interval test cannot bound them.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+bool WideBVH<N>::makePacketRays( const Ray *rays, int numRays, const Real *nearest_t, PacketRays &p )
+{
+    for ( int i = 0; i < numRays; i++ )
+    {
+        NodeRay ray = makeNodeRay( rays[i] );
+        for ( int a = 0; a < 3; a++ )
+        {
+            if ( i == 0 ) p.dirIsNeg[a] = ray.dirIsNeg[a];
+            if ( ray.dirIsNeg[a] != p.dirIsNeg[a] || !isfinite( ray.invDir[a] ) ) return false;
+
+            p.oNear[a][i] = ray.oNear[a];
+            p.oFar[a][i] = ray.oFar[a];
+            p.invDir[a][i] = ray.invDir[a];
+        }
+        p.tmax[i] = (float) nearest_t[i];
+    }
+
+    for ( int a = 0; a < 3; a++ )
+    {
+        p.oNearMin[a] = p.oNearMax[a] = p.oNear[a][0];
+        p.oFarMin[a] = p.oFarMax[a] = p.oFar[a][0];
+        p.invDirMin[a] = p.invDirMax[a] = p.invDir[a][0];
+
+        for ( int i = 1; i < numRays; i++ )
+        {
+            p.oNearMin[a] = Util::Min2( p.oNearMin[a], p.oNear[a][i] );
+            p.oNearMax[a] = Util::Max2( p.oNearMax[a], p.oNear[a][i] );
+            p.oFarMin[a] = Util::Min2( p.oFarMin[a], p.oFar[a][i] );
+            p.oFarMax[a] = Util::Max2( p.oFarMax[a], p.oFar[a][i] );
+            p.invDirMin[a] = Util::Min2( p.invDirMin[a], p.invDir[a][i] );
+            p.invDirMax[a] = Util::Max2( p.invDirMax[a], p.invDir[a][i] );
+        }
+
+        // Unused lanes repeat the first ray, and are never active.
+        for ( int i = numRays; i < WIDE_BVH_PACKET_SIZE; i++ )
+        {
+            p.oNear[a][i] = p.oNear[a][0];
+            p.oFar[a][i] = p.oFar[a][0];
+            p.invDir[a][i] = p.invDir[a][0];
+        }
+    }
+    for ( int i = numRays; i < WIDE_BVH_PACKET_SIZE; i++ ) p.tmax[i] = p.tmax[0];
+
+    return true;
+}
+
+
+
+// The near and far bounds of the boxes of the children along each axis,
+// for rays going the way of dirIsNeg.
+
+template <int N>
+void WideBVH<N>::childBounds( const Node &node, const int *dirIsNeg, float nearB[3][N], float farB[3][N] )
+{
+    const float *lo[3] = { node.minX, node.minY, node.minZ };
+    const float *hi[3] = { node.maxX, node.maxY, node.maxZ };
+
+    for ( int a = 0; a < 3; a++ )
+        for ( int i = 0; i < N; i++ )
+        {
+            nearB[a][i] = dirIsNeg[a]? hi[a][i] : lo[a][i];
+            farB[a][i] = dirIsNeg[a]? lo[a][i] : hi[a][i];
+        }
+}
+
+
+template <int N>
+void WideBVH<N>::childBounds( const QuantizedNode &node, const int *dirIsNeg, float nearB[3][N], float farB[3][N] )
+{
+    for ( int a = 0; a < 3; a++ )
+        for ( int i = 0; i < N; i++ )
+        {
+            nearB[a][i] = dequantize( node.origin[a], node.scale[a], dirIsNeg[a]? node.qmax[a][i] : node.qmin[a][i] );
+            farB[a][i] = dequantize( node.origin[a], node.scale[a], dirIsNeg[a]? node.qmin[a][i] : node.qmax[a][i] );
+        }
+}
+
+
+
+// Bounds of the product of values in [lo, hi] and [invLo, invHi]. The
+// product rounds monotonically, so they also bound the products of the
+// float slab test.
+
+static inline float productMin( float lo, float hi, float invLo, float invHi )
+{
+    return Util::Min2( Util::Min2( lo * invLo, lo * invHi ), Util::Min2( hi * invLo, hi * invHi ) );
+}
+
+
+static inline float productMax( float lo, float hi, float invLo, float invHi )
+{
+    return Util::Max2( Util::Max2( lo * invLo, lo * invHi ), Util::Max2( hi * invLo, hi * invHi ) );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Interval test of a box against all the rays of a packet, up to tmax.
+// Returns true if no ray of the packet passes the float slab test of the
+// box, else false with a lower bound on their widened entry distances.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+bool WideBVH<N>::cullPacket( const PacketRays &p, const float *nearB, const float *farB,
+                             float tmin, float tmax, float &tNear )
+{
+    float tn = tmin, tf = tmax;
+    for ( int a = 0; a < 3; a++ )
+    {
+        tn = Util::Max2( tn, productMin( nearB[a] - p.oNearMax[a], nearB[a] - p.oNearMin[a],
+                                         p.invDirMin[a], p.invDirMax[a] ) );
+        tf = Util::Min2( tf, productMax( farB[a] - p.oFarMax[a], farB[a] - p.oFarMin[a],
+                                         p.invDirMin[a], p.invDirMax[a] ) );
+    }
+
+    tn -= fabsf( tn ) * ( WIDE_BVH_ERROR_ULPS * FLT_EPSILON );
+    tf += fabsf( tf ) * ( WIDE_BVH_ERROR_ULPS * FLT_EPSILON );
+    tNear = tn;
+    return !( tn <= tf );
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Tests the active rays of a packet against a box, each up to its own
+// tmax, with the slab test of intersectNode(). Returns those hit.
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+uint64_t WideBVH<N>::intersectPacket( const PacketRays &p, uint64_t active, const float *nearB,
+                                      const float *farB, float tmin )
+{
+    uint64_t mask = 0;
+
+#ifdef WIDE_BVH_SSE
+    __m128 nearX = _mm_set1_ps( nearB[0] ), nearY = _mm_set1_ps( nearB[1] ), nearZ = _mm_set1_ps( nearB[2] );
+    __m128 farX = _mm_set1_ps( farB[0] ), farY = _mm_set1_ps( farB[1] ), farZ = _mm_set1_ps( farB[2] );
+    const __m128 absMask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+    const __m128 k = _mm_set1_ps( WIDE_BVH_ERROR_ULPS * FLT_EPSILON );
+
+    for ( int g = 0; g < WIDE_BVH_PACKET_SIZE; g += 4 )
+    {
+        if ( ( ( active >> g ) & 0xf ) == 0 ) continue;
+
+        __m128 invX = _mm_loadu_ps( p.invDir[0] + g );
+        __m128 invY = _mm_loadu_ps( p.invDir[1] + g );
+        __m128 invZ = _mm_loadu_ps( p.invDir[2] + g );
+
+        __m128 t0x = _mm_mul_ps( _mm_sub_ps( nearX, _mm_loadu_ps( p.oNear[0] + g ) ), invX );
+        __m128 t0y = _mm_mul_ps( _mm_sub_ps( nearY, _mm_loadu_ps( p.oNear[1] + g ) ), invY );
+        __m128 t0z = _mm_mul_ps( _mm_sub_ps( nearZ, _mm_loadu_ps( p.oNear[2] + g ) ), invZ );
+        __m128 t1x = _mm_mul_ps( _mm_sub_ps( farX, _mm_loadu_ps( p.oFar[0] + g ) ), invX );
+        __m128 t1y = _mm_mul_ps( _mm_sub_ps( farY, _mm_loadu_ps( p.oFar[1] + g ) ), invY );
+        __m128 t1z = _mm_mul_ps( _mm_sub_ps( farZ, _mm_loadu_ps( p.oFar[2] + g ) ), invZ );
+
+        __m128 tn = _mm_max_ps( t0x, _mm_max_ps( t0y, _mm_max_ps( t0z, _mm_set1_ps( tmin ) ) ) );
+        __m128 tf = _mm_min_ps( t1x, _mm_min_ps( t1y, _mm_min_ps( t1z, _mm_loadu_ps( p.tmax + g ) ) ) );
+
+        tn = _mm_sub_ps( tn, _mm_mul_ps( _mm_and_ps( tn, absMask ), k ) );
+        tf = _mm_add_ps( tf, _mm_mul_ps( _mm_and_ps( tf, absMask ), k ) );
+
+        mask |= (uint64_t) _mm_movemask_ps( _mm_cmple_ps( tn, tf ) ) << g;
+    }
+#else
+    for ( int i = 0; i < WIDE_BVH_PACKET_SIZE; i++ )
+    {
+        if ( !( ( active >> i ) & 1 ) ) continue;
+
+        float oNear[3] = { p.oNear[0][i], p.oNear[1][i], p.oNear[2][i] };
+        float oFar[3] = { p.oFar[0][i], p.oFar[1][i], p.oFar[2][i] };
+        float invDir[3] = { p.invDir[0][i], p.invDir[1][i], p.invDir[2][i] };
+        float tNear;
+        mask |= (uint64_t) slabTest1( nearB[0], nearB[1], nearB[2], farB[0], farB[1], farB[2],
+                                      oNear, oFar, invDir, tmin, p.tmax[i], &tNear ) << i;
+    }
+#endif
+
+    return mask & active;
+}
+
+
+
+// Index of the lowest set bit of m, which is not 0.
+static inline int lowestBit( uint64_t m )
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll( m );
+#else
+    int i = 0;
+    while ( !( m & 1 ) ) { m >>= 1; i++; }
+    return i;
+#endif
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Nearest-hit traversal of a packet. Each entry of the stack carries the
+// rays that hit the box of its child, and a lower bound on where they
+// enter it, and children are pushed farthest first as in traverseHit().
+//////////////////////////////////////////////////////////////////////////////
+
+template <int N>
+template <class NodeType>
+void WideBVH<N>::traversePacket( const NodeVector<NodeType> &nodes, const Ray *rays, const KernelRay *krays,
+                                 int numRays, PacketRays &p, Real tmin, Real *nearest_t,
+                                 SurfaceHitRecord *recs, bool *hits ) const
+{
+    struct Entry
+    {
+        float t;
+        int child;
+        uint64_t rays;
+    };
+
+    float tminF = (float) tmin;
+
+    Entry stack[ N * 2 * BVH_MAX_DEPTH ];
+    int stackSize = 0;
+    stack[ stackSize ].t = tminF;
+    stack[ stackSize ].child = 0;
+    stack[ stackSize++ ].rays = ( numRays == WIDE_BVH_PACKET_SIZE )? ~(uint64_t) 0 : ( (uint64_t) 1 << numRays ) - 1;
+
+    while ( stackSize > 0 )
+    {
+        Entry e = stack[ --stackSize ];
+
+        // Drop the rays that have found a hit before the packet enters the child.
+        uint64_t active = 0;
+        int numActive = 0;
+        for ( uint64_t m = e.rays; m != 0; m &= m - 1 )
+        {
+            int i = lowestBit( m );
+            if ( e.t > nearest_t[i] ) continue;
+            active |= (uint64_t) 1 << i;
+            numActive++;
+        }
+        if ( numActive == 0 ) continue;
+
+        if ( numActive < WIDE_BVH_PACKET_MIN_RAYS )
+        {
+            for ( uint64_t m = active; m != 0; m &= m - 1 )
+            {
+                int i = lowestBit( m );
+                if ( traverseHit( nodes, rays[i], tmin, nearest_t[i], recs[i], e.child ) ) hits[i] = true;
+                p.tmax[i] = (float) nearest_t[i];
+            }
+            continue;
+        }
+
+        if ( e.child < 0 )
+        {
+            for ( uint64_t m = active; m != 0; m &= m - 1 )
+            {
+                int i = lowestBit( m );
+                if ( mBinary.hitLeaf( mBinary.mNodes[ ~e.child ], rays[i], krays[i], tmin, nearest_t[i], recs[i] ) )
+                {
+                    hits[i] = true;
+                    p.tmax[i] = (float) nearest_t[i];
+                }
+            }
+            continue;
+        }
+
+        const NodeType &node = nodes[ e.child ];
+        float nearB[3][N], farB[3][N];
+        childBounds( node, p.dirIsNeg, nearB, farB );
+
+        float tmaxF = -INFINITY;
+        for ( uint64_t m = active; m != 0; m &= m - 1 )
+            tmaxF = Util::Max2( tmaxF, p.tmax[ lowestBit( m ) ] );
+
+        int first = stackSize;
+        for ( int c = 0; c < N; c++ )
+        {
+            if ( node.child[c] == EMPTY_CHILD ) continue;
+
+            float nearC[3] = { nearB[0][c], nearB[1][c], nearB[2][c] };
+            float farC[3] = { farB[0][c], farB[1][c], farB[2][c] };
+            float tNear;
+            if ( cullPacket( p, nearC, farC, tminF, tmaxF, tNear ) ) continue;
+
+            uint64_t mask = intersectPacket( p, active, nearC, farC, tminF );
+            if ( mask == 0 ) continue;
+
+            // Insertion sort by decreasing entry distance.
+            int j = stackSize++;
+            while ( j > first && stack[j - 1].t < tNear )
+            {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j].t = tNear;
+            stack[j].child = node.child[c];
+            stack[j].rays = mask;
+        }
+    }
+}
+
+
+
+template <int N>
+void WideBVH<N>::tracePacket( const Ray *rays, int numRays, Real tmin, Real tmax,
+                              SurfaceHitRecord *recs, bool *hits ) const
+{
+    Real nearest_t[ WIDE_BVH_PACKET_SIZE ];
+    SurfaceHitRecord tempHitRec;
+
+    for ( int i = 0; i < numRays; i++ )
+    {
+        hits[i] = false;
+        nearest_t[i] = tmax;
+
+        for ( size_t j = 0; j < mBinary.mUnbounded.size(); j++ )
+        {
+            if ( mBinary.mUnbounded[j].hit( rays[i], tmin, nearest_t[i], tempHitRec ) )
+            {
+                hits[i] = true;
+                nearest_t[i] = tempHitRec.t;
+                recs[i] = tempHitRec;
+            }
+        }
+    }
+
+    if ( numNodes() == 0 ) return;
+
+    PacketRays p;
+    if ( !makePacketRays( rays, numRays, nearest_t, p ) )
+    {
+        for ( int i = 0; i < numRays; i++ )
+        {
+            bool hasHit = mQuantized? traverseHit( mQNodes, rays[i], tmin, nearest_t[i], recs[i] )
+                                    : traverseHit( mNodes, rays[i], tmin, nearest_t[i], recs[i] );
+            if ( hasHit ) hits[i] = true;
+        }
+        return;
+    }
+
+    KernelRay krays[ WIDE_BVH_PACKET_SIZE ];
+    for ( int i = 0; i < numRays; i++ ) krays[i] = BVH::makeKernelRay( rays[i] );
+
+    if ( mQuantized )
+        traversePacket( mQNodes, rays, krays, numRays, p, tmin, nearest_t, recs, hits );
+    else
+        traversePacket( mNodes, rays, krays, numRays, p, tmin, nearest_t, recs, hits );
+}
+
+
+
+template <int N>
+void WideBVH<N>::hitPacket( const Ray *rays, int numRays, Real tmin, Real tmax,
+                            SurfaceHitRecord *recs, bool *hits ) const
+{
+    for ( int first = 0; first < numRays; first += WIDE_BVH_PACKET_SIZE )
+        tracePacket( rays + first, Util::Min2( numRays - first, WIDE_BVH_PACKET_SIZE ), tmin, tmax,
+                     recs + first, hits + first );
+}
+
+
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -0,0 +1,214 @@
+#ifndef _WIDEBVH_H_
+#define _WIDEBVH_H_
+
+#include <vector>
+#include <cstdint>
+#include "Surface.h"
+#include "BVH.h"
+#include "Util.h"
+
+using namespace std;
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// A BVH whose interior nodes have up to N children (N is 4 or 8), made by
+// collapsing the binary SAH BVH: starting from the children of a binary
+// node, the interior child with the largest surface area is repeatedly
+// replaced by its own two children until there are N of them. The leaves,
+// primitives and triangle packets stay those of the binary BVH.
+//
+// A node stores the boxes of all its children in structure-of-arrays
+// form, so a single SIMD slab test culls them all. The boxes are stored
+// in float, rounded outwards, and optionally quantized to 8-bit offsets
+// within the box of the node. The quantized nodes are stored on 64-byte
+// boundaries, so a quantized BVH4 node is one cache line, and a quantized
+// BVH8 node two, which halves the memory traffic of the traversal compared
+// with the float nodes.
+//
+// The float slab test is made conservative: the ray origin is widened by
+// its rounding error and the entry and exit distances by a few ulps, so a
+// box the exact ray touches is never culled, and the results are those of
+// the binary BVH.
+//
+// Refitting refits the binary BVH and copies its new boxes into the wide
+// nodes, each of which remembers the binary nodes its children came from.
+//
+// Coherent rays, such as the primary rays of a tile, may be traced
+// together as a packet, whose rays share the node visits. A child is
+// first tested against the whole packet with interval arithmetic, from
+// the ranges of the origins and inverse directions of its rays, which
+// culls it without looking at the rays one by one when no ray can hit it.
+// Otherwise the rays still active are tested against it four at a time,
+// with the same float slab test as a single ray. Rays whose directions
+// differ in sign, and rays left too few in a subtree, are traced singly.
+// Either way the hits are those the rays would find on their own.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Rays traced together as one packet, at most 64.
+#define WIDE_BVH_PACKET_SIZE        64
+
+// Rays of a packet below which a subtree is traced one ray at a time.
+#define WIDE_BVH_PACKET_MIN_RAYS    4
+
+// Alignment of the nodes: a cache line.
+#define WIDE_BVH_NODE_ALIGN         64
+
+
+
+template <int N>
+class WideBVH : public Surface
+{
+public:
+
+    // Builds the binary BVH over the surfaces and collapses it.
+    WideBVH( const SurfacePtr *surfaces, int numSurfaces, bool quantized,
+             const BVHBuildOptions &options = BVHBuildOptions() );
+
+    // Collapses a copy of the binary BVH.
+    WideBVH( const BVH &binary, bool quantized );
+
+
+    // See BVH::refitOrRebuild().
+    bool refitOrRebuild( double maxCostGrowth );
+
+    double sahCost() const { return mBinary.sahCost(); }
+
+    double builtSahCost() const { return mBinary.builtSahCost(); }
+
+
+    virtual bool hit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax,    // Maximum hit parameter to be searched for.
+                    SurfaceHitRecord &rec
+                    ) const;
+
+
+    virtual bool shadowHit(
+                    const Ray &r, // Ray being sent.
+                    Real tmin,    // Minimum hit parameter to be searched for.
+                    Real tmax     // Maximum hit parameter to be searched for.
+                    ) const
+        { return anyHit( r, tmin, tmax, NULL ); }
+
+
+    virtual bool shadowHitOccluder( const Ray &r, Real tmin, Real tmax, Occluder &occluder ) const
+        { return anyHit( r, tmin, tmax, &occluder ); }
+
+
+    // Traces the rays in packets of up to WIDE_BVH_PACKET_SIZE.
+    virtual void hitPacket( const Ray *rays, int numRays, Real tmin, Real tmax,
+                            SurfaceHitRecord *recs, bool *hits ) const;
+
+
+    virtual bool boundingBox( AABB &box ) const { return mBinary.boundingBox( box ); }
+
+
+    int numNodes() const { return mQuantized? (int) mQNodes.size() : (int) mNodes.size(); }
+
+    int numPrimitives() const { return mBinary.numPrimitives(); }
+
+    int numUnbounded() const { return mBinary.numUnbounded(); }
+
+    bool quantized() const { return mQuantized; }
+
+    int nodeSize() const { return mQuantized? (int) sizeof( QuantizedNode ) : (int) sizeof( Node ); }
+
+
+private:
+
+    // child[i] >= 0 is an interior node, child[i] < 0 is the binary BVH
+    // leaf ~child[i], and EMPTY_CHILD marks an unused slot.
+    enum { EMPTY_CHILD = -2147483647 - 1 };
+
+    struct Node
+    {
+        float minX[N], minY[N], minZ[N];
+        float maxX[N], maxY[N], maxZ[N];
+        int child[N];
+    };
+
+    // Child box = origin + q * scale, per axis.
+    struct alignas( WIDE_BVH_NODE_ALIGN ) QuantizedNode
+    {
+        float origin[3];
+        float scale[3];
+        unsigned char qmin[3][N];
+        unsigned char qmax[3][N];
+        int child[N];
+    };
+
+    // The nodes, on WIDE_BVH_NODE_ALIGN-byte boundaries.
+    template <class NodeType>
+    using NodeVector = vector< NodeType, AlignedAllocator<NodeType, WIDE_BVH_NODE_ALIGN> >;
+
+    // The ray as seen by the node tests.
+    struct NodeRay
+    {
+        float oNear[3], oFar[3];  // Origin, moved by its rounding error.
+        float invDir[3];
+        int dirIsNeg[3];
+    };
+
+    // The rays of a packet as seen by the node tests, in structure-of-arrays
+    // form, with the ranges of their origins and inverse directions.
+    struct PacketRays
+    {
+        float oNear[3][ WIDE_BVH_PACKET_SIZE ], oFar[3][ WIDE_BVH_PACKET_SIZE ];
+        float invDir[3][ WIDE_BVH_PACKET_SIZE ];
+        float tmax[ WIDE_BVH_PACKET_SIZE ];      // Nearest hit so far, in float.
+        int dirIsNeg[3];                         // Shared by all the rays.
+        float oNearMin[3], oNearMax[3], oFarMin[3], oFarMax[3];
+        float invDirMin[3], invDirMax[3];
+    };
+
+    int collapse( int binaryIndex );
+    void setNode( int nodeIndex, const int *binaryChildren, const int *children, int numChildren );
+
+    static NodeRay makeNodeRay( const Ray &r );
+
+    unsigned intersectNode( const Node &node, const NodeRay &ray,
+                            float tmin, float tmax, float *tNear ) const;
+    unsigned intersectNode( const QuantizedNode &node, const NodeRay &ray,
+                            float tmin, float tmax, float *tNear ) const;
+
+    static bool makePacketRays( const Ray *rays, int numRays, const Real *nearest_t, PacketRays &p );
+
+    static void childBounds( const Node &node, const int *dirIsNeg, float nearB[3][N], float farB[3][N] );
+    static void childBounds( const QuantizedNode &node, const int *dirIsNeg, float nearB[3][N], float farB[3][N] );
+
+    static bool cullPacket( const PacketRays &p, const float *nearB, const float *farB,
+                            float tmin, float tmax, float &tNear );
+    static uint64_t intersectPacket( const PacketRays &p, uint64_t active, const float *nearB,
+                                     const float *farB, float tmin );
+
+    // Traverses the subtree at child root, 0 for the whole tree.
+    template <class NodeType>
+    bool traverseHit( const NodeVector<NodeType> &nodes, const Ray &r, Real tmin,
+                      Real &nearest_t, SurfaceHitRecord &rec, int root = 0 ) const;
+    template <class NodeType>
+    void traversePacket( const NodeVector<NodeType> &nodes, const Ray *rays, const KernelRay *krays, int numRays,
+                         PacketRays &p, Real tmin, Real *nearest_t, SurfaceHitRecord *recs, bool *hits ) const;
+    void tracePacket( const Ray *rays, int numRays, Real tmin, Real tmax,
+                      SurfaceHitRecord *recs, bool *hits ) const;
+    template <class NodeType>
+    bool traverseShadowHit( const NodeVector<NodeType> &nodes, const Ray &r,
+                            Real tmin, Real tmax, Occluder *occluder ) const;
+    bool anyHit( const Ray &r, Real tmin, Real tmax, Occluder *occluder ) const;
+
+    BVH mBinary;
+    bool mQuantized;
+    NodeVector<Node> mNodes;
+    NodeVector<QuantizedNode> mQNodes;
+    vector<int> mBinaryChildren;  // N per node, the binary nodes of its children.
+
+}; // WideBVH
+
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+
+#endif // _WIDEBVH_H_